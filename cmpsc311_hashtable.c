@@ -0,0 +1,487 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cmpsc311_hashtable.c
+//  Description    : This is the implementation of the cmpsc311 hashtable
+//                   interface over one flat array of slots.  Indices are
+//                   placed with Robin Hood probing (an index that is further
+//                   from its home slot takes the slot from a closer one), so
+//                   probe runs stay short and a lookup stops at the first
+//                   slot closer to home than itself.  Deletes shift the run
+//                   back instead of leaving tombstones.  When the table gets
+//                   full a twice larger one is allocated; a small old one is
+//                   moved into it at once, a large one is drained into it a
+//                   few slots per insert or delete and lookups check both
+//                   until it is empty.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <cmpsc311_hashtable.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HT_SIZE(bits) ((uint32_t) 1 << (bits))
+#define HT_UNIT_TEST_ITERATIONS 200000
+#define HT_UNIT_TEST_KEYS 20000
+#define HT_BENCH_BITS 10 // Width the tables of the object store start at
+#define HT_BENCH_ROUNDS 3
+
+// Home slot of an index (Fibonacci hashing, sequential indices spread over the table)
+static uint32_t ht_home(HtIndexValue idx, uint8_t bits) {
+	return((uint32_t) (((uint64_t) idx * 0x9e3779b97f4a7c15ULL) >> (64 - bits)));
+}
+
+// Put an index in a table with room for it, Robin Hood style
+static void ht_place(HtSlot *slots, uint8_t bits, HtIndexValue idx, void *blk) {
+	uint32_t mask = HT_SIZE(bits) - 1, pos = ht_home(idx, bits);
+	HtSlot cur, swap;
+
+	cur.index = idx;
+	cur.block = blk;
+	cur.probe = 1;
+	for (;; pos = (pos + 1) & mask, cur.probe++) {
+		if (slots[pos].probe == 0) {
+			slots[pos] = cur;
+			return;
+		}
+		if (slots[pos].probe < cur.probe) {
+			swap = slots[pos];
+			slots[pos] = cur;
+			cur = swap;
+		}
+	}
+}
+
+// Find the slot of an index in a table, NULL if it is not there
+static HtSlot *ht_lookup(HtSlot *slots, uint8_t bits, HtIndexValue idx) {
+	uint32_t mask = HT_SIZE(bits) - 1, pos = ht_home(idx, bits), probe = 1;
+
+	for (;; pos = (pos + 1) & mask, probe++) {
+		if (slots[pos].probe < probe)
+			return(NULL);
+		if (slots[pos].index == idx)
+			return(&slots[pos]);
+	}
+}
+
+// Empty a slot, shifting the rest of its run back one slot
+static void ht_erase(HtSlot *slots, uint8_t bits, HtSlot *slot) {
+	uint32_t mask = HT_SIZE(bits) - 1, pos = slot - slots, next = (pos + 1) & mask;
+
+	while (slots[next].probe > 1) {
+		slots[pos] = slots[next];
+		slots[pos].probe--;
+		pos = next;
+		next = (next + 1) & mask;
+	}
+	slots[pos].probe = 0;
+}
+
+// Move up to steps old slots into the table (all of them if steps is 0)
+static void ht_drain(HTable *ht, uint32_t steps) {
+	uint32_t moved = 0;
+	HtSlot *slot;
+
+	// Moving them all needs no erasing, the old table is freed after
+	if (steps == 0 && ht->oldSlots != NULL) {
+		for (; ht->drained < HT_SIZE(ht->oldBits); ht->drained++) {
+			slot = &ht->oldSlots[ht->drained];
+			if (slot->probe != 0)
+				ht_place(ht->slots, ht->bits, slot->index, slot->block);
+		}
+		ht->oldElements = 0;
+	}
+	while (ht->oldSlots != NULL) {
+		if (ht->oldElements == 0 || ht->drained == HT_SIZE(ht->oldBits)) {
+			free(ht->oldSlots);
+			ht->oldSlots = NULL;
+			break;
+		}
+		if (steps > 0 && moved++ == steps)
+			break;
+
+		// Erasing may shift the next slot of the run into this one, so look at it again
+		slot = &ht->oldSlots[ht->drained];
+		if (slot->probe == 0) {
+			ht->drained++;
+			continue;
+		}
+		ht_place(ht->slots, ht->bits, slot->index, slot->block);
+		ht_erase(ht->oldSlots, ht->oldBits, slot);
+		ht->oldElements--;
+	}
+}
+
+// Make room for one more index (start growing when the table is full), 0 on success, -1 on failure
+static int ht_reserve(HTable *ht) {
+	HtSlot *grown;
+
+	ht_drain(ht, HT_DRAIN_STEPS);
+	if ((uint64_t) (ht->elements - ht->oldElements + 1) * 8 <= (uint64_t) HT_SIZE(ht->bits) * HT_LOAD_EIGHTHS)
+		return(0);
+	if (ht->bits >= HT_MAX_BITS)
+		return((ht->elements - ht->oldElements < HT_SIZE(ht->bits)) ? 0 : -1);
+	grown = calloc(HT_SIZE(ht->bits + 1), sizeof(HtSlot));
+	if (grown == NULL)
+		return(-1);
+
+	// Cannot happen (draining keeps ahead of filling), but never keep two old tables
+	ht_drain(ht, 0);
+	ht->oldSlots = ht->slots;
+	ht->oldBits = ht->bits;
+	ht->oldElements = ht->elements;
+	ht->drained = 0;
+	ht->slots = grown;
+	ht->bits++;
+
+	// A small table is moved right away, the pause is short and lookups stay on one table
+	if (ht->oldBits < HT_DRAIN_BITS)
+		ht_drain(ht, 0);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHashTable
+// Description  : Set up an empty hash table
+//
+// Inputs       : ht - the table
+//                bits - the table starts with 2^(bits) slots
+// Outputs      : 0 if successful, -1 if failure
+
+int initHashTable( HTable *ht, uint16_t bits ) {
+	memset(ht, 0, sizeof(HTable));
+	ht->htTableSize = bits;
+	ht->bits = (bits < HT_MIN_BITS) ? HT_MIN_BITS : (bits > HT_MAX_BITS) ? HT_MAX_BITS : bits;
+	ht->slots = calloc(HT_SIZE(ht->bits), sizeof(HtSlot));
+	return((ht->slots == NULL) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cleanupHashTable
+// Description  : Free every stored block and the table
+//
+// Inputs       : ht - the table
+// Outputs      : 0 if successful, -1 if failure
+
+int cleanupHashTable( HTable *ht ) {
+	HtIterator it;
+	void *blk;
+
+	initHashTableIterator(ht, &it);
+	while ((blk = iterateHashTable(&it)) != NULL)
+		free(blk);
+	free(ht->oldSlots);
+	free(ht->slots);
+	memset(ht, 0, sizeof(HTable));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertValueInHashTable
+// Description  : Add a block under an index (an index may be added twice,
+//                lookups then find either block)
+//
+// Inputs       : ht - the table
+//                idx - the index
+//                blk - the block
+// Outputs      : 0 if successful, -1 if failure
+
+int insertValueInHashTable( HTable *ht, HtIndexValue idx, void *blk ) {
+	if (ht_reserve(ht)) {
+		logMessage(LOG_ERROR_LEVEL, "Hash table full or out of memory (%u elements).", ht->elements);
+		return(-1);
+	}
+	ht_place(ht->slots, ht->bits, idx, blk);
+	ht->elements++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findValueInHashTable
+// Description  : Find the block stored under an index
+//
+// Inputs       : ht - the table
+//                idx - the index
+// Outputs      : the block, NULL if the index is not in the table
+
+void * findValueInHashTable( HTable *ht, HtIndexValue idx ) {
+	HtSlot *slot = ht_lookup(ht->slots, ht->bits, idx);
+
+	if (slot == NULL && ht->oldSlots != NULL)
+		slot = ht_lookup(ht->oldSlots, ht->oldBits, idx);
+	return((slot != NULL) ? slot->block : NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : deleteValueFromHashTable
+// Description  : Remove an index from the table
+//
+// Inputs       : ht - the table
+//                idx - the index
+// Outputs      : the block stored under it, NULL if the index is not in the table
+
+void * deleteValueFromHashTable( HTable *ht, HtIndexValue idx ) {
+	HtSlot *slot;
+	void *blk;
+
+	if ((slot = ht_lookup(ht->slots, ht->bits, idx)) != NULL) {
+		blk = slot->block;
+		ht_erase(ht->slots, ht->bits, slot);
+	} else if (ht->oldSlots != NULL && (slot = ht_lookup(ht->oldSlots, ht->oldBits, idx)) != NULL) {
+		blk = slot->block;
+		ht_erase(ht->oldSlots, ht->oldBits, slot);
+		ht->oldElements--;
+	} else {
+		return(NULL);
+	}
+	ht->elements--;
+	ht_drain(ht, HT_DRAIN_STEPS);
+	return(blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHashTableIterator
+// Description  : Start an iteration over the blocks of a table
+//
+// Inputs       : ht - the table
+//                it - the iterator
+// Outputs      : 0 if successful, -1 if failure
+
+int initHashTableIterator( HTable *ht, HtIterator *it ) {
+	it->table = ht;
+	it->idx = 0;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iterateHashTable
+// Description  : Get the next block of an iteration
+//
+// Inputs       : it - the iterator
+// Outputs      : the block, NULL once every block was returned
+
+void * iterateHashTable( HtIterator *it ) {
+	HTable *ht = it->table;
+	uint32_t old = (ht->oldSlots != NULL) ? HT_SIZE(ht->oldBits) : 0;
+	HtSlot *slot;
+
+	while (ht->slots != NULL && it->idx < old + HT_SIZE(ht->bits)) {
+		slot = (it->idx < old) ? &ht->oldSlots[it->idx] : &ht->slots[it->idx - old];
+		it->idx++;
+		if (slot->probe != 0)
+			return(slot->block);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hashTableUnitTest
+// Description  : Perform a test of the hash table against a mirror array,
+//                with inserts, lookups and deletes while the table grows
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hashTableUnitTest( void ) {
+	uintptr_t *mirror, blk;
+	HtIterator it;
+	uint32_t count = 0, seen = 0;
+	HTable ht;
+	int i, key;
+
+	mirror = calloc(HT_UNIT_TEST_KEYS, sizeof(uintptr_t));
+	if (mirror == NULL || initHashTable(&ht, 1)) {
+		logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : init failed.");
+		return(-1);
+	}
+
+	// Random inserts, deletes and lookups; every key stores itself plus one
+	for (i=0; i<HT_UNIT_TEST_ITERATIONS; i++) {
+		key = getRandomValue(0, HT_UNIT_TEST_KEYS-1);
+		switch (getRandomValue(0, 2)) {
+		case 0: // Insert (if absent)
+			if (mirror[key] == 0) {
+				if (insertValueInHashTable(&ht, key, (void *) (uintptr_t) (key + 1))) {
+					logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : insert of %d failed.", key);
+					return(-1);
+				}
+				mirror[key] = key + 1;
+				count++;
+			}
+			break;
+
+		case 1: // Delete
+			blk = (uintptr_t) deleteValueFromHashTable(&ht, key);
+			if (blk != mirror[key]) {
+				logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : delete of %d returned %lu.", key, (unsigned long) blk);
+				return(-1);
+			}
+			count -= (mirror[key] != 0);
+			mirror[key] = 0;
+			break;
+
+		default: // Lookup
+			blk = (uintptr_t) findValueInHashTable(&ht, key);
+			if (blk != mirror[key]) {
+				logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : lookup of %d returned %lu.", key, (unsigned long) blk);
+				return(-1);
+			}
+			break;
+		}
+		if (ht.elements != count) {
+			logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : element count %u, expected %u.", ht.elements, count);
+			return(-1);
+		}
+	}
+
+	// The iterator returns every block once
+	initHashTableIterator(&ht, &it);
+	while ((blk = (uintptr_t) iterateHashTable(&it)) != 0) {
+		if (blk > HT_UNIT_TEST_KEYS || mirror[blk-1] != blk) {
+			logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : iterator returned %lu.", (unsigned long) blk);
+			return(-1);
+		}
+		mirror[blk-1] = 0;
+		seen++;
+	}
+	if (seen != count) {
+		logMessage(LOG_ERROR_LEVEL, "HT_UNIT_TEST : iterator returned %u of %u blocks.", seen, count);
+		return(-1);
+	}
+
+	// Cleanup (the blocks are not allocated, take them out before the table frees them)
+	for (key=0; key<HT_UNIT_TEST_KEYS; key++)
+		deleteValueFromHashTable(&ht, key);
+	cleanupHashTable(&ht);
+	free(mirror);
+	logMessage(LOG_INFO_LEVEL, "HT_UNIT_TEST : hash table unit test completed successfully.");
+	return(0);
+}
+
+//
+// The chained table of libcrud.a, linked in under other names for the benchmark
+
+typedef struct {
+	uint16_t htTableSize;
+	uint32_t elements;
+	void   **hasHTable;
+} ChainedHTable;
+
+int chainedInitHashTable( ChainedHTable *ht, uint16_t bits );
+int chainedCleanupHashTable( ChainedHTable *ht );
+int chainedInsertValueInHashTable( ChainedHTable *ht, HtIndexValue idx, void *blk );
+void * chainedFindValueInHashTable( ChainedHTable *ht, HtIndexValue idx );
+void * chainedDeleteValueFromHashTable( ChainedHTable *ht, HtIndexValue idx );
+
+// Seconds since a start time
+static double ht_bench_elapsed(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+// Time inserts, hits, misses and deletes of count indices in one table (chained or not),
+// the nanoseconds per operation go to ns[4]
+static int ht_bench_run(int chained, HtIndexValue *keys, uint32_t count, double *ns) {
+	struct timespec start;
+	ChainedHTable old;
+	HTable ht;
+	uint32_t i, found = 0;
+
+	if (chained ? chainedInitHashTable(&old, HT_BENCH_BITS) : initHashTable(&ht, HT_BENCH_BITS))
+		return(-1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<count; i++) {
+		if (chained)
+			chainedInsertValueInHashTable(&old, keys[i], &keys[i]);
+		else
+			insertValueInHashTable(&ht, keys[i], &keys[i]);
+	}
+	ns[0] = ht_bench_elapsed(&start) * 1e9 / count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<count; i++)
+		found += ((chained ? chainedFindValueInHashTable(&old, keys[i]) : findValueInHashTable(&ht, keys[i])) == &keys[i]);
+	ns[1] = ht_bench_elapsed(&start) * 1e9 / count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<count; i++)
+		found += ((chained ? chainedFindValueInHashTable(&old, ~keys[i]) : findValueInHashTable(&ht, ~keys[i])) != NULL);
+	ns[2] = ht_bench_elapsed(&start) * 1e9 / count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<count; i++) {
+		if (chained)
+			chainedDeleteValueFromHashTable(&old, keys[i]);
+		else
+			deleteValueFromHashTable(&ht, keys[i]);
+	}
+	ns[3] = ht_bench_elapsed(&start) * 1e9 / count;
+
+	// The tables are empty, so cleanup frees nothing of keys
+	if (chained)
+		chainedCleanupHashTable(&old);
+	else
+		cleanupHashTable(&ht);
+	return((found == count) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hashTableBenchmark
+// Description  : Compare this table with the chained table of libcrud.a, both
+//                started at the width of an object store shard, for
+//                sequential (OID like) and random indices of growing counts
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hashTableBenchmark( void ) {
+	uint32_t counts[] = { 1000, 16000, 128000 }, c, i, r;
+	double ns[2][4], best[2][4];
+	HtIndexValue *keys;
+	int random, impl;
+
+	keys = malloc(counts[2] * sizeof(HtIndexValue));
+	if (keys == NULL)
+		return(-1);
+	for (random=0; random<2; random++) {
+		for (c=0; c<sizeof(counts)/sizeof(counts[0]); c++) {
+			for (i=0; i<counts[c]; i++)
+				keys[i] = random ? ((HtIndexValue) getRandomValue(0, 0x7fffffff) << 20 | i) : 0x1000 + i;
+			for (impl=0; impl<2; impl++) {
+				for (r=0; r<HT_BENCH_ROUNDS; r++) {
+					if (ht_bench_run(impl, keys, counts[c], ns[impl])) {
+						logMessage(LOG_ERROR_LEVEL, "HT_BENCHMARK : lookups failed.");
+						free(keys);
+						return(-1);
+					}
+					for (i=0; i<4; i++)
+						best[impl][i] = (r == 0 || ns[impl][i] < best[impl][i]) ? ns[impl][i] : best[impl][i];
+				}
+			}
+			for (impl=0; impl<2; impl++)
+				logMessage(LOG_OUTPUT_LEVEL, "HT_BENCHMARK : %-10s %6u keys %-7s : insert %8.1fns, hit %8.1fns, miss %8.1fns, delete %8.1fns",
+						random ? "random" : "sequential", counts[c], impl ? "chained" : "robin", best[impl][0],
+						best[impl][1], best[impl][2], best[impl][3]);
+		}
+	}
+	free(keys);
+	return(0);
+}
@@ -5,7 +5,10 @@
 //
 //  File          : cmpsc311_hashtable.h
 //  Description   : This is a generic hashtable implementation used for
-//                  data structure storage and access.
+//                  data structure storage and access.  Values live in one
+//                  flat array (open addressing, Robin Hood probing) that
+//                  doubles when it is 7/8 full; a large old array is drained
+//                  a few slots per insert or delete rather than all at once.
 ////
 //  Author   : Patrick McDaniel
 //  Created  : Sat Sep  6 08:56:10 EDT 2014
@@ -15,40 +18,46 @@
 #include <stdint.h>
 
 // Defines
-#define HT_COOKIE_VALUE 0xa3a3
+#define HT_MIN_BITS 3      // Smallest table (2^bits slots)
+#define HT_MAX_BITS 30     // Largest table
+#define HT_LOAD_EIGHTHS 7  // The table grows when more than this many eighths are used
+#define HT_DRAIN_STEPS 8   // Old slots moved per insert or delete while the table grows
+#define HT_DRAIN_BITS 16   // Tables narrower than this move every slot when they grow (lookups never check two tables)
 typedef unsigned long HtIndexValue;
 
-// Hash table entry structure
-typedef struct HtEntry {
-	uint16_t 	    cookie;  // This is a cookie value to detect memory corruption
-	HtIndexValue	index;   // This is the "key value" index of the object
-	void           *block;   // This is the data block of the stored item
-	struct HtEntry *prev;    // This is the previous item in the local chain
-	struct HtEntry *next;    // This is the next item in the local chain
-} HtEntryData;
+// Hash table slot
+typedef struct {
+	HtIndexValue index;  // This is the "key value" index of the object
+	void        *block;  // This is the data block of the stored item
+	uint32_t     probe;  // Distance from the home slot of index plus one, 0 if the slot is empty
+} HtSlot;
 
 // Hash table structure
 typedef struct  {
-	uint16_t         htTableSize;  // The the bits in the hash values
-	uint32_t	     elements;     // This is the number of elements
-	HtEntryData    **hasHTable;    // This is the hash table itself
+	uint16_t  htTableSize;  // The bits of the table asked for at init
+	uint32_t  elements;     // This is the number of elements
+	uint8_t   bits;         // The table has 2^bits slots
+	HtSlot   *slots;        // This is the hash table itself
+	uint8_t   oldBits;      // Width of the table being drained
+	HtSlot   *oldSlots;     // The table being drained (NULL unless growing)
+	uint32_t  oldElements;  // Elements left in the old table
+	uint32_t  drained;      // Old slots before this one are empty
 } HTable;
 
-// Hash table iterator
+// Hash table iterator (the table must not change while iterating)
 typedef struct {
 	HTable      *table; // The table we are iterating through
-	uint16_t 	 idx;   // The current index into the hash table
-	HtEntryData *ptr;   // The pointer into the linked list at the index
+	uint32_t     idx;   // The next slot, the old table first then the new one
 } HtIterator;
 
 //
 // Hashtable Interface
 
 int initHashTable( HTable *ht, uint16_t bits );
-	// This function initializes the hash table to a width of 2^(bits) width
+	// This function initializes the hash table to a width of 2^(bits) width (it grows as needed)
 
 int cleanupHashTable( HTable *ht );
-	// Cleanup the hash table
+	// Cleanup the hash table (the stored blocks are freed)
 
 int insertValueInHashTable( HTable *ht, HtIndexValue idx, void *blk );
 	// Insert a value into the hashtable of value idx, block size blk
@@ -74,4 +83,7 @@ void * iterateHashTable( HtIterator *it );
 int hashTableUnitTest( void );
 	// Perform a test of the hash table functionality
 
+int hashTableBenchmark( void );
+	// Compare the hash table with the chained table of libcrud.a
+
 #endif
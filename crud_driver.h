@@ -0,0 +1,42 @@
+#ifndef CRUD_DRIVER_INCLUDED
+#define CRUD_DRIVER_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : crud_driver.h
+//  Description    : This is the header file for the CRUD object store
+//                   definitions shared by the HDD server and its store
+//                   (crud_store.h): object IDs, flags and store entries.
+//                   The request interface of libcrud.a (crud_bus_request and
+//                   its table) is not used; libcrud.a was built against the
+//                   old hashtable layout.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define CRUD_MAX_OBJECT_SIZE 0xffffff // Largest object the 24-bit length field can describe
+#define CRUD_STORE_FILE "hdd_content.svd" // Store contents saved on CLOSE, loaded on INIT
+
+// These are the object flags
+typedef enum {
+	CRUD_NULL_FLAG       = 0, // Ordinary object
+	CRUD_PRIORITY_OBJECT = 1, // The single priority object (the HDD meta block)
+	CRUD_FLAGMAX         = 2
+} CRUD_FLAG_TYPES;
+
+// Object IDs
+typedef uint32_t CrudOID;
+
+// Object store entry, the values of the store tables (blk is malloc'd)
+typedef struct {
+	CrudOID  oid; // The object ID
+	uint8_t  flg; // CRUD_FLAG_TYPES of the object
+	uint32_t len; // Object length in bytes
+	void    *blk; // Object data
+} CrudObjectStoreEntry;
+
+#endif
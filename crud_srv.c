@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : crud_srv.c
+//  Description    : This is the main program of the HDD server, it parses the
+//                   command line and runs the server loop (hdd_server.c).
+//
+//  Author         : Tianjian Gao
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+
+// Project Includes
+#include <hdd_network.h>
+#include <crud_store.h>
+#include <hdd_slab.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define CRUD_SRV_ARGUMENTS "hubvel:p:t:s:"
+#define USAGE \
+	"USAGE: crud_srv [-h] [-u] [-b] [-v] [-e] [-l <logfile>] [-p <port>] [-t <workers>] [-s <sync>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -u - run the unit tests instead of the server\n" \
+	"    -b - run the benchmarks instead of the server\n" \
+	"    -v - verbose output\n" \
+	"    -e - load every object at INIT (the store file is mapped and read on demand otherwise)\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -p - port number of server to listen on.\n" \
+	"    -t - number of worker threads executing requests.\n" \
+	"    -s - when store changes are synced to disk: op, close (default) or every <sync> ms.\n" \
+	"\n" \
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_srv_signal
+// Description  : Ask the server loop to stop on SIGINT/SIGTERM
+//
+// Inputs       : sig - the signal received
+// Outputs      : none
+
+static void crud_srv_signal(int sig) {
+	hdd_network_shutdown = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the HDD server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, unit_tests = 0, benchmark = 0;
+	struct sigaction action;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CRUD_SRV_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'u': // Unit test flag
+			unit_tests = 1;
+			break;
+
+		case 'b': // Benchmark flag
+			benchmark = 1;
+			break;
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'e': // Eager store loading
+			crud_store_lazy = 0;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'p': // Set the network port number
+			if ( sscanf(optarg, "%hu", &hdd_network_port) != 1 ) {
+				fprintf( stderr, "Bad  port number [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 's': // Set the sync policy of the store
+			if ( strcmp(optarg, "op") == 0 ) {
+				crud_store_sync = CRUD_STORE_SYNC_OP;
+			} else if ( strcmp(optarg, "close") == 0 ) {
+				crud_store_sync = CRUD_STORE_SYNC_CLOSE;
+			} else if ( (sscanf(optarg, "%d", &crud_store_sync_ms) == 1) && (crud_store_sync_ms > 0) ) {
+				crud_store_sync = CRUD_STORE_SYNC_INTERVAL;
+			} else {
+				fprintf( stderr, "Bad sync policy [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 't': // Set the size of the worker pool
+			if ( (sscanf(optarg, "%d", &hdd_server_workers) != 1) || (hdd_server_workers < 1) ) {
+				fprintf( stderr, "Bad worker count [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		enableLogLevels( LOG_INFO_LEVEL );
+	}
+
+	// Run the unit tests instead of the server
+	if ( unit_tests ) {
+		if ( hddSlabUnitTest() || hashTableUnitTest() || crudStoreUnitTest() ) {
+			logMessage( LOG_ERROR_LEVEL, "Server unit tests failed.\n\n" );
+			return( -1 );
+		}
+		logMessage( LOG_INFO_LEVEL, "Server unit tests completed successfully.\n\n" );
+		return( 0 );
+	}
+
+	// Run the benchmark instead of the server
+	if ( benchmark ) {
+		return( (hashTableBenchmark() || crudStoreBenchmark()) ? -1 : 0 );
+	}
+
+	// Stop cleanly on interrupt, survive clients that disappear mid-send
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler = crud_srv_signal;
+	sigaction( SIGINT, &action, NULL );
+	sigaction( SIGTERM, &action, NULL );
+	signal( SIGPIPE, SIG_IGN );
+
+	// Run the server
+	return( hdd_server() ? -1 : 0 );
+}
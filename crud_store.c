@@ -0,0 +1,1265 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : crud_store.c
+//  Description    : This is the implementation of the sharded object store of
+//                   the HDD server.  An object lives in the shard picked by
+//                   the low bits of its OID and is found through the cmpsc311
+//                   hashtable of that shard (keyed by the remaining bits).
+//                   Readers of a shard share its lock, writers hold it alone.
+//                   Every change is appended to the log while its shard is
+//                   held, so the log has the changes of an object in order.
+//                   In lazy mode the store file is mapped, objects point into
+//                   the mapping until they are changed and their pages are
+//                   faulted in by the first read.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Project Includes
+#include <crud_store.h>
+#include <hdd_slab.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define CRUD_STORE_SHARD(oid) (&crud_store_shards[(oid) & (CRUD_STORE_SHARDS-1)])
+#define CRUD_STORE_KEY(oid) ((oid) >> CRUD_STORE_SHARD_BITS)
+#define CRUD_STORE_MAPPED(blk) ((char *) (blk) >= crud_store_map && (char *) (blk) < crud_store_map + crud_store_map_size)
+#define CRUD_STORE_UNIT_TEST_ITERATIONS 4096
+#define CRUD_STORE_UNIT_TEST_OBJECTS 256
+#define CRUD_STORE_UNIT_TEST_MAX_OBJECT 1024
+#define CRUD_STORE_UNIT_TEST_THREADS 8
+#define CRUD_STORE_UNIT_TEST_FILE "crud_store_test.svd"
+#define CRUD_STORE_UNIT_TEST_LOG CRUD_STORE_UNIT_TEST_FILE CRUD_STORE_LOG_SUFFIX
+#define CRUD_STORE_BENCH_FILE "crud_store_bench.svd"
+#define CRUD_STORE_BENCH_LOG CRUD_STORE_BENCH_FILE CRUD_STORE_LOG_SUFFIX
+#define CRUD_STORE_BENCH_CHANGES 1024 // Changes made by every benchmark thread
+#define CRUD_STORE_BENCH_THREADS 8
+#define CRUD_STORE_BENCH_OBJECT 1024
+
+// A shard of the store
+typedef struct {
+	pthread_rwlock_t lock;  // Shared by readers, held alone by writers
+	HTable           table; // OID key -> CrudObjectStoreEntry
+} CRUD_STORE_SHARD;
+
+// Header at the start of the log, names the checkpoint the log follows
+typedef struct {
+	uint32_t magic;   // CRUD_STORE_LOG_MAGIC
+	uint32_t version; // CRUD_STORE_LOG_VERSION
+	uint32_t next;    // Next OID in the checkpoint
+	uint32_t count;   // Objects in the checkpoint
+	uint64_t size;    // Bytes of the checkpoint file
+} CRUD_STORE_LOG_HEADER;
+
+// Header of a log record (the data follows)
+typedef struct {
+	uint32_t crc;    // CRC-32 of the rest of the record and the data
+	uint8_t  type;   // CRUD_STORE_LOG_TYPES
+	uint8_t  flg;    // CRUD_FLAG_TYPES of the object
+	uint16_t unused;
+	uint32_t oid;
+	uint32_t offset;
+	uint32_t len;
+} CRUD_STORE_LOG_RECORD;
+
+//
+// Global data
+
+static CRUD_STORE_SHARD crud_store_shards[CRUD_STORE_SHARDS];
+static atomic_uint      crud_store_next_oid = CRUD_STORE_FIRST_OID; // Next OID to hand out
+static atomic_uint      crud_store_priority = 0; // OID of the priority object (0 if none)
+static int              crud_store_initialized = 0; // Flag indicating the shards are set up
+static int              crud_store_log_fd = -1; // The log (-1 while loading, nothing is logged)
+static pthread_mutex_t  crud_store_log_lock = PTHREAD_MUTEX_INITIALIZER; // Orders the appends to the log
+static uint64_t         crud_store_log_bytes = 0; // Bytes of records in the log
+static uint64_t         crud_store_log_written = 0; // Bytes ever appended to the log (across checkpoints)
+static uint64_t         crud_store_log_synced = 0; // Of those, the bytes known to be on disk
+static uint64_t         crud_store_log_syncs = 0; // Syncs of the log so far
+static int              crud_store_log_syncing = 0; // Flag indicating a thread is syncing the log
+static pthread_cond_t   crud_store_log_synced_cond = PTHREAD_COND_INITIALIZER; // Signalled when a sync is done
+static pthread_cond_t   crud_store_syncer_cond = PTHREAD_COND_INITIALIZER; // Signalled to stop the syncer
+static pthread_t        crud_store_syncer; // Thread syncing the log (CRUD_STORE_SYNC_INTERVAL)
+static int              crud_store_syncer_up = 0; // Flag indicating the syncer runs
+static int              crud_store_syncer_stop = 0; // Flag asking the syncer to stop
+static __thread uint64_t crud_store_log_mine = 0; // End of the last record this thread logged
+static uint64_t         crud_store_checkpoint_bytes = 0; // Bytes of the store file
+static char             crud_store_log_name[256]; // Path of the log
+static uint32_t         crud_store_crc_table[256]; // CRC-32 of every byte value
+static char            *crud_store_map = NULL; // The store file mapping (lazy mode)
+static size_t           crud_store_map_size = 0; // Bytes of the mapping
+int                     crud_store_lazy = 1; // Map the store file instead of loading it
+int                     crud_store_sync = CRUD_STORE_SYNC_CLOSE; // When the log is forced to disk
+int                     crud_store_sync_ms = CRUD_STORE_SYNC_MS; // Period of CRUD_STORE_SYNC_INTERVAL
+
+//
+// Local helpers
+
+// CRC-32 (IEEE) of len bytes, continuing from crc (0 to start)
+static uint32_t crud_store_crc(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *byte = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crud_store_crc_table[(crc ^ *byte++) & 0xff] ^ (crc >> 8);
+	return(~crc);
+}
+
+// CRC-32 of a log record and its data
+static uint32_t crud_store_record_crc(CRUD_STORE_LOG_RECORD *rec, const void *buf) {
+	uint32_t crc = crud_store_crc(0, (char *) rec + sizeof(rec->crc), sizeof(*rec) - sizeof(rec->crc));
+	return(crud_store_crc(crc, buf, rec->len));
+}
+
+// Set up empty shards
+static int crud_store_setup(void) {
+	uint32_t c;
+	int i, k;
+
+	for (i=0; i<256; i++) {
+		for (c=i, k=0; k<8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : (c >> 1);
+		crud_store_crc_table[i] = c;
+	}
+	for (i=0; i<CRUD_STORE_SHARDS; i++) {
+		if (pthread_rwlock_init(&crud_store_shards[i].lock, NULL) ||
+		    initHashTable(&crud_store_shards[i].table, CRUD_STORE_HASH_BITS))
+			return(-1);
+	}
+	atomic_store(&crud_store_next_oid, CRUD_STORE_FIRST_OID);
+	atomic_store(&crud_store_priority, 0);
+	crud_store_initialized = 1;
+	return(0);
+}
+
+// Release the data of an object (unless it is still in the store file mapping)
+static void crud_store_drop(void *blk) {
+	if (!CRUD_STORE_MAPPED(blk))
+		hdd_slab_free(blk);
+}
+
+// Give an object data of its own with room for len bytes (copied out of the mapping
+// if it is still there), the new data or NULL if out of memory
+static void *crud_store_own(CrudObjectStoreEntry *entry, uint32_t len) {
+	void *blk;
+
+	if (!CRUD_STORE_MAPPED(entry->blk))
+		return(hdd_slab_realloc(entry->blk, len));
+	blk = hdd_slab_alloc(len);
+	if (blk != NULL)
+		memcpy(blk, entry->blk, (len < entry->len) ? len : entry->len);
+	return(blk);
+}
+
+// Release every object and the shards (the table frees the entries themselves)
+static void crud_store_release(void) {
+	CrudObjectStoreEntry *entry;
+	HtIterator it;
+	int i;
+
+	for (i=0; i<CRUD_STORE_SHARDS; i++) {
+		initHashTableIterator(&crud_store_shards[i].table, &it);
+		while ((entry = iterateHashTable(&it)) != NULL)
+			crud_store_drop(entry->blk);
+		cleanupHashTable(&crud_store_shards[i].table);
+		pthread_rwlock_destroy(&crud_store_shards[i].lock);
+	}
+	if (crud_store_map != NULL)
+		munmap(crud_store_map, crud_store_map_size);
+	crud_store_map = NULL;
+	crud_store_map_size = 0;
+	if (crud_store_syncer_up) {
+		pthread_mutex_lock(&crud_store_log_lock);
+		crud_store_syncer_stop = 1;
+		pthread_cond_signal(&crud_store_syncer_cond);
+		pthread_mutex_unlock(&crud_store_log_lock);
+		pthread_join(crud_store_syncer, NULL);
+		crud_store_syncer_up = 0;
+	}
+	if (crud_store_log_fd != -1)
+		close(crud_store_log_fd);
+	crud_store_log_fd = -1;
+	crud_store_initialized = 0;
+}
+
+// Append a change to the log (the caller holds the shard of the object), 0 on success, -1 on failure
+static int crud_store_log(uint8_t type, uint8_t flg, CrudOID oid, uint32_t offset, const void *buf, uint32_t len) {
+	CRUD_STORE_LOG_RECORD rec;
+	struct iovec iov[2];
+	ssize_t want = sizeof(rec) + len;
+	int ret = 0;
+
+	if (crud_store_log_fd == -1)
+		return(0);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.flg = flg;
+	rec.oid = oid;
+	rec.offset = offset;
+	rec.len = len;
+	rec.crc = crud_store_record_crc(&rec, buf);
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = len;
+
+	pthread_mutex_lock(&crud_store_log_lock);
+	if (writev(crud_store_log_fd, iov, (len > 0) ? 2 : 1) != want) {
+		// Cut a partial record off, the records after it would be lost on replay
+		logMessage(LOG_ERROR_LEVEL, "CRUD store log write failed : [%s]", strerror(errno));
+		if (ftruncate(crud_store_log_fd, sizeof(CRUD_STORE_LOG_HEADER) + crud_store_log_bytes) == -1)
+			logMessage(LOG_ERROR_LEVEL, "CRUD store log repair failed : [%s]", strerror(errno));
+		ret = -1;
+	} else {
+		crud_store_log_bytes += want;
+		crud_store_log_written += want;
+		crud_store_log_mine = crud_store_log_written;
+	}
+	pthread_mutex_unlock(&crud_store_log_lock);
+	return(ret);
+}
+
+// Force the log to disk up to byte target of its history, 0 on success, -1 on failure.
+// This is the group commit: whoever finds no sync running syncs everything written so
+// far, the callers arriving meanwhile wait for it (and sync again only if it fell short).
+static int crud_store_flush(uint64_t target) {
+	uint64_t written;
+	int ret = 0;
+
+	pthread_mutex_lock(&crud_store_log_lock);
+	while (crud_store_log_synced < target && ret == 0) {
+		if (crud_store_log_syncing) {
+			pthread_cond_wait(&crud_store_log_synced_cond, &crud_store_log_lock);
+			continue;
+		}
+		crud_store_log_syncing = 1;
+		written = crud_store_log_written;
+		pthread_mutex_unlock(&crud_store_log_lock);
+		ret = fdatasync(crud_store_log_fd);
+		pthread_mutex_lock(&crud_store_log_lock);
+		crud_store_log_syncing = 0;
+		crud_store_log_syncs++;
+		if (ret == 0 && written > crud_store_log_synced)
+			crud_store_log_synced = written;
+		pthread_cond_broadcast(&crud_store_log_synced_cond);
+	}
+	pthread_mutex_unlock(&crud_store_log_lock);
+	if (ret) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store log [%s] sync failed : [%s]", crud_store_log_name, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+// Make the changes this thread logged durable if the sync policy asks for it now (called
+// once the shard is released, so changes to the same shard can join the sync)
+static int crud_store_commit(void) {
+	uint64_t mine = crud_store_log_mine;
+
+	crud_store_log_mine = 0;
+	if (crud_store_sync != CRUD_STORE_SYNC_OP || mine == 0)
+		return(0);
+	return(crud_store_flush(mine));
+}
+
+// Syncer thread, forces the log to disk every crud_store_sync_ms (CRUD_STORE_SYNC_INTERVAL)
+static void *crud_store_syncer_main(void *arg) {
+	struct timespec when;
+	uint64_t written;
+
+	pthread_mutex_lock(&crud_store_log_lock);
+	while (!crud_store_syncer_stop) {
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_nsec += (long) (crud_store_sync_ms % 1000) * 1000000;
+		when.tv_sec += crud_store_sync_ms / 1000 + when.tv_nsec / 1000000000;
+		when.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&crud_store_syncer_cond, &crud_store_log_lock, &when);
+		written = crud_store_log_written;
+		if (crud_store_syncer_stop || written == crud_store_log_synced)
+			continue;
+		pthread_mutex_unlock(&crud_store_log_lock);
+		crud_store_flush(written);
+		pthread_mutex_lock(&crud_store_log_lock);
+	}
+	pthread_mutex_unlock(&crud_store_log_lock);
+	return(NULL);
+}
+
+// Start an empty log after the checkpoint described by header, 0 on success, -1 on failure
+static int crud_store_log_reset(CRUD_STORE_LOG_HEADER *header) {
+	int ret = 0;
+
+	pthread_mutex_lock(&crud_store_log_lock);
+	if (ftruncate(crud_store_log_fd, 0) == -1 || write(crud_store_log_fd, header, sizeof(*header)) != sizeof(*header)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store log [%s] reset failed : [%s]", crud_store_log_name, strerror(errno));
+		ret = -1;
+	}
+	crud_store_log_bytes = 0;
+	crud_store_checkpoint_bytes = header->size;
+	crud_store_log_synced = crud_store_log_written; // The checkpoint on disk holds all of it
+	pthread_mutex_unlock(&crud_store_log_lock);
+	return(ret);
+}
+
+// Resolve the OID of a request, the priority object is found by its flag
+static CrudOID crud_store_resolve(CrudOID oid, uint8_t flags) {
+	return((flags == CRUD_PRIORITY_OBJECT) ? atomic_load(&crud_store_priority) : oid);
+}
+
+// Add a new entry to its shard, 0 on success, -1 if the OID is taken
+static int crud_store_insert(CrudObjectStoreEntry *entry) {
+	CRUD_STORE_SHARD *shard = CRUD_STORE_SHARD(entry->oid);
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if (findValueInHashTable(&shard->table, CRUD_STORE_KEY(entry->oid)) == NULL &&
+	    crud_store_log(CRUD_STORE_LOG_PUT, entry->flg, entry->oid, 0, entry->blk, entry->len) == 0)
+		ret = insertValueInHashTable(&shard->table, CRUD_STORE_KEY(entry->oid), entry) ? -1 : 0;
+	pthread_rwlock_unlock(&shard->lock);
+	return(ret);
+}
+
+// Remove an entry from its shard, returns it (NULL if there is none)
+static CrudObjectStoreEntry *crud_store_remove(CrudOID oid) {
+	CRUD_STORE_SHARD *shard = CRUD_STORE_SHARD(oid);
+	CrudObjectStoreEntry *entry;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	entry = findValueInHashTable(&shard->table, CRUD_STORE_KEY(oid));
+	if (entry != NULL && crud_store_log(CRUD_STORE_LOG_DELETE, entry->flg, oid, 0, NULL, 0) == 0)
+		deleteValueFromHashTable(&shard->table, CRUD_STORE_KEY(oid));
+	else
+		entry = NULL;
+	pthread_rwlock_unlock(&shard->lock);
+	return(entry);
+}
+
+// Read exactly len bytes of a file, 0 on success, -1 on failure
+static int crud_store_fread(FILE *fh, void *buf, size_t len) {
+	return((len == 0 || fread(buf, len, 1, fh) == 1) ? 0 : -1);
+}
+
+// Read a field of the store file mapping, 0 on success, -1 if the file ends first
+static int crud_store_field(char **pos, char *end, void *field, size_t len) {
+	if ((size_t) (end - *pos) < len)
+		return(-1);
+	memcpy(field, *pos, len);
+	*pos += len;
+	return(0);
+}
+
+// Index the objects of the store file, *checkpoint is set to describe it.  The file is
+// mapped; lazy stores keep the mapping and point at it, others copy every object out.
+static int crud_store_load(const char *filename, CRUD_STORE_LOG_HEADER *checkpoint) {
+	CrudObjectStoreEntry *entry;
+	uint32_t next, count, i = 0;
+	struct stat st;
+	char *pos, *end;
+	int fd;
+
+	checkpoint->magic = CRUD_STORE_LOG_MAGIC;
+	checkpoint->version = CRUD_STORE_LOG_VERSION;
+	checkpoint->next = CRUD_STORE_FIRST_OID;
+	checkpoint->count = 0;
+	checkpoint->size = 0;
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			logMessage(LOG_INFO_LEVEL, "CRUD store file [%s] not found, starting empty.", filename);
+			return(0);
+		}
+		logMessage(LOG_ERROR_LEVEL, "CRUD store open of [%s] failed : [%s]", filename, strerror(errno));
+		return(-1);
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0 ||
+	    (crud_store_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		crud_store_map = NULL;
+		close(fd);
+		goto corrupt;
+	}
+	close(fd);
+	crud_store_map_size = st.st_size;
+	pos = crud_store_map;
+	end = crud_store_map + crud_store_map_size;
+
+	if (crud_store_field(&pos, end, &next, sizeof(next)) || crud_store_field(&pos, end, &count, sizeof(count)))
+		goto corrupt;
+	checkpoint->next = next;
+	checkpoint->count = count;
+	for (i=0; i<count; i++) {
+		entry = calloc(1, sizeof(CrudObjectStoreEntry));
+		if (entry == NULL)
+			goto corrupt;
+		if (crud_store_field(&pos, end, &entry->oid, sizeof(entry->oid)) ||
+		    crud_store_field(&pos, end, &entry->flg, sizeof(entry->flg)) ||
+		    crud_store_field(&pos, end, &entry->len, sizeof(entry->len)) ||
+		    entry->len > CRUD_MAX_OBJECT_SIZE || entry->len > (size_t) (end - pos)) {
+			free(entry);
+			goto corrupt;
+		}
+		if (!crud_store_lazy) {
+			entry->blk = hdd_slab_alloc(entry->len);
+			if (entry->blk != NULL)
+				memcpy(entry->blk, pos, entry->len);
+		} else if (entry->len > 0) {
+			entry->blk = pos;
+		}
+		pos += entry->len;
+		if ((entry->blk == NULL && !crud_store_lazy) || crud_store_insert(entry)) {
+			crud_store_drop(entry->blk);
+			free(entry);
+			goto corrupt;
+		}
+		if (entry->flg == CRUD_PRIORITY_OBJECT)
+			atomic_store(&crud_store_priority, entry->oid);
+		if (entry->oid >= next)
+			next = entry->oid + 1;
+	}
+	atomic_store(&crud_store_next_oid, next);
+	checkpoint->size = pos - crud_store_map;
+	if (!crud_store_lazy) {
+		munmap(crud_store_map, crud_store_map_size);
+		crud_store_map = NULL;
+		crud_store_map_size = 0;
+	}
+	logMessage(LOG_INFO_LEVEL, "CRUD store %s %u objects from [%s], next OID %u", crud_store_lazy ? "mapped" : "loaded",
+			count, filename, next);
+	return(0);
+
+corrupt:
+	logMessage(LOG_ERROR_LEVEL, "CRUD store file [%s] is corrupt (object %u)", filename, i);
+	return(-1);
+}
+
+// Apply a change read back from the log, 0 on success, -1 if it does not fit the store
+static int crud_store_apply(CRUD_STORE_LOG_RECORD *rec, const char *data) {
+	CRUD_STORE_SHARD *shard = CRUD_STORE_SHARD(rec->oid);
+	CrudObjectStoreEntry *entry = findValueInHashTable(&shard->table, CRUD_STORE_KEY(rec->oid));
+	void *grown;
+
+	switch (rec->type) {
+	case CRUD_STORE_LOG_PUT: // Whole contents of a new or updated object
+		if (entry == NULL) {
+			entry = calloc(1, sizeof(CrudObjectStoreEntry));
+			if (entry == NULL)
+				return(-1);
+			entry->oid = rec->oid;
+			if (insertValueInHashTable(&shard->table, CRUD_STORE_KEY(rec->oid), entry)) {
+				free(entry);
+				return(-1);
+			}
+		}
+		grown = crud_store_own(entry, rec->len);
+		if (grown == NULL)
+			return(-1);
+		entry->blk = grown;
+		entry->len = rec->len;
+		entry->flg = rec->flg;
+		memcpy(entry->blk, data, rec->len);
+		if (rec->flg == CRUD_PRIORITY_OBJECT)
+			atomic_store(&crud_store_priority, rec->oid);
+		if (rec->oid >= atomic_load(&crud_store_next_oid))
+			atomic_store(&crud_store_next_oid, rec->oid + 1);
+		return(0);
+
+	case CRUD_STORE_LOG_PATCH: // Bytes at an offset, possibly growing the object
+		if (entry == NULL || rec->offset > entry->len || rec->offset + rec->len > CRUD_MAX_OBJECT_SIZE)
+			return(-1);
+		grown = crud_store_own(entry, (rec->offset + rec->len > entry->len) ? rec->offset + rec->len : entry->len);
+		if (grown == NULL)
+			return(-1);
+		entry->blk = grown;
+		if (rec->offset + rec->len > entry->len)
+			entry->len = rec->offset + rec->len;
+		memcpy((char *) entry->blk + rec->offset, data, rec->len);
+		return(0);
+
+	case CRUD_STORE_LOG_DELETE:
+		entry = deleteValueFromHashTable(&shard->table, CRUD_STORE_KEY(rec->oid));
+		if (entry == NULL)
+			return(-1);
+		if (atomic_load(&crud_store_priority) == rec->oid)
+			atomic_store(&crud_store_priority, 0);
+		crud_store_drop(entry->blk);
+		free(entry);
+		return(0);
+	}
+	return(-1);
+}
+
+// Replay the log written after the checkpoint (a torn tail is cut off) and keep it open for appending
+static int crud_store_replay(CRUD_STORE_LOG_HEADER *checkpoint) {
+	CRUD_STORE_LOG_HEADER header;
+	CRUD_STORE_LOG_RECORD rec;
+	uint64_t good = 0, end = 0;
+	uint32_t changes = 0;
+	char *data;
+	FILE *fh;
+
+	fh = fopen(crud_store_log_name, "r");
+	if (fh == NULL && errno != ENOENT) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store log [%s] open failed : [%s]", crud_store_log_name, strerror(errno));
+		return(-1);
+	}
+	if (fh != NULL) {
+		if (crud_store_fread(fh, &header, sizeof(header)) == 0 && !memcmp(&header, checkpoint, sizeof(header))) {
+			data = malloc(CRUD_MAX_OBJECT_SIZE);
+			if (data == NULL) {
+				fclose(fh);
+				return(-1);
+			}
+			good = sizeof(header);
+			while (crud_store_fread(fh, &rec, sizeof(rec)) == 0 && rec.len <= CRUD_MAX_OBJECT_SIZE &&
+			       crud_store_fread(fh, data, rec.len) == 0 && rec.crc == crud_store_record_crc(&rec, data)) {
+				if (crud_store_apply(&rec, data)) {
+					logMessage(LOG_ERROR_LEVEL, "CRUD store log [%s] change %u does not apply to OID %u.",
+							crud_store_log_name, changes, rec.oid);
+					free(data);
+					fclose(fh);
+					return(-1);
+				}
+				good += sizeof(rec) + rec.len;
+				changes++;
+			}
+			free(data);
+		} else {
+			logMessage(LOG_WARNING_LEVEL, "CRUD store log [%s] does not follow the store file, ignored.", crud_store_log_name);
+		}
+		fseek(fh, 0, SEEK_END);
+		end = ftell(fh);
+		fclose(fh);
+	}
+
+	// Keep the log from the last good record on (a fresh one if it was missing or stale)
+	crud_store_log_fd = open(crud_store_log_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (crud_store_log_fd == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store log [%s] open failed : [%s]", crud_store_log_name, strerror(errno));
+		return(-1);
+	}
+	if (good == 0)
+		return(crud_store_log_reset(checkpoint));
+	if (good < end) {
+		logMessage(LOG_WARNING_LEVEL, "CRUD store log [%s] ends in a torn record, dropped %lu bytes.",
+				crud_store_log_name, (unsigned long) (end - good));
+		if (ftruncate(crud_store_log_fd, good) == -1)
+			return(-1);
+	}
+	crud_store_log_bytes = good - sizeof(header);
+	crud_store_checkpoint_bytes = checkpoint->size;
+	logMessage(LOG_INFO_LEVEL, "CRUD store replayed %u changes from [%s], next OID %u", changes,
+			crud_store_log_name, atomic_load(&crud_store_next_oid));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_open
+// Description  : Set up the store, load the objects of the store file and
+//                replay the changes logged after it
+//
+// Inputs       : filename - the store file (a missing file is an empty store)
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_open(const char *filename) {
+	CRUD_STORE_LOG_HEADER checkpoint;
+
+	if (crud_store_initialized)
+		crud_store_release();
+	if (crud_store_setup()) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store setup failed.");
+		return(-1);
+	}
+	snprintf(crud_store_log_name, sizeof(crud_store_log_name), "%s%s", filename, CRUD_STORE_LOG_SUFFIX);
+	if (crud_store_load(filename, &checkpoint) || crud_store_replay(&checkpoint)) {
+		crud_store_release();
+		return(-1);
+	}
+	if (crud_store_sync == CRUD_STORE_SYNC_INTERVAL) {
+		crud_store_syncer_stop = 0;
+		if (pthread_create(&crud_store_syncer, NULL, crud_store_syncer_main, NULL)) {
+			logMessage(LOG_ERROR_LEVEL, "CRUD store syncer start failed.");
+			crud_store_release();
+			return(-1);
+		}
+		crud_store_syncer_up = 1;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_save
+// Description  : Make the store durable.  The changes are in the log already,
+//                so this only syncs what the sync policy has not yet, until
+//                the log has grown as large as the store file (and
+//                CRUD_STORE_LOG_COMPACT), then the store is checkpointed and
+//                the log starts over.
+//
+// Inputs       : filename - the store file
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_save(const char *filename) {
+	uint64_t logged, checkpointed, written;
+
+	if (!crud_store_initialized)
+		return(-1);
+	pthread_mutex_lock(&crud_store_log_lock);
+	logged = crud_store_log_bytes;
+	checkpointed = crud_store_checkpoint_bytes;
+	written = crud_store_log_written;
+	pthread_mutex_unlock(&crud_store_log_lock);
+	if (logged < CRUD_STORE_LOG_COMPACT || logged < checkpointed)
+		return(crud_store_flush(written));
+	return(crud_store_checkpoint(filename));
+}
+
+// Force the directory entry of a file to disk (so a rename survives a crash), 0 on success
+static int crud_store_sync_dir(const char *filename) {
+	const char *slash = strrchr(filename, '/');
+	char dir[256];
+	int fd, ret;
+
+	if (slash == NULL)
+		snprintf(dir, sizeof(dir), ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - filename + 1), filename);
+	fd = open(dir, O_RDONLY);
+	if (fd == -1)
+		return(-1);
+	ret = fsync(fd);
+	close(fd);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_checkpoint
+// Description  : Write the store to a new file that then replaces the store
+//                file (a failed checkpoint leaves the old one and its log in
+//                place), then start an empty log after it
+//
+// Inputs       : filename - the store file
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_checkpoint(const char *filename) {
+	CrudObjectStoreEntry *entry;
+	CRUD_STORE_LOG_HEADER header;
+	char temp[256];
+	uint32_t next, count = 0;
+	HtIterator it;
+	FILE *fh;
+	int i, failed = 0;
+
+	if (!crud_store_initialized)
+		return(-1);
+	snprintf(temp, sizeof(temp), "%s.tmp", filename);
+	fh = fopen(temp, "w");
+	if (fh == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store save to [%s] failed : [%s]", temp, strerror(errno));
+		return(-1);
+	}
+
+	// Hold every shard so the file is one consistent picture of the store and nothing is
+	// logged until the log has been started over
+	for (i=0; i<CRUD_STORE_SHARDS; i++) {
+		pthread_rwlock_rdlock(&crud_store_shards[i].lock);
+		count += crud_store_shards[i].table.elements;
+	}
+	next = atomic_load(&crud_store_next_oid);
+	failed |= (fwrite(&next, sizeof(next), 1, fh) != 1);
+	failed |= (fwrite(&count, sizeof(count), 1, fh) != 1);
+	for (i=0; i<CRUD_STORE_SHARDS && !failed; i++) {
+		initHashTableIterator(&crud_store_shards[i].table, &it);
+		while (!failed && (entry = iterateHashTable(&it)) != NULL) {
+			failed |= (fwrite(&entry->oid, sizeof(entry->oid), 1, fh) != 1);
+			failed |= (fwrite(&entry->flg, sizeof(entry->flg), 1, fh) != 1);
+			failed |= (fwrite(&entry->len, sizeof(entry->len), 1, fh) != 1);
+			failed |= (entry->len > 0 && fwrite(entry->blk, entry->len, 1, fh) != 1);
+		}
+	}
+	header.magic = CRUD_STORE_LOG_MAGIC;
+	header.version = CRUD_STORE_LOG_VERSION;
+	header.next = next;
+	header.count = count;
+	header.size = ftell(fh);
+	failed |= (fflush(fh) != 0 || fsync(fileno(fh)) != 0);
+	failed |= (fclose(fh) != 0);
+	if (failed || rename(temp, filename) == -1 || crud_store_sync_dir(filename)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD store save to [%s] failed : [%s]", filename, strerror(errno));
+		unlink(temp);
+		failed = 1;
+	} else {
+		// The new store file holds everything, a crash before the reset just ignores the old log
+		failed = crud_store_log_reset(&header);
+	}
+	for (i=0; i<CRUD_STORE_SHARDS; i++)
+		pthread_rwlock_unlock(&crud_store_shards[i].lock);
+	if (failed)
+		return(-1);
+
+	logMessage(LOG_INFO_LEVEL, "CRUD store saved %u objects to [%s]", count, filename);
+	hdd_slab_log("CRUD store");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_close
+// Description  : Save the store and release it
+//
+// Inputs       : filename - the store file
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_close(const char *filename) {
+	int ret;
+
+	if (!crud_store_initialized)
+		return(-1);
+	ret = crud_store_save(filename);
+	crud_store_release();
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_format
+// Description  : Delete every object (the store file and its log), OIDs start over
+//
+// Inputs       : filename - the store file
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_format(const char *filename) {
+	char log[256];
+
+	if (!crud_store_initialized)
+		return(-1);
+	crud_store_release();
+	snprintf(log, sizeof(log), "%s%s", filename, CRUD_STORE_LOG_SUFFIX);
+	unlink(filename);
+	unlink(log);
+	if (crud_store_open(filename))
+		return(-1);
+	logMessage(LOG_INFO_LEVEL, "CRUD store formatted.");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_create
+// Description  : Create an object with the next OID (there is at most one
+//                priority object)
+//
+// Inputs       : oid - set to the OID of the new object
+//                flags - CRUD_FLAG_TYPES of the object
+//                buf - the object contents
+//                len - the length of the object
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_create(CrudOID *oid, uint8_t flags, const void *buf, uint32_t len) {
+	CrudObjectStoreEntry *entry;
+	CrudOID none = 0;
+
+	if (!crud_store_initialized || len > CRUD_MAX_OBJECT_SIZE)
+		return(-1);
+	if (flags == CRUD_PRIORITY_OBJECT && atomic_load(&crud_store_priority) != 0)
+		return(-1);
+	entry = malloc(sizeof(CrudObjectStoreEntry));
+	if (entry == NULL)
+		return(-1);
+	entry->blk = hdd_slab_alloc(len);
+	if (entry->blk == NULL) {
+		free(entry);
+		return(-1);
+	}
+	memcpy(entry->blk, buf, len);
+	entry->flg = flags;
+	entry->len = len;
+	entry->oid = atomic_fetch_add(&crud_store_next_oid, 1);
+	if (crud_store_insert(entry)) {
+		hdd_slab_free(entry->blk);
+		free(entry);
+		return(-1);
+	}
+
+	// Publish the priority object once it can be found, unless another won the race
+	if (flags == CRUD_PRIORITY_OBJECT && !atomic_compare_exchange_strong(&crud_store_priority, &none, entry->oid)) {
+		crud_store_remove(entry->oid);
+		hdd_slab_free(entry->blk);
+		free(entry);
+		return(-1);
+	}
+	*oid = entry->oid;
+	return(crud_store_commit());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_read
+// Description  : Copy (part of) an object out of the store
+//
+// Inputs       : oid - the object (set to the OID found for the priority object)
+//                flags - CRUD_FLAG_TYPES of the request
+//                offset - first byte to copy
+//                buf - where the bytes go
+//                max - room in buf
+//                len - set to the bytes copied
+// Outputs      : 0 if successful, -1 if failure (no object, offset past its end)
+
+int crud_store_read(CrudOID *oid, uint8_t flags, uint32_t offset, void *buf, uint32_t max, uint32_t *len) {
+	CrudObjectStoreEntry *entry;
+	CRUD_STORE_SHARD *shard;
+	CrudOID id;
+	int ret = -1;
+
+	if (!crud_store_initialized)
+		return(-1);
+	id = crud_store_resolve(*oid, flags);
+	shard = CRUD_STORE_SHARD(id);
+	pthread_rwlock_rdlock(&shard->lock);
+	entry = findValueInHashTable(&shard->table, CRUD_STORE_KEY(id));
+	if (entry != NULL && offset <= entry->len) {
+		*len = (entry->len - offset < max) ? entry->len - offset : max;
+		memcpy(buf, (char *) entry->blk + offset, *len);
+		*oid = id;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_update
+// Description  : Overwrite an object with contents of the same length (the
+//                priority flag has to match the object)
+//
+// Inputs       : oid - the object
+//                flags - CRUD_FLAG_TYPES of the request
+//                buf - the new contents
+//                len - their length
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_update(CrudOID oid, uint8_t flags, const void *buf, uint32_t len) {
+	CrudObjectStoreEntry *entry;
+	CRUD_STORE_SHARD *shard;
+	void *blk;
+	int ret = -1;
+
+	if (!crud_store_initialized)
+		return(-1);
+	oid = crud_store_resolve(oid, flags);
+	shard = CRUD_STORE_SHARD(oid);
+	pthread_rwlock_wrlock(&shard->lock);
+	entry = findValueInHashTable(&shard->table, CRUD_STORE_KEY(oid));
+	if (entry != NULL && entry->len == len &&
+	    (entry->flg == CRUD_PRIORITY_OBJECT) == (flags == CRUD_PRIORITY_OBJECT) &&
+	    (blk = crud_store_own(entry, len)) != NULL) {
+		entry->blk = blk;
+		if (crud_store_log(CRUD_STORE_LOG_PUT, entry->flg, oid, 0, buf, len) == 0) {
+			memcpy(entry->blk, buf, len);
+			ret = 0;
+		}
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	return((ret == 0) ? crud_store_commit() : ret);
+}
+
+// Copy len bytes to offset of a non-priority object (offset -1 appends), growing it up to limit
+static int crud_store_patch(CrudOID oid, int64_t offset, const void *buf, uint32_t len, uint32_t limit, uint32_t *size) {
+	CrudObjectStoreEntry *entry;
+	CRUD_STORE_SHARD *shard;
+	void *grown;
+	int ret = -1;
+
+	if (!crud_store_initialized)
+		return(-1);
+	shard = CRUD_STORE_SHARD(oid);
+	pthread_rwlock_wrlock(&shard->lock);
+	entry = findValueInHashTable(&shard->table, CRUD_STORE_KEY(oid));
+	if (entry == NULL || entry->flg == CRUD_PRIORITY_OBJECT)
+		goto done;
+	if (offset < 0)
+		offset = entry->len;
+	if (offset > entry->len || offset + len > limit || offset + len > CRUD_MAX_OBJECT_SIZE)
+		goto done;
+
+	// Make room if the data runs past the end (the length changes once the patch is logged)
+	if (offset + len > entry->len || CRUD_STORE_MAPPED(entry->blk)) {
+		grown = crud_store_own(entry, (offset + len > entry->len) ? offset + len : entry->len);
+		if (grown == NULL)
+			goto done;
+		entry->blk = grown;
+	}
+	if (crud_store_log(CRUD_STORE_LOG_PATCH, entry->flg, oid, offset, buf, len))
+		goto done;
+	if (offset + len > entry->len)
+		entry->len = offset + len;
+	memcpy((char *) entry->blk + offset, buf, len);
+	*size = entry->len;
+	ret = 0;
+done:
+	pthread_rwlock_unlock(&shard->lock);
+	return((ret == 0) ? crud_store_commit() : ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_write
+// Description  : Patch a byte range of an object, growing it as needed (the
+//                priority object is always updated whole)
+//
+// Inputs       : oid - the object
+//                offset - where the bytes go (at most the object length)
+//                buf - the bytes
+//                len - their count
+//                limit - largest length the object may grow to
+//                size - set to the new object length
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_write(CrudOID oid, uint32_t offset, const void *buf, uint32_t len, uint32_t limit, uint32_t *size) {
+	return(crud_store_patch(oid, offset, buf, len, limit, size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_append
+// Description  : Add bytes at the end of an object
+//
+// Inputs       : oid - the object
+//                buf - the bytes
+//                len - their count
+//                limit - largest length the object may grow to
+//                size - set to the new object length
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_append(CrudOID oid, const void *buf, uint32_t len, uint32_t limit, uint32_t *size) {
+	return(crud_store_patch(oid, -1, buf, len, limit, size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crud_store_delete
+// Description  : Delete an object
+//
+// Inputs       : oid - the object (set to the OID found for the priority object)
+//                flags - CRUD_FLAG_TYPES of the request
+// Outputs      : 0 if successful, -1 if failure
+
+int crud_store_delete(CrudOID *oid, uint8_t flags) {
+	CrudObjectStoreEntry *entry;
+	CrudOID id;
+
+	if (!crud_store_initialized)
+		return(-1);
+	id = crud_store_resolve(*oid, flags);
+	entry = crud_store_remove(id);
+	if (entry == NULL)
+		return(-1);
+	if (entry->flg == CRUD_PRIORITY_OBJECT)
+		atomic_compare_exchange_strong(&crud_store_priority, &id, 0);
+	*oid = entry->oid;
+	crud_store_drop(entry->blk);
+	free(entry);
+	return(crud_store_commit());
+}
+
+// Unit test worker, creates objects and reads them back while the others do the same
+static void *crud_store_unit_thread(void *arg) {
+	CrudOID oids[CRUD_STORE_UNIT_TEST_OBJECTS], oid;
+	uint32_t i, len, seed = (uint32_t) (uintptr_t) arg;
+	char buf[64], back[64];
+
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS; i++) {
+		snprintf(buf, sizeof(buf), "thread %u object %u", seed, i);
+		if (crud_store_create(&oids[i], CRUD_NULL_FLAG, buf, strlen(buf)))
+			return((void *) 1);
+	}
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS; i++) {
+		snprintf(buf, sizeof(buf), "thread %u object %u", seed, i);
+		oid = oids[i];
+		if (crud_store_read(&oid, CRUD_NULL_FLAG, 0, back, sizeof(back), &len) ||
+		    len != strlen(buf) || memcmp(buf, back, len))
+			return((void *) 1);
+		if ((i & 1) && crud_store_delete(&oid, CRUD_NULL_FLAG))
+			return((void *) 1);
+	}
+	return(NULL);
+}
+
+// Unit test check, the store holds the priority object and the mirrored objects
+static int crud_store_unit_check(const char *when, CrudOID meta, CrudOID *oids, char **mirror, uint32_t *lens) {
+	char buf[CRUD_STORE_UNIT_TEST_MAX_OBJECT*3];
+	CrudOID oid = 0;
+	uint32_t len;
+	int i;
+
+	if (crud_store_read(&oid, CRUD_PRIORITY_OBJECT, 0, buf, sizeof(buf), &len) || oid != meta || len != 4) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : priority object lost %s.", when);
+		return(-1);
+	}
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS; i++) {
+		oid = oids[i];
+		if (crud_store_read(&oid, CRUD_NULL_FLAG, 0, buf, sizeof(buf), &len) || len != lens[i] || memcmp(buf, mirror[i], len)) {
+			logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : object %u lost %s.", oids[i], when);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crudStoreUnitTest
+// Description  : Perform a test of the store against a mirror of its objects,
+//                from many threads, through a crash (log replay, torn log
+//                tail), through a checkpoint and with the store file mapped
+//                or loaded
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int crudStoreUnitTest(void) {
+	char *mirror[CRUD_STORE_UNIT_TEST_OBJECTS] = { NULL }, buf[CRUD_STORE_UNIT_TEST_MAX_OBJECT*2];
+	uint32_t lens[CRUD_STORE_UNIT_TEST_OBJECTS], len, size, off;
+	CrudOID oids[CRUD_STORE_UNIT_TEST_OBJECTS], oid, meta;
+	pthread_t threads[CRUD_STORE_UNIT_TEST_THREADS];
+	void *result;
+	FILE *fh;
+	int i, obj, failed = 0, ret = -1;
+
+	unlink(CRUD_STORE_UNIT_TEST_FILE);
+	unlink(CRUD_STORE_UNIT_TEST_LOG);
+	if (crud_store_open(CRUD_STORE_UNIT_TEST_FILE)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : open failed.");
+		goto cleanup;
+	}
+
+	// One priority object only
+	if (crud_store_create(&meta, CRUD_PRIORITY_OBJECT, "meta", 4) || !crud_store_create(&oid, CRUD_PRIORITY_OBJECT, "meta", 4)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : priority object create failed.");
+		goto cleanup;
+	}
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS; i++) {
+		lens[i] = getRandomValue(1, CRUD_STORE_UNIT_TEST_MAX_OBJECT);
+		mirror[i] = malloc(CRUD_STORE_UNIT_TEST_MAX_OBJECT*3);
+		memset(mirror[i], getRandomValue(0, 0xff), lens[i]);
+		if (crud_store_create(&oids[i], CRUD_NULL_FLAG, mirror[i], lens[i])) {
+			logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : create failed.");
+			goto cleanup;
+		}
+	}
+
+	// Random operations, checked against the mirror
+	for (i=0; i<CRUD_STORE_UNIT_TEST_ITERATIONS && !failed; i++) {
+		obj = getRandomValue(0, CRUD_STORE_UNIT_TEST_OBJECTS-1);
+		oid = oids[obj];
+		switch (getRandomValue(0, 3)) {
+		case 0: // Whole or partial read
+			off = getRandomValue(0, lens[obj]);
+			failed = crud_store_read(&oid, CRUD_NULL_FLAG, off, buf, sizeof(buf), &len) ||
+				len != lens[obj] - off || memcmp(buf, mirror[obj] + off, len);
+			break;
+
+		case 1: // Same length update
+			memset(mirror[obj], getRandomValue(0, 0xff), lens[obj]);
+			failed = crud_store_update(oid, CRUD_NULL_FLAG, mirror[obj], lens[obj]);
+			break;
+
+		case 2: // Range write, possibly growing the object
+			off = getRandomValue(0, lens[obj] - 1);
+			len = getRandomValue(1, CRUD_STORE_UNIT_TEST_MAX_OBJECT*2 - off);
+			memset(mirror[obj] + off, getRandomValue(0, 0xff), len);
+			failed = crud_store_write(oid, off, mirror[obj] + off, len, CRUD_STORE_UNIT_TEST_MAX_OBJECT*2, &size) ||
+				size != ((off + len > lens[obj]) ? off + len : lens[obj]);
+			lens[obj] = size;
+			break;
+
+		default: // Updates of another length and writes past the end are refused
+			failed = !crud_store_update(oid, CRUD_NULL_FLAG, mirror[obj], lens[obj] + 1) ||
+				!crud_store_write(oid, lens[obj] + 1, buf, 1, CRUD_STORE_UNIT_TEST_MAX_OBJECT*2, &size);
+			break;
+		}
+	}
+	if (failed) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : operation %d on object %u failed.", i, oids[obj]);
+		goto cleanup;
+	}
+
+	// Concurrent creates get distinct OIDs and do not disturb each other, each change is
+	// on disk before it returns (the threads share syncs)
+	crud_store_sync = CRUD_STORE_SYNC_OP;
+	for (i=0; i<CRUD_STORE_UNIT_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, crud_store_unit_thread, (void *) (uintptr_t) i);
+	for (i=0; i<CRUD_STORE_UNIT_TEST_THREADS; i++) {
+		pthread_join(threads[i], &result);
+		failed |= (result != NULL);
+	}
+	crud_store_sync = CRUD_STORE_SYNC_CLOSE;
+	failed |= (crud_store_log_synced != crud_store_log_written);
+	if (failed) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : concurrent operations failed.");
+		goto cleanup;
+	}
+
+	// Everything survives a crash (the store is dropped unsaved and rebuilt from the log)
+	crud_store_release();
+	if (crud_store_open(CRUD_STORE_UNIT_TEST_FILE) || crud_store_unit_check("after a crash", meta, oids, mirror, lens))
+		goto cleanup;
+
+	// A record torn by a crash in the middle of a write is dropped
+	fh = fopen(CRUD_STORE_UNIT_TEST_LOG, "a");
+	if (fh == NULL || fwrite(mirror[0], 1, 32, fh) != 32 || fclose(fh)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : log tear failed.");
+		goto cleanup;
+	}
+	crud_store_release();
+	if (crud_store_open(CRUD_STORE_UNIT_TEST_FILE) || crud_store_unit_check("after a torn write", meta, oids, mirror, lens))
+		goto cleanup;
+
+	// A checkpoint holds everything without the log
+	if (crud_store_checkpoint(CRUD_STORE_UNIT_TEST_FILE) || crud_store_close(CRUD_STORE_UNIT_TEST_FILE) ||
+	    unlink(CRUD_STORE_UNIT_TEST_LOG) || crud_store_open(CRUD_STORE_UNIT_TEST_FILE) ||
+	    crud_store_unit_check("after a checkpoint", meta, oids, mirror, lens)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : checkpoint failed.");
+		goto cleanup;
+	}
+
+	// Objects still in the store file mapping are copied out when they change
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS && !failed; i+=2) {
+		memset(mirror[i], getRandomValue(0, 0xff), lens[i]);
+		off = getRandomValue(0, lens[i+1]);
+		memset(mirror[i+1] + off, getRandomValue(0, 0xff), CRUD_STORE_UNIT_TEST_MAX_OBJECT);
+		failed = crud_store_update(oids[i], CRUD_NULL_FLAG, mirror[i], lens[i]) ||
+			crud_store_write(oids[i+1], off, mirror[i+1] + off, CRUD_STORE_UNIT_TEST_MAX_OBJECT, CRUD_STORE_UNIT_TEST_MAX_OBJECT*3, &size);
+		lens[i+1] = size;
+	}
+	if (failed || crud_store_unit_check("after changing mapped objects", meta, oids, mirror, lens)) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : mapped object change failed.");
+		goto cleanup;
+	}
+
+	// The same store loaded eagerly, with the log replayed over it
+	crud_store_release();
+	crud_store_lazy = 0;
+	failed = crud_store_open(CRUD_STORE_UNIT_TEST_FILE) || crud_store_unit_check("loaded eagerly", meta, oids, mirror, lens);
+	crud_store_lazy = 1;
+	if (failed)
+		goto cleanup;
+	if (crud_store_create(&oid, CRUD_NULL_FLAG, "x", 1) || oid <= oids[CRUD_STORE_UNIT_TEST_OBJECTS-1]) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_UNIT_TEST : OID reused after reload.");
+		goto cleanup;
+	}
+
+	logMessage(LOG_INFO_LEVEL, "CRUD_STORE_UNIT_TEST : store unit test completed successfully.");
+	ret = 0;
+
+	// Cleanup (the test store is closed and deleted whether or not it passed)
+cleanup:
+	for (i=0; i<CRUD_STORE_UNIT_TEST_OBJECTS; i++)
+		free(mirror[i]);
+	if (crud_store_initialized)
+		crud_store_release();
+	unlink(CRUD_STORE_UNIT_TEST_FILE);
+	unlink(CRUD_STORE_UNIT_TEST_LOG);
+	return(ret);
+}
+
+// Benchmark worker, creates an object and keeps changing it (whole and in part)
+static void *crud_store_bench_thread(void *arg) {
+	char buf[CRUD_STORE_BENCH_OBJECT];
+	uint32_t i, size;
+	CrudOID oid;
+
+	memset(buf, (int) (uintptr_t) arg, sizeof(buf));
+	if (crud_store_create(&oid, CRUD_NULL_FLAG, buf, sizeof(buf)))
+		return((void *) 1);
+	for (i=1; i<CRUD_STORE_BENCH_CHANGES; i++) {
+		buf[i % sizeof(buf)]++;
+		if ((i & 1) ? crud_store_update(oid, CRUD_NULL_FLAG, buf, sizeof(buf)) :
+		    crud_store_write(oid, 0, buf, sizeof(buf)/8, sizeof(buf), &size))
+			return((void *) 1);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crudStoreBenchmark
+// Description  : Measure the changes per second the store takes under each
+//                sync policy (per-op alone and with concurrent writers, so
+//                the group commit shows, every N ms, on close only); the
+//                time includes closing the store, which syncs what is left
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int crudStoreBenchmark(void) {
+	struct { int sync; int threads; } runs[] = {
+		{ CRUD_STORE_SYNC_OP, 1 },
+		{ CRUD_STORE_SYNC_OP, CRUD_STORE_BENCH_THREADS },
+		{ CRUD_STORE_SYNC_INTERVAL, CRUD_STORE_BENCH_THREADS },
+		{ CRUD_STORE_SYNC_CLOSE, CRUD_STORE_BENCH_THREADS },
+	};
+	pthread_t threads[CRUD_STORE_BENCH_THREADS];
+	int policy = crud_store_sync, i, t, failed = 0;
+	struct timespec start, end;
+	char name[32];
+	uint64_t syncs;
+	uint32_t changes;
+	void *result;
+	double secs;
+
+	for (i=0; i<(int) (sizeof(runs)/sizeof(runs[0])) && !failed; i++) {
+		unlink(CRUD_STORE_BENCH_FILE);
+		unlink(CRUD_STORE_BENCH_LOG);
+		crud_store_sync = runs[i].sync;
+		if (crud_store_open(CRUD_STORE_BENCH_FILE)) {
+			failed = 1;
+			break;
+		}
+		syncs = crud_store_log_syncs;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (t=0; t<runs[i].threads; t++)
+			pthread_create(&threads[t], NULL, crud_store_bench_thread, (void *) (uintptr_t) t);
+		for (t=0; t<runs[i].threads; t++) {
+			pthread_join(threads[t], &result);
+			failed |= (result != NULL);
+		}
+		failed |= (crud_store_close(CRUD_STORE_BENCH_FILE) != 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		changes = runs[i].threads * CRUD_STORE_BENCH_CHANGES;
+		if (runs[i].sync == CRUD_STORE_SYNC_INTERVAL)
+			snprintf(name, sizeof(name), "every %dms", crud_store_sync_ms);
+		else
+			snprintf(name, sizeof(name), "%s", (runs[i].sync == CRUD_STORE_SYNC_OP) ? "per-op" : "on-close");
+		logMessage(LOG_OUTPUT_LEVEL, "CRUD_STORE_BENCHMARK : sync %-10s %d thread(s) : %u changes in %.3fs, %.0f changes/s, %lu log syncs",
+				name, runs[i].threads, changes, secs, changes / secs, (unsigned long) (crud_store_log_syncs - syncs));
+	}
+
+	// Cleanup
+	crud_store_sync = policy;
+	unlink(CRUD_STORE_BENCH_FILE);
+	unlink(CRUD_STORE_BENCH_LOG);
+	if (failed) {
+		logMessage(LOG_ERROR_LEVEL, "CRUD_STORE_BENCHMARK : store changes failed.");
+		return(-1);
+	}
+	return(0);
+}
@@ -0,0 +1,136 @@
+#ifndef CRUD_STORE_INCLUDED
+#define CRUD_STORE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : crud_store.h
+//  Description    : This is the header file for the sharded object store used
+//                   by the HDD server in place of the single table of
+//                   libcrud.a.  Objects are spread over shards by OID, each
+//                   shard has its own reader-writer lock, and OIDs are handed
+//                   out atomically, so block commands can run on many threads.
+//                   The store file keeps the hdd_content.svd layout and is
+//                   the checkpoint of the store; every change after it goes
+//                   to an append-only log next to it (hdd_content.svd.log),
+//                   which is replayed on open and folded into a new
+//                   checkpoint once it has grown as large as the store file.
+//                   The log is the write-ahead journal of the store: the sync
+//                   policy says when it is forced to disk, and changes made
+//                   at the same time share one sync (group commit).
+//                   A lazy store maps the store file at open and only indexes
+//                   it, object data is read from the mapping until changed.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+
+// Project include files
+#include <crud_driver.h>
+
+// Defines
+#define CRUD_STORE_SHARD_BITS 4 // The store is split into 2^(bits) shards
+#define CRUD_STORE_SHARDS (1 << CRUD_STORE_SHARD_BITS)
+#define CRUD_STORE_HASH_BITS 10 // Width of the table of each shard
+#define CRUD_STORE_FIRST_OID 0x1000 // First OID of an empty store (as libcrud.a)
+#define CRUD_STORE_LOG_SUFFIX ".log" // The log is the store file name with this suffix
+#define CRUD_STORE_LOG_MAGIC 0x474c5243 // "CRLG"
+#define CRUD_STORE_LOG_VERSION 1
+#define CRUD_STORE_LOG_COMPACT 0x1000000 // Smallest log folded into a checkpoint on save (16MB)
+#define CRUD_STORE_SYNC_MS 10 // Default period of CRUD_STORE_SYNC_INTERVAL
+
+// When logged changes are forced to disk
+typedef enum {
+	CRUD_STORE_SYNC_OP       = 0, // Before a change returns (changes made together share a sync)
+	CRUD_STORE_SYNC_INTERVAL = 1, // Every crud_store_sync_ms milliseconds
+	CRUD_STORE_SYNC_CLOSE    = 2, // On save and close only
+} CRUD_STORE_SYNC_POLICIES;
+
+// Log record types
+typedef enum {
+	CRUD_STORE_LOG_PUT    = 0, // Whole object contents (create, update)
+	CRUD_STORE_LOG_PATCH  = 1, // Bytes at an offset, growing the object (range write, append)
+	CRUD_STORE_LOG_DELETE = 2, // The object is gone
+} CRUD_STORE_LOG_TYPES;
+
+/*
+ Store file layout (hdd_content.svd, fields in host byte order as libcrud.a writes them)
+   4 bytes - next OID to hand out
+   4 bytes - number of objects
+  then for every object:
+   4 bytes - OID
+   1 byte  - CRUD_FLAG_TYPES of the object
+   4 bytes - length
+   length bytes - object data
+
+ Log layout (hdd_content.svd.log, host byte order)
+   4 bytes - CRUD_STORE_LOG_MAGIC
+   4 bytes - CRUD_STORE_LOG_VERSION
+   4 bytes - next OID of the checkpoint the log follows
+   4 bytes - number of objects of that checkpoint
+   8 bytes - size of that checkpoint (a log of another checkpoint is ignored)
+  then for every change, in the order they were made:
+   4 bytes - CRC-32 of the rest of the record (torn records end the log)
+   1 byte  - CRUD_STORE_LOG_TYPES
+   1 byte  - CRUD_FLAG_TYPES of the object (PUT)
+   2 bytes - unused
+   4 bytes - OID
+   4 bytes - offset (PATCH)
+   4 bytes - length
+   length bytes - data (PUT, PATCH)
+*/
+
+//
+// Store configuration
+
+extern int crud_store_lazy; // Map the store file at open instead of reading every object (default)
+extern int crud_store_sync; // CRUD_STORE_SYNC_POLICIES of the log (set before open)
+extern int crud_store_sync_ms; // Period of CRUD_STORE_SYNC_INTERVAL
+
+//
+// Store interface
+
+int crud_store_open(const char *filename);
+	// Set up the store and load filename (a missing file is an empty store)
+
+int crud_store_save(const char *filename);
+	// Make the store durable (changes are already logged, a large log is checkpointed)
+
+int crud_store_checkpoint(const char *filename);
+	// Write the store to filename (replaced as a whole) and start an empty log
+
+int crud_store_close(const char *filename);
+	// Save the store and release it
+
+int crud_store_format(const char *filename);
+	// Delete every object, the store file and its log
+
+int crud_store_create(CrudOID *oid, uint8_t flags, const void *buf, uint32_t len);
+	// Create an object, its new OID is returned in oid
+
+int crud_store_read(CrudOID *oid, uint8_t flags, uint32_t offset, void *buf, uint32_t max, uint32_t *len);
+	// Copy the object bytes from offset on (at most max) into buf, *len is the count
+
+int crud_store_update(CrudOID oid, uint8_t flags, const void *buf, uint32_t len);
+	// Overwrite an object with new contents of the same length
+
+int crud_store_write(CrudOID oid, uint32_t offset, const void *buf, uint32_t len, uint32_t limit, uint32_t *size);
+	// Patch len bytes at offset (growing the object up to limit bytes), *size is the new length
+
+int crud_store_append(CrudOID oid, const void *buf, uint32_t len, uint32_t limit, uint32_t *size);
+	// Add len bytes at the end of an object (up to limit bytes), *size is the new length
+
+int crud_store_delete(CrudOID *oid, uint8_t flags);
+	// Delete an object
+
+//
+// Unit testing for the module
+
+int crudStoreUnitTest(void);
+	// Perform a test of the store implementation
+
+int crudStoreBenchmark(void);
+	// Measure the change rate of the store under each sync policy
+
+#endif
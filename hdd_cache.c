@@ -0,0 +1,321 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_cache.c
+//  Description    : This is the implementation of the client-side block cache
+//                   for the HDD file I/O layer.  Lookups go through a
+//                   cmpsc311 hashtable keyed by block ID, recency is kept on
+//                   a doubly linked list (head is most recently used).
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <hdd_cache.h>
+#include <hdd_slab.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define HDD_CACHE_UNIT_TEST_ITERATIONS 4096
+#define HDD_CACHE_UNIT_TEST_BLOCKS 64
+#define HDD_CACHE_UNIT_TEST_MAX_BLOCK 512
+
+// A single cached block
+typedef struct HddCacheLine {
+	HddBlockID           blk;  // Block ID of the cached block
+	uint32_t             len;  // Length of the cached block
+	char                *buf;  // Block contents
+	struct HddCacheLine *prev; // More recently used line
+	struct HddCacheLine *next; // Less recently used line
+} HDD_CACHE_LINE;
+
+//
+// Global data
+
+HTable          hdd_cache_table;         // Block ID -> cache line lookup
+HDD_CACHE_LINE *hdd_cache_head = NULL;   // Most recently used line
+HDD_CACHE_LINE *hdd_cache_tail = NULL;   // Least recently used line
+uint32_t        hdd_cache_max_bytes = 0; // Memory budget of the cache
+uint32_t        hdd_cache_used_bytes = 0; // Bytes currently held by the cache
+int             hdd_cache_initialized = 0; // Flag indicating the cache is set up
+
+// Cache statistics (reported on close)
+uint32_t hdd_cache_hits = 0, hdd_cache_misses = 0, hdd_cache_evictions = 0;
+
+//
+// Local helpers
+
+// Unlink a line from the LRU list
+static void hdd_cache_unlink(HDD_CACHE_LINE *line) {
+	if (line->prev != NULL)
+		line->prev->next = line->next;
+	else
+		hdd_cache_head = line->next;
+	if (line->next != NULL)
+		line->next->prev = line->prev;
+	else
+		hdd_cache_tail = line->prev;
+	line->prev = line->next = NULL;
+}
+
+// Push a line to the head (most recently used end) of the LRU list
+static void hdd_cache_push(HDD_CACHE_LINE *line) {
+	line->prev = NULL;
+	line->next = hdd_cache_head;
+	if (hdd_cache_head != NULL)
+		hdd_cache_head->prev = line;
+	hdd_cache_head = line;
+	if (hdd_cache_tail == NULL)
+		hdd_cache_tail = line;
+}
+
+// Remove a line from the table and the list and release it
+static void hdd_cache_drop(HDD_CACHE_LINE *line) {
+	deleteValueFromHashTable(&hdd_cache_table, line->blk);
+	hdd_cache_unlink(line);
+	hdd_cache_used_bytes -= line->len;
+	hdd_slab_free(line->buf);
+	free(line);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_hdd_cache
+// Description  : Initialize the cache with a fixed memory budget
+//
+// Inputs       : max_bytes - the most block bytes the cache may hold
+// Outputs      : 0 if successful, -1 if failure
+
+int init_hdd_cache(uint32_t max_bytes) {
+	// Re-initializing drops whatever was cached before
+	if (hdd_cache_initialized)
+		close_hdd_cache();
+
+	if (initHashTable(&hdd_cache_table, HDD_CACHE_HASH_BITS))
+		return(-1);
+	hdd_cache_head = hdd_cache_tail = NULL;
+	hdd_cache_max_bytes = max_bytes;
+	hdd_cache_used_bytes = 0;
+	hdd_cache_hits = hdd_cache_misses = hdd_cache_evictions = 0;
+	hdd_cache_initialized = 1;
+	logMessage(LOG_INFO_LEVEL, "HDD cache initialized with %u bytes", max_bytes);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_hdd_cache
+// Description  : Release every cached block and the cache structures
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int close_hdd_cache(void) {
+	if (!hdd_cache_initialized)
+		return(-1);
+
+	clear_hdd_cache();
+	cleanupHashTable(&hdd_cache_table);
+	hdd_cache_initialized = 0;
+	logMessage(LOG_INFO_LEVEL, "HDD cache closed: %u hits, %u misses, %u evictions",
+			hdd_cache_hits, hdd_cache_misses, hdd_cache_evictions);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_hdd_cache
+// Description  : Find a block in the cache and mark it most recently used
+//
+// Inputs       : blk - the block ID to look up
+//                len - set to the length of the cached block on a hit
+// Outputs      : pointer to the cached bytes (owned by the cache) or NULL
+
+void * get_hdd_cache(HddBlockID blk, uint32_t *len) {
+	HDD_CACHE_LINE *line;
+
+	if (!hdd_cache_initialized || blk == HDD_NO_BLOCK)
+		return(NULL);
+
+	line = findValueInHashTable(&hdd_cache_table, blk);
+	if (line == NULL) {
+		hdd_cache_misses++;
+		return(NULL);
+	}
+
+	// Hit, move to the front of the LRU list
+	hdd_cache_hits++;
+	if (line != hdd_cache_head) {
+		hdd_cache_unlink(line);
+		hdd_cache_push(line);
+	}
+	if (len != NULL)
+		*len = line->len;
+	return(line->buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_hdd_cache
+// Description  : Insert (or replace) a block in the cache, evicting the least
+//                recently used blocks until it fits in the budget
+//
+// Inputs       : blk - the block ID
+//                buf - malloc'd block contents, owned by the cache on success
+//                len - the length of the block
+// Outputs      : 0 if the block was cached, -1 if not (caller keeps buf)
+
+int put_hdd_cache(HddBlockID blk, void *buf, uint32_t len) {
+	HDD_CACHE_LINE *line;
+
+	if (!hdd_cache_initialized || blk == HDD_NO_BLOCK || buf == NULL)
+		return(-1);
+
+	// Any older copy of the block is stale now
+	delete_hdd_cache(blk);
+
+	// Blocks larger than the whole budget are never cached
+	if (len > hdd_cache_max_bytes)
+		return(-1);
+
+	// Evict from the tail until the new block fits
+	while (hdd_cache_tail != NULL && hdd_cache_used_bytes + len > hdd_cache_max_bytes) {
+		hdd_cache_evictions++;
+		hdd_cache_drop(hdd_cache_tail);
+	}
+
+	line = malloc(sizeof(HDD_CACHE_LINE));
+	if (line == NULL)
+		return(-1);
+	line->blk = blk;
+	line->len = len;
+	line->buf = buf;
+	if (insertValueInHashTable(&hdd_cache_table, blk, line)) {
+		free(line);
+		return(-1);
+	}
+	hdd_cache_push(line);
+	hdd_cache_used_bytes += len;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : delete_hdd_cache
+// Description  : Drop a block from the cache
+//
+// Inputs       : blk - the block ID to drop
+// Outputs      : 0 if the block was cached, -1 otherwise
+
+int delete_hdd_cache(HddBlockID blk) {
+	HDD_CACHE_LINE *line;
+
+	if (!hdd_cache_initialized || blk == HDD_NO_BLOCK)
+		return(-1);
+	line = findValueInHashTable(&hdd_cache_table, blk);
+	if (line == NULL)
+		return(-1);
+	hdd_cache_drop(line);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_hdd_cache
+// Description  : Drop every cached block (budget is unchanged)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int clear_hdd_cache(void) {
+	if (!hdd_cache_initialized)
+		return(-1);
+	while (hdd_cache_head != NULL)
+		hdd_cache_drop(hdd_cache_head);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddCacheUnitTest
+// Description  : Perform a test of the cache implementation against a
+//                mirrored "backing store" of blocks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddCacheUnitTest(void) {
+	char *store[HDD_CACHE_UNIT_TEST_BLOCKS], *buf, *cached;
+	uint32_t lens[HDD_CACHE_UNIT_TEST_BLOCKS], len, budget;
+	int i, blk, ret = 0;
+
+	// Small budget so that eviction is exercised constantly
+	budget = HDD_CACHE_UNIT_TEST_MAX_BLOCK * 8;
+	if (init_hdd_cache(budget)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE_UNIT_TEST : init failed.");
+		return(-1);
+	}
+	for (i=0; i<HDD_CACHE_UNIT_TEST_BLOCKS; i++) {
+		lens[i] = getRandomValue(1, HDD_CACHE_UNIT_TEST_MAX_BLOCK);
+		store[i] = malloc(lens[i]);
+		memset(store[i], getRandomValue(0, 0xff), lens[i]);
+	}
+
+	for (i=0; i<HDD_CACHE_UNIT_TEST_ITERATIONS; i++) {
+		blk = getRandomValue(0, HDD_CACHE_UNIT_TEST_BLOCKS-1);
+		switch (getRandomValue(0, 2)) {
+
+		case 0: // Look up, check against the backing store, fill on a miss
+			cached = get_hdd_cache(blk+1, &len);
+			if (cached != NULL) {
+				if ((len != lens[blk]) || memcmp(cached, store[blk], len)) {
+					logMessage(LOG_ERROR_LEVEL, "HDD_CACHE_UNIT_TEST : stale block %d.", blk+1);
+					ret = -1;
+					goto cleanup;
+				}
+			} else {
+				buf = hdd_slab_alloc(lens[blk]);
+				memcpy(buf, store[blk], lens[blk]);
+				if (put_hdd_cache(blk+1, buf, lens[blk]))
+					hdd_slab_free(buf);
+			}
+			break;
+
+		case 1: // Rewrite the block, keeping the cache coherent
+			lens[blk] = getRandomValue(1, HDD_CACHE_UNIT_TEST_MAX_BLOCK);
+			store[blk] = realloc(store[blk], lens[blk]);
+			memset(store[blk], getRandomValue(0, 0xff), lens[blk]);
+			buf = hdd_slab_alloc(lens[blk]);
+			memcpy(buf, store[blk], lens[blk]);
+			if (put_hdd_cache(blk+1, buf, lens[blk]))
+				hdd_slab_free(buf);
+			break;
+
+		default: // Invalidate
+			delete_hdd_cache(blk+1);
+			break;
+		}
+
+		// The budget must never be exceeded
+		if (hdd_cache_used_bytes > budget) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_CACHE_UNIT_TEST : budget exceeded [%u>%u].",
+					hdd_cache_used_bytes, budget);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	logMessage(LOG_INFO_LEVEL, "HDD_CACHE_UNIT_TEST : cache unit test completed successfully.");
+
+	// Cleanup (the cache is emptied and closed on failure too)
+cleanup:
+	for (i=0; i<HDD_CACHE_UNIT_TEST_BLOCKS; i++)
+		free(store[i]);
+	close_hdd_cache();
+	return(ret);
+}
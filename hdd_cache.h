@@ -0,0 +1,53 @@
+#ifndef HDD_CACHE_INCLUDED
+#define HDD_CACHE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_cache.h
+//  Description    : This is the header file for the client-side block cache
+//                   used by the HDD file I/O layer.  Blocks are cached whole,
+//                   keyed by HddBlockID, and evicted least-recently-used
+//                   first once the memory budget is exceeded.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+
+// Project include files
+#include <hdd_driver.h>
+
+// Defines
+#define HDD_DEFAULT_CACHE_SIZE 1024 // Default cache budget (in kilobytes)
+#define HDD_MAX_CACHE_SIZE (UINT32_MAX / 1024) // Largest cache budget (in kilobytes), the budget is kept in bytes in 32 bits
+#define HDD_CACHE_HASH_BITS 10      // Width of the cache lookup table
+
+//
+// Cache interface
+
+int init_hdd_cache(uint32_t max_bytes);
+	// Initialize the cache with a memory budget of max_bytes (0 disables it)
+
+int close_hdd_cache(void);
+	// Release all cached blocks and the cache structures
+
+void * get_hdd_cache(HddBlockID blk, uint32_t *len);
+	// Find a block in the cache, returns the cached bytes (or NULL on miss)
+
+int put_hdd_cache(HddBlockID blk, void *buf, uint32_t len);
+	// Insert/replace a block; the cache takes ownership of the malloc'd buf
+
+int delete_hdd_cache(HddBlockID blk);
+	// Drop a block from the cache (if present)
+
+int clear_hdd_cache(void);
+	// Drop every cached block, keeping the configured budget
+
+//
+// Unit testing for the module
+
+int hddCacheUnitTest(void);
+	// Perform a test of the cache implementation
+
+#endif
@@ -11,6 +11,11 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <string.h>
@@ -23,6 +28,582 @@
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_driver.h>
+#include <hdd_transport.h>
+
+// Defines
+#define HDD_CLIENT_SIZE_MASK 0x3ffffff //Block Size field of a command/response
+
+//States of a request slot
+#define HDD_REQUEST_FREE 0 //Slot unused
+#define HDD_REQUEST_INFLIGHT 1 //Sent, waiting for the response
+#define HDD_REQUEST_DONE 2 //Response received, not yet claimed by poll/wait
+#define HDD_REQUEST_QUEUED 3 //Held in the batch, not sent yet
+
+//A submitted request, kept until its response has been claimed
+typedef struct {
+	uint32_t tag; //Caller's request tag
+	uint8_t state; //HDD_REQUEST_* state of the slot
+	uint8_t op; //HDD_OP_TYPES of the command
+	uint32_t size; //Block size of the command (room in buf for a READ)
+	void *buf; //Where the block of a READ lands
+	uint64_t seq; //Submission order (untagged servers answer in order)
+	HddBitResp resp; //Converted response once DONE (-1 if the connection failed)
+	HddBitCmd wire[3]; //Command, range extension and tag words as sent
+	uint8_t words; //Words of wire in use
+	uint32_t payload; //Bytes of buf sent after the words (CREATE/OVERWRITE)
+} HDD_CLIENT_REQUEST;
+
+//Global Variable
+int socket_fd = -1; //socket file descriptor
+struct sockaddr_in caddr; //sockaddr_in
+int hdd_network_transport = HDD_TRANSPORT_TCP; //HDD_TRANSPORT_TYPES used to reach the server
+HDD_RING_END hdd_client_ring; //Rings of a HDD_TRANSPORT_SHM connection (shared is NULL otherwise)
+int hdd_client_embedded = 0; //1 between INIT and SAVE_AND_CLOSE of the in-process store (HDD_TRANSPORT_EMBEDDED)
+uint32_t hdd_server_capabilities = 0; //HDD_CAP_* bits of the connected server
+HDD_CLIENT_REQUEST hdd_client_requests[HDD_CLIENT_MAX_INFLIGHT]; //Outstanding requests
+int hdd_client_inflight = 0; //Requests sent and not answered yet
+uint64_t hdd_client_next_seq = 0; //Submission counter
+int hdd_client_tagged = 0; //1 once the server agreed to tag words on this connection
+int hdd_client_batching = 0; //1 while requests are held back for one batch
+int hdd_client_queued = 0; //Requests held in the batch
+int hdd_client_batch_order[HDD_CLIENT_MAX_INFLIGHT]; //Slots of the held requests, in order
+int hdd_client_frames = 0; //Batch frames whose response header has not arrived yet
+
+//Connect over TCP to the server at hdd_network_address/hdd_network_port (defaults if unset)
+//Output: 0 on success, -1 on failure
+static int hdd_client_connect_tcp(void){
+	int nodelay = 1;
+
+	caddr.sin_family = AF_INET;
+	caddr.sin_port = htons(hdd_network_port != 0 ? hdd_network_port : HDD_DEFAULT_PORT);
+	//If failed to convert IPv4 address to binary
+	if (inet_aton(hdd_network_address != NULL ? (char *) hdd_network_address : HDD_DEFAULT_IP, &caddr.sin_addr) == 0)
+		return -1;
+
+	socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+	//If failed to create socket
+	if (socket_fd == -1)
+		return -1;
+
+	//If socket connection failed
+	if (connect(socket_fd, (const struct sockaddr *)&caddr, sizeof(struct sockaddr)) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD client connect failed : [%s]", strerror(errno));
+		close(socket_fd);
+		socket_fd = -1;
+		return -1;
+	}
+
+	//Every request waits for its response, so never hold small writes back (Nagle)
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	return 0;
+}
+
+//Connect to the UNIX socket of the server on hdd_network_port, and for HDD_TRANSPORT_SHM
+//hand it the rings (the socket then only tells either side that the other one left)
+//Output: 0 on success, -1 on failure
+static int hdd_client_connect_local(void){
+	char control[CMSG_SPACE(HDD_RING_FDS * sizeof(int))];
+	uint64_t magic = HDD_RING_MAGIC;
+	struct sockaddr_un uaddr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[HDD_RING_FDS];
+	ssize_t ret;
+
+	hdd_transport_address(&uaddr, hdd_network_port);
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd == -1)
+		return -1;
+	if (connect(socket_fd, (const struct sockaddr *)&uaddr, sizeof(uaddr)) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD client connect to [%s] failed : [%s]", uaddr.sun_path, strerror(errno));
+		close(socket_fd);
+		socket_fd = -1;
+		return -1;
+	}
+	if (hdd_network_transport != HDD_TRANSPORT_SHM)
+		return 0;
+
+	//The magic word goes with the segment and the doorbells
+	if (hdd_ring_create(&hdd_client_ring, fds) == -1){
+		close(socket_fd);
+		socket_fd = -1;
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &magic;
+	iov.iov_len = sizeof(magic);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(HDD_RING_FDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, HDD_RING_FDS * sizeof(int));
+	do {
+		ret = sendmsg(socket_fd, &msg, 0);
+	} while (ret == -1 && errno == EINTR);
+	close(fds[0]);
+	if (ret != sizeof(magic)){
+		logMessage(LOG_ERROR_LEVEL, "HDD client ring setup failed : [%s]", strerror(errno));
+		hdd_ring_detach(&hdd_client_ring);
+		close(socket_fd);
+		socket_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+//Connect to the server over the selected transport
+//Output: 0 on success, -1 on failure
+static int hdd_client_connect(void){
+	if (hdd_network_transport == HDD_TRANSPORT_TCP)
+		return hdd_client_connect_tcp();
+	return hdd_client_connect_local();
+}
+
+//Drop the connection (after a transport failure or on close), requests still in flight fail
+static void hdd_client_disconnect(void){
+	int i;
+	hdd_ring_detach(&hdd_client_ring);
+	if (socket_fd != -1)
+		close(socket_fd);
+	socket_fd = -1;
+	for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++){
+		if (hdd_client_requests[i].state == HDD_REQUEST_INFLIGHT || hdd_client_requests[i].state == HDD_REQUEST_QUEUED){
+			hdd_client_requests[i].resp = (HddBitResp) -1;
+			hdd_client_requests[i].state = HDD_REQUEST_DONE;
+		}
+	}
+	hdd_client_inflight = 0;
+	hdd_client_queued = 0;
+	hdd_client_frames = 0;
+	hdd_client_tagged = 0;
+}
+
+//Move all of the bytes described by iov through the socket (writev or readv) or the rings,
+//restarting on EINTR and continuing after short transfers. The iovec array is consumed.
+//Input: iov/count: the buffers, sending: 1 to write, 0 to read, need: bytes to move (0 = all of iov)
+//Output: 0 on success, -1 on failure or if the server closed the connection
+static int hdd_client_transfer(struct iovec *iov, int count, int sending, size_t need){
+	size_t moved = 0;
+	ssize_t ret;
+
+	if (need == 0){
+		int i;
+		for (i = 0; i < count; i++)
+			need += iov[i].iov_len;
+	}
+	while (moved < need){
+		if (hdd_client_ring.shared != NULL){
+			//Copied straight between the caller's buffers and the shared memory
+			ret = sending ? hdd_ring_writev(&hdd_client_ring, iov, count) : hdd_ring_readv(&hdd_client_ring, iov, count);
+			if (ret == 0){
+				if (hdd_ring_wait(&hdd_client_ring, sending, socket_fd) == -1)
+					return -1;
+				continue;
+			}
+		}
+		else
+			ret = sending ? writev(socket_fd, iov, count) : readv(socket_fd, iov, count);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0){
+			logMessage(LOG_ERROR_LEVEL, "HDD client %s failed : [%s]", sending ? "send" : "receive",
+					ret == 0 ? "connection closed" : strerror(errno));
+			return -1;
+		}
+		moved += ret;
+
+		//Mark the buffers that are done, trim the one that was cut short
+		while (count > 0 && (size_t) ret >= iov->iov_len){
+			ret -= iov->iov_len;
+			iov->iov_base = (char *) iov->iov_base + iov->iov_len;
+			iov->iov_len = 0;
+			iov++;
+			count--;
+		}
+		if (count > 0){
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+//Add the words and block of a request to an iovec array
+//Input: req: the request, iov: where its buffers go
+//Output: number of iovec entries used
+static int hdd_client_request_iov(HDD_CLIENT_REQUEST *req, struct iovec *iov){
+	iov[0].iov_base = req->wire;
+	iov[0].iov_len = req->words * sizeof(HddBitCmd);
+	if (req->payload == 0)
+		return 1;
+	iov[1].iov_base = req->buf;
+	iov[1].iov_len = req->payload;
+	return 2;
+}
+
+//Send the requests held in the batch with one writev. If the server takes batch frames
+//they go in one frame (answered with one frame), otherwise they are simply pipelined.
+//Output: 0 on success, -1 on failure (the connection is dropped)
+static int hdd_client_batch_send(void){
+	static struct iovec iov[2 * HDD_CLIENT_MAX_INFLIGHT + 1];
+	HddBitCmd frame[2]; //frame header and tag word
+	HDD_CLIENT_REQUEST *req;
+	uint64_t body = 0;
+	int i, iov_count = 1, framed;
+
+	if (hdd_client_queued == 0)
+		return 0;
+	for (i = 0; i < hdd_client_queued; i++){
+		req = &hdd_client_requests[hdd_client_batch_order[i]];
+		iov_count += hdd_client_request_iov(req, &iov[iov_count]);
+		body += req->words * sizeof(HddBitCmd) + req->payload;
+	}
+
+	//Batch frame header: Block is the number of commands, Block Size the bytes of the body
+	framed = (hdd_server_capabilities & HDD_CAP_BATCH) && hdd_client_queued > 1 && body <= HDD_BATCH_MAX_BYTES;
+	if (framed){
+		frame[0] = htonll64(((HddBitCmd) HDD_BLOCK_OVERWRITE << 62) | ((HddBitCmd) body << 36) |
+				((HddBitCmd) HDD_OPTIONS << 33) | (HddBitCmd) hdd_client_queued);
+		frame[1] = htonll64((uint64_t) HDD_CLIENT_SYNC_TAG);
+		iov[0].iov_base = frame;
+		iov[0].iov_len = (hdd_client_tagged ? 2 : 1) * sizeof(HddBitCmd);
+	}
+	if (hdd_client_transfer(framed ? iov : &iov[1], framed ? iov_count : iov_count - 1, 1, 0) == -1){
+		hdd_client_disconnect();
+		return -1;
+	}
+
+	for (i = 0; i < hdd_client_queued; i++)
+		hdd_client_requests[hdd_client_batch_order[i]].state = HDD_REQUEST_INFLIGHT;
+	hdd_client_inflight += hdd_client_queued;
+	hdd_client_queued = 0;
+	hdd_client_frames += framed;
+	return 0;
+}
+
+//Send one request: the command, its range and tag words and the block it carries, in one
+//writev. While a batch is open the request is held back and sent with the batch.
+//Input: cmd: the request, offset: range offset (HDD_BLOCK_RANGE), buf: the block, tag: the request tag
+//Output: 0 on success, -1 on failure (the connection is dropped)
+static int hdd_client_send(HddBitCmd cmd, uint32_t offset, void *buf, uint32_t tag){
+	uint8_t op = (uint8_t) (cmd >> 62); //extract the op field from the command
+	uint8_t flag = ((uint8_t) (cmd >> 33)) & 7; //extract the flag from the cmd
+	uint32_t buf_size = ((uint32_t) (cmd >> 36)) & HDD_CLIENT_SIZE_MASK;
+	HDD_CLIENT_REQUEST *req = NULL;
+	struct iovec iov[2];
+	int i, slot = 0;
+
+	if (socket_fd == -1 && !hdd_client_embedded)
+		return -1;
+
+	//Find a free slot, a tag may only be in use once
+	for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++){
+		if (hdd_client_requests[i].state == HDD_REQUEST_FREE){
+			if (req == NULL){
+				req = &hdd_client_requests[i];
+				slot = i;
+			}
+		}
+		else if (hdd_client_requests[i].tag == tag){
+			logMessage(LOG_ERROR_LEVEL, "HDD client request tag %u already in use", tag);
+			return -1;
+		}
+	}
+	if (req == NULL){
+		logMessage(LOG_ERROR_LEVEL, "HDD client has too many requests outstanding");
+		return -1;
+	}
+
+	req->words = 0;
+	req->wire[req->words++] = htonll64(cmd);
+	if (flag == HDD_BLOCK_RANGE) //Range commands carry the offset in a second word
+		req->wire[req->words++] = htonll64((uint64_t) offset);
+	if (hdd_client_tagged)
+		req->wire[req->words++] = htonll64((uint64_t) tag);
+	//the block goes along with block create or block overwrite
+	req->payload = 0;
+	if ((op == HDD_BLOCK_CREATE || op == HDD_BLOCK_OVERWRITE) && (flag < HDD_FORMAT || flag > HDD_INIT))
+		req->payload = buf_size;
+	req->tag = tag;
+	req->op = op;
+	req->size = buf_size;
+	req->buf = buf;
+	req->seq = hdd_client_next_seq++;
+
+	//The in-process store completes the request right away
+	if (hdd_client_embedded){
+		req->resp = hdd_server_execute(cmd, offset, buf);
+		req->state = HDD_REQUEST_DONE;
+		return 0;
+	}
+
+	//Hold it for the batch; device commands go out at once, after whatever is held
+	if (op == HDD_DEVICE && flag >= HDD_FORMAT && flag != HDD_BLOCK_RANGE && flag != HDD_BLOCK_APPEND){
+		if (hdd_client_batch_send() == -1)
+			return -1;
+	}
+	else if (hdd_client_batching && (hdd_server_capabilities & HDD_CAP_BATCH)){
+		req->state = HDD_REQUEST_QUEUED;
+		hdd_client_batch_order[hdd_client_queued++] = slot;
+		return 0;
+	}
+
+	if (hdd_client_transfer(iov, hdd_client_request_iov(req, iov), 1, 0) == -1){
+		hdd_client_disconnect();
+		return -1;
+	}
+	req->state = HDD_REQUEST_INFLIGHT;
+	hdd_client_inflight++;
+	return 0;
+}
+
+//Receive one response and complete the request it answers. Tagged responses name their
+//request, untagged servers answer in order so the response belongs to the oldest request.
+//Output: 0 on success, -1 on failure (the connection is dropped)
+static int hdd_client_receive(void){
+	HDD_CLIENT_REQUEST *req = NULL;
+	HddBitCmd header[2]; //response and tag word
+	HddBitResp converted_res;
+	struct iovec iov[2];
+	size_t header_size = hdd_client_tagged ? 2 * sizeof(HddBitResp) : sizeof(HddBitResp);
+	int i, iov_count = 1;
+
+	if (socket_fd == -1 || hdd_client_inflight == 0)
+		return -1;
+
+	//With a single request outstanding nothing can follow its response, so a READ block
+	//lands in its buffer with the same readv; otherwise the header has to be read first
+	for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++){
+		if (hdd_client_requests[i].state == HDD_REQUEST_INFLIGHT &&
+		    (req == NULL || hdd_client_requests[i].seq < req->seq))
+			req = &hdd_client_requests[i];
+	}
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_size;
+	if (hdd_client_inflight == 1 && hdd_client_frames == 0 && req->op == HDD_BLOCK_READ && req->buf != NULL && req->size > 0){
+		iov[1].iov_base = req->buf;
+		iov[1].iov_len = req->size;
+		iov_count = 2;
+	}
+	if (hdd_client_transfer(iov, iov_count, 0, header_size) == -1){
+		hdd_client_disconnect();
+		return -1;
+	}
+	converted_res = ntohll64(header[0]);
+	if ((uint8_t) (converted_res >> 62) == HDD_BLOCK_OVERWRITE && (((uint8_t) (converted_res >> 33)) & 7) == HDD_OPTIONS){
+		//Batch frame header, the responses of its commands follow one by one
+		if (hdd_client_frames == 0 || ((converted_res >> 32) & 1)){
+			logMessage(LOG_ERROR_LEVEL, "HDD client unexpected or failed batch frame");
+			hdd_client_disconnect();
+			return -1;
+		}
+		hdd_client_frames--;
+		return 0;
+	}
+	if (hdd_client_tagged){
+		uint32_t tag = (uint32_t) ntohll64(header[1]);
+		for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++){
+			if (hdd_client_requests[i].state == HDD_REQUEST_INFLIGHT && hdd_client_requests[i].tag == tag)
+				break;
+		}
+		if (i == HDD_CLIENT_MAX_INFLIGHT || (iov_count == 2 && &hdd_client_requests[i] != req)){
+			logMessage(LOG_ERROR_LEVEL, "HDD client response for unknown tag %u", tag);
+			hdd_client_disconnect();
+			return -1;
+		}
+		req = &hdd_client_requests[i];
+	}
+
+	//Read (the rest of) the block of a READ
+	if ((uint8_t) (converted_res >> 62) == HDD_BLOCK_READ && req->op == HDD_BLOCK_READ && req->buf != NULL && req->size > 0){
+		uint32_t res_size = ((uint32_t) (converted_res >> 36)) & HDD_CLIENT_SIZE_MASK; //block size in the server response
+		size_t have = (iov_count == 2) ? req->size - iov[1].iov_len : 0; //payload bytes that came with the header
+		if (res_size > req->size){
+			logMessage(LOG_ERROR_LEVEL, "HDD client response too large [%u>%u]", res_size, req->size);
+			hdd_client_disconnect();
+			return -1;
+		}
+		if (have < res_size){
+			iov[1].iov_base = (char *) req->buf + have;
+			iov[1].iov_len = res_size - have;
+			if (hdd_client_transfer(&iov[1], 1, 0, 0) == -1){
+				hdd_client_disconnect();
+				return -1;
+			}
+		}
+	}
+
+	req->resp = converted_res;
+	req->state = HDD_REQUEST_DONE;
+	hdd_client_inflight--;
+	return 0;
+}
+
+//Find the outstanding (in flight or completed) request with a tag
+//Input: tag: the request tag
+//Output: the request slot, or NULL if no such request
+static HDD_CLIENT_REQUEST *hdd_client_find(uint32_t tag){
+	int i;
+	for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++){
+		if (hdd_client_requests[i].state != HDD_REQUEST_FREE && hdd_client_requests[i].tag == tag)
+			return &hdd_client_requests[i];
+	}
+	return NULL;
+}
+
+//Hand the response of a completed request to the caller and free its slot
+//Input: req: the completed request, resp: set to the response
+//Output: 0 if the server answered, -1 if the connection failed first
+static int hdd_client_claim(HDD_CLIENT_REQUEST *req, HddBitResp *resp){
+	if (resp != NULL)
+		*resp = req->resp;
+	req->state = HDD_REQUEST_FREE;
+	return (req->resp == (HddBitResp) -1) ? -1 : 0;
+}
+
+//Execute a command against the store of this process (HDD_TRANSPORT_EMBEDDED): there is
+//no connection, the command and the caller's buffer are handed over as they are
+//Input: cmd: the request, offset: range offset (HDD_BLOCK_RANGE), buf: the block
+//Output: the response
+static HddBitResp hdd_client_embedded_operation(HddBitCmd cmd, uint32_t offset, void *buf){
+	uint8_t op = (uint8_t) (cmd >> 62); //extract the op field from the command
+	uint8_t flag = ((uint8_t) (cmd >> 33)) & 7; //extract the flag from the cmd
+	HddBitResp res;
+	int i;
+
+	if (op == HDD_DEVICE && flag == HDD_INIT && !hdd_client_embedded){
+		for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++)
+			hdd_client_requests[i].state = HDD_REQUEST_FREE;
+	}
+	else if (!hdd_client_embedded)
+		return -1;
+
+	res = hdd_server_execute(cmd, offset, buf);
+	if (op == HDD_DEVICE && flag == HDD_INIT && ((res >> 32) & 1) == 0){
+		hdd_server_capabilities = (uint32_t) res;
+		hdd_client_embedded = 1;
+	}
+	if (op == HDD_DEVICE && flag == HDD_SAVE_AND_CLOSE)
+		hdd_client_embedded = 0;
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_submit
+// Description  : Send a request to the server without waiting for the response.
+//                Many requests can be in flight on the connection, each one is
+//                completed with hdd_client_poll or hdd_client_wait on its tag.
+//                buf must stay valid until then (READ blocks are received into it).
+//
+// Inputs       : cmd - the request opcode for the command (not INIT/SAVE_AND_CLOSE)
+//                offset - byte offset of the range in the block (HDD_BLOCK_RANGE only)
+//                buf - the block to be read/written from (READ/WRITE)
+//                tag - caller chosen tag, unique among outstanding requests
+// Outputs      : 0 if the request was sent, -1 on failure
+
+int hdd_client_submit(HddBitCmd cmd, uint32_t offset, void *buf, uint32_t tag) {
+	uint8_t op = (uint8_t) (cmd >> 62);
+	uint8_t flag = ((uint8_t) (cmd >> 33)) & 7;
+
+	//Connection setup and teardown only go through hdd_client_operation
+	if (tag == HDD_CLIENT_SYNC_TAG || (op == HDD_DEVICE && (flag == HDD_INIT || flag == HDD_SAVE_AND_CLOSE || flag == HDD_OPTIONS)))
+		return -1;
+	return hdd_client_send(cmd, offset, buf, tag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_poll
+// Description  : Check whether a submitted request has completed, receiving
+//                whatever responses have already arrived (never blocks waiting)
+//
+// Inputs       : tag - the tag of the request
+//                resp - set to the response once the request completed
+// Outputs      : 1 if completed, 0 if still in flight, -1 on failure
+
+int hdd_client_poll(uint32_t tag, HddBitResp *resp) {
+	HDD_CLIENT_REQUEST *req = hdd_client_find(tag);
+	struct pollfd pfd;
+
+	if (req == NULL)
+		return -1;
+	if (req->state == HDD_REQUEST_QUEUED && hdd_client_batch_send() == -1)
+		return hdd_client_claim(req, resp);
+	while (req->state == HDD_REQUEST_INFLIGHT){
+		pfd.fd = socket_fd;
+		pfd.events = POLLIN;
+		if (hdd_client_ring.shared != NULL){
+			//Responses are there once the ring holds bytes (a hangup fails the receive)
+			if (hdd_ring_pending(&hdd_client_ring) == 0 && poll(&pfd, 1, 0) <= 0)
+				return 0;
+		}
+		else if (poll(&pfd, 1, 0) <= 0)
+			return 0;
+		if (hdd_client_receive() == -1)
+			break;
+	}
+	return (hdd_client_claim(req, resp) == -1) ? -1 : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_wait
+// Description  : Wait for a submitted request to complete (responses of other
+//                requests received meanwhile are kept for their own waiters)
+//
+// Inputs       : tag - the tag of the request
+//                resp - set to the response
+// Outputs      : 0 if the server answered, -1 on failure
+
+int hdd_client_wait(uint32_t tag, HddBitResp *resp) {
+	HDD_CLIENT_REQUEST *req = hdd_client_find(tag);
+
+	if (req == NULL)
+		return -1;
+	if (req->state == HDD_REQUEST_QUEUED && hdd_client_batch_send() == -1)
+		return hdd_client_claim(req, resp);
+	while (req->state == HDD_REQUEST_INFLIGHT){
+		if (hdd_client_receive() == -1)
+			break;
+	}
+	return hdd_client_claim(req, resp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_batch_begin
+// Description  : Hold the requests submitted from now on and send them together
+//                in one batch frame once one of them is waited for or the batch
+//                is ended (servers without HDD_CAP_BATCH get them right away)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_client_batch_begin(void) {
+	hdd_client_batching = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_batch_end
+// Description  : Send the held requests and go back to sending each request
+//                as it is submitted
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_client_batch_end(void) {
+	hdd_client_batching = 0;
+	return hdd_client_batch_send();
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -38,102 +619,78 @@
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
-//Global Variable
-int socket_fd = -1; //socket file descriptor
-struct sockaddr_in caddr; //sockaddr_in
-
 HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
-	uint8_t op = (uint8_t) (cmd >> 62); //extract the op field from the command
-	uint8_t flag = ((uint8_t) (cmd >> 33)) & 7; //extract the flag from the cmd
-	//Get the buf size
-	uint32_t buf_size_comp = 0;
-	buf_size_comp = (~buf_size_comp) >> 6;
-	uint32_t buf_size = ((uint32_t) (cmd >> 36)) & buf_size_comp;
+	return hdd_client_range_operation(cmd, 0, buf);
+}
 
-	//Step 1: check if needs to make a connection to the server
-	if (flag == HDD_INIT){
-		//Step 1: create socket
-		caddr.sin_family = AF_INET;
-		caddr.sin_port = htons(HDD_DEFAULT_PORT);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_range_operation
+// Description  : Same as hdd_client_operation, but commands flagged with
+//                HDD_BLOCK_RANGE also carry the range extension word (offset)
+//
+// Inputs       : cmd - the request opcode for the command
+//                offset - byte offset of the range in the block (HDD_BLOCK_RANGE only)
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
 
-		//If failed to convert IPv4 address to binary
-		if (inet_aton(HDD_DEFAULT_IP, &caddr.sin_addr) == 0)
-			return -1;
+HddBitResp hdd_client_range_operation(HddBitCmd cmd, uint32_t offset, void *buf) {
+	uint8_t op = (uint8_t) (cmd >> 62); //extract the op field from the command
+	uint8_t flag = ((uint8_t) (cmd >> 33)) & 7; //extract the flag from the cmd
+	HddBitResp res; //converted back server response
+	int i;
 
-        	socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-		//If failed to create socket
-        	if (socket_fd == -1)
-            		return(-1);
+	if (hdd_network_transport == HDD_TRANSPORT_EMBEDDED)
+		return hdd_client_embedded_operation(cmd, offset, buf);
 
-		//If cocket connection failed
-		if (connect(socket_fd, (const struct sockaddr *)&caddr, sizeof(struct sockaddr)) == -1)
-			return -1;
-	}
-	
-	//Step 2: send cmd and/or buf to the server
-	//Local variables used during send
-	HddBitCmd *converted_cmd = malloc(sizeof(HddBitCmd)); //converted cmd
-	int cmd_byte_sent = 0; //..use to send cmd
-	int buf_byte_sent = 0; //..use to send buf
-	//1. Convert the cmd to binary
-	*converted_cmd = htonll64(cmd); //converted cmd
-	//2. send the cmd
-	//use a while loop to make sure all bytes are correctly sent
-	while (cmd_byte_sent < sizeof(HddBitCmd)){
-		cmd_byte_sent += write(socket_fd, &((char *)converted_cmd)[cmd_byte_sent], sizeof(HddBitCmd) - cmd_byte_sent);
-	}
-	free(converted_cmd);
-	//Check if bytes are sent correctly
-	if (cmd_byte_sent == -1)
-		return -1;
-	//3. send buf if the cmd is block create or block overwrite
-	if (op == HDD_BLOCK_CREATE || op == HDD_BLOCK_OVERWRITE){
-		while (buf_byte_sent < buf_size)
-			buf_byte_sent += write(socket_fd, &((char *)buf)[buf_byte_sent], buf_size - buf_byte_sent);
-		//Check if bytes are sent correctly
-		if (buf_byte_sent == -1)
+	//Step 1: check if needs to make a connection to the server
+	if (op == HDD_DEVICE && flag == HDD_INIT && socket_fd == -1){
+		if (hdd_client_connect() == -1)
 			return -1;
+		//A new connection starts untagged with no requests outstanding
+		for (i = 0; i < HDD_CLIENT_MAX_INFLIGHT; i++)
+			hdd_client_requests[i].state = HDD_REQUEST_FREE;
+		hdd_client_inflight = 0;
+		hdd_client_queued = 0;
+		hdd_client_frames = 0;
+		hdd_client_tagged = 0;
 	}
-	//..done sending cmd & buf
-
-	//Step 3: receive server response
-	//Local variables used during receive
-	int res_byte_read = 0; //..use below to read the server response
-	int res_block_byte_read = 0; //.. use to read bytes of block
-	HddBitResp *res = malloc(sizeof(HddBitResp)); //server response
-	HddBitResp converted_res; //converted back server response (one to be returned in hdd_client_operation)
-	//1. get server response
-	while (res_byte_read < sizeof(HddBitResp))
-		res_byte_read += read(socket_fd, &((char *)res)[res_byte_read], sizeof(HddBitResp)-res_byte_read);
-	//Check if bytes are received correctly
-	if (res_byte_read == -1)
-		return -1;
-	//2. translate server response back
-	converted_res = ntohll64(*res);
-	free(res); //free the unconverted response
-	//3. check if needed to read block
-	uint8_t res_op = (uint8_t) (converted_res >> 62);
-	if (res_op == HDD_BLOCK_READ){
-		uint32_t res_size; //block size in the server response
-		uint32_t res_size_comp = 0; //complementary to read the block size field in the response
-		res_size_comp = (~res_size_comp) >> 6; //get the block_size in the response
-		res_size = ((uint32_t) (converted_res >> 36)) & res_size_comp;
-		while (res_block_byte_read < res_size)
-			res_block_byte_read += read(socket_fd, &((char *)buf)[res_block_byte_read], res_size-res_block_byte_read);
-		//Check if bytes are received correctly
-		if (res_block_byte_read == -1)
+	if (socket_fd == -1)
+		return -1;
+
+	//Step 2: requests still in flight are answered before the connection closes
+	if (op == HDD_DEVICE && flag == HDD_SAVE_AND_CLOSE){
+		if (hdd_client_batch_send() == -1)
 			return -1;
+		while (hdd_client_inflight > 0)
+			if (hdd_client_receive() == -1)
+				return -1;
 	}
-	//..done receiving
 
-	//Step 4: close the connection if needed
-	if (flag == HDD_SAVE_AND_CLOSE){
-		close(socket_fd);
-		socket_fd = -1;
+	//Step 3: send the request and wait for its response (others may complete meanwhile)
+	if (hdd_client_send(cmd, offset, buf, HDD_CLIENT_SYNC_TAG) == -1 ||
+	    hdd_client_wait(HDD_CLIENT_SYNC_TAG, &res) == -1)
+		return -1;
+
+	//Step 4: the INIT response advertises the server capabilities in the block field,
+	//tag words are switched on when the server offers them
+	if (op == HDD_DEVICE && flag == HDD_INIT && ((res >> 32) & 1) == 0){
+		hdd_server_capabilities = (uint32_t) res;
+		if ((hdd_server_capabilities & HDD_CAP_TAGS) && !hdd_client_tagged){
+			HddBitResp options;
+			HddBitCmd enable = ((HddBitCmd) HDD_OPTIONS << 33) | HDD_CAP_TAGS;
+			if (hdd_client_send(enable, 0, NULL, HDD_CLIENT_SYNC_TAG) == -1 ||
+			    hdd_client_wait(HDD_CLIENT_SYNC_TAG, &options) == -1)
+				return -1;
+			if (((options >> 32) & 1) == 0 && ((uint32_t) options & HDD_CAP_TAGS))
+				hdd_client_tagged = 1;
+		}
 	}
 
+	//Step 5: close the connection if needed
+	if (op == HDD_DEVICE && flag == HDD_SAVE_AND_CLOSE)
+		hdd_client_disconnect();
+
 	//Finally...
-	return converted_res;
+	return res;
 }
-
-
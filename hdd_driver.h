@@ -35,7 +35,12 @@ typedef enum {
     HDD_META_BLOCK = 1,     // Flag indicating that block is the "meta block"
     HDD_FORMAT = 2,         // Flag indicating device should be formatted--used with HDD_DEVICE
     HDD_SAVE_AND_CLOSE = 3, // Flag indicating device info to save in hdd_content.svd and close HDD interface--used with HDD_DEVICE
-    HDD_INIT = 4            // Flag to initialize the device
+    HDD_INIT = 4,           // Flag to initialize the device
+    HDD_BLOCK_RANGE = 5,    // Flag indicating a byte range of the block, a range extension word follows the command
+                            //   (only when the server advertises the matching HDD_CAP_* capability at INIT)
+    HDD_BLOCK_APPEND = 6,   // Flag for an OVERWRITE that appends its data to the end of the block (HDD_CAP_RANGE_WRITE)
+    HDD_OPTIONS = 7         // Flag to switch on connection options (HDD_CAP_* in the Block field)--used with HDD_DEVICE
+                            //   (with HDD_BLOCK_OVERWRITE it marks a batch frame, see below)
 }   HDD_FLAG_TYPES;
 
 // HDD block ID type (unique to each block)
@@ -52,7 +57,13 @@ typedef uint64_t HddBitResp;
   -----   -------------------------------------------------------------
    0-31 - Block - the Block ID (0 if not relevant)
      32 - R - this is the result bit (0 success, 1 is failure)
-  33-35 - Flags - these are flags for commands (UNUSED)
+  33-35 - Flags - the HDD_FLAG_TYPES value of the command (0-4 as before), and
+            5 - HDD_BLOCK_RANGE: READ or OVERWRITE of a byte range of the block,
+                a range extension word follows the command
+            6 - HDD_BLOCK_APPEND: OVERWRITE that appends its data to the end
+                of the block
+            7 - HDD_OPTIONS: with HDD_DEVICE, switch on the HDD_CAP_* options
+                given in Block; with HDD_BLOCK_OVERWRITE, a batch frame
   36-61 - Block Size - this is the size of the block in bytes 
   62-63 - Op - the Opcode which controls whether a block is read, overwritten, or created
 
@@ -61,6 +72,42 @@ typedef uint64_t HddBitResp;
  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
  |Op |                   Block Size                      |Flags|R|                             Block                             |
  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+ Range extension word (sent right after a HddBitCmd carrying HDD_BLOCK_RANGE)
+  Bits    Description
+  -----   -------------------------------------------------------------
+   0-31 - Offset - byte offset of the range within the block
+  32-63 - Reserved (0)
+
+ For a range READ the Block Size of the command is the length of the range,
+ the Block Size of the response is the number of bytes actually returned.
+ For a range or append OVERWRITE the Block Size of the command is the length
+ of the data that follows, the block grows when the data runs past its end
+ (the range must start at or before the end) and the Block Size of the
+ response is the length of the block after the write.
+
+ Tag word (once HDD_OPTIONS enabled HDD_CAP_TAGS on the connection)
+  Bits    Description
+  -----   -------------------------------------------------------------
+   0-31 - Tag - request tag chosen by the client
+  32-63 - Reserved (0)
+
+ Every command carries a tag word after the command (and range extension
+ word), before the block data.  Every response carries the tag word of its
+ command right after the HddBitResp, before the block data.  The HDD_OPTIONS
+  command that switches tags on and its response carry no tag words; the response
+ returns the options that were switched on in the Block field.
+
+ Batch frame (only when the server advertises HDD_CAP_BATCH at INIT)
+  A HddBitCmd with Op HDD_BLOCK_OVERWRITE and Flags HDD_OPTIONS, Block is the
+  number of commands in the frame and Block Size the length of the body that
+  follows (at most HDD_BATCH_MAX_BYTES).  The body holds the commands exactly
+  as they would be sent one by one (command, range extension word, tag word,
+  block data).  The server executes them in order and answers with one frame:
+  a HddBitResp with the same Op and Flags, Block the number of responses and
+  Block Size the length of the body, then the responses exactly as they would
+  be sent one by one.  Device commands cannot be batched.  Frames carry a tag
+  word when tags are on, like any other command.
 */
 
 
@@ -18,10 +18,14 @@
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_network.h>
+#include <hdd_cache.h>
+#include <hdd_slab.h>
+#include <cmpsc311_hashtable.h>
 
 // Defines
 #define CIO_UNIT_TEST_MAX_WRITE_SIZE 1024
 #define HDD_IO_UNIT_TEST_ITERATIONS 10240
+#define HDD_IO_UNIT_TEST_FILES 64
 
 // Type for UNIT test interface
 typedef enum {
@@ -35,13 +39,29 @@ char *cio_utest_buffer = NULL;  // Unit test buffer
 
 ////////////////////////////////////////////////////////////////////////////////////////
 // User structs
-// Define a HDD_FILE type to store block info (global structure)
+// Define a HDD_EXTENT type to store one block of a file (files are lists of extents)
+typedef struct {
+	uint32_t id; //Block ID returned by hdd_client_operation (0 if not created yet)
+	uint32_t offset; //File offset of the first byte of the extent
+	uint32_t size; //Bytes in the extent
+	uint32_t dev_size; //Size of the block on the device (differs from size while the extent grows)
+	char *buf; //Write-back buffer of the extent (NULL if the extent is clean)
+	uint32_t dirty_lo, dirty_hi; //Byte range of buf written since the last flush (empty if equal)
+	uint8_t loaded; //1 if buf holds the whole extent, 0 if only the dirty range is valid
+} HDD_EXTENT;
+
+// Define a HDD_FILE type to store file info (global structure)
 typedef struct {
-	uint32_t id; //Block ID returned by hdd_client_operation
 	uint8_t open; //Indicates whether the file is open. 1 open; 0 closed
 	uint32_t position; //current position
-	uint32_t size; //...NEW IN ASSG4: BLOCK SIZE OF THE CURRENT FILE
+	uint32_t size; //Size of the file (sum of the extent sizes)
 	char name[MAX_FILENAME_LENGTH]; //File name
+	HDD_EXTENT *extents; //Extent list, ordered by offset
+	uint32_t extent_count; //Extents in use
+	uint32_t extent_slots; //Extents allocated
+	uint32_t dirty; //Bytes written into extent buffers since the last flush
+	int16_t hash_next; //Next descriptor whose name hashes to the same index value (-1 ends the chain)
+	int16_t free_next; //Next unused descriptor on the free list (-1 ends the list)
 } HDD_FILE;
 
 //Define a HDD_CMD type to store and generate HDD_IO command
@@ -53,6 +73,76 @@ typedef struct {
 	uint8_t op; //Op code indicating if the block is read, overwritten or created
 } HDD_CMD;
 
+//Kinds of the requests of a flush
+#define HDD_FLUSH_RANGE 0 //Patch or append to the block in place
+#define HDD_FLUSH_OVERWRITE 1 //Overwrite the block (same size)
+#define HDD_FLUSH_CREATE 2 //Create a new block for the extent
+#define HDD_FLUSH_DELETE 3 //Delete the block a create replaced
+
+//A request of a flush that is in flight
+typedef struct {
+	int16_t fh; //File of the extent
+	uint32_t idx; //Extent index
+	uint32_t tag; //Client request tag
+	uint8_t kind; //HDD_FLUSH_* kind of the request
+	uint32_t block; //Block deleted (HDD_FLUSH_DELETE)
+} HDD_FLUSH_OP;
+
+//A block read of hdd_read that is in flight
+typedef struct {
+	uint32_t tag; //Client request tag
+	uint32_t block; //Block ID
+	uint32_t block_size; //Size of the block
+	uint32_t offset, len; //Range of the block wanted
+	char *dst; //Where the range goes
+	char *buff; //Whole block being read (NULL for a range read straight into dst)
+} HDD_READ_OP;
+
+//Requests in flight, oldest first (a ring of HDD_IO_PIPELINE_DEPTH)
+typedef struct {
+	union {
+		HDD_FLUSH_OP flush[HDD_IO_PIPELINE_DEPTH];
+		HDD_READ_OP read[HDD_IO_PIPELINE_DEPTH];
+	} ops;
+	uint32_t head; //Slot of the oldest request
+	uint32_t count; //Requests in flight
+	int failed; //Set once any request failed
+} HDD_IO_QUEUE;
+
+//On-device layout of the meta block: header, then one variable-length record per live file
+//(uint8 name length, name bytes, uint32 size, uint32 extent count, the extents).
+//Version 1 stored a fixed record per descriptor followed by all extents.
+#define HDD_META_MAGIC 0x4d444448 //"HDDM"
+#define HDD_META_VERSION 2
+
+typedef struct {
+	uint32_t magic; //HDD_META_MAGIC
+	uint32_t version; //HDD_META_VERSION
+	uint32_t files; //Number of file records
+	uint32_t extents; //Number of extent records
+} HDD_META_HEADER;
+
+//Version 1 file record
+typedef struct {
+	uint32_t size; //File size
+	uint32_t extents; //Number of extents of the file
+	char name[MAX_FILENAME_LENGTH]; //File name
+} HDD_META_FILE;
+
+typedef struct {
+	uint32_t id; //Block ID of the extent
+	uint32_t size; //Bytes in the extent
+} HDD_META_EXTENT;
+
+//Meta block written before extents existed: a raw array of single-block files
+typedef struct {
+	uint32_t id;
+	uint8_t open;
+	uint32_t position;
+	uint32_t size;
+	char name[MAX_FILENAME_LENGTH];
+} HDD_LEGACY_FILE;
+
 // HDD Interface
 //
 //Command generator to generate command to pass into hdd_client_operation
@@ -99,21 +189,602 @@ HDD_CMD cmd_reader(HddBitResp cmd){
 //Global Variable
 int hdd_init = 0; //Flag if the block storage is initialized. 1 if succeeded, 0 if failed.
 
+//Fetch the contents of a block, going through the block cache first
+//Input: block: block id, block_size: size of the block, owned: set to 1 if the caller must free the buffer
+//Output: pointer to the block contents, or NULL on failure
+char *hdd_fetch_block(uint32_t block, uint32_t block_size, int *owned){
+	char *buff;
+	uint32_t cached_size;
+
+	//Cache hit, the buffer stays owned by the cache
+	buff = get_hdd_cache(block, &cached_size);
+	if (buff != NULL && cached_size == block_size){
+		*owned = 0;
+		return buff;
+	}
+
+	//Cache miss, read the whole block from the device
+	buff = hdd_slab_alloc(block_size);
+	if (buff == NULL)
+		return NULL;
+	HddBitCmd read_block = cmd_generator(block, 0, 0, block_size, HDD_BLOCK_READ);
+	HDD_CMD read_result = cmd_reader(hdd_client_operation(read_block, buff));
+	if (read_result.r == 1){
+		hdd_slab_free(buff);
+		return NULL;
+	}
+
+	//Keep a copy for later reads; if the cache declines it the caller frees it
+	*owned = (put_hdd_cache(block, buff, block_size) != 0);
+	return buff;
+}
+
+//Hand a block buffer written to the device over to the cache (or free it)
+//Input: block: block id, buff: slab allocated block contents, block_size: size of the block
+//Output: none
+void hdd_cache_block(uint32_t block, char *buff, uint32_t block_size){
+	if (put_hdd_cache(block, buff, block_size) != 0)
+		hdd_slab_free(buff);
+}
+
+//Next request tag for the pipelined block requests
+uint32_t hdd_io_next_tag = HDD_CLIENT_SYNC_TAG;
+
+//Get a fresh request tag (never the one hdd_client_operation uses)
+//Output: the tag
+uint32_t hdd_io_tag(void){
+	if (++hdd_io_next_tag == HDD_CLIENT_SYNC_TAG)
+		hdd_io_next_tag++;
+	return hdd_io_next_tag;
+}
+
+//Number of block requests to keep in flight. Servers that tag their responses get the
+//full pipeline; older servers answer pipelined requests slowly (small unbuffered
+//writes held back by the TCP stack), so they get one request at a time.
+//Output: the pipeline depth
+uint32_t hdd_io_depth(void){
+	return (hdd_server_capabilities & HDD_CAP_TAGS) ? HDD_IO_PIPELINE_DEPTH : 1;
+}
+
+//Complete the oldest read of a queue: copy the range out of a whole block and cache it
+//Input: queue: the read queue (must not be empty)
+//Output: 0 on success, -1 on failure (also recorded in queue->failed)
+int hdd_fetch_complete(HDD_IO_QUEUE *queue){
+	HDD_READ_OP *op = &queue->ops.read[queue->head];
+	HddBitResp resp;
+	queue->head = (queue->head + 1) % HDD_IO_PIPELINE_DEPTH;
+	queue->count--;
+
+	int ok = (hdd_client_wait(op->tag, &resp) == 0);
+	HDD_CMD read_result = cmd_reader(resp);
+	if (!ok || read_result.r == 1 || (op->buff == NULL && read_result.block_size != op->len)){
+		hdd_slab_free(op->buff);
+		queue->failed = 1;
+		return -1;
+	}
+	if (op->buff != NULL){
+		memcpy(op->dst, &op->buff[op->offset], op->len);
+		hdd_cache_block(op->block, op->buff, op->block_size);
+	}
+	return 0;
+}
+
+//Copy part of a block into a buffer. Cached blocks are copied right away; otherwise the
+//read is queued: a partial read goes to the server as a range read straight into dst
+//(when the server can), anything else reads the whole block, which is cached afterwards.
+//Input: queue: the read queue, block: block id, block_size: size of the block, offset/len: the range, dst: destination
+//Output: 0 on success, -1 on failure (also recorded in queue->failed)
+int hdd_fetch_submit(HDD_IO_QUEUE *queue, uint32_t block, uint32_t block_size, uint32_t offset, uint32_t len, char *dst){
+	uint32_t cached_size;
+	char *cached = get_hdd_cache(block, &cached_size);
+	HddBitCmd read_cmd;
+
+	if (cached != NULL && cached_size == block_size){
+		memcpy(dst, &cached[offset], len);
+		return 0;
+	}
+
+	//Make room in the queue
+	while (queue->count >= hdd_io_depth())
+		if (hdd_fetch_complete(queue) == -1)
+			return -1;
+	HDD_READ_OP *op = &queue->ops.read[(queue->head + queue->count) % HDD_IO_PIPELINE_DEPTH];
+	op->tag = hdd_io_tag();
+	op->block = block;
+	op->block_size = block_size;
+	op->offset = offset;
+	op->len = len;
+	op->dst = dst;
+	op->buff = NULL;
+	if ((offset > 0 || len < block_size) && (hdd_server_capabilities & HDD_CAP_RANGE_READ)){
+		read_cmd = cmd_generator(block, 0, HDD_BLOCK_RANGE, len, HDD_BLOCK_READ);
+		if (hdd_client_submit(read_cmd, offset, dst, op->tag) == -1){
+			queue->failed = 1;
+			return -1;
+		}
+	}
+	else {
+		op->buff = hdd_slab_alloc(block_size);
+		read_cmd = cmd_generator(block, 0, 0, block_size, HDD_BLOCK_READ);
+		if (op->buff == NULL || hdd_client_submit(read_cmd, 0, op->buff, op->tag) == -1){
+			hdd_slab_free(op->buff);
+			queue->failed = 1;
+			return -1;
+		}
+	}
+	queue->count++;
+	return 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 //
 //Global data structure initialization
 HDD_FILE hdd_files[MAX_HDD_FILEDESCR]; //Initialize a file list that takes up to MAX_HDD_FILEDESCR(1024) of HDD_FILE objects
+uint32_t hdd_meta_block = 0; //Block ID of the meta block
+uint32_t hdd_meta_size = 0; //Size of the meta block on the device
+int hdd_meta_dirty = 0; //Flag if the global structure changed since the meta block was written
+HDD_DURABILITY_MODE hdd_durability = HDD_WRITE_BACK; //Current durability mode of hdd_write
+int hdd_batching = 0; //Flag if operations are grouped until hdd_batch_commit
+HDD_IO_QUEUE hdd_batch_reads; //Device reads of the open batch, completed at the latest by the commit
+int hdd_batch_flush = 0; //Flag if a write-through flush waits for hdd_batch_commit
+
+//Check whether operations are being grouped (only with servers that take batch frames)
+//Output: 1 if grouping, 0 if every operation completes right away
+int hdd_batch_active(void){
+	return hdd_batching && (hdd_server_capabilities & HDD_CAP_BATCH);
+}
+HTable hdd_name_index; //Filename hash -> first descriptor of the chain with that hash
+int hdd_name_index_ready = 0; //Flag if hdd_name_index is initialized
+int16_t hdd_free_head = -1; //First unused descriptor
+
+//Hash a filename into a hashtable index value (64-bit FNV-1a)
+//Input: name: NUL-terminated file name
+//Output: index value for hdd_name_index
+HtIndexValue hdd_name_hash(const char *name){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (*name != '\0'){
+		hash ^= (uint8_t) *name++;
+		hash *= 0x100000001b3ULL;
+	}
+	return (HtIndexValue) hash;
+}
+
+//Find the descriptor of a file by name through the name index
+//Input: name: file name
+//Output: file handle, or -1 if there is no such file
+int16_t hdd_index_find(const char *name){
+	intptr_t fh = (intptr_t) findValueInHashTable(&hdd_name_index, hdd_name_hash(name));
+	if (fh == 0)
+		return -1;
+	//Walk the chain of names sharing the hash value
+	while (fh != -1 && strcmp(hdd_files[fh].name, name) != 0)
+		fh = hdd_files[fh].hash_next;
+	return fh;
+}
+
+//Add a named descriptor to the name index
+//Input: fh: file handle (its name must be set)
+//Output: 0 on success, -1 on failure
+int hdd_index_insert(int16_t fh){
+	HtIndexValue key = hdd_name_hash(hdd_files[fh].name);
+	intptr_t head = (intptr_t) findValueInHashTable(&hdd_name_index, key);
+
+	if (head == 0){
+		hdd_files[fh].hash_next = -1;
+		return insertValueInHashTable(&hdd_name_index, key, (void *) (intptr_t) fh);
+	}
+	//Hash collision, chain behind the descriptor already in the table
+	hdd_files[fh].hash_next = hdd_files[head].hash_next;
+	hdd_files[head].hash_next = fh;
+	return 0;
+}
+
+//Rebuild the name index and the free list from the global structure
+//Slot 0 holds the meta block and is neither indexed nor free
+//Input: none
+//Output: 0 on success, -1 on failure
+int hdd_index_build(void){
+	int16_t i;
+
+	//The table is created once, names leave it when their descriptors are cleared
+	if (hdd_name_index_ready == 0){
+		if (initHashTable(&hdd_name_index, HDD_NAME_INDEX_BITS))
+			return -1;
+		hdd_name_index_ready = 1;
+	}
+
+	//Walk down so that the lowest free descriptor is handed out first
+	hdd_free_head = -1;
+	for (i = MAX_HDD_FILEDESCR - 1; i > 0; i--){
+		if (hdd_files[i].name[0] == '\0'){
+			hdd_files[i].free_next = hdd_free_head;
+			hdd_free_head = i;
+		}
+		else if (hdd_index_insert(i) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+//Give the first free descriptor a name and index it
+//Input: name: file name (checked by the caller)
+//Output: file handle, or -1 if no descriptor is left
+int16_t hdd_file_create(const char *name){
+	int16_t fh = hdd_free_head;
+	if (fh == -1)
+		return -1;
+	strcpy(hdd_files[fh].name, name);
+	if (hdd_index_insert(fh) == -1){
+		strcpy(hdd_files[fh].name, "");
+		return -1;
+	}
+	hdd_free_head = hdd_files[fh].free_next;
+	return fh;
+}
+
+//Drop the extent list (and any buffered data) of a file without writing it
+void hdd_file_release(int16_t fh){
+	uint32_t i;
+	for (i = 0; i < hdd_files[fh].extent_count; i++)
+		hdd_slab_free(hdd_files[fh].extents[i].buf);
+	free(hdd_files[fh].extents);
+	hdd_files[fh].extents = NULL;
+	hdd_files[fh].extent_count = 0;
+	hdd_files[fh].extent_slots = 0;
+	hdd_files[fh].dirty = 0;
+}
 
 //Function to initialize the global structure that can take up to MAX_HDD_FILEDESCR(1024) of HDD_FILE objects
 void hdd_file_initialization(){
 	int i;
 	for (i = 0; i < MAX_HDD_FILEDESCR; i++){
+		hdd_file_release(i); //Buffered data of the previous mount is discarded
+		//Take the name out of the index (the values are descriptor numbers, nothing to free)
+		if (i > 0 && hdd_name_index_ready && hdd_files[i].name[0] != '\0')
+			deleteValueFromHashTable(&hdd_name_index, hdd_name_hash(hdd_files[i].name));
 		strcpy(hdd_files[i].name, "");
-		hdd_files[i].id = 0;
 		hdd_files[i].position = 0;
 		hdd_files[i].open = 0;
 		hdd_files[i].size = 0; //NEW IN ASSG4!
 	}
+
+	//Slot 0 stays reserved for the meta block
+	strcpy(hdd_files[0].name, "Meta Block");
+	hdd_files[0].open = 1;
+
+	//Every other descriptor is free again
+	hdd_index_build();
+}
+
+//Make room for at least count extents in the extent list of a file
+//Input: fh: file handle, count: number of extents needed
+//Output: 0 on success, -1 on failure
+int hdd_extent_reserve(int16_t fh, uint32_t count){
+	if (count <= hdd_files[fh].extent_slots)
+		return 0;
+	uint32_t slots = hdd_files[fh].extent_slots ? hdd_files[fh].extent_slots * 2 : 4;
+	if (slots < count)
+		slots = count;
+	HDD_EXTENT *extents = realloc(hdd_files[fh].extents, slots * sizeof(HDD_EXTENT));
+	if (extents == NULL)
+		return -1;
+	hdd_files[fh].extents = extents;
+	hdd_files[fh].extent_slots = slots;
+	return 0;
+}
+
+//Find the extent holding a file offset (binary search over the extent offsets)
+//Input: fh: file handle, offset: file offset (must be below the file size)
+//Output: index of the extent
+uint32_t hdd_find_extent(int16_t fh, uint32_t offset){
+	uint32_t low = 0, high = hdd_files[fh].extent_count - 1;
+	while (low < high){
+		uint32_t mid = (low + high + 1) / 2;
+		if (hdd_files[fh].extents[mid].offset <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+//Fill the parts of a write-back buffer outside its dirty range with the block content
+//Input: fh: file handle, idx: extent index (must be buffered)
+//Output: 0 on success, -1 on failure
+int hdd_extent_load(int16_t fh, uint32_t idx){
+	HDD_EXTENT *ext = &hdd_files[fh].extents[idx];
+	if (ext->loaded)
+		return 0;
+
+	if (ext->dev_size > 0){
+		int owned = 0;
+		char *block = hdd_fetch_block(ext->id, ext->dev_size, &owned);
+		if (block == NULL)
+			return -1;
+		if (ext->dirty_lo == ext->dirty_hi)
+			memcpy(ext->buf, block, ext->dev_size);
+		else {
+			memcpy(ext->buf, block, ext->dirty_lo);
+			if (ext->dirty_hi < ext->dev_size)
+				memcpy(&ext->buf[ext->dirty_hi], &block[ext->dirty_hi], ext->dev_size - ext->dirty_hi);
+		}
+		if (owned)
+			hdd_slab_free(block);
+	}
+	ext->loaded = 1;
+	return 0;
+}
+
+//Make sure an extent has a write-back buffer. If the server can patch blocks in place
+//the block is not read, only the bytes written later are valid (see hdd_extent_load).
+//Input: fh: file handle, idx: extent index
+//Output: 0 on success, -1 on failure
+int hdd_extent_buffer(int16_t fh, uint32_t idx){
+	HDD_EXTENT *ext = &hdd_files[fh].extents[idx];
+	if (ext->buf != NULL)
+		return 0;
+
+	//Room for the tail extent to grow up to HDD_EXTENT_SIZE
+	ext->buf = hdd_slab_alloc(ext->size > HDD_EXTENT_SIZE ? ext->size : HDD_EXTENT_SIZE);
+	if (ext->buf == NULL)
+		return -1;
+	ext->dirty_lo = ext->dirty_hi = 0;
+	ext->loaded = 0;
+	if (!(hdd_server_capabilities & HDD_CAP_RANGE_WRITE) && hdd_extent_load(fh, idx) == -1){
+		hdd_slab_free(ext->buf);
+		ext->buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+//Copy data into a write-back buffer and widen its dirty range. A range that does not
+//touch the current dirty range needs the block content in between, so it is loaded.
+//Input: fh: file handle, idx: extent index (must be buffered), start/len: range in the extent, data: bytes
+//Output: 0 on success, -1 on failure
+int hdd_extent_store(int16_t fh, uint32_t idx, uint32_t start, uint32_t len, const char *data){
+	HDD_EXTENT *ext = &hdd_files[fh].extents[idx];
+
+	if (ext->dirty_lo == ext->dirty_hi){
+		ext->dirty_lo = start;
+		ext->dirty_hi = start + len;
+	}
+	else {
+		if (!ext->loaded && (start + len < ext->dirty_lo || start > ext->dirty_hi) && hdd_extent_load(fh, idx) == -1)
+			return -1;
+		if (start < ext->dirty_lo)
+			ext->dirty_lo = start;
+		if (start + len > ext->dirty_hi)
+			ext->dirty_hi = start + len;
+	}
+	memcpy(&ext->buf[start], data, len);
+	return 0;
+}
+
+//Grow a file to new_size bytes: the tail extent is topped up to HDD_EXTENT_SIZE,
+//then new (buffered) tail extents are added. Nothing before the tail is touched.
+//Input: fh: file handle, new_size: size of the file after the write
+//Output: 0 on success, -1 on failure
+int hdd_extend_file(int16_t fh, uint32_t new_size){
+	HDD_FILE *file = &hdd_files[fh];
+	HDD_EXTENT *tail;
+
+	while (file->size < new_size){
+		if (file->extent_count == 0 || file->extents[file->extent_count-1].size >= HDD_EXTENT_SIZE){
+			//Start a new tail extent
+			if (hdd_extent_reserve(fh, file->extent_count + 1) == -1)
+				return -1;
+			tail = &file->extents[file->extent_count];
+			tail->buf = hdd_slab_alloc(HDD_EXTENT_SIZE);
+			if (tail->buf == NULL)
+				return -1;
+			tail->id = 0;
+			tail->offset = file->size;
+			tail->size = 0;
+			tail->dev_size = 0;
+			tail->dirty_lo = tail->dirty_hi = 0;
+			tail->loaded = 1; //Nothing on the device yet
+			file->extent_count++;
+		}
+		else {
+			//Top up the current tail, its content has to be buffered first
+			if (hdd_extent_buffer(fh, file->extent_count-1) == -1)
+				return -1;
+			tail = &file->extents[file->extent_count-1];
+		}
+
+		uint32_t grow = HDD_EXTENT_SIZE - tail->size;
+		if (grow > new_size - file->size)
+			grow = new_size - file->size;
+		tail->size += grow;
+		file->size += grow;
+	}
+	return 0;
+}
+
+//Length of the meta record of a file
+//Input: fh: file handle (must have a name)
+//Output: bytes of the record
+uint32_t hdd_meta_record_length(int16_t fh){
+	return sizeof(uint8_t) + strlen(hdd_files[fh].name) + 2*sizeof(uint32_t) + hdd_files[fh].extent_count*sizeof(HDD_META_EXTENT);
+}
+
+//Write the meta record of a file
+//Input: ptr: where the record goes, fh: file handle (must have a name)
+//Output: the byte after the record
+char *hdd_meta_record_put(char *ptr, int16_t fh){
+	uint8_t name_len = strlen(hdd_files[fh].name);
+	uint32_t j;
+
+	*ptr++ = name_len;
+	memcpy(ptr, hdd_files[fh].name, name_len);
+	ptr += name_len;
+	memcpy(ptr, &hdd_files[fh].size, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	memcpy(ptr, &hdd_files[fh].extent_count, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	for (j = 0; j < hdd_files[fh].extent_count; j++){
+		HDD_META_EXTENT extent = { hdd_files[fh].extents[j].id, hdd_files[fh].extents[j].size };
+		memcpy(ptr, &extent, sizeof(HDD_META_EXTENT));
+		ptr += sizeof(HDD_META_EXTENT);
+	}
+	return ptr;
+}
+
+//Read the name, size and extent count of a meta record, checking that the whole record is in the image
+//Input: ptr: the record, end: end of the image, name: set to the name (MAX_FILENAME_LENGTH bytes), size/extents: set from the record
+//Output: the first extent of the record, or NULL if it is malformed
+char *hdd_meta_record_get(char *ptr, char *end, char *name, uint32_t *size, uint32_t *extents){
+	uint8_t name_len;
+
+	if (ptr >= end)
+		return NULL;
+	name_len = (uint8_t) *ptr;
+	if (name_len == 0 || name_len >= MAX_FILENAME_LENGTH || ptr + 1 + name_len + 2*sizeof(uint32_t) > end)
+		return NULL;
+	memcpy(name, ptr + 1, name_len);
+	name[name_len] = '\0';
+	ptr += 1 + name_len;
+	memcpy(size, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	memcpy(extents, ptr, sizeof(uint32_t));
+	ptr += sizeof(uint32_t);
+	if (*extents > (end - ptr) / sizeof(HDD_META_EXTENT))
+		return NULL;
+	return ptr;
+}
+
+//Build the meta block image of the live files of the global structure
+//Input: len: set to the length of the image
+//Output: malloc'd image, or NULL on failure
+char *hdd_meta_encode(uint32_t *len){
+	HDD_META_HEADER header = { HDD_META_MAGIC, HDD_META_VERSION, 0, 0 };
+	uint32_t i, length = sizeof(HDD_META_HEADER);
+	char *image, *ptr;
+
+	//Size the image, only descriptors with a name are stored
+	for (i = 1; i < MAX_HDD_FILEDESCR; i++){
+		if (hdd_files[i].name[0] == '\0')
+			continue;
+		header.files++;
+		header.extents += hdd_files[i].extent_count;
+		length += hdd_meta_record_length(i);
+	}
+	if (length > HDD_MAX_BLOCK_SIZE)
+		return NULL;
+	image = malloc(length);
+	if (image == NULL)
+		return NULL;
+
+	memcpy(image, &header, sizeof(HDD_META_HEADER));
+	ptr = image + sizeof(HDD_META_HEADER);
+	for (i = 1; i < MAX_HDD_FILEDESCR; i++){
+		if (hdd_files[i].name[0] != '\0')
+			ptr = hdd_meta_record_put(ptr, i);
+	}
+	*len = length;
+	return image;
+}
+
+//Add a clean, on-device extent at the end of a file (used when loading the meta block)
+//Input: fh: file handle, id: block id, size: extent size
+//Output: 0 on success, -1 on failure
+int hdd_load_extent(int16_t fh, uint32_t id, uint32_t size){
+	if (hdd_extent_reserve(fh, hdd_files[fh].extent_count + 1) == -1)
+		return -1;
+	HDD_EXTENT *ext = &hdd_files[fh].extents[hdd_files[fh].extent_count++];
+	ext->id = id;
+	ext->offset = hdd_files[fh].size;
+	ext->size = size;
+	ext->dev_size = size;
+	ext->buf = NULL;
+	hdd_files[fh].size += size;
+	return 0;
+}
+
+//Add the extents of a meta record to the end of a file
+//Input: fh: file handle, ptr: the first extent of the record, extents: extent count
+//Output: 0 on success, -1 on failure
+int hdd_meta_record_load(int16_t fh, char *ptr, uint32_t extents){
+	HDD_META_EXTENT extent;
+	uint32_t j;
+
+	for (j = 0; j < extents; j++){
+		memcpy(&extent, ptr, sizeof(HDD_META_EXTENT));
+		ptr += sizeof(HDD_META_EXTENT);
+		if (hdd_load_extent(fh, extent.id, extent.size) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+//Load the global structure from a version 1 meta block (a fixed record per descriptor)
+//Input: image: meta block content, len: its length, header: the decoded header
+//Output: 0 on success, -1 on failure
+int hdd_meta_decode_v1(char *image, uint32_t len, HDD_META_HEADER *header){
+	uint32_t i, j;
+
+	if (header->files > MAX_HDD_FILEDESCR ||
+	    len != sizeof(HDD_META_HEADER) + header->files*sizeof(HDD_META_FILE) + header->extents*sizeof(HDD_META_EXTENT))
+		return -1;
+
+	HDD_META_FILE *record = (HDD_META_FILE *) (image + sizeof(HDD_META_HEADER));
+	char *ptr = (char *) &record[header->files];
+	for (i = 1; i < header->files; i++){
+		strncpy(hdd_files[i].name, record[i].name, MAX_FILENAME_LENGTH - 1);
+		for (j = 0; j < record[i].extents; j++){
+			HDD_META_EXTENT extent;
+			if (ptr + sizeof(HDD_META_EXTENT) > image + len)
+				return -1;
+			memcpy(&extent, ptr, sizeof(HDD_META_EXTENT));
+			ptr += sizeof(HDD_META_EXTENT);
+			if (hdd_load_extent(i, extent.id, extent.size) == -1)
+				return -1;
+		}
+		if (hdd_files[i].size != record[i].size)
+			return -1;
+	}
+	return 0;
+}
+
+//Load the global structure from a meta block image (any layout written so far)
+//Input: image: meta block content, len: its length
+//Output: 0 on success, -1 on failure
+int hdd_meta_decode(char *image, uint32_t len){
+	uint32_t i, size, extents;
+	HDD_META_HEADER header;
+	char *ptr, *end = image + len;
+
+	//Pre-extent meta block: an array of single-block files
+	if (len == MAX_HDD_FILEDESCR*sizeof(HDD_LEGACY_FILE)){
+		HDD_LEGACY_FILE *legacy = (HDD_LEGACY_FILE *) image;
+		for (i = 1; i < MAX_HDD_FILEDESCR; i++){
+			strncpy(hdd_files[i].name, legacy[i].name, MAX_FILENAME_LENGTH - 1);
+			if (legacy[i].id != 0 && hdd_load_extent(i, legacy[i].id, legacy[i].size) == -1)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (len < sizeof(HDD_META_HEADER))
+		return -1;
+	memcpy(&header, image, sizeof(HDD_META_HEADER));
+	if (header.magic != HDD_META_MAGIC)
+		return -1;
+	if (header.version == 1)
+		return hdd_meta_decode_v1(image, len, &header);
+	if (header.version != HDD_META_VERSION || header.files >= MAX_HDD_FILEDESCR)
+		return -1;
+
+	//Live files are packed into descriptors 1..files
+	ptr = image + sizeof(HDD_META_HEADER);
+	for (i = 1; i <= header.files; i++){
+		ptr = hdd_meta_record_get(ptr, end, hdd_files[i].name, &size, &extents);
+		if (ptr == NULL || hdd_meta_record_load(i, ptr, extents) == -1 || hdd_files[i].size != size)
+			return -1;
+		ptr += extents*sizeof(HDD_META_EXTENT);
+	}
+	return (ptr == end) ? 0 : -1;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -121,6 +792,163 @@ void hdd_file_initialization(){
 // Implementation
 // Author: Tianjian Gao
 
+//Queue a request of a flush, completing the oldest one first if the queue is full
+//Input: queue: the flush queue, fh/idx: the extent, kind: HDD_FLUSH_* request, block: block to delete (HDD_FLUSH_DELETE)
+//Output: 0 on success, -1 on failure (also recorded in queue->failed)
+int hdd_flush_submit(HDD_IO_QUEUE *queue, int16_t fh, uint32_t idx, uint8_t kind, uint32_t block);
+
+//Complete the oldest request of a flush and update its extent. A completed create
+//queues the delete of the block it replaced.
+//Input: queue: the flush queue (must not be empty)
+//Output: 0 on success, -1 on failure (also recorded in queue->failed)
+int hdd_flush_complete(HDD_IO_QUEUE *queue){
+	HDD_FLUSH_OP op = queue->ops.flush[queue->head];
+	HDD_EXTENT *ext = &hdd_files[op.fh].extents[op.idx];
+	HddBitResp resp;
+	uint32_t old_block;
+	queue->head = (queue->head + 1) % HDD_IO_PIPELINE_DEPTH;
+	queue->count--;
+
+	int ok = (hdd_client_wait(op.tag, &resp) == 0);
+	HDD_CMD result = cmd_reader(resp);
+	if (!ok || result.r == 1 || (op.kind == HDD_FLUSH_RANGE && result.block_size != ext->size)){
+		queue->failed = 1;
+		return -1;
+	}
+
+	switch (op.kind){
+	case HDD_FLUSH_DELETE:
+		return 0;
+
+	case HDD_FLUSH_RANGE:
+		if (ext->dev_size != ext->size){
+			//The block grew, the extent list in the meta block changes
+			ext->dev_size = ext->size;
+			hdd_meta_dirty = 1;
+		}
+		break;
+
+	case HDD_FLUSH_CREATE:
+		//The extent moved to the new block (recorded first so that it is not lost), the old one goes
+		old_block = ext->id;
+		ext->id = result.block;
+		ext->dev_size = ext->size;
+		hdd_meta_dirty = 1;
+		if (old_block != 0){
+			delete_hdd_cache(old_block);
+			if (hdd_flush_submit(queue, op.fh, op.idx, HDD_FLUSH_DELETE, old_block) == -1)
+				return -1;
+		}
+		break;
+	}
+
+	if (ext->loaded){
+		//The buffer is now the block content, hand it over to the cache
+		hdd_cache_block(ext->id, ext->buf, ext->size);
+	}
+	else {
+		//Partial buffer, patch the cached copy of the block (drop it if the block grew)
+		uint32_t cached_size;
+		char *cached = get_hdd_cache(ext->id, &cached_size);
+		if (cached != NULL && cached_size == ext->size)
+			memcpy(&cached[ext->dirty_lo], &ext->buf[ext->dirty_lo], ext->dirty_hi - ext->dirty_lo);
+		else
+			delete_hdd_cache(ext->id);
+		hdd_slab_free(ext->buf);
+	}
+	ext->buf = NULL;
+	return 0;
+}
+
+int hdd_flush_submit(HDD_IO_QUEUE *queue, int16_t fh, uint32_t idx, uint8_t kind, uint32_t block){
+	HDD_EXTENT *ext = &hdd_files[fh].extents[idx];
+	HddBitCmd cmd;
+	uint32_t offset = 0;
+	char *buf = ext->buf;
+
+	//Make room in the queue (a completed create queues a delete in its place)
+	while (queue->count >= hdd_io_depth())
+		if (hdd_flush_complete(queue) == -1)
+			return -1;
+
+	switch (kind){
+	case HDD_FLUSH_RANGE:
+		//Only the written bytes are sent, appended if they start at the end of the block
+		buf = &ext->buf[ext->dirty_lo];
+		if (ext->dirty_lo == ext->dev_size)
+			cmd = cmd_generator(ext->id, 0, HDD_BLOCK_APPEND, ext->dirty_hi - ext->dirty_lo, HDD_BLOCK_OVERWRITE);
+		else {
+			cmd = cmd_generator(ext->id, 0, HDD_BLOCK_RANGE, ext->dirty_hi - ext->dirty_lo, HDD_BLOCK_OVERWRITE);
+			offset = ext->dirty_lo;
+		}
+		break;
+	case HDD_FLUSH_OVERWRITE:
+		cmd = cmd_generator(ext->id, 0, 0, ext->size, HDD_BLOCK_OVERWRITE);
+		break;
+	case HDD_FLUSH_CREATE:
+		cmd = cmd_generator(0, 0, 0, ext->size, HDD_BLOCK_CREATE);
+		break;
+	default:
+		cmd = cmd_generator(block, 0, 0, 0, HDD_BLOCK_DELETE);
+		buf = NULL;
+		break;
+	}
+
+	HDD_FLUSH_OP *op = &queue->ops.flush[(queue->head + queue->count) % HDD_IO_PIPELINE_DEPTH];
+	op->fh = fh;
+	op->idx = idx;
+	op->tag = hdd_io_tag();
+	op->kind = kind;
+	op->block = block;
+	if (hdd_client_submit(cmd, offset, buf, op->tag) == -1){
+		queue->failed = 1;
+		return -1;
+	}
+	queue->count++;
+	return 0;
+}
+
+//Write the buffered extents of a range of descriptors back to the device. The requests
+//of all the files are pipelined, a file does not wait for the one before it.
+//Input: first/last: the descriptors to flush
+//Output: 0 on success, -1 on failure
+int hdd_flush_files(int16_t first, int16_t last){
+	HDD_IO_QUEUE queue;
+	int16_t fh;
+	uint32_t i;
+
+	//Reads still open in a batch come first, they must not see the new content
+	while (hdd_batch_reads.count > 0)
+		hdd_fetch_complete(&hdd_batch_reads);
+
+	queue.head = queue.count = 0;
+	queue.failed = 0;
+	for (fh = first; fh <= last && !queue.failed; fh++){
+		HDD_FILE *file = &hdd_files[fh];
+		for (i = 0; i < file->extent_count && !queue.failed; i++){
+			HDD_EXTENT *ext = &file->extents[i];
+			if (ext->buf == NULL)
+				continue;
+
+			if (ext->id != 0 && (hdd_server_capabilities & HDD_CAP_RANGE_WRITE))
+				hdd_flush_submit(&queue, fh, i, HDD_FLUSH_RANGE, 0); //Patch the block in place
+			else if (ext->id != 0 && ext->size == ext->dev_size)
+				hdd_flush_submit(&queue, fh, i, HDD_FLUSH_OVERWRITE, 0); //Same size, overwrite the block
+			else
+				hdd_flush_submit(&queue, fh, i, HDD_FLUSH_CREATE, 0); //New or grown tail extent, replace the block
+		}
+	}
+
+	//Collect the responses (completed creates may still queue deletes)
+	while (queue.count > 0)
+		hdd_flush_complete(&queue);
+	if (queue.failed)
+		return -1;
+	for (fh = first; fh <= last; fh++)
+		hdd_files[fh].dirty = 0;
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : hdd_format
@@ -151,19 +979,24 @@ uint16_t hdd_format(void) {
 	
 	//Now initializing the global structure
 	hdd_file_initialization(); //Initialize the hdd_files structure to store file open info
+	clear_hdd_cache(); //Nothing cached before the format is valid anymore
 	
 	//Create the meta block and save the global structure to it
-	HddBitCmd create_meta = cmd_generator(0, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(HDD_FILE), HDD_BLOCK_CREATE); //fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
-	HDD_CMD create_result = cmd_reader(hdd_client_operation(create_meta, hdd_files)); //USE hdd_client_operation to communicate with and format the hdd
+	uint32_t meta_size;
+	char *meta = hdd_meta_encode(&meta_size);
+	if (meta == NULL)
+		return -1;
+	HddBitCmd create_meta = cmd_generator(0, 0, HDD_META_BLOCK, meta_size, HDD_BLOCK_CREATE); //fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
+	HDD_CMD create_result = cmd_reader(hdd_client_operation(create_meta, meta)); //USE hdd_client_operation to communicate with and format the hdd
+	free(meta);
 	//Check create result
 	if (create_result.r == 1)
 		return -1;
 
-	//Save meta block info into hdd_files
-	hdd_files[0].id = create_result.block;
-	strcpy(hdd_files[0].name, "Meta Block");
-	hdd_files[0].size = create_result.block_size;
-	hdd_files[0].open = 1;
+	//Save meta block info
+	hdd_meta_block = create_result.block;
+	hdd_meta_size = meta_size;
+	hdd_meta_dirty = 0;
 
 	//Return 0 if all succeeded
 	return 0;
@@ -193,24 +1026,37 @@ uint16_t hdd_mount(void) {
 
 	//Re-initializing the global structure
 	hdd_file_initialization(); //Initialize the hdd_files structure to store file open info
+	clear_hdd_cache(); //Start the mount with a cold cache
 	
-	//Create the meta block and save the global structure to it
-	HddBitCmd read_meta = cmd_generator(hdd_files[0].id, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(HDD_FILE), HDD_BLOCK_READ); //generate read meta block command. fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
-	HDD_CMD read_result = cmd_reader(hdd_client_operation(read_meta, hdd_files)); //USE hdd_client_operation to communicate with and overwrite the hdd meta block
-	
-	//Check read result
-	if (read_result.r == 1)
+	//Read the meta block, its size depends on the number of extents so ask for the largest block
+	char *meta = malloc(HDD_MAX_BLOCK_SIZE);
+	if (meta == NULL)
 		return -1;
+	HddBitCmd read_meta = cmd_generator(0, 0, HDD_META_BLOCK, HDD_MAX_BLOCK_SIZE, HDD_BLOCK_READ); //generate read meta block command. fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
+	HDD_CMD read_result = cmd_reader(hdd_client_operation(read_meta, meta)); //USE hdd_client_operation to communicate with and overwrite the hdd meta block
 	
-	//Check if bytes read to the global structure equals to the size of the meta block
-	if (read_result.block_size != MAX_HDD_FILEDESCR*sizeof(HDD_FILE))
+	//Check read result and load the global structure from it
+	if (read_result.r == 1 || hdd_meta_decode(meta, read_result.block_size) == -1){
+		free(meta);
+		hdd_file_initialization();
 		return -1;
+	}
 
-	//Save meta block info into hdd_files
-	hdd_files[0].id = read_result.block;
-	strcpy(hdd_files[0].name, "Meta Block");
-	hdd_files[0].size = read_result.block_size;
-	hdd_files[0].open = 1;
+	//Older layouts are rewritten in the current one on unmount
+	HDD_META_HEADER header;
+	memcpy(&header, meta, sizeof(HDD_META_HEADER));
+	hdd_meta_dirty = (header.magic != HDD_META_MAGIC || header.version != HDD_META_VERSION);
+	free(meta);
+
+	//Index the names that were just loaded
+	if (hdd_index_build() == -1){
+		hdd_file_initialization();
+		return -1;
+	}
+
+	//Save meta block info
+	hdd_meta_block = read_result.block;
+	hdd_meta_size = read_result.block_size;
 
 	//Return 0 if all succeeded
 	return 0;
@@ -231,14 +1077,42 @@ uint16_t hdd_unmount(void) {
 	// Check if hdd is initialized
     	if (hdd_init == 0)
         	return -1;
+
+	//Write back every buffered file before the metadata that describes them
+	if (hdd_flush_files(1, MAX_HDD_FILEDESCR-1) == -1)
+		return -1;
 	
-	//Write back the metadata to the global structure
-	HddBitCmd save_meta = cmd_generator(hdd_files[0].id, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(HDD_FILE), HDD_BLOCK_OVERWRITE); //generate save meta command. fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
-	HDD_CMD save_result = cmd_reader(hdd_client_operation(save_meta, hdd_files)); //USE hdd_client_operation to communicate with and load the meta data to the global structure
+	//Write back the global structure to the meta block, only if it changed since it was read
+	if (hdd_meta_dirty) {
+		uint32_t meta_size;
+		char *meta = hdd_meta_encode(&meta_size);
+		if (meta == NULL)
+			return -1;
+		if (meta_size != hdd_meta_size){
+			//The encoded size changed, replace the meta block with one of the new size
+			HddBitCmd delete_meta = cmd_generator(hdd_meta_block, 0, HDD_META_BLOCK, 0, HDD_BLOCK_DELETE);
+			HDD_CMD delete_result = cmd_reader(hdd_client_operation(delete_meta, NULL));
+			HddBitCmd create_meta = cmd_generator(0, 0, HDD_META_BLOCK, meta_size, HDD_BLOCK_CREATE);
+			HDD_CMD create_result = cmd_reader(hdd_client_operation(create_meta, meta));
+			free(meta);
+			if (create_result.r == 1)
+				return -1;
+			hdd_meta_block = create_result.block;
+			hdd_meta_size = meta_size;
+			if (delete_result.r == 1)
+				return -1;
+		}
+		else {
+			HddBitCmd save_meta = cmd_generator(hdd_meta_block, 0, HDD_META_BLOCK, meta_size, HDD_BLOCK_OVERWRITE); //generate save meta command. fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
+			HDD_CMD save_result = cmd_reader(hdd_client_operation(save_meta, meta)); //USE hdd_client_operation to communicate with and load the meta data to the global structure
+			free(meta);
 	
-	//Check create result
-	if (save_result.r == 1)
-		return -1;
+			//Check create result
+			if (save_result.r == 1)
+				return -1;
+		}
+		hdd_meta_dirty = 0;
+	}
 
 	//Send a request to save and close the hdd data block
 	HddBitCmd update_meta = cmd_generator(0, 0, HDD_SAVE_AND_CLOSE, 0, HDD_DEVICE); //fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
@@ -248,8 +1122,9 @@ uint16_t hdd_unmount(void) {
 	if (update_result.r == 1)
 		return -1;
 
-	//Uninitialize the device
+	//Uninitialize the device and drop the cached blocks
 	hdd_init = 0;
+	clear_hdd_cache();
 
 	//Return 0 if all succeeded
 	return 0;
@@ -265,36 +1140,29 @@ uint16_t hdd_unmount(void) {
 //
 // Progress 	: 100%
 int16_t hdd_open(char *path) { 
-	int file_handle = 0;
+	int16_t file_handle;
 
 	// Check if hdd is initialized
     	if (hdd_init == 0)
         	return -1;
 	
 	//Check the path
-	if (path == NULL || strlen(path) > MAX_FILENAME_LENGTH)
+	if (path == NULL || path[0] == '\0' || strlen(path) >= MAX_FILENAME_LENGTH)
 		return -1;
-	//Search if file already exists
-	while (file_handle < MAX_HDD_FILEDESCR && strcmp(hdd_files[file_handle].name, path) != 0)
-		file_handle++;
+	//Look the file up in the name index
+	file_handle = hdd_index_find(path);
 
 	//Case the file does not exist
-	if (file_handle == MAX_HDD_FILEDESCR){
-		
-		int search = 0; //use as an index to search for an empty slot in the global structure
-
-		while (strcmp(hdd_files[search].name, "") != 0)
-			search ++;
-
-		//Fail if file handle exceeds max file handle available 
-		if (search == MAX_HDD_FILEDESCR)
+	if (file_handle == -1){
+		//Take the first descriptor off the free list, fail if none is left
+		file_handle = hdd_file_create(path);
+		if (file_handle == -1)
 			return -1;
+		hdd_meta_dirty = 1;
+		hdd_files[file_handle].open = 1;
+		hdd_files[file_handle].position = 0;
 
-		//Initialize the block if an empty spot is found
-		strcpy(hdd_files[search].name, path);
-		hdd_files[search].open = 1;
-
-		return search;
+		return file_handle;
 	}
 	//Case the file already exists
 	else {
@@ -324,13 +1192,17 @@ int16_t hdd_close(int16_t fh) {
         	return -1;
 
 	//Check file handle
-	if (fh < 0 || fh > MAX_HDD_FILEDESCR)
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR)
 		return -1;
 
 	//If if hdd file is already closed
 	if (hdd_files[fh].open == 0) 
 		return -1;
 
+	//Write back the buffered data of the file
+	if (hdd_flush(fh) == -1)
+		return -1;
+
 	//Close the file
 	hdd_files[fh].open = 0;
 	hdd_files[fh].position = 0;
@@ -341,7 +1213,7 @@ int16_t hdd_close(int16_t fh) {
 //
 // Function     : hdd_read
 // Description  : reads a count number of bytes from the current position in the file
-//		  and place them into data buffer
+//		  and place them into data buffer. Only the extents overlapping the range are read.
 // Inputs       : integer file handle fh, pointer -> data in file, integer count as in byte count
 // Outputs      : -1 if failed or number of bytes read
 //
@@ -358,7 +1230,7 @@ int32_t hdd_read(int16_t fh, void * data, int32_t count) {
 	}
 
 	//Check file at fh exists
-	if (fh < 0 || fh > MAX_HDD_FILEDESCR)
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR)
 		return -1;
 	
 	//Check data validity
@@ -366,48 +1238,62 @@ int32_t hdd_read(int16_t fh, void * data, int32_t count) {
 		return -1;
 	
 	//Check count
-	if (count < 0 || count > HDD_MAX_BLOCK_SIZE)
+	if (count < 0)
 		return -1;
 	
 	//If the file is not open
 	if (hdd_files[fh].open == 0)
 		return -1;
-	
-	//If all succeeded, create read command and read the file
-	HddBitCmd read_block = cmd_generator(hdd_files[fh].id, 0, 0, hdd_files[fh].size, HDD_BLOCK_READ);
-
-	//Create a buffer to copy block content
-	char *read_buff = malloc(hdd_files[fh].size);
-	HDD_CMD read_result = cmd_reader(hdd_client_operation(read_block, read_buff));
 
-	if (read_result.r == 1){
-		free(read_buff);
-		return -1;
+	//Read till the end of the file at most
+	HDD_FILE *file = &hdd_files[fh];
+	uint32_t bytes_read = file->size - file->position;
+	if (bytes_read > count)
+		bytes_read = count;
+	if (bytes_read == 0)
+		return 0;
+
+	//Copy out of every extent overlapping the range, the device reads are pipelined
+	//(inside a batch they are left to complete with the batch)
+	HDD_IO_QUEUE local, *queue = hdd_batch_active() ? &hdd_batch_reads : &local;
+	local.head = local.count = 0;
+	local.failed = 0;
+	uint32_t done = 0, idx = hdd_find_extent(fh, file->position);
+	while (done < bytes_read && !queue->failed){
+		HDD_EXTENT *ext = &file->extents[idx];
+		uint32_t start = file->position + done - ext->offset;
+		uint32_t len = ext->size - start;
+		if (len > bytes_read - done)
+			len = bytes_read - done;
+
+		if (ext->buf != NULL){
+			//Pending writes, serve from the write-back buffer (completed with the block if needed)
+			if (!ext->loaded && (start < ext->dirty_lo || start + len > ext->dirty_hi) && hdd_extent_load(fh, idx) == -1)
+				queue->failed = 1;
+			else
+				memcpy((char *) data + done, &ext->buf[start], len);
+		}
+		//Otherwise get the bytes from the cache or the device
+		else
+			hdd_fetch_submit(queue, ext->id, ext->dev_size, start, len, (char *) data + done);
+		done += len;
+		idx++;
 	}
-	else {
+	while (queue == &local && local.count > 0)
+		hdd_fetch_complete(&local);
+	if (queue->failed)
+		return -1;
 
-		//Check if the read request count exceeds the block size
-		if ((hdd_files[fh].size - hdd_files[fh].position) > count){ //more bytes than asked
-			memcpy(data, &read_buff[hdd_files[fh].position], count);
-			hdd_files[fh].position += count;
-			free(read_buff);
-			return count;
-		}
-		else { //less bytes than asked, read till the end of the block
-			memcpy(data, &read_buff[hdd_files[fh].position], (hdd_files[fh].size - hdd_files[fh].position));
-			int bytes_read = hdd_files[fh].size - hdd_files[fh].position;
-			hdd_files[fh].position = hdd_files[fh].size;
-			free(read_buff);
-			return bytes_read;
-		}
-	}	
+	file->position += bytes_read;
+	return bytes_read;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : hdd_write
 // Description  : writes a count number of bytes from current position in the file
-//		  and place them into data buffer
+//		  and place them into data buffer. The write lands in the buffers of the
+//		  extents it overlaps; appends only grow the tail extent or add new ones.
 //
 // Inputs       : integer file handle fh, pointer -> data in file, integer count as in byte count
 // Outputs      : -1 if failed or number of bytes written
@@ -425,97 +1311,52 @@ int32_t hdd_write(int16_t fh, void *data, int32_t count) {
 	}
 
 	//Check file at fh exists
-	if (fh < 0 || fh > MAX_HDD_FILEDESCR)
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR)
 		return -1;
 	
 	//Check data validity
 	if (data == NULL)
 		return -1;
 	
-	//Check count and overflow from HDD_MAX_BLOCK_SIZE
-	if (count < 0 || (count + hdd_files[fh].position) > HDD_MAX_BLOCK_SIZE) 
+	//Check count and overflow of the 32-bit file size
+	if (count < 0 || (uint64_t) count + hdd_files[fh].position > UINT32_MAX) 
 		return -1;
 	
 	//If file at fh is not opened 
 	if (hdd_files[fh].open == 0)
 		return -1;
-	//Write data
-	//First step: check if block in hdd has content already
-	if (hdd_files[fh].id == 0){ //Block is not written
-		//generate command to create a new block
-		HddBitCmd create = cmd_generator(0, 0, HDD_NULL_FLAG, count, HDD_BLOCK_CREATE);//fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
-		HDD_CMD check_create = cmd_reader(hdd_client_operation(create, data));
-
-		//..Check if block creation failed
-		if (check_create.r == 1)
-			return -1;
-		
-		//create a new block and write it
-		hdd_files[fh].id = check_create.block;
-		hdd_files[fh].position = count;
-		hdd_files[fh].size = count; //...NEW IN ASSG4!
-		return count;
-	}
-	else { //Block has been written before
-		HddBitCmd read_block = cmd_generator(hdd_files[fh].id, 0, 0, hdd_files[fh].size, HDD_BLOCK_READ); //read block data
-		
-		char *read_buff = malloc(hdd_files[fh].size); //create a read buff
-		HDD_CMD read_result = cmd_reader(hdd_client_operation(read_block, read_buff));
-		
-		//If read failed
-		if (read_result.r == 1){
-			free(read_buff); //free buff to prevent memory leak
-			return -1; 
-		}
-
-		//If block does not to be resized
-		if (hdd_files[fh].position + count < hdd_files[fh].size){
-			
-			memcpy(&read_buff[hdd_files[fh].position], data, count); //copy data from the seek position
-			//generate a block write command
-			HddBitCmd write_block = cmd_generator(hdd_files[fh].id, 0, 0, hdd_files[fh].size, HDD_BLOCK_OVERWRITE);
-			HDD_CMD check_write = cmd_reader(hdd_client_operation(write_block, read_buff));
-			
-			free(read_buff);
-
-			if (check_write.r == 1)
-				return -1;
-
-			hdd_files[fh].position += count;
-			return count;
-		}
-		else { //Need to allocate and expand the block. Then delete the old block
-			//Allocate a bigger write buffer and copy the old data into it
-			char *extend_write_buff = malloc(hdd_files[fh].position + count);
-			memcpy(extend_write_buff, read_buff, hdd_files[fh].size);
-           		memcpy(&extend_write_buff[hdd_files[fh].position], data, count);
-			
-			free(read_buff);
-			//generate block create command
-			HddBitCmd create_block = cmd_generator(0, 0, 0, hdd_files[fh].position + count, HDD_BLOCK_CREATE);
-			HDD_CMD create_result = cmd_reader(hdd_client_operation(create_block, extend_write_buff));
-			
-			free(extend_write_buff);
-			
-			if (create_result.r == 1)
-				return -1;
-			
-			//generate cmd to delete the old block
-			HddBitCmd old_block_delete = cmd_generator(hdd_files[fh].id, 0, 0, 0, HDD_BLOCK_DELETE); //generate block delete request. fileds: uint32_t block, uint8_t r, uint8_t flags, uint32_t block_size, uint8_t op
-			HDD_CMD delete_result = cmd_reader(hdd_client_operation(old_block_delete, NULL));
+	if (count == 0)
+		return 0;
 
-			if (delete_result.r == 1)
-				return -1;
-				
-			hdd_files[fh].size = hdd_files[fh].position + count;
-			hdd_files[fh].id = create_result.block; //New Block ID of the extended block
-			hdd_files[fh].position += count;
-			
-		
-			return count;
-		}
+	//Grow the file first if the write goes past its end
+	HDD_FILE *file = &hdd_files[fh];
+	if (file->position + count > file->size && hdd_extend_file(fh, file->position + count) == -1)
+		return -1;
 
+	//Copy into every extent overlapping the range
+	uint32_t done = 0, idx = hdd_find_extent(fh, file->position);
+	while (done < count){
+		if (hdd_extent_buffer(fh, idx) == -1)
+			return -1;
+		HDD_EXTENT *ext = &file->extents[idx];
+		uint32_t start = file->position + done - ext->offset;
+		uint32_t len = ext->size - start;
+		if (len > count - done)
+			len = count - done;
+		if (hdd_extent_store(fh, idx++, start, len, (char *) data + done) == -1)
+			return -1;
+		done += len;
 	}
+	file->position += count;
+	file->dirty += count;
+
+	//Write-through mode sends the extents right away (at the commit inside a batch),
+	//write-back bounds the unwritten data
+	if (hdd_durability == HDD_WRITE_THROUGH && hdd_batch_active())
+		hdd_batch_flush = 1;
+	else if ((hdd_durability == HDD_WRITE_THROUGH || file->dirty >= HDD_WRITEBACK_THRESHOLD) && hdd_flush(fh) == -1)
+		return -1;
+	return count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -532,7 +1373,7 @@ int32_t hdd_seek(int16_t fh, uint32_t loc) {
         	return -1;
 
 	//Check file handle
-	if (fh < 0 || fh > MAX_HDD_FILEDESCR)
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR)
 		return -1;
 	
 	//If file at fh is not opened 
@@ -540,13 +1381,267 @@ int32_t hdd_seek(int16_t fh, uint32_t loc) {
 		return -1;
 
 	//Check location value
-	if (loc < 0 || loc > hdd_files[fh].size) //NEW FEATURE IN ASSG4! FINALLY CAN STORE BLOCK SIZE!
+	if (loc > hdd_files[fh].size) //NEW FEATURE IN ASSG4! FINALLY CAN STORE BLOCK SIZE!
 		return -1;
 	//Set the seek position to loc
 	hdd_files[fh].position = loc;
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_flush
+// Description  : Writes the buffered extents of the file associated with fh back to
+//		  the device (one transfer per dirty extent for the whole burst of writes)
+// Inputs       : File handle fh
+// Outputs      : Returns 0 on success and -1 on failure
+//
+int16_t hdd_flush(int16_t fh) {
+	// Check if hdd is initialized
+	if (hdd_init == 0)
+		return -1;
+
+	//Check file handle
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR)
+		return -1;
+
+	return hdd_flush_files(fh, fh);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_export_files
+// Description  : Writes some files back to the device and gets their file table
+//		  records, so that another client (sharing the device) can add them to its
+//		  own file table with hdd_import_files
+// Inputs       : fhs - the file handles, count - how many, len - set to the length of the records
+// Outputs      : Returns the malloc'd records (a meta block image of just those files), or NULL on failure
+//
+char *hdd_export_files(int16_t *fhs, uint32_t count, uint32_t *len) {
+	HDD_META_HEADER header = { HDD_META_MAGIC, HDD_META_VERSION, 0, 0 };
+	uint32_t i, length = sizeof(HDD_META_HEADER);
+	char *image, *ptr;
+
+	// Check if hdd is initialized
+	if (hdd_init == 0)
+		return NULL;
+
+	//Every file must be named and on the device before it is described
+	for (i = 0; i < count; i++){
+		if (fhs[i] <= 0 || fhs[i] >= MAX_HDD_FILEDESCR || hdd_files[fhs[i]].name[0] == '\0' ||
+		    hdd_flush_files(fhs[i], fhs[i]) == -1)
+			return NULL;
+		header.files++;
+		header.extents += hdd_files[fhs[i]].extent_count;
+		length += hdd_meta_record_length(fhs[i]);
+	}
+	image = malloc(length);
+	if (image == NULL)
+		return NULL;
+
+	memcpy(image, &header, sizeof(HDD_META_HEADER));
+	ptr = image + sizeof(HDD_META_HEADER);
+	for (i = 0; i < count; i++)
+		ptr = hdd_meta_record_put(ptr, fhs[i]);
+	*len = length;
+	return image;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_meta_import_length
+// Description  : Computes the length the meta block would have once some files are
+//		  written in full (HDD_EXTENT_SIZE extents). Files already in the table
+//		  keep their records unless they are among them. Nothing is written.
+// Inputs       : names - the file names (unique), sizes - their sizes, count - how many
+// Outputs      : Returns the length of the meta block in bytes (above HDD_MAX_BLOCK_SIZE if it cannot be saved)
+//
+uint64_t hdd_meta_import_length(char **names, uint64_t *sizes, uint32_t count) {
+	uint64_t length = sizeof(HDD_META_HEADER);
+	uint32_t i;
+	int16_t fh;
+
+	//The files in the table now (none before a mount)
+	for (i = 1; i < MAX_HDD_FILEDESCR; i++){
+		if (hdd_files[i].name[0] != '\0')
+			length += hdd_meta_record_length(i);
+	}
+
+	//Each file replaces its record, if it has one
+	for (i = 0; i < count; i++){
+		if (hdd_name_index_ready && (fh = hdd_index_find(names[i])) != -1)
+			length -= hdd_meta_record_length(fh);
+		length += sizeof(uint8_t) + strlen(names[i]) + 2*sizeof(uint32_t) +
+			(sizes[i] + HDD_EXTENT_SIZE - 1) / HDD_EXTENT_SIZE * sizeof(HDD_META_EXTENT);
+	}
+	return length;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_import_files
+// Description  : Adds the files of records from hdd_export_files to the file table
+//		  (saved at unmount). A file of the same name is replaced, it must be closed.
+// Inputs       : image - the records, len - their length
+// Outputs      : Returns 0 on success and -1 on failure (records before the bad one are kept)
+//
+int hdd_import_files(char *image, uint32_t len) {
+	char name[MAX_FILENAME_LENGTH], *ptr, *end = image + len;
+	HDD_META_HEADER header;
+	uint32_t i, size, extents;
+	int16_t fh;
+
+	// Check if hdd is initialized
+	if (hdd_init == 0)
+		return -1;
+
+	//Check the header
+	if (len < sizeof(HDD_META_HEADER))
+		return -1;
+	memcpy(&header, image, sizeof(HDD_META_HEADER));
+	if (header.magic != HDD_META_MAGIC || header.version != HDD_META_VERSION)
+		return -1;
+
+	//Blocks written by the other client may be stale in the cache
+	clear_hdd_cache();
+	hdd_meta_dirty = 1;
+
+	ptr = image + sizeof(HDD_META_HEADER);
+	for (i = 0; i < header.files; i++){
+		ptr = hdd_meta_record_get(ptr, end, name, &size, &extents);
+		if (ptr == NULL)
+			return -1;
+
+		//Reuse the descriptor of the name, or take a new one
+		fh = hdd_index_find(name);
+		if (fh == -1 && (fh = hdd_file_create(name)) == -1)
+			return -1;
+		if (hdd_files[fh].open)
+			return -1;
+		hdd_file_release(fh);
+		hdd_files[fh].size = 0;
+		if (hdd_meta_record_load(fh, ptr, extents) == -1 || hdd_files[fh].size != size)
+			return -1;
+		ptr += extents*sizeof(HDD_META_EXTENT);
+	}
+	return (ptr == end) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_set_durability
+// Description  : Selects whether hdd_write buffers data per descriptor (write-back)
+//		  or sends every write to the device (write-through)
+// Inputs       : mode - HDD_WRITE_BACK or HDD_WRITE_THROUGH
+// Outputs      : Returns 0 on success and -1 on failure
+//
+int hdd_set_durability(HDD_DURABILITY_MODE mode) {
+	if (mode != HDD_WRITE_BACK && mode != HDD_WRITE_THROUGH)
+		return -1;
+
+	//Switching to write-through, nothing may stay buffered
+	if (mode == HDD_WRITE_THROUGH && hdd_init == 1 && hdd_flush_files(1, MAX_HDD_FILEDESCR-1) == -1)
+		return -1;
+	hdd_durability = mode;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_batch_begin
+// Description  : Groups the following operations until hdd_batch_commit: their
+//		  requests go to the device together. Device reads of hdd_read land
+//		  in the caller's buffer by the commit at the latest (the buffer has to
+//		  stay valid until then), write-through writes are flushed at the commit.
+//		  Servers without batch frames still get every operation right away.
+// Inputs       : None
+// Outputs      : Returns 0 on success and -1 on failure
+//
+int hdd_batch_begin(void) {
+	if (hdd_batching)
+		return -1;
+
+	hdd_batch_reads.head = hdd_batch_reads.count = 0;
+	hdd_batch_reads.failed = 0;
+	hdd_batch_flush = 0;
+	hdd_batching = 1;
+	return hdd_client_batch_begin();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_batch_commit
+// Description  : Completes the operations grouped since hdd_batch_begin
+// Inputs       : None
+// Outputs      : Returns 0 on success and -1 if any of the operations failed
+//
+int hdd_batch_commit(void) {
+	int failed;
+
+	if (!hdd_batching)
+		return -1;
+
+	//Finish the reads, then the deferred write-through flush (still batched)
+	while (hdd_batch_reads.count > 0)
+		hdd_fetch_complete(&hdd_batch_reads);
+	failed = hdd_batch_reads.failed;
+	if (hdd_batch_flush && hdd_init == 1 && hdd_flush_files(1, MAX_HDD_FILEDESCR-1) == -1)
+		failed = 1;
+
+	hdd_batching = 0;
+	hdd_batch_flush = 0;
+	if (hdd_client_batch_end() == -1)
+		failed = 1;
+	return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_unit_test_import
+// Description  : Export the records of a closed file, import them under another
+//                name and check that the copy reads the same (the copy shares
+//                the blocks of the file)
+//
+// Inputs       : fh - the file, copy - the name of the copy (as long as the file name)
+// Outputs      : 0 if successful or -1 if failure
+
+int hdd_unit_test_import(int16_t fh, char *copy) {
+	char *image, *original, *copied;
+	uint32_t len, size = hdd_files[fh].size;
+	int16_t cfh;
+	int ret = 0;
+
+	// Export the file and rename its record
+	image = hdd_export_files(&fh, 1, &len);
+	if ((image == NULL) || (strlen(copy) != strlen(hdd_files[fh].name))) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : export of %s failed.", hdd_files[fh].name);
+		free(image);
+		return(-1);
+	}
+	memcpy(image + sizeof(HDD_META_HEADER) + 1, copy, strlen(copy));
+
+	// Import it, a second import over the open copy is refused
+	if (hdd_import_files(image, len) || ((cfh = hdd_open(copy)) == -1) || (cfh == fh) ||
+	    (hdd_files[cfh].size != size) || (hdd_import_files(image, len) == 0)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : import of %s failed.", copy);
+		free(image);
+		return(-1);
+	}
+	free(image);
+
+	// Both read the same
+	original = malloc(size);
+	copied = malloc(size);
+	if ((hdd_open(hdd_files[fh].name) != fh) || (hdd_read(fh, original, size) != size) ||
+	    (hdd_read(cfh, copied, size) != size) || memcmp(original, copied, size) || hdd_close(fh) || hdd_close(cfh)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : imported %s differs from the original.", copy);
+		ret = -1;
+	}
+	free(original);
+	free(copied);
+	return(ret);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : hddIOUnitTest
@@ -559,7 +1654,7 @@ int hddIOUnitTest(void) {
 
 	// Local variables
 	uint8_t ch;
-	int16_t fh, i;
+	int16_t fh, i, handles[HDD_IO_UNIT_TEST_FILES];
 	int32_t cio_utest_length, cio_utest_position, count, bytes, expected;
 	char *cio_utest_buffer, *tbuf;
 	HDD_UNIT_TEST_TYPE cmd;
@@ -704,9 +1799,47 @@ int hddIOUnitTest(void) {
 		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure close close.", fh);
 		return(-1);
 	}
+
+	// Open a set of files, each name must keep its own descriptor
+	for (i=0; i<HDD_IO_UNIT_TEST_FILES; i++) {
+		snprintf(lstr, sizeof(lstr), "index_file_%d.txt", i);
+		handles[i] = hdd_open(lstr);
+		if ((handles[i] == -1) || (handles[i] == fh) || ((i > 0) && (handles[i] == handles[i-1]))) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : bad descriptor [%d] for %s.", handles[i], lstr);
+			return(-1);
+		}
+	}
+	for (i=HDD_IO_UNIT_TEST_FILES-1; i>=0; i--) {
+		snprintf(lstr, sizeof(lstr), "index_file_%d.txt", i);
+		if ((hdd_open(lstr) != handles[i]) || hdd_close(handles[i])) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : reopen of %s lost its descriptor.", lstr);
+			return(-1);
+		}
+	}
+	if (hdd_open("temp_file.txt") != fh || hdd_close(fh)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : reopen of temp_file.txt failed.");
+		return(-1);
+	}
+
+	// Remount, the name must still lead to the file contents
+	if (hdd_unmount() || hdd_mount()) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on remount operation.");
+		return(-1);
+	}
+	fh = hdd_open("temp_file.txt");
+	if ((fh == -1) || (hdd_read(fh, tbuf, cio_utest_length) != cio_utest_length) ||
+			(memcmp(tbuf, cio_utest_buffer, cio_utest_length) != 0) || hdd_close(fh)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : temp_file.txt differs after remount.");
+		return(-1);
+	}
 	free(cio_utest_buffer);
 	free(tbuf);
 
+	// Exported records import under another name as the same content, not over an open file
+	if (hdd_unit_test_import(fh, "temp_copy.txt")) {
+		return(-1);
+	}
+
 	// Format and mount the file system
 	if (hdd_unmount()) {
 		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on unmount operation.");
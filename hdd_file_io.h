@@ -20,6 +20,16 @@
 // Defines
 #define MAX_HDD_FILEDESCR 1024
 #define MAX_FILENAME_LENGTH 128
+#define HDD_WRITEBACK_THRESHOLD 0x100000 // Dirty bytes a descriptor absorbs before it is flushed
+#define HDD_EXTENT_SIZE 0x4000 // Largest extent a file grows by; files are lists of extents
+#define HDD_NAME_INDEX_BITS 10 // Width of the filename index table
+#define HDD_IO_PIPELINE_DEPTH 16 // Block requests a flush or read keeps in flight at once
+
+// These are the durability modes of hdd_write
+typedef enum {
+	HDD_WRITE_BACK    = 0, // Writes are buffered per descriptor until flush/close/unmount
+	HDD_WRITE_THROUGH = 1  // Every write goes to the device before hdd_write returns
+} HDD_DURABILITY_MODE;
 
 
 // Management operations
@@ -51,6 +61,27 @@ int32_t hdd_write(int16_t fd, void *buf, int32_t count);
 int32_t hdd_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int16_t hdd_flush(int16_t fd);
+	// Write any buffered data of the file back to the device
+
+int hdd_set_durability(HDD_DURABILITY_MODE mode);
+	// Select write-back or write-through behaviour for hdd_write
+
+int hdd_batch_begin(void);
+	// Group the following operations, their device requests are sent together
+
+int hdd_batch_commit(void);
+	// Complete the grouped operations (read buffers are filled by now)
+
+char *hdd_export_files(int16_t *fhs, uint32_t count, uint32_t *len);
+	// Write back some files and get their file table records, for another client sharing the device
+
+uint64_t hdd_meta_import_length(char **names, uint64_t *sizes, uint32_t count);
+	// Length of the file table once the named files are written to those sizes (too long above HDD_MAX_BLOCK_SIZE)
+
+int hdd_import_files(char *image, uint32_t len);
+	// Add the files of hdd_export_files records to the file table, replacing closed files of the same name
+
 //
 // Unit testing for the module
 
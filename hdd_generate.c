@@ -0,0 +1,519 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_generate.c
+//  Description    : This is the implementation of the synthetic workload
+//                   generator.  It keeps the size and position of every file
+//                   as the simulator will see them, so each operation it
+//                   draws can be made valid before it is written out.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Project Includes
+#include <hdd_generate.h>
+#include <hdd_file_io.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_GENERATE_MAX_SIZE 0x100000 // Largest READ/WRITE/WRITEAT of a spec
+#define HDD_GENERATE_MAX_FILE 0x7fffffff // Largest file, offsets are ints in the workload
+#define HDD_GENERATE_BUFFER 0x100000 // Bytes of output buffered between writes
+#define HDD_GENERATE_UNIT_TEST_FILES 200 // More than HDD_GENERATE_MAX_OPEN, to remount
+#define HDD_GENERATE_UNIT_TEST_OPS 20000
+
+// The state of a generation
+typedef struct {
+	uint64_t  rng;       // State of the random number generator
+	double   *cdf;       // Cumulative popularity of the files
+	uint64_t *size;      // Bytes in each file
+	uint64_t *pos;       // Position in each open file
+	char     *open;      // 1 if the file is open
+	uint32_t  nopen;     // Files open since the last mount
+	char     *text;      // Random text payloads are cut from
+	FILE     *out;       // The workload being written
+} HDD_GENERATE_STATE;
+
+// The names of the commands, in HDD_GENERATE_COMMANDS order
+static const char *hdd_generate_names[HDD_GENERATE_COMMANDS] = { "READ", "WRITE", "WRITEAT", "SEEK" };
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_random
+// Description  : Get the next random number of a generation (xorshift64*,
+//                so a seed always gives the same workload)
+//
+// Inputs       : state - the generation
+// Outputs      : 64 random bits
+
+static uint64_t hdd_generate_random(HDD_GENERATE_STATE *state) {
+	state->rng ^= state->rng >> 12;
+	state->rng ^= state->rng << 25;
+	state->rng ^= state->rng >> 27;
+	return(state->rng * 0x2545f4914f6cdd1dULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_uniform
+// Description  : Get a random number in a range
+//
+// Inputs       : state - the generation
+//                min, max - the range (inclusive)
+// Outputs      : the number
+
+static uint64_t hdd_generate_uniform(HDD_GENERATE_STATE *state, uint64_t min, uint64_t max) {
+	return(min + hdd_generate_random(state) % (max - min + 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_real
+// Description  : Get a random number in [0, 1)
+//
+// Inputs       : state - the generation
+// Outputs      : the number
+
+static double hdd_generate_real(HDD_GENERATE_STATE *state) {
+	return((hdd_generate_random(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_file
+// Description  : Pick a file by its popularity
+//
+// Inputs       : state - the generation
+//                spec - the spec
+// Outputs      : the file index
+
+static uint32_t hdd_generate_file(HDD_GENERATE_STATE *state, HDD_GENERATE_SPEC *spec) {
+	double u = hdd_generate_real(state) * state->cdf[spec->files-1];
+	uint32_t lo = 0, hi = spec->files - 1, mid;
+
+	// The first file whose cumulative popularity is above the draw
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (state->cdf[mid] > u)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return(lo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_size
+// Description  : Pick the length of a read or write
+//
+// Inputs       : state - the generation
+//                spec - the spec
+// Outputs      : the length
+
+static uint32_t hdd_generate_size(HDD_GENERATE_STATE *state, HDD_GENERATE_SPEC *spec) {
+	double lo, hi;
+	uint32_t size;
+
+	if (!spec->size_log)
+		return((uint32_t) hdd_generate_uniform(state, spec->size_min, spec->size_max));
+
+	// Uniform over the logarithms of the range
+	lo = log(spec->size_min);
+	hi = log(spec->size_max + 1.0);
+	size = (uint32_t) exp(lo + (hi - lo) * hdd_generate_real(state));
+	return((size < spec->size_min) ? spec->size_min : ((size > spec->size_max) ? spec->size_max : size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_command
+// Description  : Pick a command by the weights of the mix
+//
+// Inputs       : state - the generation
+//                spec - the spec
+// Outputs      : the HDD_GENERATE_COMMAND value
+
+static int hdd_generate_command(HDD_GENERATE_STATE *state, HDD_GENERATE_SPEC *spec) {
+	uint64_t total = 0, draw;
+	int i;
+
+	for (i=0; i<HDD_GENERATE_COMMANDS; i++)
+		total += spec->mix[i];
+	draw = hdd_generate_uniform(state, 0, total - 1);
+	for (i=0; i<HDD_GENERATE_COMMANDS-1; i++) {
+		if (draw < spec->mix[i])
+			break;
+		draw -= spec->mix[i];
+	}
+	return(i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_line
+// Description  : Write a line of the workload (file operations move the
+//                position and size of the file as the simulator will)
+//
+// Inputs       : state - the generation
+//                file - the file index
+//                command - the HDD_GENERATE_COMMAND value
+//                len - the length of a read or write
+//                off - the offset of a seek or WRITEAT
+// Outputs      : none
+
+static void hdd_generate_line(HDD_GENERATE_STATE *state, uint32_t file, int command, uint32_t len, uint64_t off) {
+	const char *text = "";
+
+	switch (command) {
+	case HDD_GENERATE_SEEK:
+		state->pos[file] = off;
+		len = 0;
+		break;
+	case HDD_GENERATE_WRITEAT:
+		state->pos[file] = off;
+		// Fall through
+	case HDD_GENERATE_WRITE:
+		text = state->text + hdd_generate_uniform(state, 0, HDD_GENERATE_TEXT - 1);
+		state->pos[file] += len;
+		if (state->pos[file] > state->size[file])
+			state->size[file] = state->pos[file];
+		break;
+	default: // HDD_GENERATE_READ
+		state->pos[file] += len;
+		break;
+	}
+	if ((command == HDD_GENERATE_READ) || (command == HDD_GENERATE_WRITE))
+		off = 0;
+	fprintf(state->out, "gen%04u.dat %s %u %lu :", file, hdd_generate_names[command], len, (unsigned long) off);
+	fwrite(text, 1, (command == HDD_GENERATE_READ) ? 0 : len, state->out);
+	fputc('\n', state->out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_op
+// Description  : Write one operation of the mix, with the seeks and remount
+//                it needs to be valid
+//
+// Inputs       : state - the generation
+//                spec - the spec
+// Outputs      : none
+
+static void hdd_generate_op(HDD_GENERATE_STATE *state, HDD_GENERATE_SPEC *spec) {
+	uint32_t file = hdd_generate_file(state, spec), len, i;
+	int command = hdd_generate_command(state, spec);
+	int random = (hdd_generate_uniform(state, 1, 100) <= spec->random);
+
+	// A file past the simulator's open files waits for them all to be closed
+	if (!state->open[file]) {
+		if (state->nopen == HDD_GENERATE_MAX_OPEN) {
+			fprintf(state->out, "x UNMOUNT 0 0:\nx MOUNT 0 0:\n");
+			for (i=0; i<spec->files; i++) {
+				state->open[i] = 0;
+				state->pos[i] = 0;
+			}
+			state->nopen = 0;
+		}
+		state->open[file] = 1;
+		state->nopen++;
+	}
+
+	// Nothing to read in an empty file, write it instead
+	if ((command == HDD_GENERATE_READ) && (state->size[file] == 0))
+		command = HDD_GENERATE_WRITE;
+	len = hdd_generate_size(state, spec);
+
+	switch (command) {
+	case HDD_GENERATE_READ:
+		// Read from a random place, or go on reading (from the start at the end)
+		if (random)
+			hdd_generate_line(state, file, HDD_GENERATE_SEEK, 0, hdd_generate_uniform(state, 0, state->size[file] - 1));
+		else if (state->pos[file] == state->size[file])
+			hdd_generate_line(state, file, HDD_GENERATE_SEEK, 0, 0);
+		if (len > state->size[file] - state->pos[file])
+			len = state->size[file] - state->pos[file];
+		hdd_generate_line(state, file, HDD_GENERATE_READ, len, 0);
+		break;
+
+	case HDD_GENERATE_WRITE:
+		// Write at a random place, or go on writing (from the start when full)
+		if (random)
+			hdd_generate_line(state, file, HDD_GENERATE_SEEK, 0, hdd_generate_uniform(state, 0, state->size[file]));
+		if (state->pos[file] + len > HDD_GENERATE_MAX_FILE)
+			hdd_generate_line(state, file, HDD_GENERATE_SEEK, 0, 0);
+		hdd_generate_line(state, file, HDD_GENERATE_WRITE, len, 0);
+		break;
+
+	case HDD_GENERATE_WRITEAT:
+		// Overwrite a random place, or append
+		hdd_generate_line(state, file, HDD_GENERATE_WRITEAT, len,
+				(state->size[file] + len > HDD_GENERATE_MAX_FILE) ? 0 :
+				(random ? hdd_generate_uniform(state, 0, state->size[file]) : state->size[file]));
+		break;
+
+	default: // HDD_GENERATE_SEEK
+		hdd_generate_line(state, file, HDD_GENERATE_SEEK, 0, hdd_generate_uniform(state, 0, state->size[file]));
+		break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_parse
+// Description  : Fill a spec from its text (keys not given keep their
+//                defaults)
+//
+// Inputs       : text - the spec text ("key=value,..."), NULL for the defaults
+//                spec - the spec to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_generate_parse(const char *text, HDD_GENERATE_SPEC *spec) {
+	char *copy, *pair, *save, *value;
+	unsigned long long number;
+	int ok = 1;
+
+	// The defaults
+	memset(spec, 0, sizeof(HDD_GENERATE_SPEC));
+	spec->files = 100;
+	spec->ops = 100000;
+	spec->zipf = 0.99;
+	spec->size_min = 1;
+	spec->size_max = 4096;
+	spec->size_log = 1;
+	spec->mix[HDD_GENERATE_READ] = 50;
+	spec->mix[HDD_GENERATE_WRITE] = 30;
+	spec->mix[HDD_GENERATE_WRITEAT] = 10;
+	spec->mix[HDD_GENERATE_SEEK] = 10;
+	spec->random = 50;
+	spec->seed = 1;
+	if (text == NULL)
+		return(0);
+
+	// Walk the key=value pairs
+	copy = strdup(text);
+	for (pair = strtok_r(copy, ",", &save); ok && (pair != NULL); pair = strtok_r(NULL, ",", &save)) {
+		if ((value = strchr(pair, '=')) == NULL) {
+			ok = 0;
+			break;
+		}
+		*value++ = '\0';
+		if (strcmp(pair, "files") == 0)
+			ok = (sscanf(value, "%u", &spec->files) == 1);
+		else if (strcmp(pair, "ops") == 0)
+			ok = (sscanf(value, "%llu", &number) == 1) && ((spec->ops = number) == number);
+		else if (strcmp(pair, "zipf") == 0)
+			ok = (sscanf(value, "%lf", &spec->zipf) == 1);
+		else if (strcmp(pair, "size") == 0)
+			ok = (sscanf(value, "%u:%u", &spec->size_min, &spec->size_max) == 2);
+		else if (strcmp(pair, "sizes") == 0)
+			ok = ((spec->size_log = (strcmp(value, "log") == 0)) || (strcmp(value, "uniform") == 0));
+		else if (strcmp(pair, "mix") == 0)
+			ok = (sscanf(value, "%u:%u:%u:%u", &spec->mix[0], &spec->mix[1], &spec->mix[2], &spec->mix[3]) == 4);
+		else if (strcmp(pair, "random") == 0)
+			ok = (sscanf(value, "%u", &spec->random) == 1);
+		else if (strcmp(pair, "seed") == 0)
+			ok = (sscanf(value, "%llu", &number) == 1) && ((spec->seed = number) == number);
+		else
+			ok = 0;
+	}
+	free(copy);
+	if (!ok) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE : bad workload spec [%s].", text);
+		return(-1);
+	}
+
+	// Check the values fit the simulator
+	if ((spec->files == 0) || (spec->files >= MAX_HDD_FILEDESCR) || (spec->ops == 0) || (spec->zipf < 0) ||
+	    (spec->size_min == 0) || (spec->size_min > spec->size_max) || (spec->size_max > HDD_GENERATE_MAX_SIZE) ||
+	    ((uint64_t) spec->mix[0] + spec->mix[1] + spec->mix[2] + spec->mix[3] == 0) || (spec->random > 100)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE : workload spec [%s] out of range (files 1-%d, sizes 1-%d).",
+				text, MAX_HDD_FILEDESCR - 1, HDD_GENERATE_MAX_SIZE);
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_generate_workload
+// Description  : Write the workload of a spec to a file
+//
+// Inputs       : spec - the spec
+//                path - the workload file
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_generate_workload(HDD_GENERATE_SPEC *spec, const char *path) {
+	static const char letters[] = "abcdefghijklmnopqrstuvwxyz    ";
+	HDD_GENERATE_STATE state;
+	uint64_t op;
+	uint32_t i;
+	int ret;
+
+	// Setup the files, their popularity and the text
+	memset(&state, 0, sizeof(HDD_GENERATE_STATE));
+	state.rng = spec->seed ^ 0x9e3779b97f4a7c15ULL;
+	if (state.rng == 0)
+		state.rng = 1;
+	if ((state.out = fopen(path, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE : unable to create workload [%s].", path);
+		return(-1);
+	}
+	setvbuf(state.out, NULL, _IOFBF, HDD_GENERATE_BUFFER);
+	state.cdf = malloc(sizeof(double) * spec->files);
+	state.size = calloc(spec->files, sizeof(uint64_t));
+	state.pos = calloc(spec->files, sizeof(uint64_t));
+	state.open = calloc(spec->files, 1);
+	state.text = malloc(HDD_GENERATE_TEXT + spec->size_max);
+	for (i=0; i<spec->files; i++)
+		state.cdf[i] = ((i > 0) ? state.cdf[i-1] : 0) + pow(i + 1.0, -spec->zipf);
+	for (i=0; i<HDD_GENERATE_TEXT + spec->size_max; i++)
+		state.text[i] = letters[hdd_generate_uniform(&state, 0, sizeof(letters) - 2)];
+
+	// Format and mount the device, run the mix and unmount
+	fprintf(state.out, "x FORMAT 0 0:\nx MOUNT 0 0:\n");
+	for (op=0; op<spec->ops; op++)
+		hdd_generate_op(&state, spec);
+	fprintf(state.out, "x UNMOUNT 0 0:\n");
+	ret = (ferror(state.out) | fclose(state.out)) ? -1 : 0;
+	if (ret)
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE : unable to write workload [%s].", path);
+
+	// Cleanup and return
+	free(state.cdf);
+	free(state.size);
+	free(state.pos);
+	free(state.open);
+	free(state.text);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddGenerateUnitTest
+// Description  : Perform a test of the generator: a workload over more files
+//                than can be open is replayed against a model of the files,
+//                every line must be valid there, and popular files must get
+//                more operations
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddGenerateUnitTest(void) {
+	static const char *bad[] = { "files=0", "files=5000", "size=10:5", "mix=0:0:0:0", "random=101", "color=red", "ops" };
+	char path[] = "/tmp/hdd_generate_XXXXXX", fname[MAX_FILENAME_LENGTH], cmd[16], *line = NULL, *text;
+	uint64_t size[HDD_GENERATE_UNIT_TEST_FILES] = { 0 }, pos[HDD_GENERATE_UNIT_TEST_FILES] = { 0 };
+	uint32_t count[HDD_GENERATE_UNIT_TEST_FILES] = { 0 }, nopen = 0, file, len, off, linecount = 0, i;
+	char open[HDD_GENERATE_UNIT_TEST_FILES] = { 0 };
+	HDD_GENERATE_SPEC spec;
+	size_t cap = 0;
+	ssize_t got;
+	FILE *in;
+	int fd, ok = 1, mounted = 0;
+
+	// Bad specs are refused
+	for (i=0; i<sizeof(bad)/sizeof(bad[0]); i++) {
+		if (hdd_generate_parse(bad[i], &spec) == 0) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE_UNIT_TEST : bad spec [%s] accepted.", bad[i]);
+			return(-1);
+		}
+	}
+
+	// Generate a workload
+	if (hdd_generate_parse("files=200,ops=20000,zipf=1.1,size=1:3000,sizes=log,mix=40:30:15:15,random=50,seed=7", &spec) ||
+	    (spec.files != HDD_GENERATE_UNIT_TEST_FILES) || (spec.ops != HDD_GENERATE_UNIT_TEST_OPS) || !spec.size_log) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE_UNIT_TEST : good spec not parsed.");
+		return(-1);
+	}
+	if ((fd = mkstemp(path)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE_UNIT_TEST : unable to create a workload file.");
+		return(-1);
+	}
+	close(fd);
+	if (hdd_generate_workload(&spec, path) || ((in = fopen(path, "r")) == NULL)) {
+		unlink(path);
+		return(-1);
+	}
+
+	// Replay it against the model, line by line
+	while (ok && ((got = getline(&line, &cap, in)) > 0)) {
+		linecount++;
+		if (((text = strchr(line, ':')) == NULL) || (line[got-1] != '\n') ||
+		    (sscanf(line, "%127s %15s %u %u", fname, cmd, &len, &off) != 4)) {
+			ok = 0;
+			break;
+		}
+		text++;
+		if (strcmp(fname, "x") == 0) {
+			// Mounts close every file, and come in order
+			if (strcmp(cmd, "MOUNT") == 0)
+				ok = !mounted;
+			else if (strcmp(cmd, "UNMOUNT") == 0)
+				ok = mounted;
+			else
+				ok = (strcmp(cmd, "FORMAT") == 0) && (linecount == 1);
+			mounted = (strcmp(cmd, "MOUNT") == 0) || ((strcmp(cmd, "FORMAT") == 0) && mounted);
+			memset(open, 0, sizeof(open));
+			memset(pos, 0, sizeof(pos));
+			nopen = 0;
+			continue;
+		}
+		if (!mounted || (sscanf(fname, "gen%u.dat", &file) != 1) || (file >= HDD_GENERATE_UNIT_TEST_FILES)) {
+			ok = 0;
+			break;
+		}
+		if (!open[file]) {
+			open[file] = 1;
+			nopen++;
+		}
+		ok = (nopen <= HDD_GENERATE_MAX_OPEN);
+		if (strcmp(cmd, "READ") == 0) {
+			ok = ok && (len > 0) && (pos[file] + len <= size[file]) && (text == line + got - 1);
+			pos[file] += len;
+		} else if (strcmp(cmd, "SEEK") == 0) {
+			ok = ok && (len == 0) && (off <= size[file]);
+			pos[file] = off;
+		} else {
+			// Payloads are the length given, without line breaks
+			if (strcmp(cmd, "WRITEAT") == 0) {
+				ok = ok && (off <= size[file]);
+				pos[file] = off;
+			} else {
+				ok = ok && (strcmp(cmd, "WRITE") == 0);
+			}
+			ok = ok && (len >= spec.size_min) && (len <= spec.size_max) && (text + len == line + got - 1) &&
+					(memchr(text, '*', len) == NULL);
+			pos[file] += len;
+			if (pos[file] > size[file])
+				size[file] = pos[file];
+		}
+		count[file]++;
+	}
+	free(line);
+	fclose(in);
+	unlink(path);
+	if (!ok || mounted) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE_UNIT_TEST : invalid workload at line %u.", linecount);
+		return(-1);
+	}
+
+	// Popular files see more of the operations
+	if (count[0] <= 10 * count[HDD_GENERATE_UNIT_TEST_FILES-1] || count[0] <= count[1]) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_GENERATE_UNIT_TEST : popularity not skewed (%u, %u, %u).",
+				count[0], count[1], count[HDD_GENERATE_UNIT_TEST_FILES-1]);
+		return(-1);
+	}
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "HDD_GENERATE_UNIT_TEST : generator unit test completed successfully.");
+	return(0);
+}
@@ -0,0 +1,73 @@
+#ifndef HDD_GENERATE_INCLUDED
+#define HDD_GENERATE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_generate.h
+//  Description    : This is the header file for the synthetic workload
+//                   generator.  It writes workloads in the format of the
+//                   checked-in ones ("<file> <command> <len> <off> :<text>")
+//                   from a spec of comma separated key=value pairs:
+//
+//                     files=<n>          files the operations go to
+//                     ops=<n>            file operations to generate
+//                     zipf=<s>           skew of file popularity (0 is uniform)
+//                     size=<min>:<max>   bytes of a READ, WRITE or WRITEAT
+//                     sizes=uniform|log  how sizes spread over that range
+//                     mix=<r>:<w>:<a>:<s> weights of READ, WRITE, WRITEAT, SEEK
+//                     random=<pct>       share of reads/writes at a random offset
+//                     seed=<n>           seed of the generator (same seed, same workload)
+//
+//                   Every operation is valid when replayed: reads stay within
+//                   the file, seeks and WRITEATs within its size, and the
+//                   files are remounted before the simulator's table of open
+//                   files would overflow.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define HDD_GENERATE_MAX_OPEN 128 // Files the simulator keeps open between mounts (HDD_SIM_MAX_OPEN_FILES)
+#define HDD_GENERATE_TEXT 0x10000 // Bytes of random text payloads are cut from (plus the largest size)
+
+// Commands of the mix, in spec order
+typedef enum {
+	HDD_GENERATE_READ    = 0,
+	HDD_GENERATE_WRITE   = 1,
+	HDD_GENERATE_WRITEAT = 2,
+	HDD_GENERATE_SEEK    = 3,
+	HDD_GENERATE_COMMANDS = 4,
+} HDD_GENERATE_COMMAND;
+
+// What to generate
+typedef struct {
+	uint32_t files;     // Files the operations go to
+	uint64_t ops;       // Operations drawn from the mix (the seeks and remounts they need come on top)
+	double   zipf;      // Skew of file popularity, file i is picked in proportion to 1/(i+1)^zipf
+	uint32_t size_min;  // Smallest READ/WRITE/WRITEAT
+	uint32_t size_max;  // Largest READ/WRITE/WRITEAT
+	int      size_log;  // 1 if sizes are log-uniform (mostly small), 0 if uniform
+	uint32_t mix[HDD_GENERATE_COMMANDS]; // Weights of the commands
+	uint32_t random;    // Percent of reads and writes after a seek to a random offset
+	uint64_t seed;      // Seed of the generator
+} HDD_GENERATE_SPEC;
+
+//
+// Generator interface
+
+int hdd_generate_parse(const char *text, HDD_GENERATE_SPEC *spec);
+	// Fill a spec from its text (keys not given keep their defaults)
+
+int hdd_generate_workload(HDD_GENERATE_SPEC *spec, const char *path);
+	// Write the workload of a spec to a file
+
+//
+// Unit testing for the module
+
+int hddGenerateUnitTest(void);
+	// Perform a test of the generator
+
+#endif
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_histogram.c
+//  Description    : This is the implementation of the log-linear latency
+//                   histograms.  Values below HDD_HISTOGRAM_SUB have a bucket
+//                   each; above that, the bucket of a value is its power of
+//                   two and its next HDD_HISTOGRAM_SUB_BITS bits.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <hdd_histogram.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_HISTOGRAM_UNIT_TEST_VALUES 20000
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_index
+// Description  : Get the bucket of a value
+//
+// Inputs       : value - the value
+// Outputs      : the bucket index
+
+static uint32_t hdd_histogram_index(uint64_t value) {
+	uint32_t msb, shift;
+
+	if (value < HDD_HISTOGRAM_SUB)
+		return(value);
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= HDD_HISTOGRAM_MAX_BITS)
+		return(HDD_HISTOGRAM_BUCKETS - 1);
+
+	// Keep the top bit and the sub-bucket bits under it
+	shift = msb - HDD_HISTOGRAM_SUB_BITS;
+	return((shift + 1) * HDD_HISTOGRAM_SUB + (uint32_t) (value >> shift) - HDD_HISTOGRAM_SUB);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_top
+// Description  : Get the largest value of a bucket
+//
+// Inputs       : idx - the bucket index
+// Outputs      : the value
+
+static uint64_t hdd_histogram_top(uint32_t idx) {
+	uint32_t shift;
+
+	if (idx < HDD_HISTOGRAM_SUB)
+		return(idx);
+	shift = idx / HDD_HISTOGRAM_SUB - 1;
+	return((((uint64_t) HDD_HISTOGRAM_SUB + idx % HDD_HISTOGRAM_SUB + 1) << shift) - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_init
+// Description  : Empty a histogram
+//
+// Inputs       : hist - the histogram
+// Outputs      : none
+
+void hdd_histogram_init(HDD_HISTOGRAM *hist) {
+	memset(hist, 0, sizeof(HDD_HISTOGRAM));
+	hist->min = UINT64_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_record
+// Description  : Add a value to a histogram
+//
+// Inputs       : hist - the histogram
+//                value - the value
+// Outputs      : none
+
+void hdd_histogram_record(HDD_HISTOGRAM *hist, uint64_t value) {
+	hist->buckets[hdd_histogram_index(value)]++;
+	hist->count++;
+	hist->total += value;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_percentile
+// Description  : Get the value below which a share of the values are
+//
+// Inputs       : hist - the histogram
+//                percentile - the share (0 to 100)
+// Outputs      : the top of the bucket that holds it (at most the largest
+//                value), 0 if the histogram is empty
+
+uint64_t hdd_histogram_percentile(HDD_HISTOGRAM *hist, double percentile) {
+	uint64_t rank, seen = 0, top;
+	uint32_t i;
+
+	if (hist->count == 0)
+		return(0);
+
+	// The rank of the value, counting from 1
+	rank = (uint64_t) (percentile / 100.0 * hist->count + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > hist->count)
+		rank = hist->count;
+
+	// Walk the buckets up to it
+	for (i=0; i<HDD_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	top = hdd_histogram_top(i);
+	return((top < hist->max) ? top : hist->max);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_histogram_compare
+// Description  : Order two values for qsort
+//
+// Inputs       : a, b - the values
+// Outputs      : -1, 0 or 1
+
+static int hdd_histogram_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return((x > y) - (x < y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddHistogramUnitTest
+// Description  : Perform a test of the histograms: every value falls in a
+//                bucket no wider than 1/HDD_HISTOGRAM_SUB of it, and the
+//                percentiles of random values are within that of the exact
+//                ones
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddHistogramUnitTest(void) {
+	static const double percentiles[] = { 0, 50, 90, 99, 99.9, 100 };
+	HDD_HISTOGRAM hist;
+	uint64_t *values, value, exact, got, last = 0;
+	uint32_t i, idx, bits;
+
+	// Buckets are in value order and tight around their values
+	for (bits=0; bits<HDD_HISTOGRAM_MAX_BITS; bits++) {
+		for (i=0; i<64; i++) {
+			value = ((uint64_t) getRandomValue(0, UINT32_MAX-1) << 32) | getRandomValue(0, UINT32_MAX-1);
+			value = ((uint64_t) 1 << bits) | (value & (((uint64_t) 1 << bits) - 1));
+			idx = hdd_histogram_index(value);
+			if ((hdd_histogram_top(idx) < value) || (idx > 0 && hdd_histogram_top(idx-1) >= value) ||
+			    (hdd_histogram_top(idx) - value > value / HDD_HISTOGRAM_SUB)) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : value %lu in bad bucket %u.", (unsigned long) value, idx);
+				return(-1);
+			}
+		}
+	}
+	for (idx=0; idx<HDD_HISTOGRAM_BUCKETS; idx++) {
+		if ((idx > 0 && hdd_histogram_top(idx) <= last) || hdd_histogram_index(hdd_histogram_top(idx)) != idx) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : bucket %u out of order.", idx);
+			return(-1);
+		}
+		last = hdd_histogram_top(idx);
+	}
+
+	// Random values over many powers of two, against the sorted values
+	values = malloc(sizeof(uint64_t) * HDD_HISTOGRAM_UNIT_TEST_VALUES);
+	hdd_histogram_init(&hist);
+	for (i=0; i<HDD_HISTOGRAM_UNIT_TEST_VALUES; i++) {
+		bits = getRandomValue(0, 32);
+		values[i] = (bits == 32) ? getRandomValue(0, UINT32_MAX-1) : getRandomValue(0, ((uint32_t) 1 << bits) - 1);
+		hdd_histogram_record(&hist, values[i]);
+	}
+	qsort(values, HDD_HISTOGRAM_UNIT_TEST_VALUES, sizeof(uint64_t), hdd_histogram_compare);
+	for (i=0; i<sizeof(percentiles)/sizeof(percentiles[0]); i++) {
+		idx = (uint32_t) (percentiles[i] / 100.0 * HDD_HISTOGRAM_UNIT_TEST_VALUES + 0.999999);
+		exact = values[(idx > 0) ? idx-1 : 0];
+		got = hdd_histogram_percentile(&hist, percentiles[i]);
+		if ((got < exact) || (got - exact > exact / HDD_HISTOGRAM_SUB)) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : p%.1f is %lu, expected %lu.",
+					percentiles[i], (unsigned long) got, (unsigned long) exact);
+			free(values);
+			return(-1);
+		}
+	}
+	if ((hist.count != HDD_HISTOGRAM_UNIT_TEST_VALUES) || (hist.min != values[0]) ||
+	    (hist.max != values[HDD_HISTOGRAM_UNIT_TEST_VALUES-1])) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : bad count or range.");
+		free(values);
+		return(-1);
+	}
+	free(values);
+
+	// An empty histogram has nothing to report
+	hdd_histogram_init(&hist);
+	if (hdd_histogram_percentile(&hist, 50) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : empty histogram has values.");
+		return(-1);
+	}
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "HDD_HISTOGRAM_UNIT_TEST : histogram unit test completed successfully.");
+	return(0);
+}
@@ -0,0 +1,53 @@
+#ifndef HDD_HISTOGRAM_INCLUDED
+#define HDD_HISTOGRAM_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_histogram.h
+//  Description    : This is the header file for the latency histograms of the
+//                   load generator.  Buckets are log-linear (HDR style):
+//                   each power of two is split into the same number of
+//                   linear sub-buckets, so a value is kept to within
+//                   1/HDD_HISTOGRAM_SUB of itself from nanoseconds to
+//                   minutes in a fixed, small array.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define HDD_HISTOGRAM_SUB_BITS 6 // Linear sub-buckets per power of two (2^bits)
+#define HDD_HISTOGRAM_SUB (1 << HDD_HISTOGRAM_SUB_BITS)
+#define HDD_HISTOGRAM_MAX_BITS 40 // Values from 2^bits up share the last bucket (about 18 minutes of ns)
+#define HDD_HISTOGRAM_BUCKETS ((HDD_HISTOGRAM_MAX_BITS - HDD_HISTOGRAM_SUB_BITS + 1) * HDD_HISTOGRAM_SUB)
+
+// A histogram of values (nanoseconds for latencies)
+typedef struct {
+	uint64_t count;  // Values recorded
+	uint64_t min;    // Smallest value (exact)
+	uint64_t max;    // Largest value (exact)
+	uint64_t total;  // Sum of the values, for the mean
+	uint64_t buckets[HDD_HISTOGRAM_BUCKETS];
+} HDD_HISTOGRAM;
+
+//
+// Histogram interface
+
+void hdd_histogram_init(HDD_HISTOGRAM *hist);
+	// Empty a histogram
+
+void hdd_histogram_record(HDD_HISTOGRAM *hist, uint64_t value);
+	// Add a value
+
+uint64_t hdd_histogram_percentile(HDD_HISTOGRAM *hist, double percentile);
+	// Get the value below which percentile % of the values are (the top of its bucket, at most max)
+
+//
+// Unit testing for the module
+
+int hddHistogramUnitTest(void);
+	// Perform a test of the histograms
+
+#endif
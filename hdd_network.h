@@ -16,23 +16,62 @@
 #include <hdd_driver.h>
 
 // Defines
-#define HDD_MAX_BACKLOG 5
+#define HDD_MAX_BACKLOG 128
 #define HDD_NET_HEADER_SIZE sizeof(HddBitResp)
 #define HDD_DEFAULT_IP "127.0.0.1"
 #define HDD_DEFAULT_PORT 19876
+#define HDD_SERVER_WORKERS 4 // Default size of the server worker pool
+
+// Server capabilities, returned in the Block field of the INIT response
+// (servers without extensions return 0 and only get whole-block commands)
+#define HDD_CAP_RANGE_READ 0x1  // READ with HDD_BLOCK_RANGE returns part of a block
+#define HDD_CAP_RANGE_WRITE 0x2 // OVERWRITE with HDD_BLOCK_RANGE/HDD_BLOCK_APPEND patches or grows a block
+#define HDD_CAP_TAGS 0x4        // Commands and responses carry a tag word once enabled with HDD_OPTIONS
+#define HDD_CAP_BATCH 0x8       // Commands can be sent in one batch frame, answered by one frame
+#define HDD_SERVER_CAPABILITIES (HDD_CAP_RANGE_READ|HDD_CAP_RANGE_WRITE|HDD_CAP_TAGS|HDD_CAP_BATCH)
+#define HDD_SERVER_OPTIONS (HDD_CAP_TAGS) // Capabilities a connection has to switch on with HDD_OPTIONS
+
+// Pipelined requests
+#define HDD_CLIENT_MAX_INFLIGHT 64 // Requests outstanding (in flight or unclaimed) per connection
+#define HDD_CLIENT_SYNC_TAG 0      // Tag reserved for hdd_client_operation
+#define HDD_BATCH_MAX_BYTES 0x400000 // Largest batch frame body
 
 //
 // Functional Prototypes
 HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf);
     // This is the implementation of the client operation (hdd_client.c)
 
+HddBitResp hdd_client_range_operation(HddBitCmd cmd, uint32_t offset, void *buf);
+    // Client operation on the byte range at offset of a block (HDD_BLOCK_RANGE commands)
+
+int hdd_client_submit(HddBitCmd cmd, uint32_t offset, void *buf, uint32_t tag);
+    // Send a request without waiting, completed later by its (non-zero) tag
+
+int hdd_client_poll(uint32_t tag, HddBitResp *resp);
+    // Check a submitted request without blocking: 1 done, 0 in flight, -1 failure
+
+int hdd_client_wait(uint32_t tag, HddBitResp *resp);
+    // Wait for a submitted request to complete, 0 when answered, -1 on failure
+
+int hdd_client_batch_begin(void);
+    // Hold submitted requests to send them together (one batch frame)
+
+int hdd_client_batch_end(void);
+    // Send the held requests, stop holding new ones
+
 int hdd_server( void );
     // This is the implementation of the server application (hdd_server.c)
 
+HddBitResp hdd_server_execute(HddBitCmd cmd, uint32_t offset, void *buf);
+    // Execute one command against the store of this process (hdd_server.c)
+
 //
 // Network Global Data
 extern int            hdd_network_shutdown; // Flag indicating shutdown
 extern unsigned char *hdd_network_address;  // Address of HDD server 
 extern unsigned short hdd_network_port;     // Port of HDD server
+extern uint32_t       hdd_server_capabilities; // HDD_CAP_* bits advertised by the server
+extern int            hdd_server_workers;     // Worker threads of the server
+extern int            hdd_network_transport;  // HDD_TRANSPORT_TYPES the client uses (hdd_transport.h)
 
 #endif
@@ -0,0 +1,1083 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_server.c
+//  Description    : This is the server side of the HDD communication protocol.
+//                   Each HddBitCmd is executed against the sharded object
+//                   store (crud_store.c), the result is sent back as a
+//                   HddBitResp (followed by the block data for READs).
+//                   One epoll event loop does the socket I/O of every client,
+//                   complete requests are executed by a pool of workers.
+//                   Clients connect over TCP, or over the UNIX socket of the
+//                   server, where they can switch to shared memory rings
+//                   (hdd_transport.c).
+//
+//  Author         : Tianjian Gao
+//
+
+// Include Files
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Project Include Files
+#include <hdd_network.h>
+#include <hdd_driver.h>
+#include <crud_store.h>
+#include <hdd_transport.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_SERVER_BUFFER_SIZE (HDD_MAX_BLOCK_SIZE+1) // Largest block a request can carry
+#define HDD_SERVER_MAX_EVENTS 64 // Events taken per epoll_wait
+#define HDD_SERVER_READ_CHUNK 0x10000 // Least free input room per read
+#define HDD_SERVER_INPUT_LIMIT (2*HDD_BATCH_MAX_BYTES) // Stop reading a client holding this much unexecuted input
+#define HDD_SERVER_SWEEP_MS 1000 // How often ring clients are checked for a closed socket
+
+// Decoded HddBitCmd
+typedef struct {
+	uint32_t block; // Block ID
+	uint8_t  r;     // Result bit
+	uint8_t  flags; // HDD_FLAG_TYPES
+	uint32_t size;  // Block size
+	uint8_t  op;    // HDD_OP_TYPES
+} HDD_SERVER_CMD;
+
+// A request split into its words and data (pointers into the received bytes)
+typedef struct {
+	HDD_SERVER_CMD cmd;     // The decoded command
+	uint32_t       offset;  // Range offset (HDD_BLOCK_RANGE commands only)
+	char          *tag;     // Tag word as received (NULL when tags are off)
+	char          *payload; // Block data of writes, body of batch frames (NULL otherwise)
+} HDD_SERVER_REQUEST;
+
+// A client connection, owned by the event loop unless a worker is serving it
+typedef struct HddServerConn {
+	int                   sock;     // The client socket (non-blocking)
+	char                  peer[32]; // Address of the client, for the log
+	int                   hello;    // 1 until the first bytes of a UNIX socket client were checked for rings
+	HDD_RING_END          ring;     // The rings of a shared memory client (shared is NULL otherwise)
+	uint32_t              options;  // HDD_SERVER_OPTIONS switched on with HDD_OPTIONS
+	int                   session;  // 1 between the INIT and the SAVE_AND_CLOSE of the client
+	int                   busy;     // 1 while a worker holds the connection
+	int                   eof;      // The client closed its side
+	int                   failed;   // Transport or protocol error, drop the connection
+	uint32_t              events;   // epoll events armed (0 when out of the poll set)
+	char                 *in;       // Received bytes not executed yet
+	size_t                in_len, in_size;
+	char                 *out;      // Responses not sent yet
+	size_t                out_len, out_size, out_sent;
+	struct HddServerConn *next;     // Link on the job or done list
+	struct HddServerConn *all;      // Link on the list of all connections
+	struct HddServerConn *prev;
+} HDD_SERVER_CONN;
+
+//
+// Global data
+
+static const char *hdd_server_flag_labels[] = { "NULL", "META_BLOCK", "FORMAT", "SAVE_AND_CLOSE", "INIT", "BLOCK_RANGE", "BLOCK_APPEND", "OPTIONS" };
+int hdd_server_workers = HDD_SERVER_WORKERS; // Size of the worker pool
+
+// The object store, block commands share it (the store locks its shards),
+// device commands hold it alone
+static pthread_rwlock_t hdd_server_store_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int hdd_server_store_up = 0;  // 1 between the first INIT and the last SAVE_AND_CLOSE
+static int hdd_server_sessions = 0;  // Connections with a session open
+
+// Work handed between the event loop and the workers
+static pthread_mutex_t  hdd_server_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   hdd_server_queue_cond = PTHREAD_COND_INITIALIZER;
+static HDD_SERVER_CONN *hdd_server_jobs = NULL, *hdd_server_jobs_tail = NULL; // Connections with requests to execute
+static HDD_SERVER_CONN *hdd_server_done = NULL; // Connections the workers are done with
+static int              hdd_server_stopping = 0; // Workers exit once the job list is empty
+
+// Event loop state
+static int              hdd_server_epoll = -1;  // The poll set
+static int              hdd_server_wakeup = -1; // eventfd the workers signal when they are done
+static int              hdd_server_local = -1;  // The listening UNIX socket
+static int              hdd_server_rings = 0;   // Connections on shared memory rings
+static HDD_SERVER_CONN *hdd_server_conns = NULL; // Every open connection
+
+//
+// Local helpers
+
+// Split a HddBitCmd into its fields
+static HDD_SERVER_CMD hdd_server_decode(HddBitCmd cmd) {
+	HDD_SERVER_CMD fields;
+	fields.block = (uint32_t) cmd;
+	fields.r = (cmd >> 32) & 1;
+	fields.flags = (cmd >> 33) & 7;
+	fields.size = (cmd >> 36) & 0x3ffffff;
+	fields.op = (cmd >> 62) & 3;
+	return(fields);
+}
+
+// Pack the fields of a HddBitResp
+static HddBitResp hdd_server_encode(uint32_t block, uint8_t r, uint8_t flags, uint32_t size, uint8_t op) {
+	return(((HddBitResp) (op & 3) << 62) | ((HddBitResp) (size & 0x3ffffff) << 36) |
+		((HddBitResp) (flags & 7) << 33) | ((HddBitResp) (r & 1) << 32) | block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_process
+// Description  : Execute one block command against the object store
+//
+// Inputs       : cmd - the decoded command
+//                offset - range offset (HDD_BLOCK_RANGE commands only)
+//                buf - the block data (in for CREATE/OVERWRITE, out for READ)
+//                data - set to the start of the data to send back
+// Outputs      : the response to send back (Block Size is the data length)
+
+static HddBitResp hdd_server_process(HDD_SERVER_CMD cmd, uint32_t offset, char *buf, char **data) {
+	CrudOID oid = cmd.block;
+	uint32_t length = 0;
+	uint8_t flags;
+	int ret;
+
+	*data = NULL;
+
+	// Block commands, the meta block is the CRUD priority object
+	flags = (cmd.flags == HDD_META_BLOCK) ? CRUD_PRIORITY_OBJECT : CRUD_NULL_FLAG;
+	switch (cmd.op) {
+	case HDD_BLOCK_CREATE:
+		ret = crud_store_create(&oid, flags, buf, cmd.size);
+		return(hdd_server_encode(oid, (ret != 0), cmd.flags, cmd.size, cmd.op));
+
+	case HDD_BLOCK_READ:
+		// Whole blocks, or the range from offset on
+		if (cmd.flags != HDD_BLOCK_RANGE)
+			offset = 0;
+		if (crud_store_read(&oid, flags, offset, buf, (cmd.size < HDD_SERVER_BUFFER_SIZE) ? cmd.size : HDD_SERVER_BUFFER_SIZE, &length))
+			return(hdd_server_encode(cmd.block, 1, cmd.flags, 0, cmd.op));
+		*data = buf;
+		return(hdd_server_encode(oid, 0, cmd.flags, length, cmd.op));
+
+	case HDD_BLOCK_OVERWRITE:
+		// Range writes patch or extend the block, the response carries its new length
+		if (cmd.flags == HDD_BLOCK_RANGE || cmd.flags == HDD_BLOCK_APPEND) {
+			if (cmd.flags == HDD_BLOCK_RANGE)
+				ret = crud_store_write(cmd.block, offset, buf, cmd.size, HDD_MAX_BLOCK_SIZE, &length);
+			else
+				ret = crud_store_append(cmd.block, buf, cmd.size, HDD_MAX_BLOCK_SIZE, &length);
+			return(hdd_server_encode(cmd.block, (ret != 0), cmd.flags, length, cmd.op));
+		}
+		ret = crud_store_update(cmd.block, flags, buf, cmd.size);
+		return(hdd_server_encode(cmd.block, (ret != 0), cmd.flags, cmd.size, cmd.op));
+
+	default: // HDD_BLOCK_DELETE
+		ret = crud_store_delete(&oid, flags);
+		return(hdd_server_encode(cmd.block, (ret != 0), cmd.flags, 0, cmd.op));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_device
+// Description  : Execute a device command (INIT, FORMAT, SAVE_AND_CLOSE); the
+//                store stays up while any client has a session open, so only
+//                the last SAVE_AND_CLOSE shuts it down (the others just save)
+//
+// Inputs       : conn - the connection the command came on
+//                cmd - the decoded command
+// Outputs      : the response to send back
+
+static HddBitResp hdd_server_device(HDD_SERVER_CONN *conn, HDD_SERVER_CMD cmd) {
+	uint8_t res = 0;
+
+	switch (cmd.flags) {
+	case HDD_INIT:
+		if (!hdd_server_store_up) {
+			res = (crud_store_open(CRUD_STORE_FILE) != 0);
+			hdd_server_store_up = !res;
+		}
+		if (!res && !conn->session) {
+			conn->session = 1;
+			hdd_server_sessions++;
+		}
+
+		// The INIT response advertises what this server understands beyond whole blocks
+		return(hdd_server_encode(HDD_SERVER_CAPABILITIES, res, cmd.flags, 0, cmd.op));
+
+	case HDD_FORMAT:
+		res = (crud_store_format(CRUD_STORE_FILE) != 0);
+		return(hdd_server_encode(0, res, cmd.flags, 0, cmd.op));
+
+	default: // HDD_SAVE_AND_CLOSE
+		if (conn->session) {
+			conn->session = 0;
+			hdd_server_sessions--;
+		}
+		if (!hdd_server_store_up) {
+			res = 1;
+		} else if (hdd_server_sessions > 0) {
+			res = (crud_store_save(CRUD_STORE_FILE) != 0);
+		} else {
+			res = (crud_store_close(CRUD_STORE_FILE) != 0);
+			hdd_server_store_up = 0;
+		}
+		return(hdd_server_encode(0, res, cmd.flags, 0, cmd.op));
+	}
+}
+
+// Split the request at the front of [*next, end) into its words and block data,
+// 1 if it is complete (*next moves past it), 0 if more bytes are needed, -1 if it is bad
+static int hdd_server_parse(char **next, char *end, int tagged, HDD_SERVER_REQUEST *req) {
+	char *start = *next;
+	size_t need = sizeof(HddBitCmd);
+	uint32_t limit;
+	HddBitCmd wire;
+
+	if ((size_t) (end - start) < need)
+		return(0);
+	memcpy(&wire, start, sizeof(HddBitCmd));
+	req->cmd = hdd_server_decode(ntohll64(wire));
+	req->offset = 0;
+	req->tag = req->payload = NULL;
+	if (req->cmd.flags == HDD_BLOCK_RANGE)
+		need += sizeof(HddBitCmd);
+	if (tagged)
+		need += sizeof(HddBitCmd);
+
+	// Writes (and batch frames) carry their data after the words
+	if ((req->cmd.op == HDD_BLOCK_CREATE || req->cmd.op == HDD_BLOCK_OVERWRITE) &&
+	    (req->cmd.flags < HDD_FORMAT || req->cmd.flags > HDD_INIT)) {
+		limit = (req->cmd.op == HDD_BLOCK_OVERWRITE && req->cmd.flags == HDD_OPTIONS) ? HDD_BATCH_MAX_BYTES : HDD_SERVER_BUFFER_SIZE;
+		if (req->cmd.size > limit)
+			return(-1);
+		req->payload = start + need;
+		need += req->cmd.size;
+	}
+	if ((size_t) (end - start) < need)
+		return(0);
+
+	if (req->cmd.flags == HDD_BLOCK_RANGE) {
+		memcpy(&wire, start + sizeof(HddBitCmd), sizeof(HddBitCmd));
+		req->offset = (uint32_t) ntohll64(wire);
+	}
+	if (tagged)
+		req->tag = start + sizeof(HddBitCmd) * ((req->cmd.flags == HDD_BLOCK_RANGE) ? 2 : 1);
+	*next = start + need;
+	return(1);
+}
+
+// Append len bytes to the output of a connection, NULL if out of memory
+static char *hdd_server_append(HDD_SERVER_CONN *conn, size_t len) {
+	char *grown;
+	size_t size;
+
+	if (conn->out_len + len > conn->out_size) {
+		size = (conn->out_len + len) * 2;
+		grown = realloc(conn->out, size);
+		if (grown == NULL)
+			return(NULL);
+		conn->out = grown;
+		conn->out_size = size;
+	}
+	grown = conn->out + conn->out_len;
+	conn->out_len += len;
+	return(grown);
+}
+
+// Queue a response (tag word and data) on a connection, 0 on success, -1 on failure.
+// Data already in place right after the response words (see hdd_server_run) is not copied.
+static int hdd_server_respond(HDD_SERVER_CONN *conn, HddBitResp resp, const char *tag, const char *data, uint32_t len) {
+	HddBitResp wire = htonll64(resp);
+	char *out;
+
+	out = hdd_server_append(conn, sizeof(HddBitResp) + ((tag != NULL) ? sizeof(HddBitCmd) : 0) + len);
+	if (out == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server out of memory for a response of [%u] bytes", len);
+		return(-1);
+	}
+	memcpy(out, &wire, sizeof(HddBitResp));
+	out += sizeof(HddBitResp);
+	if (tag != NULL) {
+		memcpy(out, tag, sizeof(HddBitCmd));
+		out += sizeof(HddBitCmd);
+	}
+	if (len > 0 && out != data)
+		memcpy(out, data, len);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_run
+// Description  : Execute one command (device commands hold the store alone)
+//                and queue its response
+//
+// Inputs       : conn - the connection the command came on
+//                req - the parsed request
+//                buf - the block buffer of the worker (HDD_SERVER_BUFFER_SIZE bytes)
+// Outputs      : 0 if successful, -1 on failure
+
+static int hdd_server_run(HDD_SERVER_CONN *conn, HDD_SERVER_REQUEST *req, char *buf) {
+	HDD_SERVER_CMD cmd = req->cmd;
+	HddBitResp resp;
+	char *data = NULL;
+	size_t words, room;
+	int device;
+
+	logMessage(LOG_INFO_LEVEL, "Parsed Received HddBitCmd: flags:%s, op_type:%d, blockID:%u, block_size:%u",
+			hdd_server_flag_labels[cmd.flags], cmd.op, cmd.block, cmd.size);
+	device = (cmd.op == HDD_DEVICE && cmd.flags >= HDD_FORMAT && cmd.flags <= HDD_INIT);
+	if (device) {
+		pthread_rwlock_wrlock(&hdd_server_store_lock);
+		resp = hdd_server_device(conn, cmd);
+	} else {
+		// Reads land in the output of the connection after room for the response words,
+		// so the block is copied once on its way to the socket
+		if (cmd.op == HDD_BLOCK_READ) {
+			words = sizeof(HddBitResp) + ((req->tag != NULL) ? sizeof(HddBitCmd) : 0);
+			room = (cmd.size < HDD_SERVER_BUFFER_SIZE) ? cmd.size : HDD_SERVER_BUFFER_SIZE;
+			if (hdd_server_append(conn, words + room) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "HDD server out of memory for a response of [%u] bytes", (unsigned) room);
+				return(-1);
+			}
+			conn->out_len -= words + room;
+			buf = conn->out + conn->out_len + words;
+		}
+		pthread_rwlock_rdlock(&hdd_server_store_lock);
+		resp = hdd_server_process(cmd, req->offset, (req->payload != NULL) ? req->payload : buf, &data);
+	}
+	pthread_rwlock_unlock(&hdd_server_store_lock);
+	logMessage(LOG_INFO_LEVEL, "Server Sending HddBitResp: flags:%s, op_type:%d, blockID:%u, block_size:%u",
+			hdd_server_flag_labels[cmd.flags], cmd.op, (uint32_t) resp, (uint32_t) (resp >> 36) & 0x3ffffff);
+	return(hdd_server_respond(conn, resp, req->tag, data, (data != NULL) ? (resp >> 36) & 0x3ffffff : 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_execute
+// Description  : Execute one command in this process (HDD_TRANSPORT_EMBEDDED
+//                clients), against the same store the server runs: nothing is
+//                encoded or byte swapped, READs land in buf directly.  The
+//                process has one session, connection options and batch
+//                frames are not offered.
+//
+// Inputs       : cmd - the request opcode for the command (host byte order)
+//                offset - byte offset of the range in the block (HDD_BLOCK_RANGE only)
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response (host byte order)
+
+HddBitResp hdd_server_execute(HddBitCmd cmd, uint32_t offset, void *buf) {
+	static HDD_SERVER_CONN embedded; // Session of the process
+	HDD_SERVER_CMD fields = hdd_server_decode(cmd);
+	HddBitResp resp;
+	char *data;
+
+	if (fields.op == HDD_DEVICE && fields.flags == HDD_OPTIONS)
+		return(hdd_server_encode(0, 0, fields.flags, 0, fields.op));
+	if (fields.op == HDD_BLOCK_OVERWRITE && fields.flags == HDD_OPTIONS)
+		return(hdd_server_encode(fields.block, 1, fields.flags, 0, fields.op));
+	if (fields.op == HDD_DEVICE && fields.flags >= HDD_FORMAT && fields.flags <= HDD_INIT) {
+		pthread_rwlock_wrlock(&hdd_server_store_lock);
+		resp = hdd_server_device(&embedded, fields);
+		if (fields.flags == HDD_INIT)
+			resp &= ~((HddBitResp) (HDD_CAP_TAGS | HDD_CAP_BATCH));
+	} else {
+		pthread_rwlock_rdlock(&hdd_server_store_lock);
+		resp = hdd_server_process(fields, offset, buf, &data);
+	}
+	pthread_rwlock_unlock(&hdd_server_store_lock);
+	return(resp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_batch
+// Description  : Execute the commands of a batch frame in order and answer
+//                with one frame holding all of their responses
+//
+// Inputs       : conn - the connection the frame came on
+//                frame - the parsed frame (payload is the body)
+//                buf - the block buffer of the worker (HDD_SERVER_BUFFER_SIZE bytes)
+// Outputs      : 0 if successful, -1 on failure
+
+static int hdd_server_batch(HDD_SERVER_CONN *conn, HDD_SERVER_REQUEST *frame, char *buf) {
+	char *next = frame->payload, *end = frame->payload + frame->cmd.size;
+	size_t header, start;
+	HDD_SERVER_REQUEST req;
+	HDD_SERVER_CMD cmd;
+	HddBitResp wire;
+	uint32_t i;
+	int ret;
+
+	// The frame header goes first, its size is known once the responses are in
+	header = conn->out_len;
+	if (hdd_server_respond(conn, 0, frame->tag, NULL, 0))
+		return(-1);
+	start = conn->out_len;
+	logMessage(LOG_INFO_LEVEL, "Parsed Received batch frame: commands:%u, bytes:%u", frame->cmd.block, frame->cmd.size);
+
+	for (i = 0; i < frame->cmd.block; i++) {
+		if (hdd_server_parse(&next, end, frame->tag != NULL, &req) != 1) {
+			logMessage(LOG_ERROR_LEVEL, "Server batch failure, malformed frame (command %u)", i);
+			return(-1);
+		}
+
+		// Device commands (and nested frames) are refused
+		cmd = req.cmd;
+		if ((cmd.op == HDD_DEVICE && cmd.flags >= HDD_FORMAT && cmd.flags != HDD_BLOCK_RANGE && cmd.flags != HDD_BLOCK_APPEND) ||
+		    (cmd.op == HDD_BLOCK_OVERWRITE && cmd.flags == HDD_OPTIONS))
+			ret = hdd_server_respond(conn, hdd_server_encode(cmd.block, 1, cmd.flags, 0, cmd.op), req.tag, NULL, 0);
+		else
+			ret = hdd_server_run(conn, &req, buf);
+		if (ret)
+			return(-1);
+	}
+	if (next != end) {
+		logMessage(LOG_ERROR_LEVEL, "Server batch failure, malformed frame (command %u)", i);
+		return(-1);
+	}
+	if (conn->out_len - start > 0x3ffffff) {
+		logMessage(LOG_ERROR_LEVEL, "Server batch failure, answer too large [%lu]", (unsigned long) (conn->out_len - start));
+		return(-1);
+	}
+
+	// Fill in the frame header
+	wire = htonll64(hdd_server_encode(frame->cmd.block, 0, HDD_OPTIONS, conn->out_len - start, HDD_BLOCK_OVERWRITE));
+	memcpy(conn->out + header, &wire, sizeof(HddBitResp));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_serve
+// Description  : Execute every complete request received on a connection, in
+//                order, queueing the responses (runs on a worker)
+//
+// Inputs       : conn - the connection, owned by the worker until it is done
+//                buf - the block buffer of the worker (HDD_SERVER_BUFFER_SIZE bytes)
+// Outputs      : none (conn->failed is set on a bad request)
+
+static void hdd_server_serve(HDD_SERVER_CONN *conn, char *buf) {
+	char *next = conn->in, *end = conn->in + conn->in_len;
+	HDD_SERVER_REQUEST req;
+	int ret;
+
+	while (!conn->failed) {
+		ret = hdd_server_parse(&next, end, conn->options & HDD_CAP_TAGS, &req);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			logMessage(LOG_ERROR_LEVEL, "Server failure, bad HDD block size [%u]", req.cmd.size);
+			conn->failed = 1;
+			break;
+		}
+
+		// Connection options are switched on after their response
+		if (req.cmd.op == HDD_DEVICE && req.cmd.flags == HDD_OPTIONS) {
+			if (hdd_server_respond(conn, hdd_server_encode(req.cmd.block & HDD_SERVER_OPTIONS, 0, req.cmd.flags, 0, req.cmd.op), req.tag, NULL, 0))
+				conn->failed = 1;
+			conn->options = req.cmd.block & HDD_SERVER_OPTIONS;
+			continue;
+		}
+
+		// Batch frames carry many commands and get one answer
+		if (req.cmd.op == HDD_BLOCK_OVERWRITE && req.cmd.flags == HDD_OPTIONS)
+			ret = hdd_server_batch(conn, &req, buf);
+		else
+			ret = hdd_server_run(conn, &req, buf);
+		if (ret)
+			conn->failed = 1;
+	}
+
+	// Keep the start of an unfinished request for the next round
+	conn->in_len = end - next;
+	memmove(conn->in, next, conn->in_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_worker
+// Description  : Worker thread, serves the connections the event loop hands
+//                over and gives them back once their requests are done
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *hdd_server_worker(void *arg) {
+	HDD_SERVER_CONN *conn;
+	uint64_t wake = 1;
+	char *buf;
+
+	buf = malloc(HDD_SERVER_BUFFER_SIZE);
+	if (buf == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server worker out of memory, not starting.");
+		return(NULL);
+	}
+	for (;;) {
+		pthread_mutex_lock(&hdd_server_queue_lock);
+		while (hdd_server_jobs == NULL && !hdd_server_stopping)
+			pthread_cond_wait(&hdd_server_queue_cond, &hdd_server_queue_lock);
+		conn = hdd_server_jobs;
+		if (conn == NULL) {
+			pthread_mutex_unlock(&hdd_server_queue_lock);
+			break;
+		}
+		hdd_server_jobs = conn->next;
+		if (hdd_server_jobs == NULL)
+			hdd_server_jobs_tail = NULL;
+		pthread_mutex_unlock(&hdd_server_queue_lock);
+
+		hdd_server_serve(conn, buf);
+
+		// Hand the connection back to the event loop
+		pthread_mutex_lock(&hdd_server_queue_lock);
+		conn->next = hdd_server_done;
+		hdd_server_done = conn;
+		pthread_mutex_unlock(&hdd_server_queue_lock);
+		if (write(hdd_server_wakeup, &wake, sizeof(wake)) == -1 && errno != EAGAIN)
+			logMessage(LOG_ERROR_LEVEL, "HDD server wakeup failed : [%s]", strerror(errno));
+	}
+	free(buf);
+	return(NULL);
+}
+
+// Set the epoll events of a connection (0 takes it out of the poll set), 0 on success, -1 on failure
+static int hdd_server_arm(HDD_SERVER_CONN *conn, uint32_t events) {
+	int fd = (conn->ring.shared != NULL) ? conn->ring.self : conn->sock, ret;
+	struct epoll_event ev;
+	uint64_t one = 1;
+
+	// Rings have no poll events of their own, the client rings the doorbell once there
+	// is data (or room); if there already is, ring it here
+	if (conn->ring.shared != NULL && events != 0) {
+		if (hdd_ring_sleep(&conn->ring, events & EPOLLIN, events & EPOLLOUT) &&
+		    write(conn->ring.self, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			logMessage(LOG_ERROR_LEVEL, "HDD server doorbell failed : [%s]", strerror(errno));
+		events = EPOLLIN;
+	}
+	if (events == conn->events)
+		return(0);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (events == 0)
+		ret = epoll_ctl(hdd_server_epoll, EPOLL_CTL_DEL, fd, &ev);
+	else
+		ret = epoll_ctl(hdd_server_epoll, (conn->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+	if (ret == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server epoll_ctl failed : [%s]", strerror(errno));
+		return(-1);
+	}
+	conn->events = events;
+	return(0);
+}
+
+// Drop a connection, ending its session if it did not close it
+static void hdd_server_close(HDD_SERVER_CONN *conn) {
+	logMessage(LOG_INFO_LEVEL, "Closing client connection [%s]", conn->peer);
+
+	// The client holds the doorbell too, so closing it would not take it out of the poll set
+	if (conn->ring.shared != NULL) {
+		hdd_server_arm(conn, 0);
+		hdd_ring_detach(&conn->ring);
+		hdd_server_rings--;
+	}
+	close(conn->sock);
+	if (conn->session) {
+		pthread_rwlock_wrlock(&hdd_server_store_lock);
+		hdd_server_sessions--;
+		pthread_rwlock_unlock(&hdd_server_store_lock);
+	}
+	if (conn->prev != NULL)
+		conn->prev->all = conn->all;
+	else
+		hdd_server_conns = conn->all;
+	if (conn->all != NULL)
+		conn->all->prev = conn->prev;
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+// Make room to read into the input of a connection, 0 on success, -1 if out of memory
+static int hdd_server_room(HDD_SERVER_CONN *conn) {
+	char *grown;
+
+	if (conn->in_size - conn->in_len < HDD_SERVER_READ_CHUNK) {
+		grown = realloc(conn->in, conn->in_size * 2);
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "HDD server out of memory for client input");
+			conn->failed = 1;
+			return(-1);
+		}
+		conn->in = grown;
+		conn->in_size *= 2;
+	}
+	return(0);
+}
+
+// Take the first bytes of a UNIX socket client; a shared memory client sends the
+// magic word along with the segment and doorbells of its rings, and switches to them
+static void hdd_server_hello(HDD_SERVER_CONN *conn) {
+	char control[CMSG_SPACE(HDD_RING_FDS * sizeof(int))];
+	int fds[HDD_RING_FDS], count, i;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint64_t magic;
+	ssize_t ret;
+
+	if (hdd_server_room(conn))
+		return;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = conn->in + conn->in_len;
+	iov.iov_len = conn->in_size - conn->in_len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ret = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret <= 0)
+		return; // Left to hdd_server_receive
+	conn->hello = 0;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL && !(msg.msg_flags & MSG_CTRUNC)) {
+		conn->in_len += ret;
+		return;
+	}
+
+	// Anything but exactly the magic word with the three descriptors is refused
+	count = 0;
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), ((count < HDD_RING_FDS) ? count : HDD_RING_FDS) * sizeof(int));
+	}
+	memcpy(&magic, iov.iov_base, (ret < sizeof(magic)) ? ret : sizeof(magic));
+	if (count != HDD_RING_FDS || ret != sizeof(magic) || magic != HDD_RING_MAGIC || (msg.msg_flags & MSG_CTRUNC)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server bad ring setup from client [%s]", conn->peer);
+		for (i = 0; i < count && i < HDD_RING_FDS; i++)
+			close(fds[i]);
+		conn->failed = 1;
+		return;
+	}
+
+	// The doorbell takes the place of the socket in the poll set
+	if (hdd_server_arm(conn, 0) || hdd_ring_attach(&conn->ring, fds)) {
+		conn->failed = 1;
+		return;
+	}
+	hdd_server_rings++;
+	snprintf(conn->peer, sizeof(conn->peer), "unix/%d/shm", conn->sock);
+	logMessage(LOG_INFO_LEVEL, "Client [%s] switched to shared memory rings", conn->peer);
+}
+
+// Take what a ring client sent, until the ring is drained or the input is full
+static void hdd_server_receive_ring(HDD_SERVER_CONN *conn) {
+	struct iovec iov;
+	uint64_t wakes;
+	size_t got;
+	int closed;
+
+	if (read(conn->ring.self, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN)
+		logMessage(LOG_ERROR_LEVEL, "HDD server doorbell read failed : [%s]", strerror(errno));
+
+	// The client sets closed after its last bytes, so look at it first
+	closed = __atomic_load_n(&conn->ring.shared->closed, __ATOMIC_ACQUIRE);
+	while (!conn->eof && conn->in_len < HDD_SERVER_INPUT_LIMIT) {
+		if (hdd_server_room(conn))
+			return;
+		iov.iov_base = conn->in + conn->in_len;
+		iov.iov_len = conn->in_size - conn->in_len;
+		got = hdd_ring_readv(&conn->ring, &iov, 1);
+		if (got == 0) {
+			if (closed) {
+				logMessage(LOG_INFO_LEVEL, "HDD client rings closed");
+				conn->eof = 1;
+			}
+			return;
+		}
+		conn->in_len += got;
+	}
+}
+
+// Take what the client sent, until the socket is drained or the input is full
+static void hdd_server_receive(HDD_SERVER_CONN *conn) {
+	ssize_t ret;
+
+	if (conn->hello)
+		hdd_server_hello(conn);
+	if (conn->ring.shared != NULL) {
+		hdd_server_receive_ring(conn);
+		return;
+	}
+	while (!conn->failed && !conn->eof && conn->in_len < HDD_SERVER_INPUT_LIMIT) {
+		if (hdd_server_room(conn))
+			return;
+		ret = read(conn->sock, conn->in + conn->in_len, conn->in_size - conn->in_len);
+		if (ret > 0) {
+			conn->in_len += ret;
+			continue;
+		}
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (ret == 0) {
+			logMessage(LOG_INFO_LEVEL, "HDD client socket closed on rd");
+		} else {
+			logMessage(LOG_ERROR_LEVEL, "HDD read bytes failed : [%s]", strerror(errno));
+			conn->failed = 1;
+		}
+		conn->eof = 1;
+	}
+}
+
+// Send as much of the queued responses as the socket takes
+static void hdd_server_transmit(HDD_SERVER_CONN *conn) {
+	struct iovec iov;
+	ssize_t ret;
+
+	// Ring clients get what fits (the answers of a client that left are dropped)
+	if (conn->ring.shared != NULL && !__atomic_load_n(&conn->ring.shared->closed, __ATOMIC_ACQUIRE)) {
+		iov.iov_base = conn->out + conn->out_sent;
+		iov.iov_len = conn->out_len - conn->out_sent;
+		conn->out_sent += hdd_ring_writev(&conn->ring, &iov, 1);
+		if (conn->out_sent < conn->out_len)
+			return;
+	}
+	while (conn->ring.shared == NULL && conn->out_sent < conn->out_len) {
+		ret = write(conn->sock, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+		if (ret > 0) {
+			conn->out_sent += ret;
+			continue;
+		}
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		logMessage(LOG_ERROR_LEVEL, "HDD send bytes failed : [%s]", strerror(errno));
+		conn->failed = 1;
+		return;
+	}
+	conn->out_len = conn->out_sent = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_update
+// Description  : Move an idle connection along: flush its responses, hand it
+//                to a worker once a request is complete (and the previous
+//                answers are out), otherwise wait for more input/output room
+//
+// Inputs       : conn - the connection (not held by a worker)
+// Outputs      : none (the connection may be closed)
+
+static void hdd_server_update(HDD_SERVER_CONN *conn) {
+	HDD_SERVER_REQUEST req;
+	uint32_t events = 0;
+	char *next = conn->in;
+	int ready = 0;
+
+	if (!conn->failed && conn->out_len > 0)
+		hdd_server_transmit(conn);
+	if (!conn->failed && conn->out_len == 0)
+		ready = hdd_server_parse(&next, conn->in + conn->in_len, conn->options & HDD_CAP_TAGS, &req);
+	if (ready < 0)
+		logMessage(LOG_ERROR_LEVEL, "Server failure, bad HDD block size [%u]", req.cmd.size);
+	if (conn->failed || ready < 0 || (conn->eof && !ready && conn->out_len == 0)) {
+		hdd_server_close(conn);
+		return;
+	}
+
+	// A complete request, the connection goes to a worker
+	if (ready) {
+		if (hdd_server_arm(conn, 0)) {
+			hdd_server_close(conn);
+			return;
+		}
+		conn->busy = 1;
+		conn->next = NULL;
+		pthread_mutex_lock(&hdd_server_queue_lock);
+		if (hdd_server_jobs_tail != NULL)
+			hdd_server_jobs_tail->next = conn;
+		else
+			hdd_server_jobs = conn;
+		hdd_server_jobs_tail = conn;
+		pthread_cond_signal(&hdd_server_queue_cond);
+		pthread_mutex_unlock(&hdd_server_queue_lock);
+		return;
+	}
+
+	// Wait for the rest of the request, or for room to send the answers
+	if (!conn->eof && conn->in_len < HDD_SERVER_INPUT_LIMIT)
+		events |= EPOLLIN;
+	if (conn->out_len > 0)
+		events |= EPOLLOUT;
+	if (hdd_server_arm(conn, events))
+		hdd_server_close(conn);
+}
+
+// Accept every pending client on a listening socket (TCP or UNIX)
+static void hdd_server_accept(int server, int local) {
+	struct sockaddr_in caddr;
+	HDD_SERVER_CONN *conn;
+	socklen_t clen;
+	int client, nodelay = 1;
+
+	for (;;) {
+		clen = sizeof(caddr);
+		client = accept(server, local ? NULL : (struct sockaddr *) &caddr, local ? NULL : &clen);
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				logMessage(LOG_ERROR_LEVEL, "HDD server accept failed : [%s]", strerror(errno));
+			return;
+		}
+		fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+		if (!local)
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		conn = calloc(1, sizeof(HDD_SERVER_CONN));
+		if (conn != NULL)
+			conn->in = malloc(HDD_SERVER_READ_CHUNK * 2);
+		if (conn == NULL || conn->in == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "HDD server out of memory for a new client, dropping it.");
+			free(conn);
+			close(client);
+			continue;
+		}
+		conn->sock = client;
+		conn->hello = local;
+		if (local)
+			snprintf(conn->peer, sizeof(conn->peer), "unix/%d", client);
+		else
+			snprintf(conn->peer, sizeof(conn->peer), "%s/%d", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
+		logMessage(LOG_INFO_LEVEL, "Server new client connection [%s]", conn->peer);
+		conn->in_size = HDD_SERVER_READ_CHUNK * 2;
+		conn->all = hdd_server_conns;
+		if (hdd_server_conns != NULL)
+			hdd_server_conns->prev = conn;
+		hdd_server_conns = conn;
+		hdd_server_update(conn);
+	}
+}
+
+// Drop the ring clients whose socket was closed without closing the rings (the
+// process died); nothing else tells the server they are gone
+static void hdd_server_sweep(void) {
+	HDD_SERVER_CONN *conn, *next;
+	char byte;
+
+	for (conn = hdd_server_conns; conn != NULL; conn = next) {
+		next = conn->all;
+		if (conn->ring.shared == NULL || conn->busy || recv(conn->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != 0)
+			continue;
+		logMessage(LOG_INFO_LEVEL, "HDD client [%s] socket closed", conn->peer);
+		conn->failed = 1;
+		hdd_server_update(conn);
+	}
+}
+
+// Take back the connections the workers are done with
+static void hdd_server_reclaim(void) {
+	HDD_SERVER_CONN *conn, *next;
+	uint64_t wakes;
+
+	if (read(hdd_server_wakeup, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN)
+		logMessage(LOG_ERROR_LEVEL, "HDD server wakeup read failed : [%s]", strerror(errno));
+	pthread_mutex_lock(&hdd_server_queue_lock);
+	conn = hdd_server_done;
+	hdd_server_done = NULL;
+	pthread_mutex_unlock(&hdd_server_queue_lock);
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+		conn->busy = 0;
+		hdd_server_update(conn);
+	}
+}
+
+// Create the listening UNIX socket next to the TCP port (the TCP bind succeeded,
+// so a socket file left on the path is stale), the socket or -1 on failure
+static int hdd_server_listen_local(unsigned short port) {
+	struct sockaddr_un uaddr;
+	int local;
+
+	hdd_transport_address(&uaddr, port);
+	unlink(uaddr.sun_path);
+	local = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (local == -1 || bind(local, (struct sockaddr *) &uaddr, sizeof(uaddr)) == -1 || listen(local, HDD_MAX_BACKLOG) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server UNIX socket [%s] failed, TCP only : [%s]", uaddr.sun_path, strerror(errno));
+		if (local != -1)
+			close(local);
+		return(-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "Server listening on UNIX socket [%s]", uaddr.sun_path);
+	return(local);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server
+// Description  : The server main loop, an epoll event loop that does all of
+//                the socket I/O and hands complete requests to the worker
+//                pool, until shutdown
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_server(void) {
+	struct epoll_event events[HDD_SERVER_MAX_EVENTS], ev;
+	struct sockaddr_in saddr;
+	struct sockaddr_un uaddr;
+	struct timespec now, swept;
+	sigset_t block, old;
+	pthread_t *workers;
+	HDD_SERVER_CONN *conn;
+	int server, optval = 1, count, i, started = 0, ret = -1;
+	unsigned short port;
+
+	// Create the listening socket
+	port = (hdd_network_port != 0) ? hdd_network_port : HDD_DEFAULT_PORT;
+	server = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD socket() create failed : [%s]", strerror(errno));
+		return(-1);
+	}
+	if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD set socket option create failed : [%s]", strerror(errno));
+		close(server);
+		return(-1);
+	}
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(server, (struct sockaddr *) &saddr, sizeof(saddr)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD bind() create failed : [%s]", strerror(errno));
+		close(server);
+		return(-1);
+	}
+	if (listen(server, HDD_MAX_BACKLOG) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD listen() create failed : [%s]", strerror(errno));
+		close(server);
+		return(-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "Server bound and listening on port [%d]", port);
+	hdd_server_local = hdd_server_listen_local(port);
+
+	// The poll set: the listening sockets, the worker wakeup and the clients
+	hdd_server_epoll = epoll_create1(EPOLL_CLOEXEC);
+	hdd_server_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (hdd_server_epoll == -1 || hdd_server_wakeup == -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD server event setup failed : [%s]", strerror(errno));
+		goto cleanup;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &hdd_server_epoll;
+	if (epoll_ctl(hdd_server_epoll, EPOLL_CTL_ADD, server, &ev) == -1)
+		goto cleanup;
+	ev.data.ptr = &hdd_server_wakeup;
+	if (epoll_ctl(hdd_server_epoll, EPOLL_CTL_ADD, hdd_server_wakeup, &ev) == -1)
+		goto cleanup;
+	ev.data.ptr = &hdd_server_local;
+	if (hdd_server_local != -1 && epoll_ctl(hdd_server_epoll, EPOLL_CTL_ADD, hdd_server_local, &ev) == -1)
+		goto cleanup;
+
+	// Start the workers, signals are left to this thread (they stop epoll_wait)
+	if (hdd_server_workers < 1)
+		hdd_server_workers = 1;
+	workers = calloc(hdd_server_workers, sizeof(pthread_t));
+	if (workers == NULL)
+		goto cleanup;
+	hdd_server_stopping = 0;
+	sigfillset(&block);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for (started = 0; started < hdd_server_workers; started++) {
+		if (pthread_create(&workers[started], NULL, hdd_server_worker, NULL)) {
+			logMessage(LOG_ERROR_LEVEL, "HDD server failed to start worker %d", started);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	logMessage(LOG_INFO_LEVEL, "Server started %d workers", started);
+
+	// Serve the clients
+	ret = (started > 0) ? 0 : -1;
+	clock_gettime(CLOCK_MONOTONIC, &swept);
+	while (!hdd_network_shutdown && started > 0) {
+		count = epoll_wait(hdd_server_epoll, events, HDD_SERVER_MAX_EVENTS, (hdd_server_rings > 0) ? HDD_SERVER_SWEEP_MS : -1);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			logMessage(LOG_ERROR_LEVEL, "HDD server epoll_wait failed, aborting.");
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (events[i].data.ptr == &hdd_server_epoll) {
+				hdd_server_accept(server, 0);
+			} else if (events[i].data.ptr == &hdd_server_local) {
+				hdd_server_accept(hdd_server_local, 1);
+			} else if (events[i].data.ptr == &hdd_server_wakeup) {
+				hdd_server_reclaim();
+			} else {
+				conn = events[i].data.ptr;
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					hdd_server_receive(conn);
+				hdd_server_update(conn);
+			}
+		}
+
+		// Ring clients that died are only noticed by looking at their sockets
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (hdd_server_rings > 0 && (now.tv_sec - swept.tv_sec) * 1000 + (now.tv_nsec - swept.tv_nsec) / 1000000 >= HDD_SERVER_SWEEP_MS) {
+			hdd_server_sweep();
+			swept = now;
+		}
+	}
+
+	// Stop the workers (they finish the connections they hold) and drop the clients
+	logMessage(LOG_INFO_LEVEL, "Shutting down HDD server ...");
+	pthread_mutex_lock(&hdd_server_queue_lock);
+	hdd_server_stopping = 1;
+	pthread_cond_broadcast(&hdd_server_queue_cond);
+	pthread_mutex_unlock(&hdd_server_queue_lock);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	hdd_server_jobs = hdd_server_jobs_tail = hdd_server_done = NULL;
+	while (hdd_server_conns != NULL)
+		hdd_server_close(hdd_server_conns);
+
+	// Fold the log into the store file, so it stands alone (and loads fast) next time
+	if (hdd_server_store_up || crud_store_open(CRUD_STORE_FILE) == 0) {
+		if (crud_store_checkpoint(CRUD_STORE_FILE))
+			ret = -1;
+		crud_store_close(CRUD_STORE_FILE);
+		hdd_server_store_up = 0;
+	}
+
+cleanup:
+	if (hdd_server_local != -1) {
+		hdd_transport_address(&uaddr, port);
+		unlink(uaddr.sun_path);
+		close(hdd_server_local);
+		hdd_server_local = -1;
+	}
+	if (hdd_server_wakeup != -1)
+		close(hdd_server_wakeup);
+	if (hdd_server_epoll != -1)
+		close(hdd_server_epoll);
+	close(server);
+	return(ret);
+}
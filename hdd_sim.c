@@ -10,6 +10,7 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -17,6 +18,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -25,34 +30,158 @@
 #include <hdd_driver.h>
 #include <hdd_network.h>
 #include <hdd_file_io.h>
+#include <hdd_cache.h>
+#include <hdd_slab.h>
+#include <hdd_transport.h>
+#include <hdd_histogram.h>
+#include <hdd_generate.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <cmpsc311_hashtable.h>
 
 // Defines
 #define HDD_SIM_MAX_OPEN_FILES 128
-#define HDD_ARGUMENTS "hvul:x:a:p:"
+#define HDD_SIM_BATCH_OPS 256 // Consecutive file operations grouped into one batch
+#define HDD_TRACE_MAGIC 0x3143415254444448ULL // "HDDTRAC1", first bytes of a compiled trace
+#define HDD_TRACE_HASH_BITS 10 // Initial width of the name/payload tables while compiling
+#define HDD_TRACE_FILE_BITS 24 // Bits of the file ID in an op record, the command is above them
+#define HDD_SIM_LATENCIES 9 // Latency histograms of a load (the commands and the opens)
+#define HDD_SIM_IMPORT_CHUNK HDD_WRITEBACK_THRESHOLD // Bytes of a host file an import writes at once (a flush each)
+#define HDD_SIM_UNIT_TEST_BIG_FILE 0xc0000000 // Sparse host file the file table cannot describe (3 GB)
+#define HDD_SIM_UNIT_TEST_PART_FILE 0x48000000 // Sparse host file that fits alone but not twice (1.125 GB)
+#define HDD_SIM_UNIT_TEST_SPEC "files=12,ops=3000,size=1:300,seed=11" // Workload the trace test compiles
+#define HDD_SIM_UNIT_TEST_LONG_LINE 5000 // Text bytes of the long line the parser test reads
+#define HDD_SIM_UNIT_TEST_CLIENTS 4 // Parallel replays of the test, with 1 to this many clients (fewer than the files of HDD_SIM_UNIT_TEST_SPEC)
+#define HDD_ARGUMENTS "hvuwl:c:x:a:p:t:k:j:r:g:i:"
 #define USAGE \
-	"USAGE: hdd [-h] [-v] [-l <logfile>] [-c <sz>] [-x <file>] [-a <ip addr>] [-p <port>] <workload-file>\n" \
+	"USAGE: hdd [-h] [-v] [-w] [-l <logfile>] [-c <sz>] [-x <file>] [-a <ip addr>] [-p <port>] [-t <transport>] [-k <trace>] [-j <n>] [-r <ops/s>] [-g <spec>] [-i <hostfile>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -u - run the unit tests instead of the simulator\n" \
 	"    -v - verbose output\n" \
+	"    -w - write-through mode (no write-back buffering of file writes)\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
+	"    -c - size of the client block cache in kilobytes (0 disables it)\n" \
 	"    -x - extract a file <file> from the hdd filesystem\n" \
 	"    -a - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
+	"    -t - transport to the server: tcp (default), unix (socket), shm (shared memory, same host)\n" \
+	"         or embedded (no server, the store runs in this process on the files of the current directory).\n" \
+	"    -k - compile the workload into the binary trace <trace> instead of running it\n" \
+	"    -j - replay the workload with 1 to <n> clients in parallel (0 for one per core), each client\n" \
+	"         runs the operations of its own files; reports the throughput (the device is formatted).\n" \
+	"    -r - replay the workload open loop at <ops/s> operations per second (unbatched) and report\n" \
+	"         the latency of each kind of operation, timed from when it was due.\n" \
+	"    -g - generate a synthetic workload into <workload-file> instead of running one (with -k, also\n" \
+	"         compile it), <spec> is key=value pairs separated by commas (e.g. files=500,ops=1000000):\n" \
+	"         files, ops, zipf (file popularity skew), size=<min>:<max>, sizes=uniform|log,\n" \
+	"         mix=<read>:<write>:<writeat>:<seek> (weights), random (percent of random offsets), seed.\n" \
+	"    -i - import the host file <hostfile> into the hdd filesystem (under its base name) in large\n" \
+	"         writes instead of running a workload; more host files may follow the options, with -j <n>\n" \
+	"         they are imported by <n> clients in parallel (the device must be formatted).\n" \
 	"\n" \
-	"    <workload-file> - file contain the workload to simulate\n" \
+	"    <workload-file> - file contain the workload to simulate (text, or a trace made with -k)\n" \
 	"\n" \
 
+// Workload commands
+typedef enum {
+	HDD_SIM_UNKNOWN = 0,
+	HDD_SIM_FORMAT  = 1,
+	HDD_SIM_MOUNT   = 2,
+	HDD_SIM_UNMOUNT = 3,
+	HDD_SIM_WRITE   = 4,
+	HDD_SIM_WRITEAT = 5,
+	HDD_SIM_SEEK    = 6,
+	HDD_SIM_READ    = 7,
+	HDD_SIM_OPEN    = 8, // Not a command, the opens of a replay (for their latency)
+} HDD_SIM_COMMANDS;
+
+// A workload line split into its fields (pointers into the mapped workload)
+typedef struct {
+	char    *start;   // The line
+	size_t   length;  // Its length (newline included)
+	char    *fname;   // The file name (NUL terminated in place)
+	int      command; // HDD_SIM_COMMANDS
+	int32_t  len;     // Length field
+	int32_t  off;     // Offset field
+	char    *text;    // Text after the ':' (written by WRITE/WRITEAT)
+	size_t   avail;   // Bytes from text to the end of the line (newline included)
+	uint32_t file;    // File ID (traces only)
+} HddSimulationLine;
+
 // This is the file table
 typedef struct {
 	char     *filename;  // This is the filename for the test file
 	int16_t   fhandle;   // This is a file handle for the opened file
+	uint32_t  file;      // File ID (traces only)
 } HddSimulationTable;
 
+// State of a replay
+typedef struct {
+	HddSimulationTable ftable[HDD_SIM_MAX_OPEN_FILES];
+	char    *batch_bufs[HDD_SIM_BATCH_OPS]; // Read buffers of the open batch
+	int      batch_ops;                     // Operations in the open batch
+	int16_t *slots;                         // File ID -> file table index (-1 if not open), NULL for text workloads
+	uint64_t ops;                           // File operations run
+	uint64_t bytes;                         // Bytes read and written
+	HDD_HISTOGRAM *latency;                 // Latencies by HDD_SIM_COMMANDS of a load (file operations are not batched), NULL otherwise
+	uint64_t start;                         // When the load started (ns)
+	uint64_t interval;                      // Time between the records of the load (ns)
+} HddSimulationState;
+
+// What a parallel replay worker sends back
+typedef struct {
+	uint64_t ops;    // File operations run
+	uint64_t bytes;  // Bytes read and written
+	int32_t  ret;    // 0 if its part of the workload replayed successfully
+} HddSimulationResult;
+
+// A host file to import
+typedef struct {
+	char     *path;   // Host path
+	char     *name;   // Name in the hdd filesystem (the base name)
+	uint64_t  size;   // Bytes
+	uint32_t  worker; // Client importing it in a parallel import
+} HddImportFile;
+
+// Header of a compiled trace, followed by the op records, the file names
+// (NUL terminated, in file ID order) and the payloads (host byte order)
+typedef struct {
+	uint64_t magic;  // HDD_TRACE_MAGIC
+	uint64_t ops;    // Op records
+	uint32_t files;  // File names
+	uint32_t names;  // Bytes of the file names
+	uint32_t data;   // Bytes of the payloads
+	uint32_t unused;
+} HddTraceHeader;
+
+// An op record of a trace (one workload line)
+typedef struct {
+	uint32_t command;   // HDD_SIM_COMMANDS, shifted above the file ID (file operations)
+	int32_t  len;       // Length field
+	int32_t  off;       // Offset field
+	uint32_t payload;   // Offset of the WRITE/WRITEAT text in the payloads (equal texts are stored once)
+} HddTraceOp;
+
+// A trace mapped for replay
+typedef struct {
+	HddTraceHeader header;
+	HddTraceOp    *ops;       // The op records
+	char         **fnames;    // File names by ID
+	char          *payloads;  // The payload section
+	char          *data;      // The mapped file (simulate_trace_open)
+	size_t         size;      // Its length
+	char          *image;     // The trace compiled from it if it is a text workload
+} HddTrace;
+
+// A file name or payload interned while compiling
+typedef struct {
+	uint64_t offset;  // Where it is in the names or payloads
+	uint32_t length;  // Its length
+	uint32_t id;      // File ID (names only)
+} HddTraceEntry;
+
 //
 // Global Data
 int verbose;
@@ -61,7 +190,43 @@ int verbose;
 // Functional Prototypes
 
 int simulate_HDD( char *wload );
+int simulate_map( char *path, char **data, size_t *size );
+int simulate_workload( char *data, size_t size );
+int simulate_trace( char *data, size_t size );
+int simulate_trace_load( char *data, size_t size, HddTrace *trace );
+int simulate_trace_open( char *wload, HddTrace *trace );
+void simulate_trace_close( HddTrace *trace );
+int simulate_trace_replay( HddTrace *trace, HddSimulationState *state, uint32_t worker, uint32_t workers );
+int simulate_execute( HddSimulationState *state, HddSimulationLine *line, int32_t linecount );
+int simulate_close( HddSimulationState *state );
+void simulate_state_init( HddSimulationState *state, uint32_t files );
+int simulate_parse( char **next, char *end, HddSimulationLine *line );
+int simulate_command( const char *tok, size_t len );
+int simulate_batch_commit( char **rbufs, int *ops );
+int simulate_compile( char *wload, char *trace );
+int simulate_build( char *data, size_t size, char **image, size_t *length );
+HddTraceEntry * simulate_intern( HTable *ht, char **buf, size_t *used, size_t *size, const char *data, size_t len );
+int simulate_parallel( char *wload, uint32_t clients );
+int simulate_parallel_round( HddTrace *trace, uint32_t workers, HddSimulationResult *total, double *secs );
+void simulate_parallel_worker( HddTrace *trace, uint32_t worker, uint32_t workers, int ready, int go, int results );
+int simulate_parallel_save( int *results, uint32_t workers );
+int simulate_load( char *wload, uint32_t rate );
+uint64_t simulate_now( void );
+int simulate_generate( char *spec, char *wload, char *trace );
+int simulate_import( char **paths, uint32_t count, int parallel, uint32_t clients );
+int simulate_import_file( HddImportFile *file, int16_t *fh );
+int simulate_import_parallel( HddImportFile *files, uint32_t count, uint32_t workers );
+void simulate_import_worker( HddImportFile *files, uint32_t count, uint32_t worker, int results );
+int simulate_import_fits( HddImportFile *files, uint32_t count );
+int simulate_import_compare( const void *a, const void *b );
 int extract_file_from_hdd(char *ex_file);
+int simulate_unit_test_sparse( char *path, uint64_t size );
+int simulate_unit_test_import( char *dir );
+int simulate_unit_test_trace( char *dir );
+int simulate_unit_test_parse( char *dir );
+int simulate_unit_test_parallel( char *dir );
+int simulate_unit_test_contents( HddTrace *trace, char **contents, uint32_t *sizes );
+int hddSimUnitTest( void );
 
 //
 // Functions
@@ -78,8 +243,13 @@ int extract_file_from_hdd(char *ex_file);
 int main( int argc, char *argv[] ) {
 	// Local variables
 	int ch, verbose = 0, unit_tests = 0, log_initialized = 0, extract_file = 0;
-	uint32_t cache_size = 1024; // Defaults to 1024 cache lines
-	char *ex_file = NULL;
+	uint32_t cache_size = HDD_DEFAULT_CACHE_SIZE; // Cache budget in kilobytes
+	uint64_t cache_bytes;
+	unsigned long value;
+	char *end;
+	char *ex_file = NULL, *trace = NULL, *generate = NULL, **imports = malloc( sizeof(char *) * argc );
+	uint32_t clients = 0, rate = 0, nimports = 0;
+	int parallel = 0;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, HDD_ARGUMENTS)) != -1) {
@@ -97,6 +267,10 @@ int main( int argc, char *argv[] ) {
 			unit_tests = 1;
 			break;
 
+		case 'w': // Write-through Flag
+			hdd_set_durability( HDD_WRITE_THROUGH );
+			break;
+
 		case 'l': // Set the log filename
 			initializeLogWithFilename( optarg );
 			log_initialized = 1;
@@ -107,16 +281,19 @@ int main( int argc, char *argv[] ) {
 			extract_file = 1;
 			break;
 
-		case 'c': // Set cache line size
-			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+		case 'c': // Set the cache size (kilobytes)
+			errno = 0;
+			value = strtoul( optarg, &end, 10 );
+			if ( (errno != 0) || (end == optarg) || (*end != '\0') || (optarg[0] == '-') || (value > HDD_MAX_CACHE_SIZE) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s], at most %u KB", optarg, HDD_MAX_CACHE_SIZE );
                 return(-1);
 			}
+			cache_size = (uint32_t)value;
 			break;
 
         case 'a': // Get the IP address
             if (inet_addr(optarg) == INADDR_NONE) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+			    logMessage( LOG_ERROR_LEVEL, "Bad  IP address [%s]", optarg );
                 return(-1);
             } 
             hdd_network_address = (unsigned char *)strdup(optarg);
@@ -129,6 +306,48 @@ int main( int argc, char *argv[] ) {
 			}
             break;
 
+		case 't': // Set the transport to the server
+			if ( strcmp(optarg, "tcp") == 0 ) {
+				hdd_network_transport = HDD_TRANSPORT_TCP;
+			} else if ( strcmp(optarg, "unix") == 0 ) {
+				hdd_network_transport = HDD_TRANSPORT_UNIX;
+			} else if ( strcmp(optarg, "shm") == 0 ) {
+				hdd_network_transport = HDD_TRANSPORT_SHM;
+			} else if ( strcmp(optarg, "embedded") == 0 ) {
+				hdd_network_transport = HDD_TRANSPORT_EMBEDDED;
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "Bad transport [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'k': // Compile the workload into a trace
+			trace = optarg;
+			break;
+
+		case 'j': // Replay with parallel clients
+			if ( sscanf( optarg, "%u", &clients ) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad client count [%s]", optarg );
+				return( -1 );
+			}
+			parallel = 1;
+			break;
+
+		case 'r': // Open loop load at a rate
+			if ( (sscanf( optarg, "%u", &rate ) != 1) || (rate == 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad rate [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'g': // Generate a workload
+			generate = optarg;
+			break;
+
+		case 'i': // Import a host file
+			imports[nimports++] = optarg;
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -143,12 +362,19 @@ int main( int argc, char *argv[] ) {
 		enableLogLevels( LOG_INFO_LEVEL );
 	}
 
+	// Setup the client block cache
+	cache_bytes = (uint64_t)cache_size * 1024;
+	if ( init_hdd_cache(cache_bytes) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failed to initialize the block cache [%u KB]", cache_size );
+		return( -1 );
+	}
+
 	// If we are running the unit tests, do that
 	if ( unit_tests ) {
 
 		// Enable verbose, run the tests and check the results
 		enableLogLevels( LOG_INFO_LEVEL );
-		if ( b64UnitTest() || hddIOUnitTest() ) {
+		if ( b64UnitTest() || hddSlabUnitTest() || hddHistogramUnitTest() || hddGenerateUnitTest() || hashTableUnitTest() || hddTransportUnitTest() || hddCacheUnitTest() || init_hdd_cache(cache_bytes) || hddIOUnitTest() || hddSimUnitTest() ) {
 			logMessage( LOG_ERROR_LEVEL, "HDD unit tests failed.\n\n" );
 		} else {
 			logMessage( LOG_INFO_LEVEL, "HDD unit tests completed successfully.\n\n" );
@@ -163,6 +389,18 @@ int main( int argc, char *argv[] ) {
 			logMessage(LOG_ERROR_LEVEL, "File [%s] extraction failed, aborting.\n\n");
 		}
 
+	} else if ( nimports > 0 ) {
+
+		// Import the host files, those after the options too
+		while ( optind < argc ) {
+			imports[nimports++] = argv[optind++];
+		}
+		if ( simulate_import(imports, nimports, parallel, clients) == 0 ) {
+			logMessage( LOG_INFO_LEVEL, "HDD import completed successfully.\n\n" );
+		} else {
+			logMessage( LOG_ERROR_LEVEL, "HDD import failed.\n\n" );
+		}
+
 	} else {
 
 		// The filename should be the next option
@@ -174,8 +412,32 @@ int main( int argc, char *argv[] ) {
 
 		}
 
-		// Run the simulation
-		if ( simulate_HDD(argv[optind]) == 0 ) {
+		// Generate the workload (and compile it), compile it, or run the simulation
+		if ( generate != NULL ) {
+			if ( simulate_generate(generate, argv[optind], trace) == 0 ) {
+				logMessage( LOG_INFO_LEVEL, "HDD workload generated into [%s].\n\n", argv[optind] );
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "HDD workload generation failed.\n\n" );
+			}
+		} else if ( trace != NULL ) {
+			if ( simulate_compile(argv[optind], trace) == 0 ) {
+				logMessage( LOG_INFO_LEVEL, "HDD workload compiled into trace [%s].\n\n", trace );
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "HDD workload compile failed.\n\n" );
+			}
+		} else if ( parallel ) {
+			if ( simulate_parallel(argv[optind], clients) == 0 ) {
+				logMessage( LOG_INFO_LEVEL, "HDD parallel replay completed successfully.\n\n" );
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "HDD parallel replay failed.\n\n" );
+			}
+		} else if ( rate > 0 ) {
+			if ( simulate_load(argv[optind], rate) == 0 ) {
+				logMessage( LOG_INFO_LEVEL, "HDD load completed successfully.\n\n" );
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "HDD load failed.\n\n" );
+			}
+		} else if ( simulate_HDD(argv[optind]) == 0 ) {
 			logMessage( LOG_INFO_LEVEL, "HDD simulation completed successfully.\n\n" );
 		} else {
 			logMessage( LOG_INFO_LEVEL, "HDD simulation failed.\n\n" );
@@ -183,6 +445,7 @@ int main( int argc, char *argv[] ) {
 	}
 
 	// Return successfully
+	free( imports );
 	return( 0 );
 }
 
@@ -190,7 +453,10 @@ int main( int argc, char *argv[] ) {
 //
 // Function     : simulate_HDD
 // Description  : The main control loop for the processing of the HDD
-//                simulation.
+//                simulation.  The workload file is mapped (privately, so
+//                lines are tokenized and WRITE text is converted in place)
+//                and replayed line by line, or record by record if it is a
+//                compiled trace.
 //
 // Inputs       : wload - the name of the workload file
 // Outputs      : 0 if successful test, -1 if failure
@@ -198,281 +464,2186 @@ int main( int argc, char *argv[] ) {
 int simulate_HDD( char *wload ) {
 
 	// Local variables
-	char line[2048], fname[128], command[128], text[2048], *sep, *rbuf;
-	FILE *fhandle = NULL;
-	int32_t err=0, len, off, fields, linecount;
-	HddSimulationTable ftable[HDD_SIM_MAX_OPEN_FILES];
-	int idx, i;
+	char *data;
+	size_t size;
+	uint64_t magic = 0;
+	int ret;
 
-	// Setup the file table
-	memset(ftable, 0x0, sizeof(HddSimulationTable)*HDD_SIM_MAX_OPEN_FILES);
+	// Map the workload file
+	if ( simulate_map(wload, &data, &size) ) {
+		return( -1 );
+	}
+
+	// Replay it, then drop the mapping
+	if ( size >= sizeof(magic) ) {
+		memcpy( &magic, data, sizeof(magic) );
+	}
+	if ( magic == HDD_TRACE_MAGIC ) {
+		ret = simulate_trace( data, size );
+	} else {
+		ret = simulate_workload( data, size );
+	}
+	if ( data != NULL ) {
+		munmap( data, size );
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_map
+// Description  : Map a workload or trace file privately (writable, changes
+//                stay in this process)
+//
+// Inputs       : path - the name of the file
+//                data - set to the mapping (NULL if the file is empty)
+//                size - set to its length
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_map( char *path, char **data, size_t *size ) {
+
+	// Local variables
+	struct stat st;
+	int fd;
 
-	// Open the workload file
-	linecount = 0;
-	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+	// Open the file and get its size
+	if ( ((fd=open(path, O_RDONLY)) == -1) || (fstat(fd, &st) == -1) ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
-			wload, strerror(errno) );
+			path, strerror(errno) );
+		if ( fd != -1 ) {
+			close( fd );
+		}
 		return( -1 );
 	}
 
-	// While file not done
-	while (!feof(fhandle)) {
+	// Map it (an empty file has nothing to map)
+	*data = NULL;
+	*size = st.st_size;
+	if ( st.st_size > 0 ) {
+		*data = mmap( NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0 );
+		if ( *data == MAP_FAILED ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure mapping the workload file [%s], error: %s.\n",
+				path, strerror(errno) );
+			close( fd );
+			return( -1 );
+		}
+		madvise( *data, st.st_size, MADV_SEQUENTIAL );
+	}
+	close( fd );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_close
+// Description  : Close every file the replay has open (the batch must be
+//                committed)
+//
+// Inputs       : state - the replay state
+// Outputs      : 0 if successful, -1 if failure
 
-		// Get the line and bail out on fail
-		if (fgets(line, 2048, fhandle) != NULL) {
+int simulate_close( HddSimulationState *state ) {
 
-			// Parse out the string
-			linecount ++;
-			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
-			sep = strchr(line, ':');
-			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%s], line %d",
-						line, linecount );
-				fclose( fhandle );
-				return( -1 );
+	// Local variables
+	HddSimulationTable *ftable = state->ftable;
+	int idx;
+
+	for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+
+		// If file in use, close if
+		if (ftable[idx].filename != NULL) {
+			// Log the file close
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
+			if (hdd_close(ftable[idx].fhandle) == -1) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
+				return(-1);
 			}
+			free(ftable[idx].filename);
+			ftable[idx].filename = NULL;
+			if ( state->slots != NULL ) {
+				state->slots[ftable[idx].file] = -1;
+			}
+		}
+
+	}
+	return( 0 );
+}
 
-			// Just log the contents
-			logMessage(LOG_INFO_LEVEL, "File [%s], command [%s], len=%d, offset=%d",
-					fname, command, len, off);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_state_init
+// Description  : Setup the state of a replay
+//
+// Inputs       : state - the replay state
+//                files - the file IDs of a trace (0 for a text workload)
+// Outputs      : none
 
-			// Now process the commands
-			if (strncmp(command, "FORMAT", 6) == 0) {
+void simulate_state_init( HddSimulationState *state, uint32_t files ) {
 
-				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
+	// Local variables
+	uint32_t f;
+
+	// Nothing open, traces find their open files by ID
+	memset( state, 0x0, sizeof(HddSimulationState) );
+	if ( files > 0 ) {
+		state->slots = malloc( sizeof(int16_t) * files );
+		for (f=0; f<files; f++) {
+			state->slots[f] = -1;
+		}
+	}
+}
 
-				// Now perform the format
-				if (hdd_format() != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
-					return(-1);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_parse
+// Description  : Split the next workload line ("<file> <command> <len> <off> :<text>")
+//                into its fields, in place (the file name is NUL terminated
+//                where it ends)
+//
+// Inputs       : next - start of the line, moved past it
+//                end - end of the workload
+//                line - set to the fields
+// Outputs      : 1 if a line was parsed, 0 at the end of the workload, -1 if it is bad
 
-			} else if (strncmp(command, "MOUNT", 5) == 0) {
+int simulate_parse( char **next, char *end, HddSimulationLine *line ) {
 
-				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
+	// Local variables
+	char *p = *next, *eol, *tok;
+	int32_t *numbers[2] = { &line->len, &line->off };
+	int64_t value;
+	int i, negative;
+
+	// Find the end of the line (the newline belongs to the text)
+	if ( p >= end ) {
+		return( 0 );
+	}
+	eol = memchr( p, '\n', end - p );
+	eol = (eol == NULL) ? end : eol + 1;
+	*next = eol;
+	line->start = p;
+	line->length = eol - p;
+
+	// File name and command
+	for (i=0; i<2; i++) {
+		while ( (p < eol) && ((*p == ' ') || (*p == '\t')) ) {
+			p++;
+		}
+		tok = p;
+		while ( (p < eol) && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r') ) {
+			p++;
+		}
+		if ( (p == tok) || (p == eol) ) {
+			return( -1 );
+		}
+		if ( i == 0 ) {
+			line->fname = tok;
+			*p = 0x0;
+		} else {
+			line->command = simulate_command( tok, p - tok );
+		}
+		p++;
+	}
 
-				// Now perform the filesystem mount
-				if (hdd_mount() != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
-					return(-1);
-				}
+	// Length and offset
+	for (i=0; i<2; i++) {
+		while ( (p < eol) && ((*p == ' ') || (*p == '\t')) ) {
+			p++;
+		}
+		negative = (p < eol) && (*p == '-');
+		if ( (p < eol) && ((*p == '-') || (*p == '+')) ) {
+			p++;
+		}
+		if ( (p == eol) || (*p < '0') || (*p > '9') ) {
+			return( -1 );
+		}
+		for (value=0; (p < eol) && (*p >= '0') && (*p <= '9') && (value <= INT32_MAX); p++) {
+			value = value * 10 + (*p - '0');
+		}
+		if ( value > INT32_MAX ) {
+			return( -1 );
+		}
+		*numbers[i] = (int32_t) (negative ? -value : value);
+	}
+
+	// The text follows the separator
+	tok = memchr( line->fname, ':', eol - line->fname );
+	if ( tok == NULL ) {
+		return( -1 );
+	}
+	line->text = tok + 1;
+	line->avail = eol - line->text;
+	return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_command
+// Description  : Identify a workload command
+//
+// Inputs       : tok - the command name (not NUL terminated)
+//                len - its length
+// Outputs      : the HDD_SIM_COMMANDS value (HDD_SIM_UNKNOWN if not a command)
+
+int simulate_command( const char *tok, size_t len ) {
+
+	// Switch on the first letter, then check the whole name
+	switch ( tok[0] ) {
+	case 'F':
+		return( ((len == 6) && (memcmp(tok, "FORMAT", 6) == 0)) ? HDD_SIM_FORMAT : HDD_SIM_UNKNOWN );
+	case 'M':
+		return( ((len == 5) && (memcmp(tok, "MOUNT", 5) == 0)) ? HDD_SIM_MOUNT : HDD_SIM_UNKNOWN );
+	case 'U':
+		return( ((len == 7) && (memcmp(tok, "UNMOUNT", 7) == 0)) ? HDD_SIM_UNMOUNT : HDD_SIM_UNKNOWN );
+	case 'W':
+		if ( (len == 5) && (memcmp(tok, "WRITE", 5) == 0) ) {
+			return( HDD_SIM_WRITE );
+		}
+		return( ((len == 7) && (memcmp(tok, "WRITEAT", 7) == 0)) ? HDD_SIM_WRITEAT : HDD_SIM_UNKNOWN );
+	case 'S':
+		return( ((len == 4) && (memcmp(tok, "SEEK", 4) == 0)) ? HDD_SIM_SEEK : HDD_SIM_UNKNOWN );
+	case 'R':
+		return( ((len == 4) && (memcmp(tok, "READ", 4) == 0)) ? HDD_SIM_READ : HDD_SIM_UNKNOWN );
+	default:
+		return( HDD_SIM_UNKNOWN );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_workload
+// Description  : Replay the lines of a workload
+//
+// Inputs       : data - the workload (writable, lines are tokenized in place)
+//                size - its length in bytes
+// Outputs      : 0 if successful test, -1 if failure
 
-			} else if (strncmp(command, "UNMOUNT", 5) == 0) {
+int simulate_workload( char *data, size_t size ) {
 
-				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
+	// Local variables
+	char *next = data, *end = data + size, *star;
+	HddSimulationState state;
+	HddSimulationLine line;
+	int32_t linecount = 0;
+	int parsed;
 
-				// Finished, close all of the files
-				for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+	// Setup the file table
+	simulate_state_init( &state, 0 );
 
-					// If file in use, close if
-					if (ftable[idx].filename != NULL) {
-						// Log the file close
-						logMessage(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
-						if (hdd_close(ftable[idx].fhandle) == -1) {
-							// Failed, error out
-							logMessage(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
-							return(-1);
-						}
-						free(ftable[idx].filename);
-						ftable[idx].filename = NULL;
-					}
+	// While workload not done
+	while ( (parsed = simulate_parse(&next, end, &line)) != 0 ) {
 
-				}
+		// Bail out on lines that do not parse
+		linecount ++;
+		if ( parsed < 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%.*s], line %d",
+					(int) line.length, line.start, linecount );
+			return( -1 );
+		}
 
-				// Now perform the filesystem unmount
-				if (hdd_unmount() != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
-					return(-1);
-				}
+		// The text is written where it lies, with its line breaks restored
+		if ( (line.command == HDD_SIM_WRITE) || (line.command == HDD_SIM_WRITEAT) ) {
+			CMPSC_ASSERT2(((line.len >= 0) && (line.avail >= (size_t) line.len)), "Workload str [%d<%d]", (int) line.avail, line.len);
+			for (star=line.text; (star = memchr(star, '*', line.text + line.len - star)) != NULL; star++) {
+				*star = '\n';
+			}
+		}
 
+		// Now process the command
+		if ( simulate_execute(&state, &line, linecount) ) {
+			return( -1 );
+		}
+	}
 
-			} else {
+	// Workload done, successfully
+	if ( simulate_batch_commit(state.batch_bufs, &state.batch_ops) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD batch of file operations failed, aborting simulation.");
+		return(-1);
+	}
+	return( 0 );
+}
 
-				//
-				// File operations
-
-				// Now walk the the table looking for the file
-				idx = -1;
-				i = 0;
-				while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-					if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-						idx = i;
-					}
-					i++;
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_trace
+// Description  : Replay the op records of a compiled trace (files are found
+//                by ID and payloads are written from the mapping, nothing is
+//                parsed or copied)
+//
+// Inputs       : data - the trace
+//                size - its length in bytes
+// Outputs      : 0 if successful test, -1 if failure
 
-				// File is not found, open the file
-				if (idx == -1) {
-
-					// Log message, find unused index and save filename for later use
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", fname);
-					idx = 0;
-					while ((ftable[idx].filename != NULL) && (idx < HDD_SIM_MAX_OPEN_FILES)) {
-						idx++;
-					}
-					CMPSC_ASSERT1(idx<HDD_SIM_MAX_OPEN_FILES, "Too many open files on HDD sim [%d]", idx);
-					ftable[idx].filename = strdup(fname);
-
-					// Now perform the open
-					ftable[idx].fhandle = hdd_open(ftable[idx].filename);
-					if (ftable[idx].fhandle == -1) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-						return(-1);
-					}
+int simulate_trace( char *data, size_t size ) {
 
-				}
+	// Local variables
+	HddSimulationState state;
+	HddTrace trace;
+	int ret;
+
+	// Find the sections, then replay the records
+	if ( simulate_trace_load(data, size, &trace) ) {
+		return( -1 );
+	}
+	simulate_state_init( &state, trace.header.files );
+	ret = simulate_trace_replay( &trace, &state, 0, 0 );
+
+	// Trace done
+	if ( (ret == 0) && simulate_batch_commit(state.batch_bufs, &state.batch_ops) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD batch of file operations failed, aborting simulation.");
+		ret = -1;
+	}
+	free( trace.fnames );
+	free( state.slots );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_trace_load
+// Description  : Find the sections of a trace and check that they fit it
+//                and that every record is valid
+//
+// Inputs       : data - the trace
+//                size - its length in bytes
+//                trace - set to the sections (fnames is allocated)
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_trace_load( char *data, size_t size, HddTrace *trace ) {
+
+	// Local variables
+	char *names, *name;
+	HddTraceOp *op;
+	uint32_t f, command, file;
+	uint64_t i;
+
+	// Check that the sections fit the file
+	if ( size < sizeof(HddTraceHeader) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD trace is truncated, aborting." );
+		return( -1 );
+	}
+	memcpy( &trace->header, data, sizeof(HddTraceHeader) );
+	if ( (trace->header.ops > (size - sizeof(HddTraceHeader)) / sizeof(HddTraceOp)) ||
+	     (size - sizeof(HddTraceHeader) - trace->header.ops*sizeof(HddTraceOp) != (uint64_t) trace->header.names + trace->header.data) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD trace sections do not match its size, aborting." );
+		return( -1 );
+	}
+	trace->ops = (HddTraceOp *) (data + sizeof(HddTraceHeader));
+	names = (char *) (trace->ops + trace->header.ops);
+	trace->payloads = names + trace->header.names;
+
+	// Find the file names, they must all end inside the name section
+	trace->fnames = malloc( sizeof(char *) * ((trace->header.files > 0) ? trace->header.files : 1) );
+	for (f=0, name=names; f<trace->header.files; f++) {
+		if ( (name == trace->payloads) || (memchr(name, 0x0, trace->payloads - name) == NULL) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD trace file name %u is truncated, aborting.", f );
+			free( trace->fnames );
+			return( -1 );
+		}
+		trace->fnames[f] = name;
+		name += strlen(name) + 1;
+	}
+
+	// Check the fields the text parser would have, so that a replay never starts on a bad record
+	for (i=0; i<trace->header.ops; i++) {
+		op = &trace->ops[i];
+		command = op->command >> HDD_TRACE_FILE_BITS;
+		file = op->command & ((1 << HDD_TRACE_FILE_BITS) - 1);
+		if ( (command <= HDD_SIM_UNKNOWN) || (command > HDD_SIM_READ) ||
+		     ((command > HDD_SIM_UNMOUNT) && (file >= trace->header.files)) ||
+		     (((command == HDD_SIM_WRITE) || (command == HDD_SIM_WRITEAT)) &&
+		      ((op->len < 0) || ((uint64_t) op->payload + op->len > trace->header.data))) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD bad trace record %lu, aborting.", (unsigned long) i );
+			free( trace->fnames );
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_trace_open
+// Description  : Map a workload or trace file as a trace (a text workload is
+//                compiled into one in memory)
+//
+// Inputs       : wload - the name of the file
+//                trace - set to the trace
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_trace_open( char *wload, HddTrace *trace ) {
+
+	// Local variables
+	uint64_t magic = 0;
+	size_t length = 0;
+	int ret = 0;
+
+	// Map the file, compile it if it is text
+	trace->image = NULL;
+	if ( simulate_map(wload, &trace->data, &trace->size) ) {
+		return( -1 );
+	}
+	if ( trace->size >= sizeof(magic) ) {
+		memcpy( &magic, trace->data, sizeof(magic) );
+	}
+	if ( magic != HDD_TRACE_MAGIC ) {
+		ret = simulate_build( trace->data, trace->size, &trace->image, &length );
+	}
+
+	// Find the sections
+	if ( (ret == 0) && simulate_trace_load(trace->image ? trace->image : trace->data,
+			trace->image ? length : trace->size, trace) ) {
+		ret = -1;
+	}
+	if ( ret != 0 ) {
+		free( trace->image );
+		if ( trace->data != NULL ) {
+			munmap( trace->data, trace->size );
+		}
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_trace_close
+// Description  : Release a trace from simulate_trace_open
+//
+// Inputs       : trace - the trace
+// Outputs      : none
+
+void simulate_trace_close( HddTrace *trace ) {
+	free( trace->fnames );
+	free( trace->image );
+	if ( trace->data != NULL ) {
+		munmap( trace->data, trace->size );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_trace_replay
+// Description  : Run the op records of a trace.  A parallel worker only runs
+//                the operations on its own files (ID modulo workers), the
+//                device is set up for it and UNMOUNT just closes its files.
+//
+// Inputs       : trace - the trace
+//                state - the replay state
+//                worker - the worker (0 to workers-1)
+//                workers - the number of workers (0 to run the whole trace)
+// Outputs      : 0 if successful, -1 if failure
 
-				// Now execute the specific command
-				if (strncmp(command, "WRITEAT", 7) == 0) {
-
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
-
-					// First perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off)) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
-
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
-
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
-
-				} else if (strncmp(command, "WRITE", 5) == 0) {
-
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
-
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", len, fname);
-
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
-
-				} else if (strncmp(command, "SEEK", 4) == 0) {
-
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", off, fname);
-
-					// Now perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
-
-				} else if (strncmp(command, "READ", 4) == 0) {
-
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", len, fname);
-
-					// Now perform the read
-					rbuf = malloc(len);
-					if (hdd_read(ftable[idx].fhandle, rbuf, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
-					free(rbuf);
-					rbuf = NULL;
-
-				} else {
-
-					// Bomb out, don't understand the command
-					CMPSC_ASSERT1(0, "HDD_SIM : Failed, unknown command [%s]", command);
+int simulate_trace_replay( HddTrace *trace, HddSimulationState *state, uint32_t worker, uint32_t workers ) {
 
+	// Local variables
+	HddSimulationLine line;
+	HddTraceOp *op;
+	struct timespec due;
+	uint64_t i, when = 0;
+
+	// Walk the records
+	for (i=0; i<trace->header.ops; i++) {
+
+		// The records were checked when the trace was loaded
+		op = &trace->ops[i];
+		line.command = op->command >> HDD_TRACE_FILE_BITS;
+		line.file = op->command & ((1 << HDD_TRACE_FILE_BITS) - 1);
+		line.len = op->len;
+		line.off = op->off;
+		line.text = trace->payloads + op->payload;
+		line.avail = line.len;
+		line.fname = (line.command > HDD_SIM_UNMOUNT) ? trace->fnames[line.file] : "-";
+
+		// Workers skip the files of the others and leave the device alone
+		if ( workers > 0 ) {
+			if ( line.command == HDD_SIM_UNMOUNT ) {
+				if ( simulate_batch_commit(state->batch_bufs, &state->batch_ops) || simulate_close(state) ) {
+					logMessage(LOG_ERROR_LEVEL, "HDD worker %u failed closing its files, aborting.", worker);
+					return( -1 );
 				}
 			}
-
-			// Check for the virtual level failing
-			if ( err ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD system failed, aborting [%d]", err );
-				fclose( fhandle );
-				return( -1 );
+			if ( (line.command <= HDD_SIM_UNMOUNT) || (line.file % workers != worker) ) {
+				continue;
 			}
 		}
-	}
 
-	// Close the workload file, successfully
-	fclose( fhandle );
+		// A load runs each record when it is due (or late, right away) and times it from then
+		if ( state->latency != NULL ) {
+			when = state->start + i * state->interval;
+			due.tv_sec = when / 1000000000;
+			due.tv_nsec = when % 1000000000;
+			while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR );
+		}
+
+		// Now process the command
+		if ( simulate_execute(state, &line, (int32_t) i + 1) ) {
+			return( -1 );
+		}
+		if ( state->latency != NULL ) {
+			hdd_histogram_record( &state->latency[line.command], simulate_now() - when );
+		}
+	}
 	return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : extract_file_from_hdd
-// Description  : Extract a file from the HDD file system
+// Function     : simulate_execute
+// Description  : Run one workload command (file operations are grouped into
+//                batches, device commands commit the batch before them)
 //
-// Inputs       : ex_file - the name of the file to extract
-// Outputs      : 0 if successful test, -1 if failure
+// Inputs       : state - the replay state
+//                line - the command and its fields
+//                linecount - its line number (or record number)
+// Outputs      : 0 if successful, -1 if failure
 
-int extract_file_from_hdd(char *ex_file) {
+int simulate_execute( HddSimulationState *state, HddSimulationLine *line, int32_t linecount ) {
 
 	// Local variables
-	int16_t fd;
-	int32_t len;
-	char buf[HDD_MAX_BLOCK_SIZE];
-    int fhandle, flags;
-    mode_t mode;
-	// Open the file, read from it, close it
-	if ( (hdd_mount()) || ((fd = hdd_open(ex_file)) == -1) ||
-		 ((len = hdd_read(fd, buf, HDD_MAX_BLOCK_SIZE)) == -1) ||
-		 (hdd_close(fd) == -1)	) {
-		// Error out
-		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+	HddSimulationTable *ftable = state->ftable;
+	uint64_t start;
+	char *rbuf;
+	int idx, i;
+
+	// Just log the contents
+	logMessage(LOG_INFO_LEVEL, "File [%s], command [%d], len=%d, offset=%d",
+			line->fname, line->command, line->len, line->off);
+
+	// Device commands end the batch of file operations before them
+	if ( ((line->command == HDD_SIM_FORMAT) || (line->command == HDD_SIM_MOUNT) ||
+	      (line->command == HDD_SIM_UNMOUNT)) && simulate_batch_commit(state->batch_bufs, &state->batch_ops) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD batch of file operations failed, aborting simulation.");
 		return(-1);
 	}
 
-    // Setup the file for creating and open
-    flags = O_WRONLY|O_CREAT|O_EXCL; // Create a NEW file (no overwrite)
-    mode = S_IRUSR|S_IWUSR|S_IRGRP;   // User can read/write, group read
-    fhandle = open(ex_file, flags, mode);
-    if ( fhandle == -1 ) {
-        fprintf( stderr, "HDD: extraction open() failed, error=%s\n", strerror(errno) );
-        return( -1 );
-    }
+	// Now process the commands
+	switch ( line->command ) {
+	case HDD_SIM_FORMAT:
 
-    // Now write the read bytes to the file, then close
-    if (write(fhandle, buf, len) != len) {
-        fprintf( stderr, "HDD: extraction write() failed, error=%s\n", strerror(errno) );
-        return( -1 );
-    }
-    close( fhandle );
+		// Log the command executed
+		logMessage(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
 
-    // Return successfully
-	return( 0 );
+		// Now perform the format
+		if (hdd_format() != line->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
+			return(-1);
+		}
+		break;
+
+	case HDD_SIM_MOUNT:
+
+		// Log the command executed
+		logMessage(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
+
+		// Now perform the filesystem mount
+		if (hdd_mount() != line->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+			return(-1);
+		}
+		break;
+
+	case HDD_SIM_UNMOUNT:
+
+		// Log the command executed
+		logMessage(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
+
+		// Finished, close all of the files, then perform the filesystem unmount
+		if ( simulate_close(state) ) {
+			return(-1);
+		}
+		if (hdd_unmount() != line->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+			return(-1);
+		}
+		break;
+
+	default:
+
+		// Bomb out, don't understand the command
+		CMPSC_ASSERT1(line->command != HDD_SIM_UNKNOWN, "HDD_SIM : Failed, unknown command on line [%d]", linecount);
+
+		//
+		// File operations, consecutive ones are grouped into batches (not under a load, each is timed)
+		if ( (state->latency == NULL) && (state->batch_ops == 0) && hdd_batch_begin() ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD batch begin failed, aborting simulation.");
+			return(-1);
+		}
+		state->batch_bufs[state->batch_ops] = NULL;
+
+		// Traces know the table index of their open files, otherwise walk the table looking for the file
+		idx = -1;
+		if ( state->slots != NULL ) {
+			idx = state->slots[line->file];
+		} else {
+			i = 0;
+			while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
+				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,line->fname) == 0) ) {
+					idx = i;
+				}
+				i++;
+			}
+		}
+
+		// File is not found, open the file
+		if (idx == -1) {
+
+			// Log message, find unused index and save filename for later use
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", line->fname);
+			idx = 0;
+			while ((idx < HDD_SIM_MAX_OPEN_FILES) && (ftable[idx].filename != NULL)) {
+				idx++;
+			}
+			CMPSC_ASSERT1(idx<HDD_SIM_MAX_OPEN_FILES, "Too many open files on HDD sim [%d]", idx);
+			ftable[idx].filename = strdup(line->fname);
+			ftable[idx].file = line->file;
+			if ( state->slots != NULL ) {
+				state->slots[line->file] = idx;
+			}
+
+			// Now perform the open
+			start = (state->latency != NULL) ? simulate_now() : 0;
+			ftable[idx].fhandle = hdd_open(ftable[idx].filename);
+			if ( state->latency != NULL ) {
+				hdd_histogram_record( &state->latency[HDD_SIM_OPEN], simulate_now() - start );
+			}
+			if (ftable[idx].fhandle == -1) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", line->fname);
+				return(-1);
+			}
+
+		}
+
+		// Now execute the specific command
+		switch ( line->command ) {
+		case HDD_SIM_WRITEAT:
+		case HDD_SIM_WRITE:
+
+			// Log the command executed, WRITEAT seeks first
+			if ( line->command == HDD_SIM_WRITE ) {
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", line->len, line->fname);
+			} else {
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", line->len, line->off, line->fname);
+				if (hdd_seek(ftable[idx].fhandle, line->off)) {
+					// Failed, error out
+					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", line->fname, line->off);
+					return(-1);
+				}
+			}
+
+			// Now perform the write
+			if (hdd_write(ftable[idx].fhandle, line->text, line->len) != line->len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", line->fname, line->len);
+				return(-1);
+			}
+			state->bytes += line->len;
+			break;
+
+		case HDD_SIM_SEEK:
+
+			// Log the command executed
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", line->off, line->fname);
+
+			// Now perform the seek
+			if (hdd_seek(ftable[idx].fhandle, line->off) != line->len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", line->fname, line->off);
+				return(-1);
+			}
+			break;
+
+		default: // HDD_SIM_READ
+
+			// Log the command executed
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", line->len, line->fname);
+
+			// Now perform the read
+			rbuf = malloc(line->len);
+			if (hdd_read(ftable[idx].fhandle, rbuf, line->len) != line->len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", line->fname, line->off);
+				return(-1);
+			}
+			// The data may land in the buffer as late as the batch commit
+			state->batch_bufs[state->batch_ops] = rbuf;
+			rbuf = NULL;
+			state->bytes += line->len;
+			break;
+		}
+
+		// Commit full batches, unbatched reads are done
+		state->ops ++;
+		if ( state->latency != NULL ) {
+			free( state->batch_bufs[state->batch_ops] );
+			break;
+		}
+		state->batch_ops ++;
+		if ( (state->batch_ops == HDD_SIM_BATCH_OPS) && simulate_batch_commit(state->batch_bufs, &state->batch_ops) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD batch of file operations failed, aborting simulation.");
+			return(-1);
+		}
+		break;
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_batch_commit
+// Description  : Commit the open batch of file operations (if any) and release
+//                the read buffers it used
+//
+// Inputs       : rbufs - the read buffers of the batch (NULL for other operations)
+//                ops - the number of operations in the batch, reset to 0
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_batch_commit( char **rbufs, int *ops ) {
+
+	// Local variables
+	int i, ret;
+
+	// Nothing open
+	if ( *ops == 0 ) {
+		return( 0 );
+	}
+
+	// Commit, then the buffers can go
+	ret = hdd_batch_commit();
+	for (i=0; i<*ops; i++) {
+		free( rbufs[i] );
+	}
+	*ops = 0;
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_compile
+// Description  : Compile a workload into a trace file
+//
+// Inputs       : wload - the name of the workload file
+//                trace - the name of the trace file to write
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_compile( char *wload, char *trace ) {
+
+	// Local variables
+	char *data, *image = NULL;
+	size_t size, length = 0;
+	int ret;
+	FILE *fh;
+
+	// Map and compile the workload
+	if ( simulate_map(wload, &data, &size) ) {
+		return( -1 );
+	}
+	ret = simulate_build( data, size, &image, &length );
+	if ( data != NULL ) {
+		munmap( data, size );
+	}
+
+	// Write the trace
+	if ( ret == 0 ) {
+		if ( (fh = fopen(trace, "w")) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure creating the trace file [%s], error: %s.\n", trace, strerror(errno) );
+			ret = -1;
+		} else if ( (fwrite(image, 1, length, fh) != length) | (fclose(fh) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure writing the trace file [%s], error: %s.\n", trace, strerror(errno) );
+			ret = -1;
+		}
+	}
+	free( image );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_build
+// Description  : Compile a workload into a trace image: file names become
+//                IDs, lines become fixed size op records and each distinct
+//                WRITE text is stored once (with its line breaks restored)
+//
+// Inputs       : data - the workload (writable, lines are tokenized in place)
+//                size - its length in bytes
+//                image - set to the trace (allocated)
+//                length - set to its length in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_build( char *data, size_t size, char **image, size_t *length ) {
+
+	// Local variables
+	char *next = data, *end = data + size, *star, *names = NULL, *payloads = NULL;
+	size_t nused = 0, nsize = 0, pused = 0, psize = 0, oused = 0, osize = 0, raw = 0;
+	HddTraceOp *ops = NULL;
+	HddTraceHeader header;
+	HddTraceEntry *entry;
+	HddSimulationLine line;
+	HTable fnames, texts;
+	uint32_t files = 0;
+	int32_t linecount = 0;
+	int parsed = 1, ret = 0;
+
+	// Setup the tables
+	initHashTable( &fnames, HDD_TRACE_HASH_BITS );
+	initHashTable( &texts, HDD_TRACE_HASH_BITS );
+
+	// Turn each line into a record
+	while ( (ret == 0) && ((parsed = simulate_parse(&next, end, &line)) > 0) ) {
+
+		// Only known commands go into the trace
+		linecount ++;
+		if ( line.command == HDD_SIM_UNKNOWN ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD unknown workload command, line %d", linecount );
+			ret = -1;
+			break;
+		}
+		if ( oused == osize ) {
+			osize = (osize == 0) ? 1024 : osize*2;
+			ops = realloc( ops, osize * sizeof(HddTraceOp) );
+		}
+		memset( &ops[oused], 0x0, sizeof(HddTraceOp) );
+		ops[oused].command = (uint32_t) line.command << HDD_TRACE_FILE_BITS;
+		ops[oused].len = line.len;
+		ops[oused].off = line.off;
+
+		// File operations name the file by ID
+		if ( line.command > HDD_SIM_UNMOUNT ) {
+			entry = simulate_intern( &fnames, &names, &nused, &nsize, line.fname, strlen(line.fname)+1 );
+			if ( entry->id == UINT32_MAX ) {
+				entry->id = files++;
+			}
+			ops[oused].command |= entry->id;
+		}
+
+		// Writes point at their text
+		if ( ((line.command == HDD_SIM_WRITE) || (line.command == HDD_SIM_WRITEAT)) && (line.len != 0) ) {
+			if ( (line.len < 0) || (line.avail < (size_t) line.len) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD workload text shorter than its length [%d<%d], line %d",
+						(int) line.avail, line.len, linecount );
+				ret = -1;
+				break;
+			}
+			for (star=line.text; (star = memchr(star, '*', line.text + line.len - star)) != NULL; star++) {
+				*star = '\n';
+			}
+			entry = simulate_intern( &texts, &payloads, &pused, &psize, line.text, line.len );
+			ops[oused].payload = entry->offset;
+			raw += line.len;
+		}
+		oused ++;
+
+		// The records and header only have room for so many files and payload bytes
+		if ( (files >= (1 << HDD_TRACE_FILE_BITS)) || (nused > UINT32_MAX) || (pused > UINT32_MAX) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD workload too large for a trace, line %d", linecount );
+			ret = -1;
+		}
+	}
+	if ( parsed < 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%.*s], line %d",
+				(int) line.length, line.start, linecount );
+		ret = -1;
+	}
+
+	// Lay out the header and the sections
+	if ( ret == 0 ) {
+		header.magic = HDD_TRACE_MAGIC;
+		header.ops = oused;
+		header.files = files;
+		header.names = nused;
+		header.data = pused;
+		header.unused = 0;
+		*length = sizeof(HddTraceHeader) + oused*sizeof(HddTraceOp) + nused + pused;
+		*image = malloc( *length );
+		memcpy( *image, &header, sizeof(HddTraceHeader) );
+		memcpy( *image + sizeof(HddTraceHeader), ops, oused*sizeof(HddTraceOp) );
+		memcpy( *image + sizeof(HddTraceHeader) + oused*sizeof(HddTraceOp), names, nused );
+		memcpy( *image + sizeof(HddTraceHeader) + oused*sizeof(HddTraceOp) + nused, payloads, pused );
+		logMessage( LOG_INFO_LEVEL, "HDD_SIM : Compiled %d lines, %u files, %lu payload bytes (%lu written)",
+				linecount, files, (unsigned long) pused, (unsigned long) raw );
+	}
+
+	// Cleanup and return
+	cleanupHashTable( &fnames );
+	cleanupHashTable( &texts );
+	free( ops );
+	free( names );
+	free( payloads );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_intern
+// Description  : Find a run of bytes already added to a section, or append it
+//
+// Inputs       : ht - the table of the section (FNV-1a hash -> entry, bytes
+//                     that hash alike but differ take the next free value)
+//                buf - the section, grown as needed
+//                used - bytes of the section in use
+//                size - bytes of the section allocated
+//                data - the bytes
+//                len - their length
+// Outputs      : the entry (its id is UINT32_MAX when it is new)
+
+HddTraceEntry * simulate_intern( HTable *ht, char **buf, size_t *used, size_t *size, const char *data, size_t len ) {
+
+	// Local variables
+	HddTraceEntry *entry;
+	HtIndexValue key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	// Hash the bytes, then look for them
+	for (i=0; i<len; i++) {
+		hash ^= (uint8_t) data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	for (key=(HtIndexValue) hash; (entry = findValueInHashTable(ht, key)) != NULL; key++) {
+		if ( (entry->length == len) && (memcmp(*buf + entry->offset, data, len) == 0) ) {
+			return( entry );
+		}
+	}
+
+	// Not there, append them
+	if ( *used + len > *size ) {
+		while ( *used + len > *size ) {
+			*size = (*size == 0) ? 4096 : *size*2;
+		}
+		*buf = realloc( *buf, *size );
+	}
+	memcpy( *buf + *used, data, len );
+	entry = malloc( sizeof(HddTraceEntry) );
+	entry->offset = *used;
+	entry->length = len;
+	entry->id = UINT32_MAX;
+	*used += len;
+	insertValueInHashTable( ht, key, entry );
+	return( entry );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_parallel
+// Description  : Replay a workload with 1 to clients parallel clients and
+//                report the throughput of each round.  The files are split
+//                between the clients (per-file order is all a workload
+//                depends on), each client is a process with its own
+//                connection as the client library holds one per process.
+//
+// Inputs       : wload - the name of the workload (or trace) file
+//                clients - the most clients (0 for one per core)
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_parallel( char *wload, uint32_t clients ) {
+
+	// Local variables
+	HddSimulationResult total;
+	HddTrace trace;
+	uint32_t n;
+	double secs, base = 0;
+	int ret = 0;
+
+	// The clients share the device through the server
+	if ( hdd_network_transport == HDD_TRANSPORT_EMBEDDED ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay needs a server, not the embedded transport." );
+		return( -1 );
+	}
+	if ( clients == 0 ) {
+		clients = sysconf( _SC_NPROCESSORS_ONLN );
+	}
+
+	// Get the workload as a trace
+	if ( simulate_trace_open(wload, &trace) ) {
+		return( -1 );
+	}
+
+	// Replay with more and more clients
+	for (n=1; (n<=clients) && (ret == 0); n++) {
+		if ( (ret = simulate_parallel_round(&trace, n, &total, &secs)) == 0 ) {
+			if ( n == 1 ) {
+				base = total.ops / secs;
+			}
+			logMessage( LOG_OUTPUT_LEVEL, "HDD_SIM : %2u client(s) : %lu ops in %.3fs, %.0f ops/s, %.2f MB/s, %.2fx one client",
+					n, (unsigned long) total.ops, secs, total.ops / secs, total.bytes / secs / (1024*1024),
+					total.ops / secs / base );
+		}
+	}
+	simulate_trace_close( &trace );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_parallel_round
+// Description  : Format the device, then replay a trace with workers clients.
+//                The clock runs from when every client has mounted to when
+//                the last one has closed its files.  The file table is saved
+//                after that with the records the clients send back.
+//
+// Inputs       : trace - the trace
+//                workers - the number of clients
+//                total - set to the operations and bytes of all the clients
+//                secs - set to the time they took
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_parallel_round( HddTrace *trace, uint32_t workers, HddSimulationResult *total, double *secs ) {
+
+	// Local variables
+	int ready[2], go[2], fds[2], *results, status, failed = 0;
+	HddSimulationResult result;
+	struct timespec start, end;
+	uint32_t w;
+	pid_t pid;
+	char c;
+
+	// Format the device in a child, this process never connects so the workers start clean
+	pid = fork();
+	if ( pid == 0 ) {
+		_exit( (hdd_format() || hdd_mount() || hdd_unmount()) ? 1 : 0 );
+	}
+	if ( (pid == -1) || (waitpid(pid, &status, 0) == -1) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay failed formatting the device." );
+		return( -1 );
+	}
+
+	// Start the workers, they wait for the go once they are mounted
+	if ( pipe(ready) || pipe(go) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay pipe failed, error: %s", strerror(errno) );
+		return( -1 );
+	}
+	results = malloc( sizeof(int) * workers );
+	for (w=0; w<workers; w++) {
+		results[w] = -1;
+	}
+	for (w=0; w<workers; w++) {
+		if ( pipe(fds) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD parallel replay pipe failed, error: %s", strerror(errno) );
+			failed = 1;
+			break;
+		}
+		if ( (pid = fork()) == 0 ) {
+			close( ready[0] );
+			close( go[1] );
+			close( fds[0] );
+			simulate_parallel_worker( trace, w, workers, ready[1], go[0], fds[1] );
+		}
+		close( fds[1] );
+		results[w] = fds[0];
+		if ( pid == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD parallel replay fork failed, error: %s", strerror(errno) );
+			failed = 1;
+			break;
+		}
+	}
+	close( ready[1] );
+	close( go[0] );
+
+	// Let them go together, then collect what they did
+	for (w=0; (w<workers) && (read(ready[0], &c, 1) == 1); w++);
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	for (w=0; w<workers; w++) {
+		if ( write(go[1], "g", 1) != 1 ) {
+			break;
+		}
+	}
+	close( go[1] );
+	memset( total, 0x0, sizeof(HddSimulationResult) );
+	for (w=0; w<workers; w++) {
+		if ( (results[w] == -1) || (read(results[w], &result, sizeof(result)) != sizeof(result)) ) {
+			failed = 1;
+			continue;
+		}
+		total->ops += result.ops;
+		total->bytes += result.bytes;
+		failed |= (result.ret != 0);
+	}
+	clock_gettime( CLOCK_MONOTONIC, &end );
+	close( ready[0] );
+
+	// Save the file table with the files of all of them (in a child, as for the format)
+	if ( !failed ) {
+		pid = fork();
+		if ( pid == 0 ) {
+			_exit( simulate_parallel_save(results, workers) ? 1 : 0 );
+		}
+		if ( (pid == -1) || (waitpid(pid, &status, 0) == -1) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0) ) {
+			failed = 1;
+		}
+	}
+	for (w=0; w<workers; w++) {
+		if ( results[w] != -1 ) {
+			close( results[w] );
+		}
+	}
+	while ( wait(&status) > 0 );
+	free( results );
+
+	// Check that every client made it
+	if ( failed ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay with %u client(s) failed.", workers );
+		return( -1 );
+	}
+	*secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_parallel_worker
+// Description  : Replay the files of one worker with its own connection (runs
+//                in a child, never returns).  Its file table is not saved, the
+//                records of its files are sent back instead.
+//
+// Inputs       : trace - the trace
+//                worker - the worker (0 to workers-1)
+//                workers - the number of workers
+//                ready - pipe to say it is mounted
+//                go - pipe to wait on before starting
+//                results - pipe for its HddSimulationResult, then (if it
+//                          succeeded) the length of its records and the records
+// Outputs      : none
+
+void simulate_parallel_worker( HddTrace *trace, uint32_t worker, uint32_t workers, int ready, int go, int results ) {
+
+	// Local variables
+	HddSimulationState state;
+	HddSimulationResult result = { 0, 0, 0 };
+	int16_t *fhs = malloc( sizeof(int16_t) * (trace->header.files + 1) );
+	char *image = NULL, c = 'r';
+	uint32_t f, count = 0, len = 0;
+
+	// Mount, then wait for the others
+	simulate_state_init( &state, trace->header.files );
+	if ( hdd_mount() ) {
+		result.ret = -1;
+	} else if ( hdd_server_capabilities == 0 ) {
+		// Legacy servers (no capabilities) do not keep concurrent clients apart
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay needs a server that takes concurrent clients." );
+		result.ret = -1;
+	}
+	if ( write(ready, &c, 1) != 1 ) {
+		result.ret = -1;
+	}
+	close( ready ); // The parent sees the end of the pipe even if a worker dies
+	if ( read(go, &c, 1) != 1 ) {
+		result.ret = -1;
+	}
+
+	// Replay, the files are closed (flushed) at the end but the device stays mounted
+	if ( result.ret == 0 ) {
+		if ( simulate_trace_replay(trace, &state, worker, workers) ||
+		     simulate_batch_commit(state.batch_bufs, &state.batch_ops) || simulate_close(&state) ) {
+			result.ret = -1;
+		}
+	}
+	result.ops = state.ops;
+	result.bytes = state.bytes;
+
+	// Describe its files (every one it has, the device was formatted for the round)
+	for (f=worker; (f<trace->header.files) && (result.ret == 0); f+=workers) {
+		if ( (fhs[count++] = hdd_open(trace->fnames[f])) == -1 ) {
+			result.ret = -1;
+		}
+	}
+	if ( (result.ret == 0) && ((image = hdd_export_files(fhs, count, &len)) == NULL) ) {
+		result.ret = -1;
+	}
+	while ( (result.ret == 0) && (count > 0) ) {
+		hdd_close( fhs[--count] );
+	}
+	if ( (write(results, &result, sizeof(result)) != sizeof(result)) ||
+	     ((result.ret == 0) && ((write(results, &len, sizeof(len)) != sizeof(len)) || (write(results, image, len) != len))) ) {
+		_exit( 1 );
+	}
+	_exit( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_parallel_save
+// Description  : Add the files the workers of a round send back to the file
+//                table and save it (their results were read already)
+//
+// Inputs       : results - the pipes of the workers
+//                workers - the number of workers
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_parallel_save( int *results, uint32_t workers ) {
+
+	// Local variables
+	uint32_t w, len;
+	char *image;
+	ssize_t got;
+	size_t have;
+	int ret = 0;
+
+	// Mount, then add the records of each worker
+	if ( hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay failed mounting the device to save its files." );
+		return( -1 );
+	}
+	for (w=0; (w<workers) && (ret == 0); w++) {
+		if ( read(results[w], &len, sizeof(len)) != sizeof(len) ) {
+			ret = -1;
+			break;
+		}
+		image = malloc( len );
+		for (have=0; (have<len) && ((got = read(results[w], image + have, len - have)) > 0); have+=got);
+		if ( (have != len) || hdd_import_files(image, len) ) {
+			ret = -1;
+		}
+		free( image );
+	}
+
+	// The unmount saves the table
+	if ( hdd_unmount() || (ret != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel replay failed saving the files of its workers." );
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_load
+// Description  : Replay a workload open loop: record i is due rate/s * i
+//                after the start whether or not the ones before it are done,
+//                and its latency runs from when it was due, so a slow
+//                operation shows in the latency of the ones queued behind it
+//                rather than lowering the load.  Reports the latency of each
+//                kind of operation and the rate achieved.
+//
+// Inputs       : wload - the name of the workload (or trace) file
+//                rate - the operations (records) per second
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_load( char *wload, uint32_t rate ) {
+
+	// Local variables
+	static const char *names[HDD_SIM_LATENCIES] = { "-", "FORMAT", "MOUNT", "UNMOUNT", "WRITE", "WRITEAT", "SEEK", "READ", "OPEN" };
+	HDD_HISTOGRAM latency[HDD_SIM_LATENCIES];
+	HddSimulationState state;
+	HddTrace trace;
+	double secs;
+	int ret, c;
+
+	// Get the workload as a trace, setup the histograms
+	if ( simulate_trace_open(wload, &trace) ) {
+		return( -1 );
+	}
+	for (c=0; c<HDD_SIM_LATENCIES; c++) {
+		hdd_histogram_init( &latency[c] );
+	}
+	simulate_state_init( &state, trace.header.files );
+	state.latency = latency;
+	state.interval = 1000000000 / rate;
+
+	// Run it on the schedule (the default timer slack would make every wakeup 50us late)
+	prctl( PR_SET_TIMERSLACK, 1 );
+	state.start = simulate_now();
+	ret = simulate_trace_replay( &trace, &state, 0, 0 );
+	secs = (simulate_now() - state.start) / 1e9;
+	simulate_trace_close( &trace );
+	free( state.slots );
+	if ( ret != 0 ) {
+		return( -1 );
+	}
+
+	// Report
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_SIM : %lu operations in %.3fs, %.0f ops/s (target %u ops/s)",
+			(unsigned long) trace.header.ops, secs, trace.header.ops / secs, rate );
+	for (c=0; c<HDD_SIM_LATENCIES; c++) {
+		if ( latency[c].count > 0 ) {
+			logMessage( LOG_OUTPUT_LEVEL, "HDD_SIM : %-7s %8lu ops  p50 %9.1fus  p99 %9.1fus  p99.9 %9.1fus  max %9.1fus",
+					names[c], (unsigned long) latency[c].count,
+					hdd_histogram_percentile(&latency[c], 50) / 1e3, hdd_histogram_percentile(&latency[c], 99) / 1e3,
+					hdd_histogram_percentile(&latency[c], 99.9) / 1e3, latency[c].max / 1e3 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_now
+// Description  : Get the time of the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds
+
+uint64_t simulate_now( void ) {
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return( (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_generate
+// Description  : Generate a synthetic workload, and compile it into a trace
+//
+// Inputs       : spec - the spec of the workload (see hdd_generate.h)
+//                wload - the workload file to write
+//                trace - the trace to compile it into (NULL for none)
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_generate( char *spec, char *wload, char *trace ) {
+	HDD_GENERATE_SPEC parsed;
+
+	// Parse the spec and write the workload
+	if ( hdd_generate_parse(spec, &parsed) || hdd_generate_workload(&parsed, wload) ) {
+		return( -1 );
+	}
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_SIM : generated %lu operations on %u files into [%s]",
+			(unsigned long) parsed.ops, parsed.files, wload );
+
+	// Then the trace, if asked
+	if ( (trace != NULL) && simulate_compile(wload, trace) ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import
+// Description  : Import host files into the hdd filesystem, each one streamed
+//                into hdd_write in HDD_SIM_IMPORT_CHUNK pieces
+//
+// Inputs       : paths - the host files
+//                count - how many
+//                parallel - 1 to import with several clients
+//                clients - how many (0 for one per core)
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_import( char **paths, uint32_t count, int parallel, uint32_t clients ) {
+
+	// Local variables
+	HddImportFile *files = calloc( count, sizeof(HddImportFile) );
+	struct stat st;
+	uint64_t bytes = 0, start;
+	uint32_t i, j;
+	int16_t fh;
+	double secs;
+	int ret = 0;
+
+	// Check the files before anything is written, names must be unique in the filesystem
+	for (i=0; (i<count) && (ret == 0); i++) {
+		files[i].path = paths[i];
+		files[i].name = (strrchr(paths[i], '/') != NULL) ? strrchr(paths[i], '/') + 1 : paths[i];
+		if ( (stat(paths[i], &st) == -1) || !S_ISREG(st.st_mode) ||
+		     (files[i].name[0] == '\0') || (strlen(files[i].name) >= MAX_FILENAME_LENGTH) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD import of [%s] impossible, not a regular file with a short name.", paths[i] );
+			ret = -1;
+		}
+		files[i].size = st.st_size;
+		bytes += files[i].size;
+		for (j=0; (j<i) && (ret == 0); j++) {
+			if ( strcmp(files[i].name, files[j].name) == 0 ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD import of [%s] and [%s] would write the same file.", paths[j], paths[i] );
+				ret = -1;
+			}
+		}
+	}
+
+	// The file table has to describe them all (sizes are checked there too)
+	if ( ret == 0 ) {
+		ret = simulate_import_fits( files, count );
+	}
+
+	// Import them here, or with parallel clients
+	start = simulate_now();
+	if ( (ret == 0) && parallel ) {
+		if ( clients == 0 ) {
+			clients = sysconf( _SC_NPROCESSORS_ONLN );
+		}
+		ret = simulate_import_parallel( files, count, (clients < count) ? clients : count );
+	} else if ( ret == 0 ) {
+		if ( hdd_mount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD import failed mounting the device (is it formatted?)." );
+			ret = -1;
+		} else {
+			// Now with the files already there
+			ret = simulate_import_fits( files, count );
+		}
+		for (i=0; (i<count) && (ret == 0); i++) {
+			ret = simulate_import_file( &files[i], &fh );
+		}
+		if ( (ret == 0) && hdd_unmount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD import failed unmounting the device." );
+			ret = -1;
+		}
+		clients = 1;
+	}
+
+	// Report the throughput
+	if ( ret == 0 ) {
+		secs = (simulate_now() - start) / 1e9;
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_SIM : imported %u file(s), %.2f MB in %.3fs, %.2f MB/s with %u client(s)",
+				count, bytes / (1024.0*1024), secs, bytes / secs / (1024*1024), clients );
+	}
+	free( files );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import_file
+// Description  : Stream a host file into a file of the mounted hdd filesystem
+//                (the host file is mapped, so the chunks go to hdd_write
+//                without being copied first)
+//
+// Inputs       : file - the host file
+//                fh - set to the handle of the hdd file (closed when done)
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_import_file( HddImportFile *file, int16_t *fh ) {
+
+	// Local variables
+	char *data;
+	size_t size, done, chunk;
+	int ret = 0;
+
+	// Map the host file and open the hdd one
+	if ( simulate_map(file->path, &data, &size) ) {
+		return( -1 );
+	}
+	if ( (*fh = hdd_open(file->name)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD import failed opening [%s].", file->name );
+		ret = -1;
+	} else if ( hdd_seek(*fh, size + 1) == 0 ) {
+		// Files cannot shrink, a longer one would keep its tail
+		logMessage( LOG_ERROR_LEVEL, "HDD import of [%s] impossible, the hdd file is longer than the host file.", file->name );
+		ret = -1;
+	}
+
+	// Write it in large chunks, then flush it
+	for (done=0; (done<size) && (ret == 0); done+=chunk) {
+		chunk = (size - done < HDD_SIM_IMPORT_CHUNK) ? size - done : HDD_SIM_IMPORT_CHUNK;
+		if ( hdd_write(*fh, data + done, chunk) != chunk ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD import failed writing [%s] at %lu.", file->name, (unsigned long) done );
+			ret = -1;
+		}
+	}
+	if ( (ret == 0) && hdd_close(*fh) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD import failed closing [%s].", file->name );
+		ret = -1;
+	}
+	if ( data != NULL ) {
+		munmap( data, size );
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import_parallel
+// Description  : Import host files with several clients.  Each client writes
+//                its files and sends back their file table records; this
+//                process then adds them to the file table and saves it once
+//                (the clients' own tables are never saved, they would
+//                overwrite each other)
+//
+// Inputs       : files - the host files
+//                count - how many
+//                workers - the number of clients
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_import_parallel( HddImportFile *files, uint32_t count, uint32_t workers ) {
+
+	// Local variables
+	int *results = malloc( sizeof(int) * workers ), fds[2], status, failed = 0;
+	uint64_t *load = calloc( workers, sizeof(uint64_t) );
+	HddSimulationResult result;
+	uint32_t i, w, len, done = 0;
+	char *image;
+	ssize_t got;
+	size_t have;
+	pid_t pid;
+
+	// The clients share the device through the server
+	if ( hdd_network_transport == HDD_TRANSPORT_EMBEDDED ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel import needs a server, not the embedded transport." );
+		free( results );
+		free( load );
+		return( -1 );
+	}
+
+	// Largest files first, each to the least loaded client
+	qsort( files, count, sizeof(HddImportFile), simulate_import_compare );
+	for (i=0; i<count; i++) {
+		for (w=0, files[i].worker=0; w<workers; w++) {
+			if ( load[w] < load[files[i].worker] ) {
+				files[i].worker = w;
+			}
+		}
+		load[files[i].worker] += files[i].size;
+	}
+
+	// Start the clients, each with a pipe for its records
+	for (w=0; w<workers; w++) {
+		results[w] = -1;
+	}
+	for (w=0; (w<workers) && !failed; w++) {
+		if ( pipe(fds) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD parallel import pipe failed, error: %s", strerror(errno) );
+			failed = 1;
+			break;
+		}
+		if ( (pid = fork()) == 0 ) {
+			close( fds[0] );
+			simulate_import_worker( files, count, w, fds[1] );
+		}
+		close( fds[1] );
+		results[w] = fds[0];
+		if ( pid == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD parallel import fork failed, error: %s", strerror(errno) );
+			failed = 1;
+		}
+	}
+
+	// Mount once they are done, and add the files of each one
+	for (w=0; w<workers; w++) {
+		if ( results[w] == -1 ) {
+			continue;
+		}
+		if ( !failed && (read(results[w], &result, sizeof(result)) == sizeof(result)) && (result.ret == 0) &&
+		     (read(results[w], &len, sizeof(len)) == sizeof(len)) ) {
+			image = malloc( len );
+			for (have=0; (have<len) && ((got = read(results[w], image + have, len - have)) > 0); have+=got);
+			if ( (have == len) && ((done > 0) || (hdd_mount() == 0)) && (hdd_import_files(image, len) == 0) ) {
+				done ++;
+			} else {
+				failed = 1;
+			}
+			free( image );
+		} else {
+			failed = 1;
+		}
+		close( results[w] );
+	}
+	while ( wait(&status) > 0 );
+
+	// Save the file table with all of them
+	if ( failed || (done != workers) || hdd_unmount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel import with %u client(s) failed.", workers );
+		failed = 1;
+	}
+	free( results );
+	free( load );
+	return( failed ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import_worker
+// Description  : Import the host files of one client of a parallel import and
+//                send their file table records back (does not return)
+//
+// Inputs       : files - the host files
+//                count - how many
+//                worker - the index of this client
+//                results - where the records go (a result, their length,
+//                          then the records)
+// Outputs      : none
+
+void simulate_import_worker( HddImportFile *files, uint32_t count, uint32_t worker, int results ) {
+
+	// Local variables
+	HddSimulationResult result = { 0, 0, 0 };
+	int16_t *fhs = malloc( sizeof(int16_t) * count );
+	char *image = NULL;
+	uint32_t i, len = 0;
+
+	// Import its files
+	if ( hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD import failed mounting the device (is it formatted?)." );
+		result.ret = -1;
+	} else if ( hdd_server_capabilities == 0 ) {
+		// Legacy servers (no capabilities) do not keep concurrent clients apart
+		logMessage( LOG_ERROR_LEVEL, "HDD parallel import needs a server that takes concurrent clients." );
+		result.ret = -1;
+	}
+	for (i=0; (i<count) && (result.ret == 0); i++) {
+		if ( files[i].worker == worker ) {
+			result.ret = simulate_import_file( &files[i], &fhs[result.ops] );
+			result.ops ++;
+			result.bytes += files[i].size;
+		}
+	}
+
+	// Then describe them
+	if ( (result.ret == 0) && ((image = hdd_export_files(fhs, result.ops, &len)) == NULL) ) {
+		result.ret = -1;
+	}
+	if ( (write(results, &result, sizeof(result)) != sizeof(result)) ||
+	     ((result.ret == 0) && ((write(results, &len, sizeof(len)) != sizeof(len)) || (write(results, image, len) != len))) ) {
+		_exit( 1 );
+	}
+	_exit( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import_fits
+// Description  : Check that the file table can still be saved once host files
+//                are imported: it lives in one block, one extent record per
+//                HDD_EXTENT_SIZE of file data, about 2 GB of files in all
+//
+// Inputs       : files - the host files
+//                count - how many
+// Outputs      : 0 if they fit, -1 if not
+
+int simulate_import_fits( HddImportFile *files, uint32_t count ) {
+
+	// Local variables
+	char **names = malloc( sizeof(char *) * count );
+	uint64_t *sizes = malloc( sizeof(uint64_t) * count ), length;
+	uint32_t i;
+
+	for (i=0; i<count; i++) {
+		names[i] = files[i].name;
+		sizes[i] = files[i].size;
+	}
+	length = hdd_meta_import_length( names, sizes, count );
+	free( names );
+	free( sizes );
+	if ( length > HDD_MAX_BLOCK_SIZE ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD import impossible, the file table would take %lu bytes, more than one block (%u bytes, about 2 GB of files).",
+				(unsigned long) length, HDD_MAX_BLOCK_SIZE );
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_import_compare
+// Description  : Order host files from the largest for qsort
+//
+// Inputs       : a, b - the files
+// Outputs      : -1, 0 or 1
+
+int simulate_import_compare( const void *a, const void *b ) {
+	uint64_t x = ((const HddImportFile *) a)->size, y = ((const HddImportFile *) b)->size;
+	return( (x < y) - (x > y) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extract_file_from_hdd
+// Description  : Extract a file from the HDD file system
+//
+// Inputs       : ex_file - the name of the file to extract
+// Outputs      : 0 if successful test, -1 if failure
+
+int extract_file_from_hdd(char *ex_file) {
+
+	// Local variables
+	int16_t fd;
+	int32_t len;
+	char buf[HDD_MAX_BLOCK_SIZE];
+    int fhandle, flags;
+    mode_t mode;
+	// Mount the device and open the file
+	if ( (hdd_mount()) || ((fd = hdd_open(ex_file)) == -1) ) {
+		// Error out
+		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+		return(-1);
+	}
+
+    // Setup the file for creating and open
+    flags = O_WRONLY|O_CREAT|O_EXCL; // Create a NEW file (no overwrite)
+    mode = S_IRUSR|S_IWUSR|S_IRGRP;   // User can read/write, group read
+    fhandle = open(ex_file, flags, mode);
+    if ( fhandle == -1 ) {
+        fprintf( stderr, "HDD: extraction open() failed, error=%s\n", strerror(errno) );
+        return( -1 );
+    }
+
+    // Files span several extents now, copy them over in chunks
+    while ( (len = hdd_read(fd, buf, HDD_MAX_BLOCK_SIZE)) > 0 ) {
+        if (write(fhandle, buf, len) != len) {
+            fprintf( stderr, "HDD: extraction write() failed, error=%s\n", strerror(errno) );
+            close( fhandle );
+            return( -1 );
+        }
+    }
+    close( fhandle );
+    if ( (len == -1) || (hdd_close(fd) == -1) ) {
+		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+		return(-1);
+    }
+
+    // Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_sparse
+// Description  : Create a sparse host file of a size (no disk space is used)
+//
+// Inputs       : path - the host file
+//                size - its size
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_sparse( char *path, uint64_t size ) {
+	int fd = open( path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR );
+	if ( (fd == -1) || ftruncate(fd, size) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot create [%s].", path );
+		if ( fd != -1 ) {
+			close( fd );
+		}
+		return( -1 );
+	}
+	close( fd );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_import
+// Description  : Check that imports the file table could not describe are
+//                refused before anything is written (the device must be
+//                formatted and unmounted)
+//
+// Inputs       : dir - a scratch directory
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_import( char *dir ) {
+
+	// Local variables
+	char big[256], part_a[256], part_b[256], *paths[2];
+	HddImportFile file = { part_a, "part_a.bin", HDD_SIM_UNIT_TEST_PART_FILE, 0 };
+	char *names[] = { "big.bin", "part_a.bin", "part_b.bin" };
+	int16_t fh;
+	int ret = 0, i;
+
+	snprintf( big, sizeof(big), "%s/%s", dir, names[0] );
+	snprintf( part_a, sizeof(part_a), "%s/%s", dir, names[1] );
+	snprintf( part_b, sizeof(part_b), "%s/%s", dir, names[2] );
+	if ( simulate_unit_test_sparse(big, HDD_SIM_UNIT_TEST_BIG_FILE) ||
+	     simulate_unit_test_sparse(part_a, HDD_SIM_UNIT_TEST_PART_FILE) ||
+	     simulate_unit_test_sparse(part_b, HDD_SIM_UNIT_TEST_PART_FILE) ) {
+		ret = -1;
+	}
+
+	// One file too large, then two that only fit one at a time
+	paths[0] = big;
+	if ( (ret == 0) && (simulate_import(paths, 1, 0, 0) != -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : import of a 3 GB file was not refused." );
+		ret = -1;
+	}
+	paths[0] = part_a;
+	paths[1] = part_b;
+	if ( (ret == 0) && ((simulate_import(paths, 2, 0, 0) != -1) || (simulate_import(paths, 2, 1, 2) != -1)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : import of two 1.1 GB files was not refused." );
+		ret = -1;
+	}
+	if ( (ret == 0) && simulate_import_fits(&file, 1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : a 1.1 GB file does not fit the file table." );
+		ret = -1;
+	}
+
+	// None of them got any data
+	if ( (ret == 0) && hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : mount failed." );
+		ret = -1;
+	}
+	for (i=0; (i<3) && (ret == 0); i++) {
+		if ( ((fh = hdd_open(names[i])) == -1) || (hdd_seek(fh, 1) == 0) || hdd_close(fh) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : refused import wrote [%s].", names[i] );
+			ret = -1;
+		}
+	}
+	if ( (ret == 0) && hdd_unmount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : unmount failed." );
+		ret = -1;
+	}
+
+	unlink( big );
+	unlink( part_a );
+	unlink( part_b );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_parse
+// Description  : Check the edge cases of the in-place workload tokenizer
+//
+// Inputs       : dir - a scratch directory
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_parse( char *dir ) {
+
+	// Local variables
+	static const struct {
+		const char *text;   // One line
+		int         parsed; // What simulate_parse returns
+		int32_t     len;    // Fields of a line that parses
+		int32_t     off;
+	} cases[] = {
+		{ "f.txt WRITE 5 0 hello\n", -1, 0, 0 },                 // No ':' before the text
+		{ "f.txt SEEK -5 -7 :\n", 1, -5, -7 },                    // Negative numbers parse as such
+		{ "f.txt READ +2147483647 -2147483647 :\n", 1, INT32_MAX, -INT32_MAX },
+		{ "f.txt READ 2147483648 0 :\n", -1, 0, 0 },              // Past INT32_MAX
+		{ "f.txt READ 1 -2147483649 :\n", -1, 0, 0 },
+		{ "f.txt READ 99999999999999999999999 0 :\n", -1, 0, 0 },
+		{ "f.txt READ 1x 0 :\n", -1, 0, 0 },
+		{ "f.txt READ - 0 :\n", -1, 0, 0 },
+		{ "f.txt READ\n", -1, 0, 0 },
+	};
+	char path[256], *buf, *next, *end, *data = NULL, *image = NULL;
+	size_t i, size, length;
+	HddSimulationLine line;
+	HddTrace trace;
+	int parsed, fd, ret = 0;
+
+	// Single lines
+	for (i=0; (i<sizeof(cases)/sizeof(cases[0])) && (ret == 0); i++) {
+		buf = strdup( cases[i].text );
+		next = buf;
+		end = buf + strlen( buf );
+		parsed = simulate_parse( &next, end, &line );
+		if ( (parsed != cases[i].parsed) || ((parsed == 1) && ((line.len != cases[i].len) || (line.off != cases[i].off) ||
+		     strcmp(line.fname, "f.txt") || (next != end))) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : bad parse of [%s].", cases[i].text );
+			ret = -1;
+		}
+		free( buf );
+	}
+
+	// The last line needs no newline
+	buf = strdup( "f.txt WRITE 3 0 :abc\ng.txt WRITE 3 1 :xyz" );
+	next = buf;
+	end = buf + strlen( buf );
+	if ( (ret == 0) && ((simulate_parse(&next, end, &line) != 1) || (line.avail != 4) || memcmp(line.text, "abc\n", 4) ||
+	     (simulate_parse(&next, end, &line) != 1) || strcmp(line.fname, "g.txt") || (line.off != 1) ||
+	     (line.avail != 3) || memcmp(line.text, "xyz", 3) || (simulate_parse(&next, end, &line) != 0)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : bad parse of a last line without a newline." );
+		ret = -1;
+	}
+	free( buf );
+
+	// Lines have no length limit (the old reader stopped at 1024 bytes)
+	buf = malloc( HDD_SIM_UNIT_TEST_LONG_LINE + 64 );
+	length = snprintf( buf, 64, "big.txt WRITE %d 0 :", HDD_SIM_UNIT_TEST_LONG_LINE );
+	memset( buf + length, 'x', HDD_SIM_UNIT_TEST_LONG_LINE );
+	length += HDD_SIM_UNIT_TEST_LONG_LINE;
+	buf[length++] = '\n';
+	next = buf;
+	if ( (ret == 0) && ((simulate_parse(&next, buf + length, &line) != 1) || strcmp(line.fname, "big.txt") ||
+	     (line.command != HDD_SIM_WRITE) || (line.len != HDD_SIM_UNIT_TEST_LONG_LINE) ||
+	     (line.avail != HDD_SIM_UNIT_TEST_LONG_LINE + 1) || (next != buf + length)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : bad parse of a %d byte line.", HDD_SIM_UNIT_TEST_LONG_LINE );
+		ret = -1;
+	}
+	free( buf );
+
+	// An empty workload maps to nothing, has no lines and compiles to an empty trace
+	snprintf( path, sizeof(path), "%s/empty.txt", dir );
+	if ( (ret == 0) && (((fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR)) == -1) || close(fd) ||
+	     simulate_map(path, &data, &size) || (data != NULL) || (size != 0)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot map an empty workload." );
+		ret = -1;
+	}
+	next = data;
+	if ( (ret == 0) && ((simulate_parse(&next, data + size, &line) != 0) || simulate_build(data, size, &image, &length) ||
+	     simulate_trace_load(image, length, &trace)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : bad parse of an empty workload." );
+		ret = -1;
+	} else if ( ret == 0 ) {
+		if ( (trace.header.ops != 0) || (trace.header.files != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : empty workload has records." );
+			ret = -1;
+		}
+		free( trace.fnames );
+	}
+	free( image );
+	unlink( path );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_trace
+// Description  : Check that a compiled trace has the records of its workload,
+//                stores equal payloads once and that damaged traces are
+//                refused when loaded
+//
+// Inputs       : dir - a scratch directory
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_trace( char *dir ) {
+
+	// Local variables
+	char path[256], *text = NULL, *data = NULL, *image = NULL, *copy = NULL, *next, *star;
+	char dups[] = "a.txt MOUNT 0 0 :\na.txt WRITE 11 0 :hello*world\nb.txt WRITE 11 0 :hello*world\n"
+	              "a.txt WRITEAT 5 3 :other\nb.txt READ 11 0 :\na.txt UNMOUNT 0 0 :\n";
+	size_t tsize = 0, dsize = 0, length = 0;
+	HDD_GENERATE_SPEC spec;
+	HddSimulationLine line;
+	HddTrace trace;
+	HddTraceOp *op;
+	uint64_t i = 0;
+	int parsed, loaded, ret = 0;
+
+	// Compile a generated workload, then parse it again and compare the records
+	snprintf( path, sizeof(path), "%s/generated.txt", dir );
+	if ( hdd_generate_parse(HDD_SIM_UNIT_TEST_SPEC, &spec) || hdd_generate_workload(&spec, path) ||
+	     simulate_map(path, &data, &dsize) || simulate_map(path, &text, &tsize) ||
+	     simulate_build(data, dsize, &image, &length) || simulate_trace_load(image, length, &trace) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot compile the generated workload." );
+		ret = -1;
+	}
+	loaded = (ret == 0);
+	for (next=text; (ret == 0) && ((parsed = simulate_parse(&next, text + tsize, &line)) != 0); i++) {
+		op = &trace.ops[i];
+		if ( (parsed < 0) || (i >= trace.header.ops) || ((op->command >> HDD_TRACE_FILE_BITS) != (uint32_t) line.command) ||
+		     (op->len != line.len) || (op->off != line.off) ||
+		     ((line.command > HDD_SIM_UNMOUNT) && strcmp(trace.fnames[op->command & ((1 << HDD_TRACE_FILE_BITS) - 1)], line.fname)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : trace record %lu differs from its line.", (unsigned long) i );
+			ret = -1;
+		} else if ( ((line.command == HDD_SIM_WRITE) || (line.command == HDD_SIM_WRITEAT)) && (line.len > 0) ) {
+			for (star=line.text; (star = memchr(star, '*', line.text + line.len - star)) != NULL; star++) {
+				*star = '\n';
+			}
+			if ( memcmp(trace.payloads + op->payload, line.text, line.len) != 0 ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : trace record %lu has the wrong payload.", (unsigned long) i );
+				ret = -1;
+			}
+		}
+	}
+	if ( (ret == 0) && (i != trace.header.ops) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : trace has %lu records for %lu lines.",
+				(unsigned long) trace.header.ops, (unsigned long) i );
+		ret = -1;
+	}
+
+	if ( loaded ) {
+		free( trace.fnames );
+	}
+
+	// A trace cut short or with a payload past the end of the file is refused
+	if ( ret == 0 ) {
+		copy = malloc( length );
+		memcpy( copy, image, length );
+		if ( (simulate_trace_load(copy, length - 1, &trace) != -1) || (simulate_trace_load(copy, sizeof(HddTraceHeader) - 1, &trace) != -1) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : truncated trace was loaded." );
+			ret = -1;
+		}
+		op = (HddTraceOp *) (copy + sizeof(HddTraceHeader));
+		for (i=0; (i < trace.header.ops) && (((op[i].command >> HDD_TRACE_FILE_BITS) != HDD_SIM_WRITE) || (op[i].len == 0)); i++);
+		if ( i < trace.header.ops ) {
+			op[i].payload = trace.header.data - op[i].len + 1;
+		}
+		if ( (ret == 0) && ((i == trace.header.ops) || (simulate_trace_load(copy, length, &trace) != -1)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : trace with a payload past its end was loaded." );
+			ret = -1;
+		}
+	}
+	free( copy );
+	free( image );
+	image = NULL;
+
+	// Equal texts share one payload
+	if ( (ret == 0) && (simulate_build(dups, strlen(dups), &image, &length) || simulate_trace_load(image, length, &trace)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot compile the duplicate payload workload." );
+		ret = -1;
+	} else if ( ret == 0 ) {
+		if ( (trace.header.ops != 6) || (trace.header.files != 2) || (trace.header.data != strlen("hello\nworldother")) ||
+		     (trace.ops[1].payload != trace.ops[2].payload) || (memcmp(trace.payloads + trace.ops[1].payload, "hello\nworld", 11) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : equal payloads are not stored once." );
+			ret = -1;
+		}
+		free( trace.fnames );
+	}
+
+	// Cleanup and return
+	free( image );
+	if ( data != NULL ) {
+		munmap( data, dsize );
+	}
+	if ( text != NULL ) {
+		munmap( text, tsize );
+	}
+	unlink( path );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_parallel
+// Description  : Check that parallel replays with 1 to HDD_SIM_UNIT_TEST_CLIENTS
+//                clients run every operation once and leave the files a
+//                replay by one process leaves (so the per-file order is kept)
+//
+// Inputs       : dir - a scratch directory
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_parallel( char *dir ) {
+
+	// Local variables
+	char path[256], **expected = NULL, **contents = NULL;
+	uint32_t *esizes = NULL, *sizes = NULL, f, n = 1;
+	HddSimulationResult total;
+	HDD_GENERATE_SPEC spec;
+	HddTrace trace;
+	uint64_t i, ops = 0;
+	double secs;
+	int opened = 0, ret = 0;
+
+	// The clients need a server
+	if ( hdd_network_transport == HDD_TRANSPORT_EMBEDDED ) {
+		logMessage( LOG_INFO_LEVEL, "HDD_SIM_UNIT_TEST : no parallel replay test with the embedded transport." );
+		return( 0 );
+	}
+
+	// Replay a generated workload in this process, keep what it wrote
+	snprintf( path, sizeof(path), "%s/parallel.txt", dir );
+	if ( hdd_generate_parse(HDD_SIM_UNIT_TEST_SPEC, &spec) || hdd_generate_workload(&spec, path) ||
+	     simulate_HDD(path) || simulate_trace_open(path, &trace) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot replay the parallel test workload." );
+		ret = -1;
+	} else {
+		opened = 1;
+		expected = calloc( trace.header.files, sizeof(char *) );
+		contents = calloc( trace.header.files, sizeof(char *) );
+		esizes = calloc( trace.header.files, sizeof(uint32_t) );
+		sizes = calloc( trace.header.files, sizeof(uint32_t) );
+		ret = simulate_unit_test_contents( &trace, expected, esizes );
+		if ( hdd_server_capabilities == 0 ) {
+			logMessage( LOG_INFO_LEVEL, "HDD_SIM_UNIT_TEST : no parallel replay test with a legacy server." );
+			n = HDD_SIM_UNIT_TEST_CLIENTS + 1;
+		}
+		for (i=0; i<trace.header.ops; i++) {
+			ops += ((trace.ops[i].command >> HDD_TRACE_FILE_BITS) > HDD_SIM_UNMOUNT);
+		}
+	}
+
+	// Then with more and more clients, each file must come out the same
+	for (; (n<=HDD_SIM_UNIT_TEST_CLIENTS) && (ret == 0); n++) {
+		if ( simulate_parallel_round(&trace, n, &total, &secs) || (total.ops != ops) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : %u client(s) ran %lu of %lu operations.",
+					n, (unsigned long) total.ops, (unsigned long) ops );
+			ret = -1;
+			break;
+		}
+		ret = simulate_unit_test_contents( &trace, contents, sizes );
+		for (f=0; (f<trace.header.files) && (ret == 0); f++) {
+			if ( (sizes[f] != esizes[f]) || memcmp(contents[f], expected[f], sizes[f]) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : [%s] differs after a replay with %u client(s).",
+						trace.fnames[f], n );
+				ret = -1;
+			}
+		}
+	}
+
+	// Cleanup and return
+	if ( opened ) {
+		for (f=0; f<trace.header.files; f++) {
+			free( expected[f] );
+			free( contents[f] );
+		}
+		free( expected );
+		free( contents );
+		free( esizes );
+		free( sizes );
+		simulate_trace_close( &trace );
+	}
+	unlink( path );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_unit_test_contents
+// Description  : Read the files of a trace from the device
+//
+// Inputs       : trace - the trace
+//                contents - set to the bytes of each file (freed first)
+//                sizes - set to their lengths
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_unit_test_contents( HddTrace *trace, char **contents, uint32_t *sizes ) {
+
+	// Local variables
+	int32_t got = 0;
+	uint32_t f;
+	int16_t fh;
+	int ret = 0;
+
+	// Read each file until a short read
+	if ( hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot mount the device to read the files." );
+		return( -1 );
+	}
+	for (f=0; (f<trace->header.files) && (ret == 0); f++) {
+		free( contents[f] );
+		contents[f] = NULL;
+		sizes[f] = 0;
+		if ( (fh = hdd_open(trace->fnames[f])) == -1 ) {
+			ret = -1;
+			break;
+		}
+		do {
+			contents[f] = realloc( contents[f], sizes[f] + HDD_SIM_IMPORT_CHUNK );
+			if ( (got = hdd_read(fh, contents[f] + sizes[f], HDD_SIM_IMPORT_CHUNK)) > 0 ) {
+				sizes[f] += got;
+			}
+		} while ( got == HDD_SIM_IMPORT_CHUNK );
+		if ( (got < 0) || hdd_close(fh) ) {
+			ret = -1;
+		}
+	}
+	if ( hdd_unmount() || (ret != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot read the files of the workload." );
+		ret = -1;
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddSimUnitTest
+// Description  : Perform a test of the simulator (the device must be
+//                formatted and unmounted)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddSimUnitTest( void ) {
+
+	// Local variables
+	char dir[] = "/tmp/hdd_sim_test.XXXXXX";
+	int ret;
+
+	if ( mkdtemp(dir) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SIM_UNIT_TEST : cannot create a scratch directory." );
+		return( -1 );
+	}
+	ret = simulate_unit_test_parse( dir );
+	if ( ret == 0 ) {
+		ret = simulate_unit_test_import( dir );
+	}
+	if ( ret == 0 ) {
+		ret = simulate_unit_test_trace( dir );
+	}
+	if ( ret == 0 ) {
+		ret = simulate_unit_test_parallel( dir );
+	}
+	rmdir( dir );
+
+	if ( ret == 0 ) {
+		logMessage( LOG_INFO_LEVEL, "HDD_SIM_UNIT_TEST : tests completed successfully." );
+	}
+	return( ret );
 }
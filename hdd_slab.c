@@ -0,0 +1,436 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_slab.c
+//  Description    : This is the implementation of the slab allocator for block
+//                   payloads.  Every chunk starts with a small header naming
+//                   its size class; free chunks are linked through that
+//                   header.  Each thread has a cache of chunks per class so
+//                   the lists of the classes (and their locks) are only
+//                   touched to refill or drain a cache.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Project Includes
+#include <hdd_slab.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_SLAB_MAGIC 0x5a5a // Header cookie, catches frees of foreign pointers
+#define HDD_SLAB_LARGE 0xffff // Class of requests above the largest class
+#define HDD_SLAB_CLASS_SIZE(cls) ((size_t) 1 << ((cls) + HDD_SLAB_MIN_SHIFT))
+#define HDD_SLAB_UNIT_TEST_ITERATIONS 20000
+#define HDD_SLAB_UNIT_TEST_SLOTS 128
+#define HDD_SLAB_UNIT_TEST_THREADS 4
+
+// Header of every chunk (16 bytes, so payloads keep malloc alignment)
+typedef struct HddSlabHeader {
+	struct HddSlabHeader *next;  // Next free chunk (while free)
+	uint32_t              size;  // Bytes requested (while in use)
+	uint16_t              cls;   // Size class (HDD_SLAB_LARGE for malloc'd requests)
+	uint16_t              magic; // HDD_SLAB_MAGIC
+} HDD_SLAB_HEADER;
+
+// A size class, its free chunks and statistics
+typedef struct {
+	pthread_mutex_t  lock;      // Protects the free list
+	HDD_SLAB_HEADER *free;      // Free chunks not held by a thread cache
+	atomic_ulong     live;      // Chunks in use
+	atomic_ulong     requested; // Bytes requested by the chunks in use
+	atomic_ulong     reserved;  // Slab bytes taken from the heap
+} HDD_SLAB_CLASS;
+
+// Chunks a thread keeps for one class
+typedef struct {
+	HDD_SLAB_HEADER *items[HDD_SLAB_CACHE_DEPTH];
+	uint32_t         count;
+} HDD_SLAB_CACHE;
+
+//
+// Global data
+
+static HDD_SLAB_CLASS hdd_slab_classes[HDD_SLAB_CLASSES];
+static pthread_once_t hdd_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  hdd_slab_key; // Drains the cache of an exiting thread
+static atomic_ulong   hdd_slab_large_live = 0, hdd_slab_large_bytes = 0;
+static __thread HDD_SLAB_CACHE hdd_slab_cache[HDD_SLAB_CLASSES]; // Chunks of this thread
+static __thread int hdd_slab_registered = 0; // This thread has its cache drained on exit
+
+//
+// Local helpers
+
+// Smallest class holding len bytes (HDD_SLAB_LARGE if none does)
+static uint16_t hdd_slab_class(size_t len) {
+	uint16_t cls = 0;
+
+	if (len > HDD_SLAB_CLASS_SIZE(HDD_SLAB_CLASSES-1))
+		return(HDD_SLAB_LARGE);
+	while (HDD_SLAB_CLASS_SIZE(cls) < len)
+		cls++;
+	return(cls);
+}
+
+// Chunks a thread cache keeps for a class
+static uint32_t hdd_slab_depth(uint16_t cls) {
+	size_t depth = HDD_SLAB_CACHE_BYTES / HDD_SLAB_CLASS_SIZE(cls);
+	if (depth < 1)
+		return(1);
+	return((depth > HDD_SLAB_CACHE_DEPTH) ? HDD_SLAB_CACHE_DEPTH : depth);
+}
+
+// Give count chunks of a thread cache back to their class
+static void hdd_slab_drain(HDD_SLAB_CACHE *cache, uint16_t cls, uint32_t count) {
+	HDD_SLAB_CLASS *class = &hdd_slab_classes[cls];
+	HDD_SLAB_HEADER *chunk;
+
+	pthread_mutex_lock(&class->lock);
+	while (count-- > 0 && cache->count > 0) {
+		chunk = cache->items[--cache->count];
+		chunk->next = class->free;
+		class->free = chunk;
+	}
+	pthread_mutex_unlock(&class->lock);
+}
+
+// Thread exit, everything the thread cached goes back to the classes
+static void hdd_slab_exit(void *caches) {
+	HDD_SLAB_CACHE *cache = caches;
+	uint16_t cls;
+
+	for (cls = 0; cls < HDD_SLAB_CLASSES; cls++)
+		hdd_slab_drain(&cache[cls], cls, cache[cls].count);
+}
+
+// One-time setup of the classes
+static void hdd_slab_setup(void) {
+	int cls;
+
+	for (cls = 0; cls < HDD_SLAB_CLASSES; cls++)
+		pthread_mutex_init(&hdd_slab_classes[cls].lock, NULL);
+	pthread_key_create(&hdd_slab_key, hdd_slab_exit);
+}
+
+// Make sure the cache of this thread is drained when the thread exits
+static void hdd_slab_register(void) {
+	if (!hdd_slab_registered) {
+		pthread_once(&hdd_slab_once, hdd_slab_setup);
+		pthread_setspecific(hdd_slab_key, hdd_slab_cache);
+		hdd_slab_registered = 1;
+	}
+}
+
+// Fill a thread cache from its class (carving a new slab if the class has nothing free)
+static int hdd_slab_refill(HDD_SLAB_CACHE *cache, uint16_t cls) {
+	HDD_SLAB_CLASS *class = &hdd_slab_classes[cls];
+	size_t chunk_size = sizeof(HDD_SLAB_HEADER) + HDD_SLAB_CLASS_SIZE(cls), count, i;
+	uint32_t want = (hdd_slab_depth(cls) + 1) / 2;
+	HDD_SLAB_HEADER *chunk;
+	char *slab;
+
+	hdd_slab_register();
+	pthread_mutex_lock(&class->lock);
+	if (class->free == NULL) {
+		count = HDD_SLAB_BYTES / chunk_size;
+		if (count < 1)
+			count = 1;
+		slab = malloc(count * chunk_size);
+		if (slab == NULL) {
+			pthread_mutex_unlock(&class->lock);
+			return(-1);
+		}
+		atomic_fetch_add_explicit(&class->reserved, count * chunk_size, memory_order_relaxed);
+		for (i = 0; i < count; i++) {
+			chunk = (HDD_SLAB_HEADER *) (slab + i * chunk_size);
+			chunk->cls = cls;
+			chunk->magic = HDD_SLAB_MAGIC;
+			chunk->next = class->free;
+			class->free = chunk;
+		}
+	}
+	while (want-- > 0 && class->free != NULL) {
+		cache->items[cache->count++] = class->free;
+		class->free = class->free->next;
+	}
+	pthread_mutex_unlock(&class->lock);
+	return(0);
+}
+
+// Header of an allocation (NULL if it is not one)
+static HDD_SLAB_HEADER *hdd_slab_header(void *ptr) {
+	HDD_SLAB_HEADER *chunk = (HDD_SLAB_HEADER *) ptr - 1;
+
+	if (chunk->magic != HDD_SLAB_MAGIC || (chunk->cls >= HDD_SLAB_CLASSES && chunk->cls != HDD_SLAB_LARGE)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD slab: bad pointer %p", ptr);
+		return(NULL);
+	}
+	return(chunk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_slab_alloc
+// Description  : Allocate a chunk of the smallest class that holds len bytes
+//
+// Inputs       : len - bytes needed
+// Outputs      : pointer to the bytes, NULL if out of memory
+
+void * hdd_slab_alloc(size_t len) {
+	uint16_t cls = hdd_slab_class(len);
+	HDD_SLAB_CACHE *cache;
+	HDD_SLAB_HEADER *chunk;
+
+	// Beyond the classes, plain heap memory with a header
+	if (cls == HDD_SLAB_LARGE) {
+		if (len > UINT32_MAX || (chunk = malloc(sizeof(HDD_SLAB_HEADER) + len)) == NULL)
+			return(NULL);
+		chunk->cls = HDD_SLAB_LARGE;
+		chunk->magic = HDD_SLAB_MAGIC;
+		chunk->size = len;
+		atomic_fetch_add_explicit(&hdd_slab_large_live, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&hdd_slab_large_bytes, len, memory_order_relaxed);
+		return(chunk + 1);
+	}
+
+	cache = &hdd_slab_cache[cls];
+	if (cache->count == 0 && (hdd_slab_refill(cache, cls) || cache->count == 0))
+		return(NULL);
+	chunk = cache->items[--cache->count];
+	chunk->size = len;
+	atomic_fetch_add_explicit(&hdd_slab_classes[cls].live, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hdd_slab_classes[cls].requested, len, memory_order_relaxed);
+	return(chunk + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_slab_free
+// Description  : Release a chunk into the cache of this thread (half of a
+//                full cache goes back to the class)
+//
+// Inputs       : ptr - the allocation (NULL is ignored)
+// Outputs      : none
+
+void hdd_slab_free(void *ptr) {
+	HDD_SLAB_HEADER *chunk;
+	HDD_SLAB_CACHE *cache;
+	uint32_t depth;
+
+	if (ptr == NULL || (chunk = hdd_slab_header(ptr)) == NULL)
+		return;
+	if (chunk->cls == HDD_SLAB_LARGE) {
+		atomic_fetch_sub_explicit(&hdd_slab_large_live, 1, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&hdd_slab_large_bytes, chunk->size, memory_order_relaxed);
+		chunk->magic = 0;
+		free(chunk);
+		return;
+	}
+
+	atomic_fetch_sub_explicit(&hdd_slab_classes[chunk->cls].live, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&hdd_slab_classes[chunk->cls].requested, chunk->size, memory_order_relaxed);
+	hdd_slab_register();
+	cache = &hdd_slab_cache[chunk->cls];
+	depth = hdd_slab_depth(chunk->cls);
+	if (cache->count >= depth)
+		hdd_slab_drain(cache, chunk->cls, (depth + 1) / 2);
+	cache->items[cache->count++] = chunk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_slab_realloc
+// Description  : Resize an allocation, in place while the new length fits its
+//                class, otherwise moved to a chunk of a larger class
+//
+// Inputs       : ptr - the allocation (NULL allocates)
+//                len - the new length
+// Outputs      : pointer to the bytes, NULL if out of memory (ptr is kept)
+
+void * hdd_slab_realloc(void *ptr, size_t len) {
+	HDD_SLAB_HEADER *chunk;
+	void *moved;
+
+	if (ptr == NULL)
+		return(hdd_slab_alloc(len));
+	if ((chunk = hdd_slab_header(ptr)) == NULL)
+		return(NULL);
+	if (chunk->cls != HDD_SLAB_LARGE && len <= HDD_SLAB_CLASS_SIZE(chunk->cls) &&
+	    (chunk->cls == 0 || len > HDD_SLAB_CLASS_SIZE(chunk->cls - 1))) {
+		atomic_fetch_add_explicit(&hdd_slab_classes[chunk->cls].requested, len - chunk->size, memory_order_relaxed);
+		chunk->size = len;
+		return(ptr);
+	}
+	moved = hdd_slab_alloc(len);
+	if (moved == NULL)
+		return(NULL);
+	memcpy(moved, ptr, (len < chunk->size) ? len : chunk->size);
+	hdd_slab_free(ptr);
+	return(moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_slab_stats
+// Description  : Gather the allocator statistics of all classes
+//
+// Inputs       : stats - filled with the statistics
+// Outputs      : none
+
+void hdd_slab_stats(HDD_SLAB_STATS *stats) {
+	uint64_t live;
+	int cls;
+
+	memset(stats, 0, sizeof(HDD_SLAB_STATS));
+	for (cls = 0; cls < HDD_SLAB_CLASSES; cls++) {
+		live = atomic_load_explicit(&hdd_slab_classes[cls].live, memory_order_relaxed);
+		stats->live_chunks += live;
+		stats->live_bytes += live * HDD_SLAB_CLASS_SIZE(cls);
+		stats->requested += atomic_load_explicit(&hdd_slab_classes[cls].requested, memory_order_relaxed);
+		stats->reserved += atomic_load_explicit(&hdd_slab_classes[cls].reserved, memory_order_relaxed);
+	}
+	stats->large_chunks = atomic_load_explicit(&hdd_slab_large_live, memory_order_relaxed);
+	stats->large_bytes = atomic_load_explicit(&hdd_slab_large_bytes, memory_order_relaxed);
+	stats->fragmentation = (stats->live_bytes > 0) ? 1.0 - (double) stats->requested / stats->live_bytes : 0.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_slab_log
+// Description  : Log the allocator statistics
+//
+// Inputs       : who - name of the user of the allocator (for the log)
+// Outputs      : none
+
+void hdd_slab_log(const char *who) {
+	HDD_SLAB_STATS stats;
+
+	hdd_slab_stats(&stats);
+	logMessage(LOG_INFO_LEVEL, "%s slab memory: %lu chunks live (%lu bytes, %lu requested, %.1f%% internal fragmentation), "
+			"%lu bytes reserved, %lu large (%lu bytes)", who,
+			(unsigned long) stats.live_chunks, (unsigned long) stats.live_bytes, (unsigned long) stats.requested,
+			stats.fragmentation * 100.0, (unsigned long) stats.reserved,
+			(unsigned long) stats.large_chunks, (unsigned long) stats.large_bytes);
+}
+
+// Unit test worker, allocates in one round and frees what another thread allocated in the next
+static void *hdd_slab_unit_thread(void *arg) {
+	char **slots = arg;
+	uint32_t i, len;
+
+	for (i=0; i<HDD_SLAB_UNIT_TEST_SLOTS; i++) {
+		hdd_slab_free(slots[i]);
+		len = (i * 7919) % (HDD_SLAB_CLASS_SIZE(HDD_SLAB_CLASSES-1) / 8) + 1;
+		slots[i] = hdd_slab_alloc(len);
+		if (slots[i] == NULL)
+			return((void *) 1);
+		memset(slots[i], (int) i, len);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddSlabUnitTest
+// Description  : Perform a test of the allocator: random allocations, resizes
+//                and frees checked against fill patterns, frees from other
+//                threads, and statistics back to where they started
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddSlabUnitTest(void) {
+	char *ptrs[HDD_SLAB_UNIT_TEST_SLOTS], *slots[HDD_SLAB_UNIT_TEST_THREADS][HDD_SLAB_UNIT_TEST_SLOTS], *moved;
+	uint32_t lens[HDD_SLAB_UNIT_TEST_SLOTS], len, j;
+	pthread_t threads[HDD_SLAB_UNIT_TEST_THREADS];
+	HDD_SLAB_STATS before, after;
+	void *result;
+	int i, slot, round, ret = -1;
+
+	hdd_slab_stats(&before);
+	memset(ptrs, 0, sizeof(ptrs));
+	memset(lens, 0, sizeof(lens));
+	memset(slots, 0, sizeof(slots));
+	for (i=0; i<HDD_SLAB_UNIT_TEST_ITERATIONS; i++) {
+		slot = getRandomValue(0, HDD_SLAB_UNIT_TEST_SLOTS-1);
+
+		// Whatever is in the slot must still hold its pattern
+		for (j=0; j<lens[slot]; j++) {
+			if (ptrs[slot][j] != (char) slot) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_SLAB_UNIT_TEST : chunk of slot %d corrupted.", slot);
+				goto cleanup;
+			}
+		}
+
+		// Sizes from a few bytes to past the largest class
+		len = getRandomValue(0, 3) ? getRandomValue(1, 4096) : getRandomValue(1, HDD_SLAB_CLASS_SIZE(HDD_SLAB_CLASSES-1) + 4096);
+		switch (getRandomValue(0, 2)) {
+		case 0: // Allocate (or replace)
+			hdd_slab_free(ptrs[slot]);
+			ptrs[slot] = hdd_slab_alloc(len);
+			break;
+
+		case 1: // Resize, the old bytes must follow
+			moved = hdd_slab_realloc(ptrs[slot], len);
+			if (moved == NULL)
+				break;
+			ptrs[slot] = moved;
+			if (lens[slot] > len)
+				lens[slot] = len;
+			memset(ptrs[slot] + lens[slot], slot, len - lens[slot]);
+			lens[slot] = len;
+			continue;
+
+		default: // Free
+			hdd_slab_free(ptrs[slot]);
+			ptrs[slot] = NULL;
+			len = 0;
+			break;
+		}
+		if (len > 0 && ptrs[slot] == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_SLAB_UNIT_TEST : allocation of %u bytes failed.", len);
+			goto cleanup;
+		}
+		lens[slot] = len;
+		if (len > 0)
+			memset(ptrs[slot], slot, len);
+	}
+
+	// Chunks allocated by one thread and freed by another (every thread is joined before giving up)
+	for (round=0, ret=0; round<HDD_SLAB_UNIT_TEST_THREADS && ret == 0; round++) {
+		for (i=0; i<HDD_SLAB_UNIT_TEST_THREADS; i++)
+			pthread_create(&threads[i], NULL, hdd_slab_unit_thread, slots[(i + round) % HDD_SLAB_UNIT_TEST_THREADS]);
+		for (i=0; i<HDD_SLAB_UNIT_TEST_THREADS; i++) {
+			pthread_join(threads[i], &result);
+			ret |= (result != NULL) ? -1 : 0;
+		}
+	}
+	if (ret != 0)
+		logMessage(LOG_ERROR_LEVEL, "HDD_SLAB_UNIT_TEST : thread allocation failed.");
+
+	// Cleanup, passed or not everything is freed
+cleanup:
+	for (i=0; i<HDD_SLAB_UNIT_TEST_SLOTS; i++)
+		hdd_slab_free(ptrs[i]);
+	for (i=0; i<HDD_SLAB_UNIT_TEST_THREADS; i++)
+		for (j=0; j<HDD_SLAB_UNIT_TEST_SLOTS; j++)
+			hdd_slab_free(slots[i][j]);
+	if (ret != 0)
+		return(-1);
+
+	// Everything was given back
+	hdd_slab_stats(&after);
+	if (after.live_chunks != before.live_chunks || after.requested != before.requested || after.large_chunks != before.large_chunks) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_SLAB_UNIT_TEST : statistics off after freeing everything [%lu/%lu chunks].",
+				(unsigned long) after.live_chunks, (unsigned long) before.live_chunks);
+		return(-1);
+	}
+	hdd_slab_log("HDD_SLAB_UNIT_TEST :");
+	logMessage(LOG_INFO_LEVEL, "HDD_SLAB_UNIT_TEST : slab unit test completed successfully.");
+	return(0);
+}
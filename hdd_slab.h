@@ -0,0 +1,65 @@
+#ifndef HDD_SLAB_INCLUDED
+#define HDD_SLAB_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_slab.h
+//  Description    : This is the header file for the slab allocator that backs
+//                   block payloads (object store, client block buffers and
+//                   cache).  Requests are rounded up to a power-of-two size
+//                   class, freed chunks are kept for reuse (first in a small
+//                   per-thread cache, then on the list of their class) and
+//                   never go back to the heap, so a long-running process
+//                   settles at its peak working set instead of fragmenting.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Defines
+#define HDD_SLAB_MIN_SHIFT 5  // Smallest size class (32 bytes)
+#define HDD_SLAB_MAX_SHIFT 20 // Largest size class (1MB, a whole HDD block), larger requests use malloc
+#define HDD_SLAB_CLASSES (HDD_SLAB_MAX_SHIFT - HDD_SLAB_MIN_SHIFT + 1)
+#define HDD_SLAB_BYTES 0x100000 // Memory carved into chunks at a time (at least one chunk)
+#define HDD_SLAB_CACHE_DEPTH 32 // Most chunks a thread keeps per class
+#define HDD_SLAB_CACHE_BYTES 0x40000 // Most bytes a thread keeps per class (at least one chunk)
+
+// Allocator statistics
+typedef struct {
+	uint64_t live_chunks;    // Chunks handed out and not freed
+	uint64_t live_bytes;     // Size class bytes of the live chunks
+	uint64_t requested;      // Bytes asked for by the live chunks
+	uint64_t reserved;       // Bytes taken from the heap for slabs
+	uint64_t large_chunks;   // Live requests above the largest class
+	uint64_t large_bytes;    // Bytes of those requests
+	double   fragmentation;  // Share of live_bytes not requested (internal fragmentation)
+} HDD_SLAB_STATS;
+
+//
+// Allocator interface
+
+void * hdd_slab_alloc(size_t len);
+	// Allocate len bytes, NULL if out of memory
+
+void * hdd_slab_realloc(void *ptr, size_t len);
+	// Resize an allocation (in place while it fits its class), NULL if out of memory
+
+void hdd_slab_free(void *ptr);
+	// Release an allocation (NULL is ignored)
+
+void hdd_slab_stats(HDD_SLAB_STATS *stats);
+	// Get the allocator statistics
+
+void hdd_slab_log(const char *who);
+	// Log the allocator statistics
+
+//
+// Unit testing for the module
+
+int hddSlabUnitTest(void);
+	// Perform a test of the allocator
+
+#endif
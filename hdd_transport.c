@@ -0,0 +1,454 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_transport.c
+//  Description    : This is the implementation of the local transports (see
+//                   hdd_transport.h).  Each ring has one producer and one
+//                   consumer, which only ever move their own position, so
+//                   the rings need no lock; a side that runs out of data (or
+//                   room) raises a wait flag and sleeps on its doorbell, the
+//                   other side rings it only when it finds the flag raised.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+// Project Includes
+#include <hdd_transport.h>
+#include <hdd_network.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_RING_MASK (HDD_RING_BYTES - 1)
+#define HDD_RING_DATA 0x1000 // Offset of the ring data in the segment (the control blocks come first)
+#define HDD_RING_SEGMENT (HDD_RING_DATA + 2 * HDD_RING_BYTES)
+#define HDD_RING_TEST_BYTES 0x4000000 // Bytes streamed through the ring by the unit test
+#define HDD_RING_TEST_CHUNK 0x60000 // Largest transfer of the unit test (more than a third of the ring)
+
+//
+// Global data (defined here rather than by libcrud's cmpsc311_network.o, which
+// would pull its old driver and hash table layout into the link)
+int            hdd_network_shutdown = 0;    // Flag indicating shutdown
+unsigned char *hdd_network_address = NULL;  // Address of HDD server (HDD_DEFAULT_IP if NULL)
+unsigned short hdd_network_port = 0;        // Port of HDD server (HDD_DEFAULT_PORT if 0)
+
+//
+// Local helpers
+
+// Ring the doorbell of the other side if it raised the wait flag
+static void hdd_ring_notify(HDD_RING_END *end, uint32_t *flag) {
+	uint64_t one = 1;
+
+	// Pairs with the fence in hdd_ring_sleep: either we see the flag or it sees our update
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(flag, __ATOMIC_RELAXED) && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)) {
+		if (write(end->peer, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			logMessage(LOG_ERROR_LEVEL, "HDD ring doorbell failed : [%s]", strerror(errno));
+	}
+}
+
+// Point the ring pointers of a side at the mapped segment
+static void hdd_ring_setup(HDD_RING_END *end, char *map, int client) {
+	end->shared = (HDD_RING_SHARED *) map;
+	end->tx = client ? &end->shared->commands : &end->shared->responses;
+	end->rx = client ? &end->shared->responses : &end->shared->commands;
+	end->tx_data = map + HDD_RING_DATA + (client ? 0 : HDD_RING_BYTES);
+	end->rx_data = map + HDD_RING_DATA + (client ? HDD_RING_BYTES : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_transport_address
+// Description  : Get the address of the UNIX socket of the server on a port
+//
+// Inputs       : addr - set to the address
+//                port - the TCP port of the server (0 for the default)
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_transport_address(struct sockaddr_un *addr, uint16_t port) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), HDD_TRANSPORT_SOCKET, (port != 0) ? port : HDD_DEFAULT_PORT);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_create
+// Description  : Set up a ring pair as the client: the shared segment and the
+//                two doorbells, to be sent to the server
+//
+// Inputs       : end - the client side
+//                fds - set to the segment, client doorbell and server doorbell
+//                      (the segment fd is the caller's to close once sent)
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_ring_create(HDD_RING_END *end, int fds[HDD_RING_FDS]) {
+	char *map;
+
+	memset(end, 0, sizeof(HDD_RING_END));
+	fds[0] = memfd_create("hdd_ring", MFD_CLOEXEC);
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || ftruncate(fds[0], HDD_RING_SEGMENT) == -1 ||
+	    (map = mmap(NULL, HDD_RING_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "HDD ring setup failed : [%s]", strerror(errno));
+		if (fds[0] != -1)
+			close(fds[0]);
+		if (fds[1] != -1)
+			close(fds[1]);
+		if (fds[2] != -1)
+			close(fds[2]);
+		return(-1);
+	}
+
+	// A new segment reads as zeros, so both rings start empty
+	hdd_ring_setup(end, map, 1);
+	end->self = fds[1];
+	end->peer = fds[2];
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_attach
+// Description  : Map the ring pair a client sent, as the server
+//
+// Inputs       : end - the server side
+//                fds - the segment, client doorbell and server doorbell (the
+//                      segment is closed, the doorbells belong to end)
+// Outputs      : 0 if successful, -1 if failure (the fds are closed)
+
+int hdd_ring_attach(HDD_RING_END *end, int fds[HDD_RING_FDS]) {
+	struct stat st;
+	char *map;
+
+	memset(end, 0, sizeof(HDD_RING_END));
+	if (fstat(fds[0], &st) == -1 || st.st_size != HDD_RING_SEGMENT ||
+	    (map = mmap(NULL, HDD_RING_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "HDD ring attach failed, bad segment");
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		return(-1);
+	}
+	close(fds[0]);
+	hdd_ring_setup(end, map, 0);
+	end->self = fds[2];
+	end->peer = fds[1];
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_detach
+// Description  : Unmap a ring pair and close its doorbells; a client also
+//                tells the server it is gone
+//
+// Inputs       : end - the side to take down
+// Outputs      : none
+
+void hdd_ring_detach(HDD_RING_END *end) {
+	uint64_t one = 1;
+
+	if (end->shared == NULL)
+		return;
+	if (end->tx == &end->shared->commands) {
+		__atomic_store_n(&end->shared->closed, 1, __ATOMIC_SEQ_CST);
+		if (write(end->peer, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			logMessage(LOG_ERROR_LEVEL, "HDD ring doorbell failed : [%s]", strerror(errno));
+	}
+	munmap(end->shared, HDD_RING_SEGMENT);
+	close(end->self);
+	close(end->peer);
+	memset(end, 0, sizeof(HDD_RING_END));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_writev
+// Description  : Copy as much of the buffers as fits into the outgoing ring
+//                (straight from the caller's buffers), in order
+//
+// Inputs       : end - the producing side
+//                iov - the buffers
+//                count - the number of buffers
+// Outputs      : the bytes copied (0 if the ring is full)
+
+size_t hdd_ring_writev(HDD_RING_END *end, const struct iovec *iov, int count) {
+	HDD_RING *ring = end->tx;
+	uint64_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t room = HDD_RING_BYTES - (head - tail), done = 0, len, at, first;
+	int i;
+
+	for (i = 0; i < count && room > 0; i++) {
+		len = (iov[i].iov_len < room) ? iov[i].iov_len : room;
+		at = head & HDD_RING_MASK;
+		first = (len < HDD_RING_BYTES - at) ? len : HDD_RING_BYTES - at;
+		memcpy(end->tx_data + at, iov[i].iov_base, first);
+		memcpy(end->tx_data, (char *) iov[i].iov_base + first, len - first);
+		head += len;
+		room -= len;
+		done += len;
+	}
+	if (done > 0) {
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		hdd_ring_notify(end, &ring->data_wait);
+	}
+	return(done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_readv
+// Description  : Copy what the incoming ring holds (up to the length of the
+//                buffers) straight into the buffers, in order
+//
+// Inputs       : end - the consuming side
+//                iov - the buffers
+//                count - the number of buffers
+// Outputs      : the bytes copied (0 if the ring is empty)
+
+size_t hdd_ring_readv(HDD_RING_END *end, const struct iovec *iov, int count) {
+	HDD_RING *ring = end->rx;
+	uint64_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t left = head - tail, done = 0, len, at, first;
+	int i;
+
+	for (i = 0; i < count && left > 0; i++) {
+		len = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+		at = tail & HDD_RING_MASK;
+		first = (len < HDD_RING_BYTES - at) ? len : HDD_RING_BYTES - at;
+		memcpy(iov[i].iov_base, end->rx_data + at, first);
+		memcpy((char *) iov[i].iov_base + first, end->rx_data, len - first);
+		tail += len;
+		left -= len;
+		done += len;
+	}
+	if (done > 0) {
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		hdd_ring_notify(end, &ring->space_wait);
+	}
+	return(done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_pending
+// Description  : Get the bytes the incoming ring holds
+//
+// Inputs       : end - the consuming side
+// Outputs      : the bytes waiting to be read
+
+size_t hdd_ring_pending(HDD_RING_END *end) {
+	return(__atomic_load_n(&end->rx->head, __ATOMIC_ACQUIRE) - end->rx->tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_sleep
+// Description  : Raise the wait flags before sleeping on the doorbell, so the
+//                other side rings it once there is data (or room)
+//
+// Inputs       : end - the side going to sleep
+//                reading - wait for data in the incoming ring
+//                writing - wait for room in the outgoing ring
+// Outputs      : 1 if there already is (do not sleep), 0 if the doorbell will ring
+
+int hdd_ring_sleep(HDD_RING_END *end, int reading, int writing) {
+	int ready = 0;
+
+	if (reading)
+		__atomic_store_n(&end->rx->data_wait, 1, __ATOMIC_SEQ_CST);
+	if (writing)
+		__atomic_store_n(&end->tx->space_wait, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (reading && (hdd_ring_pending(end) > 0 || __atomic_load_n(&end->shared->closed, __ATOMIC_ACQUIRE)))
+		ready = 1;
+	if (writing && end->tx->head - __atomic_load_n(&end->tx->tail, __ATOMIC_ACQUIRE) < HDD_RING_BYTES)
+		ready = 1;
+	if (ready) {
+		__atomic_store_n(&end->rx->data_wait, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&end->tx->space_wait, 0, __ATOMIC_RELAXED);
+	}
+	return(ready);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ring_wait
+// Description  : Block until the other side produced data (or made room),
+//                or until it closed the socket the rings were set up over
+//
+// Inputs       : end - the waiting side
+//                writing - wait for room to write rather than for data
+//                sock - the socket of the connection
+// Outputs      : 0 if there may be data/room now, -1 if the peer is gone
+
+int hdd_ring_wait(HDD_RING_END *end, int writing, int sock) {
+	struct pollfd pfd[2];
+	uint64_t wakes;
+
+	if (hdd_ring_sleep(end, !writing, writing))
+		return(0);
+	pfd[0].fd = end->self;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sock;
+	pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) == -1) {
+		if (errno != EINTR) {
+			logMessage(LOG_ERROR_LEVEL, "HDD ring wait failed : [%s]", strerror(errno));
+			return(-1);
+		}
+	}
+	if ((pfd[0].revents & POLLIN) && read(end->self, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN)
+		logMessage(LOG_ERROR_LEVEL, "HDD ring doorbell read failed : [%s]", strerror(errno));
+
+	// Nothing but a hangup ever arrives on the socket once the rings are up
+	if (pfd[1].revents != 0) {
+		logMessage(LOG_ERROR_LEVEL, "HDD ring peer closed the connection");
+		return(-1);
+	}
+	return(0);
+}
+
+//
+// Unit test
+
+// Byte at a position of the test stream
+static char hdd_ring_test_byte(uint64_t pos) {
+	return((char) (pos * 131 + (pos >> 11)));
+}
+
+// Test producer: streams HDD_RING_TEST_BYTES in random pieces (two buffers each)
+static void *hdd_ring_test_producer(void *arg) {
+	HDD_RING_END *end = arg;
+	static char chunk[HDD_RING_TEST_CHUNK];
+	unsigned int seed = 311;
+	struct iovec iov[2];
+	uint64_t pos = 0;
+	size_t len, i, done;
+
+	while (pos < HDD_RING_TEST_BYTES) {
+		len = 1 + rand_r(&seed) % HDD_RING_TEST_CHUNK;
+		if (len > HDD_RING_TEST_BYTES - pos)
+			len = HDD_RING_TEST_BYTES - pos;
+		for (i = 0; i < len; i++)
+			chunk[i] = hdd_ring_test_byte(pos + i);
+		iov[0].iov_base = chunk;
+		iov[0].iov_len = rand_r(&seed) % (len + 1);
+		iov[1].iov_base = chunk + iov[0].iov_len;
+		iov[1].iov_len = len - iov[0].iov_len;
+		while (iov[0].iov_len + iov[1].iov_len > 0) {
+			done = hdd_ring_writev(end, iov, 2);
+			if (done == 0 && hdd_ring_wait(end, 1, -1))
+				return((void *) -1);
+			if (done >= iov[0].iov_len) {
+				done -= iov[0].iov_len;
+				iov[0].iov_len = 0;
+			} else {
+				iov[0].iov_base = (char *) iov[0].iov_base + done;
+				iov[0].iov_len -= done;
+				done = 0;
+			}
+			iov[1].iov_base = (char *) iov[1].iov_base + done;
+			iov[1].iov_len -= done;
+		}
+		pos += len;
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddTransportUnitTest
+// Description  : Stream data through a ring pair between two threads, the
+//                consumer checks every byte (both sides sleep on their
+//                doorbells), then check a wait notices a closed peer
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddTransportUnitTest(void) {
+	static char chunk[HDD_RING_TEST_CHUNK];
+	HDD_RING_END client, server;
+	int fds[HDD_RING_FDS], pair[2];
+	unsigned int seed = 473;
+	struct iovec iov;
+	pthread_t producer;
+	uint64_t pos = 0;
+	size_t got, i;
+	void *ret;
+
+	// The server side maps the segment the way the server does
+	if (hdd_ring_create(&client, fds))
+		return(-1);
+	fds[1] = dup(fds[1]);
+	fds[2] = dup(fds[2]);
+	if (hdd_ring_attach(&server, fds)) {
+		hdd_ring_detach(&client);
+		return(-1);
+	}
+
+	// Commands from the client, checked by the server
+	if (pthread_create(&producer, NULL, hdd_ring_test_producer, &client)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : failed to start the producer.");
+		return(-1);
+	}
+	while (pos < HDD_RING_TEST_BYTES) {
+		iov.iov_base = chunk;
+		iov.iov_len = 1 + rand_r(&seed) % HDD_RING_TEST_CHUNK;
+		got = hdd_ring_readv(&server, &iov, 1);
+		if (got == 0) {
+			if (hdd_ring_wait(&server, 0, -1)) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : wait failed.");
+				return(-1);
+			}
+			continue;
+		}
+		for (i = 0; i < got; i++) {
+			if (chunk[i] != hdd_ring_test_byte(pos + i)) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : bad byte at %lu.", (unsigned long) (pos + i));
+				return(-1);
+			}
+		}
+		pos += got;
+	}
+	pthread_join(producer, &ret);
+	if (ret != NULL || server.rx->head != server.rx->tail) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : producer failed or ring not drained.");
+		return(-1);
+	}
+
+	// A client waiting for a response notices the server went away
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+		return(-1);
+	close(pair[1]);
+	if (hdd_ring_wait(&client, 0, pair[0]) != -1) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : wait missed a closed peer.");
+		return(-1);
+	}
+	close(pair[0]);
+
+	// The server sees the client leave
+	hdd_ring_detach(&client);
+	if (hdd_ring_sleep(&server, 1, 0) != 1 || !server.shared->closed) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_TRANSPORT_UNIT_TEST : close not seen.");
+		return(-1);
+	}
+	hdd_ring_detach(&server);
+	logMessage(LOG_INFO_LEVEL, "HDD_TRANSPORT_UNIT_TEST : transport unit test completed successfully.");
+	return(0);
+}
@@ -0,0 +1,104 @@
+#ifndef HDD_TRANSPORT_INCLUDED
+#define HDD_TRANSPORT_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_transport.h
+//  Description    : This is the header file for the local transports between
+//                   a client and a server on the same machine.  The server
+//                   listens on a UNIX domain socket next to its TCP port; a
+//                   client either speaks the protocol over that socket, or
+//                   hands the server a shared memory segment with two
+//                   single-producer single-consumer byte rings (commands one
+//                   way, responses the other) and an eventfd doorbell per
+//                   side, and the bytes never go through the kernel.
+//
+//  Author         : Tianjian Gao
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// Defines
+#define HDD_TRANSPORT_SOCKET "/tmp/hdd_server.%u.sock" // UNIX socket of the server on a port
+#define HDD_RING_BYTES 0x200000 // Bytes of each ring (a power of two)
+#define HDD_RING_MAGIC 0x31474e4952444448ULL // "HDDRING1", sent with the segment
+#define HDD_RING_FDS 3 // Segment, client doorbell and server doorbell
+
+// The transports a client can use
+typedef enum {
+	HDD_TRANSPORT_TCP  = 0, // TCP to hdd_network_address/hdd_network_port
+	HDD_TRANSPORT_UNIX = 1, // The UNIX socket of the server
+	HDD_TRANSPORT_SHM  = 2, // Shared memory rings, set up over the UNIX socket
+	HDD_TRANSPORT_EMBEDDED = 3, // No server, the store runs in the client process
+} HDD_TRANSPORT_TYPES;
+
+// Control block of one ring (positions are byte counts that only grow)
+typedef struct {
+	uint64_t head;           // Bytes produced
+	char     head_line[56];  // Keep the producer and consumer on their own cache lines
+	uint64_t tail;           // Bytes consumed
+	char     tail_line[56];
+	uint32_t data_wait;      // The consumer sleeps until the producer rings its doorbell
+	uint32_t space_wait;     // The producer sleeps until the consumer rings its doorbell
+	char     wait_line[56];
+} HDD_RING;
+
+// Start of the shared segment, the ring data follows
+typedef struct {
+	HDD_RING commands;  // Client to server
+	HDD_RING responses; // Server to client
+	uint32_t closed;    // Set by the client when it goes away
+} HDD_RING_SHARED;
+
+// One side of a ring pair
+typedef struct {
+	HDD_RING_SHARED *shared; // The mapped segment (NULL if not set up)
+	HDD_RING        *tx;     // Ring this side produces into
+	HDD_RING        *rx;     // Ring this side consumes from
+	char            *tx_data;
+	char            *rx_data;
+	int              self;   // Doorbell this side waits on
+	int              peer;   // Doorbell of the other side
+} HDD_RING_END;
+
+//
+// Transport interface
+
+int hdd_transport_address(struct sockaddr_un *addr, uint16_t port);
+	// Get the address of the UNIX socket of the server on a port
+
+int hdd_ring_create(HDD_RING_END *end, int fds[HDD_RING_FDS]);
+	// Set up a ring pair as the client, fds are sent to the server
+
+int hdd_ring_attach(HDD_RING_END *end, int fds[HDD_RING_FDS]);
+	// Map the ring pair of a client as the server (takes over the fds)
+
+void hdd_ring_detach(HDD_RING_END *end);
+	// Unmap a ring pair and close its doorbells
+
+size_t hdd_ring_writev(HDD_RING_END *end, const struct iovec *iov, int count);
+	// Copy as much of iov as fits into the ring, returns the bytes copied
+
+size_t hdd_ring_readv(HDD_RING_END *end, const struct iovec *iov, int count);
+	// Copy as much as is there (up to the iov length) out of the ring, returns the bytes copied
+
+size_t hdd_ring_pending(HDD_RING_END *end);
+	// Get the bytes waiting in the incoming ring
+
+int hdd_ring_sleep(HDD_RING_END *end, int reading, int writing);
+	// Ask the other side to ring the doorbell once there is data/space, 1 if there already is
+
+int hdd_ring_wait(HDD_RING_END *end, int writing, int sock);
+	// Block until there is data (or space), 0 if there may be, -1 if the peer closed sock
+
+//
+// Unit testing for the module
+
+int hddTransportUnitTest(void);
+	// Perform a test of the rings
+
+#endif